@@ -0,0 +1,242 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include "accesslog.h"
+#include "metrics.h"
+
+__thread access_log::ring* access_log::t_ring = NULL;
+
+// 后台线程取记录的间隔，微秒
+static const int FLUSH_INTERVAL_US = 50000;
+// 格式化缓冲超过这个大小就先写出去
+static const size_t FLUSH_BYTES = 256 * 1024;
+
+static const char* method_name[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS", "CONNECT", "PATCH" };
+static const int METHOD_COUNT = sizeof( method_name ) / sizeof( method_name[0] );
+
+access_log* access_log::get_instance()
+{
+    static access_log log;
+    return &log;
+}
+
+access_log::access_log()
+{
+    m_fd = -1;
+    m_rotate_bytes = 0;
+    m_rotate_s = 0;
+    m_written = 0;
+    m_opened = 0;
+    m_running = false;
+    m_last_sec = 0;
+    m_time_str[0] = '\0';
+}
+
+access_log::~access_log()
+{
+    stop();
+}
+
+bool access_log::init( const char* path, int rotate_mb, int rotate_s )
+{
+    m_path = path;
+    m_rotate_bytes = ( uint64_t )rotate_mb * 1024 * 1024;
+    m_rotate_s = rotate_s;
+    if( !open_file() )
+    {
+        return false;
+    }
+    m_buf.reserve( FLUSH_BYTES + 1024 );
+    m_running = true;
+    if( pthread_create( &m_thread, NULL, worker, this ) != 0 )
+    {
+        m_running = false;
+        close( m_fd );
+        m_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+void access_log::stop()
+{
+    if( !m_running )
+    {
+        return;
+    }
+    m_running = false;
+    pthread_join( m_thread, NULL );
+    // 后台线程退出后再取一次，停止前完成的请求都能写进去
+    drain();
+    close( m_fd );
+    m_fd = -1;
+}
+
+access_log::ring* access_log::local()
+{
+    if( !t_ring )
+    {
+        ring* r = new ring;
+        r->tail = 0;
+        r->dropped = 0;
+        r->head = 0;
+        m_lock.lock();
+        m_rings.push_back( r );
+        m_lock.unlock();
+        t_ring = r;
+    }
+    return t_ring;
+}
+
+void access_log::record( const access_record& rec )
+{
+    ring* r = local();
+    uint64_t tail = r->tail;
+    if( tail - __atomic_load_n( &r->head, __ATOMIC_ACQUIRE ) >= RING_SIZE )
+    {
+        // 后台线程跟不上，丢弃而不是等待
+        __atomic_store_n( &r->dropped, r->dropped + 1, __ATOMIC_RELAXED );
+        metrics::get_instance()->inc( M_ACCESS_DROPPED );
+        return;
+    }
+    r->recs[ tail & ( RING_SIZE - 1 ) ] = rec;
+    __atomic_store_n( &r->tail, tail + 1, __ATOMIC_RELEASE );
+}
+
+void* access_log::worker( void* arg )
+{
+    access_log* log = ( access_log* )arg;
+    log->run();
+    return log;
+}
+
+void access_log::run()
+{
+    while( m_running )
+    {
+        usleep( FLUSH_INTERVAL_US );
+        drain();
+    }
+}
+
+void access_log::drain()
+{
+    m_lock.lock();
+    vector< ring* > rings( m_rings );
+    m_lock.unlock();
+
+    for( size_t i = 0; i < rings.size(); ++i )
+    {
+        ring* r = rings[i];
+        uint64_t head = r->head;
+        uint64_t tail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+        for( ; head != tail; ++head )
+        {
+            format( r->recs[ head & ( RING_SIZE - 1 ) ] );
+            if( m_buf.size() >= FLUSH_BYTES )
+            {
+                flush_buf();
+            }
+        }
+        // 格式化完才归还位置，生产者不会覆盖正在读的记录
+        __atomic_store_n( &r->head, tail, __ATOMIC_RELEASE );
+
+        uint64_t dropped = __atomic_exchange_n( &r->dropped, 0, __ATOMIC_RELAXED );
+        if( dropped )
+        {
+            char line[ 64 ];
+            int len = snprintf( line, sizeof( line ), "# dropped %llu records\n", ( unsigned long long )dropped );
+            m_buf.append( line, len );
+        }
+    }
+    flush_buf();
+}
+
+// 每行: ip - - [时间] "方法 url" 状态码 字节数 耗时us
+void access_log::format( const access_record& rec )
+{
+    time_t sec = rec.time_us / 1000000;
+    if( sec != m_last_sec )
+    {
+        struct tm tm;
+        localtime_r( &sec, &tm );
+        strftime( m_time_str, sizeof( m_time_str ), "%d/%b/%Y:%H:%M:%S %z", &tm );
+        m_last_sec = sec;
+    }
+    char ip[ INET_ADDRSTRLEN ];
+    inet_ntop( AF_INET, &rec.addr, ip, sizeof( ip ) );
+    char line[ 256 ];
+    int len = snprintf( line, sizeof( line ), "%s - - [%s] \"%s %.*s\" %d %llu %uus%s\n", ip, m_time_str,
+                        rec.method < METHOD_COUNT ? method_name[ rec.method ] : "-", rec.url_len ? ( int )rec.url_len : 1,
+                        rec.url_len ? rec.url : "-", rec.status, ( unsigned long long )rec.bytes, rec.latency_us,
+                        rec.aborted ? " aborted" : "" );
+    if( len > ( int )sizeof( line ) - 1 )
+    {
+        len = sizeof( line ) - 1;
+    }
+    m_buf.append( line, len );
+}
+
+void access_log::flush_buf()
+{
+    if( m_buf.empty() )
+    {
+        return;
+    }
+    size_t off = 0;
+    while( off < m_buf.size() )
+    {
+        ssize_t n = write( m_fd, m_buf.data() + off, m_buf.size() - off );
+        if( n <= 0 )
+        {
+            break;
+        }
+        off += n;
+    }
+    m_written += m_buf.size();
+    m_buf.clear();
+    if( ( m_rotate_bytes && m_written >= m_rotate_bytes ) || ( m_rotate_s && time( NULL ) - m_opened >= m_rotate_s ) )
+    {
+        rotate();
+    }
+}
+
+bool access_log::open_file()
+{
+    m_fd = open( m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+    if( m_fd < 0 )
+    {
+        return false;
+    }
+    m_written = lseek( m_fd, 0, SEEK_END );
+    m_opened = time( NULL );
+    return true;
+}
+
+// 当前文件改名为 path.年月日-时分秒，再打开新文件
+void access_log::rotate()
+{
+    time_t now = time( NULL );
+    struct tm tm;
+    localtime_r( &now, &tm );
+    char suffix[ 32 ];
+    strftime( suffix, sizeof( suffix ), ".%Y%m%d-%H%M%S", &tm );
+    string rotated = m_path + suffix;
+    // 同一秒内轮转多次时加序号，不覆盖已有的文件
+    for( int seq = 1; access( rotated.c_str(), F_OK ) == 0; ++seq )
+    {
+        rotated = m_path + suffix + "." + to_string( seq );
+    }
+    close( m_fd );
+    rename( m_path.c_str(), rotated.c_str() );
+    if( !open_file() )
+    {
+        // 打不开新文件时写到被改名的文件里，不丢日志
+        m_fd = open( rotated.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC );
+        m_opened = now;
+    }
+}
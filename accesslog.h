@@ -0,0 +1,94 @@
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "locker.h"
+
+using namespace std;
+
+// url最多记录的字节数，超出截断
+static const int ACCESS_URL_LEN = 88;
+
+// 一条访问记录，固定128字节，请求结束时写入当前线程的环形缓冲
+// url在请求结束后会被下一个请求覆盖，所以复制一份而不是记读缓冲中的偏移
+struct access_record
+{
+    uint64_t time_us;       // 请求结束的墙上时间，微秒
+    uint64_t bytes;         // 发送的字节数
+    uint32_t addr;          // 客户端IPv4地址，网络字节序
+    uint32_t latency_us;    // 第一次读到数据到响应发完
+    int fd;
+    uint16_t status;        // http状态码，0表示没有生成响应
+    uint8_t method;         // http_conn::METHOD
+    uint8_t aborted;        // 写失败，连接被关闭
+    uint8_t url_len;
+    char url[ ACCESS_URL_LEN ];
+};
+
+// 访问日志
+// 每个线程一个单生产者单消费者的环形缓冲，请求结束时只做一次复制和一次release store，不加锁也不做格式化
+// 后台线程定期取走所有缓冲中的记录，格式化后一次write写入文件，按大小或时间轮转
+// 缓冲满时丢弃新记录并计数，丢弃数写进日志和指标，不会阻塞请求
+class access_log
+{
+public:
+    static access_log* get_instance();
+
+    // 打开日志文件并启动后台线程，rotate_mb为0表示不按大小轮转，rotate_s为0表示不按时间轮转
+    bool init( const char* path, int rotate_mb, int rotate_s );
+    // 写完剩余记录，停止后台线程
+    void stop();
+    bool enabled() const { return m_running; }
+    // 请求结束时调用，任何线程都可以
+    void record( const access_record& rec );
+
+private:
+    access_log();
+    ~access_log();
+
+    static const uint32_t RING_SIZE = 4096;
+
+    // 生产者和消费者的位置放在不同的缓存行，避免互相失效
+    struct ring
+    {
+        uint64_t tail __attribute__(( aligned( 64 ) ));     // 生产者写
+        uint64_t dropped;                                   // 生产者写，消费者交换清零
+        uint64_t head __attribute__(( aligned( 64 ) ));     // 消费者写
+        access_record recs[ RING_SIZE ];
+    };
+
+    ring* local();
+    static void* worker( void* arg );
+    void run();
+    // 取走所有缓冲中的记录并写入文件
+    void drain();
+    void format( const access_record& rec );
+    void flush_buf();
+    bool open_file();
+    void rotate();
+
+private:
+    static __thread ring* t_ring;
+
+    string m_path;
+    int m_fd;
+    uint64_t m_rotate_bytes;
+    int m_rotate_s;
+    uint64_t m_written;         // 当前文件已写入的字节数
+    time_t m_opened;            // 当前文件打开的时间
+    bool m_running;
+    pthread_t m_thread;
+
+    locker m_lock;              // 保护缓冲的登记
+    vector< ring* > m_rings;
+
+    // 以下只由后台线程使用
+    string m_buf;
+    time_t m_last_sec;          // 缓存的时间字符串对应的秒
+    char m_time_str[ 32 ];
+};
+
+#endif
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "admission.h"
+
+// 客户端多久之后重试，秒
+static const int RETRY_AFTER_S = 1;
+// 令牌桶最多积累的令牌数，即允许的突发连接数
+static const double ACCEPT_BURST = 64;
+// 留给日志、数据库连接等非客户端socket的fd
+static const int FD_RESERVE = 64;
+// 每次最多关闭的空闲连接数
+static const int EVICT_BATCH = 64;
+
+static string build_response( const char* status, const char* body )
+{
+    char buf[ 256 ];
+    snprintf( buf, sizeof( buf ), "HTTP/1.1 %s\r\nRetry-After: %d\r\nContent-Type: text/plain\r\n"
+              "Content-Length: %zu\r\nConnection: close\r\n\r\n%s", status, RETRY_AFTER_S, strlen( body ), body );
+    return buf;
+}
+
+admission* admission::get_instance()
+{
+    static admission adm;
+    return &adm;
+}
+
+admission::admission()
+{
+    m_max_queue = 0;
+    m_queue_us = 0;
+    m_queue_ewma = 0;
+    m_accept_rate = 0;
+    m_tokens = 0;
+    m_last_refill = 0;
+    m_capacity = 0;
+    m_high_mark = 0;
+    m_idle_timeout = 0;
+}
+
+void admission::init( int max_queue, int queue_ms, int accept_rate )
+{
+    m_max_queue = max_queue;
+    m_queue_us = ( uint64_t )queue_ms * 1000;
+    m_accept_rate = accept_rate;
+    m_tokens = ACCEPT_BURST;
+    m_last_refill = metrics::now_us();
+
+    m_response = build_response( "503 Service Unavailable", "The server is overloaded, please retry later.\n" );
+    m_limited_response = build_response( "429 Too Many Requests", "Too many requests from your address, please retry later.\n" );
+}
+
+void admission::init_idle( int max_fd, int high_pct, int idle_timeout )
+{
+    m_capacity = max_fd;
+    struct rlimit rl;
+    if( getrlimit( RLIMIT_NOFILE, &rl ) == 0 && rl.rlim_cur != RLIM_INFINITY && ( int )rl.rlim_cur - FD_RESERVE < m_capacity )
+    {
+        m_capacity = ( int )rl.rlim_cur - FD_RESERVE;
+    }
+    if( m_capacity < 1 )
+    {
+        m_capacity = 1;
+    }
+    m_high_mark = high_pct ? ( int )( ( int64_t )m_capacity * high_pct / 100 ) : 0;
+    m_idle_timeout = idle_timeout;
+}
+
+int admission::evict_count( int user_count, bool fd_exhausted )
+{
+    if( !m_high_mark )
+    {
+        return 0;
+    }
+    if( fd_exhausted )
+    {
+        return EVICT_BATCH;
+    }
+    if( user_count < m_high_mark )
+    {
+        return 0;
+    }
+    // 回到高水位以下，一次不超过EVICT_BATCH个
+    int n = user_count - m_high_mark + 1;
+    return n < EVICT_BATCH ? n : EVICT_BATCH;
+}
+
+int admission::idle_timeout( int user_count )
+{
+    if( !m_high_mark || user_count < m_high_mark )
+    {
+        return m_idle_timeout;
+    }
+    if( user_count >= m_capacity )
+    {
+        return 1;
+    }
+    int timeout = ( int64_t )m_idle_timeout * ( m_capacity - user_count ) / ( m_capacity - m_high_mark );
+    return timeout > 1 ? timeout : 1;
+}
+
+bool admission::admit( size_t queue_size )
+{
+    if( m_max_queue && queue_size >= m_max_queue )
+    {
+        return false;
+    }
+    // 队列空时不会再有排队，即使平均值还没降下来也放行，平均值由之后的请求更新
+    if( m_queue_us && queue_size > 0 && __atomic_load_n( &m_queue_ewma, __ATOMIC_RELAXED ) > m_queue_us )
+    {
+        return false;
+    }
+    return true;
+}
+
+void admission::observe_queue( uint64_t wait_us )
+{
+    if( !m_queue_us )
+    {
+        return;
+    }
+    // ewma += (v - ewma) / 8，多个线程同时更新时丢失一次更新没有关系
+    uint64_t old = __atomic_load_n( &m_queue_ewma, __ATOMIC_RELAXED );
+    uint64_t ewma = old - old / 8 + wait_us / 8;
+    __atomic_store_n( &m_queue_ewma, ewma, __ATOMIC_RELAXED );
+}
+
+bool admission::accept_allowed()
+{
+    if( m_accept_rate <= 0 )
+    {
+        return true;
+    }
+    if( !accept_ready() )
+    {
+        return false;
+    }
+    m_tokens -= 1;
+    return true;
+}
+
+bool admission::accept_ready()
+{
+    if( m_accept_rate <= 0 )
+    {
+        return true;
+    }
+    uint64_t now = metrics::now_us();
+    m_tokens += ( now - m_last_refill ) * m_accept_rate / 1e6;
+    m_last_refill = now;
+    if( m_tokens > ACCEPT_BURST )
+    {
+        m_tokens = ACCEPT_BURST;
+    }
+    return m_tokens >= 1;
+}
+
+const string& admission::response( metric_counter reason ) const
+{
+    return ( reason == M_RATE_LIMITED || reason == M_CONN_LIMITED ) ? m_limited_response : m_response;
+}
+
+void admission::reject( int fd, metric_counter reason )
+{
+    metrics::get_instance()->inc( reason );
+    if( fd < 0 )
+    {
+        return;
+    }
+    // 新连接或刚读完请求的socket，发送缓冲是空的，一次就能发完；发不完也不等待
+    const string& res = response( reason );
+    send( fd, res.data(), res.size(), MSG_NOSIGNAL | MSG_DONTWAIT );
+}
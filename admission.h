@@ -0,0 +1,70 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stdint.h>
+#include <string>
+#include "metrics.h"
+
+using namespace std;
+
+// 过载保护
+// 请求交给线程池之前检查队列长度和最近的排队时间，超过阈值时主线程直接回复503 + Retry-After并关闭连接，
+// 不经过线程池；线程池队列满、连接数达到上限时同样处理。
+// 监听socket按令牌桶限制每秒accept的连接数，令牌用完时暂停监听，新连接留在内核的backlog中。
+// 连接数超过高水位时，事件循环从最早到期的定时器开始关闭空闲的长连接，同时按剩余容量缩短空闲超时，
+// 突发的新连接总能被接受；高水位以下行为不变，保留长连接的好处。
+class admission
+{
+public:
+    static admission* get_instance();
+
+    // max_queue为0表示只在线程池队列满时拒绝；queue_ms为0表示不按排队时间拒绝；accept_rate为0表示不限制accept
+    void init( int max_queue, int queue_ms, int accept_rate );
+
+    // 主线程在请求交给线程池之前调用，返回false时应调用reject
+    bool admit( size_t queue_size );
+    // 工作线程取到请求时报告它在队列中等待的时间
+    void observe_queue( uint64_t wait_us );
+    // 监听socket上能否再accept一个连接，能则消耗一个令牌，只由主线程调用
+    bool accept_allowed();
+    // 补充令牌，返回是否有令牌，不消耗；暂停监听后用来判断何时恢复
+    bool accept_ready();
+
+    // 连接容量取MAX_FD和RLIMIT_NOFILE中较小的，high_pct为高水位占容量的百分比(0表示不回收)，idle_timeout为正常的空闲超时秒数
+    void init_idle( int max_fd, int high_pct, int idle_timeout );
+    // 应当关闭的空闲连接数，0表示不需要；fd_exhausted表示accept因为fd用完失败
+    int evict_count( int user_count, bool fd_exhausted );
+    // 当前的空闲超时秒数，高水位以下不变，以上按剩余容量线性缩短，最少1秒
+    int idle_timeout( int user_count );
+
+    // 按reason计数并回复，调用者随后关闭连接；M_RATE_LIMITED和M_CONN_LIMITED回复429，其他回复503
+    // 响应在init时生成，这里只有一次send；fd为-1时只计数，用于还没完成TLS握手的连接
+    void reject( int fd, metric_counter reason );
+    // reason对应的响应，HTTPS连接由http_conn加密后发送
+    const string& response( metric_counter reason ) const;
+
+private:
+    admission();
+    ~admission(){}
+
+private:
+    size_t m_max_queue;
+    uint64_t m_queue_us;
+    // 排队时间的指数加权平均，工作线程更新，不要求精确
+    uint64_t m_queue_ewma;
+
+    // accept令牌桶，按微秒补充
+    double m_accept_rate;
+    double m_tokens;
+    uint64_t m_last_refill;
+
+    // 空闲连接回收
+    int m_capacity;
+    int m_high_mark;
+    int m_idle_timeout;
+
+    string m_response;
+    string m_limited_response;
+};
+
+#endif
@@ -0,0 +1,733 @@
+// HTTP压测工具，代替webbench
+// 每个线程一个epoll，负责一部分连接，支持长连接、流水线、闭环和定速开环两种模式，
+// 多个URL和登录POST混合，以及连接数扫描，结果以JSON输出到stdout
+//
+// 用法: ./bench [options] host port
+//   ./bench -c 10,100,1000 -d 10 -k 127.0.0.1 9006
+//   ./bench -c 100 -r 20000 -k -u GET:/ -u POST:/2CGISQL.cgi:user=a\&password=b 127.0.0.1 9006
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include "histogram.h"
+
+using namespace std;
+
+static const int MAX_EVENT_NUMBER = 1024;
+static const int READ_CHUNK = 65536;
+// 开环模式下积压的请求超过这个数就丢弃，防止被压垮时内存无限增长
+static const size_t MAX_BACKLOG = 1000000;
+
+// 压测参数
+struct bench_conf
+{
+    struct sockaddr_in addr;
+    string host;
+    vector< int > conns;        // 连接数扫描的每一档
+    int threads;
+    double duration;            // 每一档的测量时间，秒
+    double warmup;              // 每一档开始时不计入统计的时间，秒
+    bool keepalive;
+    int depth;                  // 每个连接最多同时在途的请求数
+    double rate;                // 开环模式的总请求速率，0表示闭环
+    double timeout;             // 请求超时，秒
+    vector< string > requests;  // 预先拼好的请求报文，按顺序轮流发送
+};
+
+// 一个客户端连接
+struct bench_conn
+{
+    int fd;
+    bool connected;
+    uint64_t connect_start;     // 短连接模式下延迟从connect开始算
+    uint64_t last_active;
+    string out;                 // 待发送的数据
+    size_t out_off;
+    string in;                  // 收到还没解析完的响应
+    deque< uint64_t > inflight; // 在途请求的开始时间
+    size_t next_req;
+};
+
+// 每个线程的状态和统计
+struct bench_worker
+{
+    const bench_conf* conf;
+    int nconn;
+    double rate;                // 本线程分到的请求速率
+    uint64_t start;
+    uint64_t record_start;
+    uint64_t end;
+    pthread_t tid;
+
+    histogram hist;
+    uint64_t completed;
+    uint64_t errors;            // 连接失败、被对端关闭、超时
+    uint64_t non_2xx;
+    uint64_t dropped;           // 开环积压过多被丢弃的请求
+    uint64_t bytes;
+
+    int epollfd;
+    vector< bench_conn > conns;
+    deque< uint64_t > backlog;  // 开环模式下到期还没发出去的请求
+};
+
+static bool parse_list( const char* arg, vector< int >& out )
+{
+    out.clear();
+    const char* p = arg;
+    while( *p )
+    {
+        char* end;
+        long v = strtol( p, &end, 10 );
+        if( end == p || v <= 0 )
+        {
+            return false;
+        }
+        out.push_back( v );
+        p = *end == ',' ? end + 1 : end;
+        if( *end && *end != ',' )
+        {
+            return false;
+        }
+    }
+    return !out.empty();
+}
+
+// METHOD:path[:body]拼成完整请求报文
+static bool build_request( const char* spec, const string& host, bool keepalive, string& out )
+{
+    const char* colon = strchr( spec, ':' );
+    if( !colon )
+    {
+        return false;
+    }
+    string method( spec, colon - spec );
+    string path = colon + 1;
+    string body;
+    size_t sep = path.find( ':' );
+    if( sep != string::npos )
+    {
+        body = path.substr( sep + 1 );
+        path.resize( sep );
+    }
+    if( path.empty() || path[0] != '/' )
+    {
+        return false;
+    }
+    char line[ 256 ];
+    out = method + " " + path + " HTTP/1.1\r\nHost: " + host + "\r\n";
+    if( keepalive )
+    {
+        out += "Connection: keep-alive\r\n";
+    }
+    if( method == "POST" )
+    {
+        snprintf( line, sizeof( line ), "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n", ( int )body.size() );
+        out += line;
+    }
+    out += "\r\n" + body;
+    return true;
+}
+
+static void conn_close( bench_worker* w, bench_conn& c )
+{
+    if( c.fd >= 0 )
+    {
+        epoll_ctl( w->epollfd, EPOLL_CTL_DEL, c.fd, 0 );
+        close( c.fd );
+    }
+    c.fd = -1;
+    c.connected = false;
+    c.out.clear();
+    c.out_off = 0;
+    c.in.clear();
+    c.inflight.clear();
+}
+
+static void conn_open( bench_worker* w, bench_conn& c )
+{
+    c.fd = socket( AF_INET, SOCK_STREAM, 0 );
+    if( c.fd < 0 )
+    {
+        ++w->errors;
+        return;
+    }
+    fcntl( c.fd, F_SETFL, fcntl( c.fd, F_GETFL ) | O_NONBLOCK );
+    int one = 1;
+    setsockopt( c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    c.connect_start = now_us();
+    c.last_active = c.connect_start;
+    c.connected = false;
+    if( connect( c.fd, ( struct sockaddr* )&w->conf->addr, sizeof( w->conf->addr ) ) < 0 && errno != EINPROGRESS )
+    {
+        ++w->errors;
+        close( c.fd );
+        c.fd = -1;
+        return;
+    }
+    epoll_event event;
+    event.data.ptr = &c;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl( w->epollfd, EPOLL_CTL_ADD, c.fd, &event );
+}
+
+// 连接出错，计数后重连
+static void conn_fail( bench_worker* w, bench_conn& c )
+{
+    if( now_us() >= w->record_start )
+    {
+        ++w->errors;
+    }
+    conn_close( w, c );
+    conn_open( w, c );
+}
+
+static bool conn_flush( bench_worker* w, bench_conn& c )
+{
+    while( c.out_off < c.out.size() )
+    {
+        ssize_t n = send( c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL );
+        if( n < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                return true;
+            }
+            return false;
+        }
+        c.out_off += n;
+    }
+    c.out.clear();
+    c.out_off = 0;
+    return true;
+}
+
+static bool can_send( const bench_worker* w, const bench_conn& c )
+{
+    if( !c.connected )
+    {
+        return false;
+    }
+    // 短连接每个连接只发一个请求
+    int depth = w->conf->keepalive ? w->conf->depth : 1;
+    return ( int )c.inflight.size() < depth;
+}
+
+static void conn_send( bench_worker* w, bench_conn& c, uint64_t start )
+{
+    const vector< string >& reqs = w->conf->requests;
+    c.out += reqs[ c.next_req ];
+    c.next_req = ( c.next_req + 1 ) % reqs.size();
+    c.inflight.push_back( start );
+}
+
+// 闭环模式下把连接的在途请求补满
+static void fill_closed( bench_worker* w, bench_conn& c )
+{
+    uint64_t now = now_us();
+    if( now >= w->end )
+    {
+        return;
+    }
+    bool queued = false;
+    while( can_send( w, c ) )
+    {
+        conn_send( w, c, w->conf->keepalive ? now : c.connect_start );
+        queued = true;
+    }
+    if( queued && !conn_flush( w, c ) )
+    {
+        conn_fail( w, c );
+    }
+}
+
+// 开环模式下把到期的请求分给有空位的连接
+static void dispatch_open( bench_worker* w )
+{
+    for( size_t i = 0; i < w->conns.size() && !w->backlog.empty(); ++i )
+    {
+        bench_conn& c = w->conns[i];
+        bool queued = false;
+        while( !w->backlog.empty() && can_send( w, c ) )
+        {
+            conn_send( w, c, w->backlog.front() );
+            w->backlog.pop_front();
+            queued = true;
+        }
+        if( queued && !conn_flush( w, c ) )
+        {
+            conn_fail( w, c );
+        }
+    }
+}
+
+// 分块编码的消息体从pos开始，完整时返回消息体之后的位置，不完整返回0
+static size_t chunked_end( const string& in, size_t pos )
+{
+    while( true )
+    {
+        size_t eol = in.find( "\r\n", pos );
+        if( eol == string::npos )
+        {
+            return 0;
+        }
+        unsigned long size = strtoul( in.c_str() + pos, NULL, 16 );
+        pos = eol + 2;
+        if( size == 0 )
+        {
+            break;
+        }
+        // 数据之后的CRLF
+        pos += size + 2;
+        if( pos > in.size() )
+        {
+            return 0;
+        }
+    }
+    // 尾部头部直到空行
+    while( true )
+    {
+        size_t eol = in.find( "\r\n", pos );
+        if( eol == string::npos )
+        {
+            return 0;
+        }
+        if( eol == pos )
+        {
+            return pos + 2;
+        }
+        pos = eol + 2;
+    }
+}
+
+// 解析出一个完整响应返回true，consumed为响应长度
+// 消息体按Content-Length或者分块编码定界，两者都没有时读到连接关闭为止，eof表示服务器已经关闭连接
+static bool parse_response( const string& in, bool eof, size_t& consumed, int& status, bool& close_conn )
+{
+    size_t header_end = in.find( "\r\n\r\n" );
+    if( header_end == string::npos )
+    {
+        return false;
+    }
+    status = 0;
+    if( in.compare( 0, 5, "HTTP/" ) == 0 && in.size() > 12 )
+    {
+        status = atoi( in.c_str() + 9 );
+    }
+    long content_length = -1;
+    bool chunked = false;
+    close_conn = false;
+    size_t pos = in.find( "\r\n" ) + 2;
+    while( pos < header_end )
+    {
+        size_t eol = in.find( "\r\n", pos );
+        if( strncasecmp( in.c_str() + pos, "Content-Length:", 15 ) == 0 )
+        {
+            content_length = atol( in.c_str() + pos + 15 );
+        }
+        else if( strncasecmp( in.c_str() + pos, "Transfer-Encoding:", 18 ) == 0 )
+        {
+            chunked = strncasecmp( in.c_str() + eol - 7, "chunked", 7 ) == 0;
+        }
+        else if( strncasecmp( in.c_str() + pos, "Connection:", 11 ) == 0 )
+        {
+            close_conn = strncasecmp( in.c_str() + pos + 11 + strspn( in.c_str() + pos + 11, " \t" ), "close", 5 ) == 0;
+        }
+        pos = eol + 2;
+    }
+    size_t body = header_end + 4;
+    if( chunked )
+    {
+        consumed = chunked_end( in, body );
+        return consumed != 0;
+    }
+    // 1xx、204和304没有消息体
+    if( content_length < 0 && ( status < 200 || status == 204 || status == 304 ) )
+    {
+        content_length = 0;
+    }
+    if( content_length < 0 )
+    {
+        if( !eof )
+        {
+            return false;
+        }
+        consumed = in.size();
+        close_conn = true;
+        return true;
+    }
+    if( in.size() < body + content_length )
+    {
+        return false;
+    }
+    consumed = body + content_length;
+    return true;
+}
+
+static void conn_read( bench_worker* w, bench_conn& c )
+{
+    char buf[ READ_CHUNK ];
+    bool peer_closed = false;
+    while( true )
+    {
+        ssize_t n = recv( c.fd, buf, sizeof( buf ), 0 );
+        if( n < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                break;
+            }
+            conn_fail( w, c );
+            return;
+        }
+        if( n == 0 )
+        {
+            peer_closed = true;
+            break;
+        }
+        c.in.append( buf, n );
+        c.last_active = now_us();
+    }
+
+    bool reopen = false;
+    size_t consumed;
+    int status;
+    bool close_conn;
+    while( !c.inflight.empty() && parse_response( c.in, peer_closed, consumed, status, close_conn ) )
+    {
+        uint64_t now = now_us();
+        uint64_t start = c.inflight.front();
+        c.inflight.pop_front();
+        // 只统计在测量窗口内发出(开环为计划发出)的请求
+        if( start >= w->record_start && now < w->end )
+        {
+            w->hist.add( now - start );
+            ++w->completed;
+            w->bytes += consumed;
+            if( status < 200 || status >= 300 )
+            {
+                ++w->non_2xx;
+            }
+        }
+        c.in.erase( 0, consumed );
+        if( close_conn || !w->conf->keepalive )
+        {
+            reopen = true;
+            break;
+        }
+    }
+
+    if( reopen || ( peer_closed && c.inflight.empty() ) )
+    {
+        // 正常结束的短连接或空闲时被服务器关闭的长连接，直接重连
+        conn_close( w, c );
+        conn_open( w, c );
+    }
+    else if( peer_closed )
+    {
+        conn_fail( w, c );
+    }
+    else if( w->rate == 0 )
+    {
+        fill_closed( w, c );
+    }
+}
+
+static void* worker_run( void* arg )
+{
+    bench_worker* w = ( bench_worker* )arg;
+    w->epollfd = epoll_create( 5 );
+    w->conns.resize( w->nconn );
+    for( int i = 0; i < w->nconn; ++i )
+    {
+        bench_conn& c = w->conns[i];
+        c.fd = -1;
+        c.out_off = 0;
+        c.next_req = i % w->conf->requests.size();
+        conn_open( w, c );
+    }
+
+    uint64_t interval = w->rate > 0 ? ( uint64_t )( 1e6 / w->rate ) : 0;
+    if( w->rate > 0 && interval == 0 )
+    {
+        interval = 1;
+    }
+    uint64_t next_due = w->start;
+    uint64_t timeout_us = ( uint64_t )( w->conf->timeout * 1e6 );
+    uint64_t last_scan = w->start;
+    epoll_event events[ MAX_EVENT_NUMBER ];
+
+    while( true )
+    {
+        uint64_t now = now_us();
+        if( now >= w->end )
+        {
+            break;
+        }
+        int wait_ms = ( w->end - now ) / 1000 + 1;
+        if( interval )
+        {
+            // 到期的请求加入积压队列，延迟从计划发送时间算起，避免协调遗漏
+            while( next_due <= now )
+            {
+                if( w->backlog.size() < MAX_BACKLOG )
+                {
+                    w->backlog.push_back( next_due );
+                }
+                else if( now >= w->record_start )
+                {
+                    ++w->dropped;
+                }
+                next_due += interval;
+            }
+            dispatch_open( w );
+            int due_ms = ( next_due - now ) / 1000;
+            if( due_ms < wait_ms )
+            {
+                wait_ms = due_ms;
+            }
+        }
+        if( wait_ms > 100 )
+        {
+            wait_ms = 100;
+        }
+
+        int number = epoll_wait( w->epollfd, events, MAX_EVENT_NUMBER, wait_ms );
+        for( int i = 0; i < number; ++i )
+        {
+            bench_conn& c = *( bench_conn* )events[i].data.ptr;
+            if( c.fd < 0 )
+            {
+                continue;
+            }
+            if( !c.connected && ( events[i].events & ( EPOLLOUT | EPOLLERR | EPOLLHUP ) ) )
+            {
+                int err = 0;
+                socklen_t len = sizeof( err );
+                getsockopt( c.fd, SOL_SOCKET, SO_ERROR, &err, &len );
+                if( err )
+                {
+                    conn_fail( w, c );
+                    continue;
+                }
+                c.connected = true;
+                if( w->rate == 0 )
+                {
+                    fill_closed( w, c );
+                }
+                continue;
+            }
+            if( events[i].events & EPOLLOUT )
+            {
+                if( !conn_flush( w, c ) )
+                {
+                    conn_fail( w, c );
+                    continue;
+                }
+            }
+            if( events[i].events & ( EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP ) )
+            {
+                conn_read( w, c );
+            }
+        }
+
+        // 每100ms检查一次超时的请求
+        now = now_us();
+        if( now - last_scan >= 100000 )
+        {
+            last_scan = now;
+            for( size_t i = 0; i < w->conns.size(); ++i )
+            {
+                bench_conn& c = w->conns[i];
+                bool waiting = !c.inflight.empty() || ( c.fd >= 0 && !c.connected );
+                if( c.fd < 0 || ( waiting && now - c.last_active > timeout_us ) )
+                {
+                    conn_fail( w, c );
+                }
+            }
+        }
+    }
+
+    for( size_t i = 0; i < w->conns.size(); ++i )
+    {
+        conn_close( w, w->conns[i] );
+    }
+    close( w->epollfd );
+    return NULL;
+}
+
+// 跑一档连接数，输出一个JSON对象
+static void run_phase( const bench_conf& conf, int nconn, bool first )
+{
+    int threads = conf.threads < nconn ? conf.threads : nconn;
+    vector< bench_worker > workers( threads );
+    uint64_t start = now_us();
+    uint64_t record_start = start + ( uint64_t )( conf.warmup * 1e6 );
+    uint64_t end = record_start + ( uint64_t )( conf.duration * 1e6 );
+    for( int i = 0; i < threads; ++i )
+    {
+        bench_worker& w = workers[i];
+        w.conf = &conf;
+        w.nconn = nconn / threads + ( i < nconn % threads ? 1 : 0 );
+        w.rate = conf.rate / threads;
+        w.start = start;
+        w.record_start = record_start;
+        w.end = end;
+        w.completed = w.errors = w.non_2xx = w.dropped = w.bytes = 0;
+        pthread_create( &w.tid, NULL, worker_run, &w );
+    }
+
+    histogram total;
+    uint64_t completed = 0, errors = 0, non_2xx = 0, dropped = 0, bytes = 0;
+    for( int i = 0; i < threads; ++i )
+    {
+        pthread_join( workers[i].tid, NULL );
+        total.merge( workers[i].hist );
+        completed += workers[i].completed;
+        errors += workers[i].errors;
+        non_2xx += workers[i].non_2xx;
+        dropped += workers[i].dropped;
+        bytes += workers[i].bytes;
+    }
+
+    printf( "%s  {\"connections\": %d, \"threads\": %d, \"keepalive\": %s, \"depth\": %d, \"mode\": \"%s\", "
+            "\"target_rps\": %.0f, \"duration_s\": %.3f,\n", first ? "" : ",\n", nconn, threads,
+            conf.keepalive ? "true" : "false", conf.keepalive ? conf.depth : 1, conf.rate > 0 ? "open" : "closed",
+            conf.rate, conf.duration );
+    printf( "   \"requests\": %llu, \"errors\": %llu, \"non_2xx\": %llu, \"dropped\": %llu, \"bytes\": %llu, "
+            "\"rps\": %.1f, \"mb_per_s\": %.3f,\n", ( unsigned long long )completed, ( unsigned long long )errors,
+            ( unsigned long long )non_2xx, ( unsigned long long )dropped, ( unsigned long long )bytes,
+            completed / conf.duration, bytes / conf.duration / 1e6 );
+    printf( "   \"latency_us\": {\"mean\": %.1f, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}",
+            total.mean(), ( unsigned long long )total.percentile( 0.5 ), ( unsigned long long )total.percentile( 0.99 ),
+            ( unsigned long long )total.percentile( 0.999 ), ( unsigned long long )total.max() );
+    fflush( stdout );
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "usage: %s [options] host port\n", prog );
+    fprintf( stderr, "  -c n[,n...]     connections, a list runs a sweep (default 10)\n" );
+    fprintf( stderr, "  -t threads      client threads (default 4)\n" );
+    fprintf( stderr, "  -d seconds      measured duration per sweep step (default 10)\n" );
+    fprintf( stderr, "  -W seconds      warmup per sweep step, not measured (default 1)\n" );
+    fprintf( stderr, "  -k              keep-alive, otherwise one request per connection\n" );
+    fprintf( stderr, "  -P depth        pipelined requests per keep-alive connection (default 1)\n" );
+    fprintf( stderr, "  -r rps          open loop at a fixed total rate, 0 is closed loop (default 0)\n" );
+    fprintf( stderr, "  -T seconds      request timeout (default 5)\n" );
+    fprintf( stderr, "  -u METHOD:path[:body]  request to send, may be repeated to build a mix (default GET:/)\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+    bench_conf conf;
+    conf.conns.push_back( 10 );
+    conf.threads = 4;
+    conf.duration = 10;
+    conf.warmup = 1;
+    conf.keepalive = false;
+    conf.depth = 1;
+    conf.rate = 0;
+    conf.timeout = 5;
+    vector< const char* > specs;
+
+    int opt;
+    while( ( opt = getopt( argc, argv, "c:t:d:W:kP:r:T:u:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'c':
+            if( !parse_list( optarg, conf.conns ) )
+            {
+                usage( argv[0] );
+                return 1;
+            }
+            break;
+        case 't':
+            conf.threads = atoi( optarg );
+            break;
+        case 'd':
+            conf.duration = atof( optarg );
+            break;
+        case 'W':
+            conf.warmup = atof( optarg );
+            break;
+        case 'k':
+            conf.keepalive = true;
+            break;
+        case 'P':
+            conf.depth = atoi( optarg );
+            break;
+        case 'r':
+            conf.rate = atof( optarg );
+            break;
+        case 'T':
+            conf.timeout = atof( optarg );
+            break;
+        case 'u':
+            specs.push_back( optarg );
+            break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if( argc - optind < 2 || conf.threads <= 0 || conf.duration <= 0 || conf.warmup < 0 || conf.depth <= 0
+        || conf.rate < 0 || conf.timeout <= 0 )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+    conf.host = argv[ optind ];
+
+    struct addrinfo hints, *res;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if( getaddrinfo( argv[ optind ], argv[ optind + 1 ], &hints, &res ) != 0 )
+    {
+        fprintf( stderr, "cannot resolve %s\n", argv[ optind ] );
+        return 1;
+    }
+    memcpy( &conf.addr, res->ai_addr, sizeof( conf.addr ) );
+    freeaddrinfo( res );
+
+    if( specs.empty() )
+    {
+        specs.push_back( "GET:/" );
+    }
+    for( size_t i = 0; i < specs.size(); ++i )
+    {
+        string req;
+        if( !build_request( specs[i], conf.host, conf.keepalive, req ) )
+        {
+            fprintf( stderr, "bad request spec: %s\n", specs[i] );
+            return 1;
+        }
+        conf.requests.push_back( req );
+    }
+
+    signal( SIGPIPE, SIG_IGN );
+    printf( "[\n" );
+    for( size_t i = 0; i < conf.conns.size(); ++i )
+    {
+        run_phase( conf, conf.conns[i], i == 0 );
+    }
+    printf( "\n]\n" );
+    return 0;
+}
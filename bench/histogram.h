@@ -0,0 +1,105 @@
+#ifndef BENCH_HISTOGRAM_H
+#define BENCH_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+// 压测和重放工具共用的计时和延迟直方图
+
+static inline uint64_t now_us()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ( uint64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 延迟直方图，和metrics一样按HDR方式分桶，每个2的幂区间分128个子桶，相对误差小于1%
+class histogram
+{
+public:
+    histogram() { reset(); }
+
+    void reset()
+    {
+        memset( m_buckets, 0, sizeof( m_buckets ) );
+        m_count = 0;
+        m_sum = 0;
+        m_max = 0;
+    }
+    void add( uint64_t v )
+    {
+        ++m_buckets[ bucket_of( v ) ];
+        ++m_count;
+        m_sum += v;
+        if( v > m_max )
+        {
+            m_max = v;
+        }
+    }
+    void merge( const histogram& other )
+    {
+        for( int b = 0; b < BUCKETS; ++b )
+        {
+            m_buckets[b] += other.m_buckets[b];
+        }
+        m_count += other.m_count;
+        m_sum += other.m_sum;
+        if( other.m_max > m_max )
+        {
+            m_max = other.m_max;
+        }
+    }
+    uint64_t percentile( double q ) const
+    {
+        uint64_t rank = ( uint64_t )( q * m_count );
+        uint64_t seen = 0;
+        for( int b = 0; b < BUCKETS && m_count > 0; ++b )
+        {
+            seen += m_buckets[b];
+            if( seen > rank )
+            {
+                uint64_t upper = bucket_upper( b );
+                return upper < m_max ? upper : m_max;
+            }
+        }
+        return 0;
+    }
+    uint64_t count() const { return m_count; }
+    uint64_t max() const { return m_max; }
+    double mean() const { return m_count ? ( double )m_sum / m_count : 0; }
+
+private:
+    static const int SUB_BITS = 7;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    static int bucket_of( uint64_t v )
+    {
+        if( v < ( uint64_t )SUB_BUCKETS )
+        {
+            return v;
+        }
+        int e = 63 - __builtin_clzll( v );
+        int sub = ( v >> ( e - SUB_BITS ) ) & ( SUB_BUCKETS - 1 );
+        return ( e - SUB_BITS + 1 ) * SUB_BUCKETS + sub;
+    }
+    static uint64_t bucket_upper( int b )
+    {
+        if( b < SUB_BUCKETS )
+        {
+            return b;
+        }
+        int e = b / SUB_BUCKETS + SUB_BITS - 1;
+        int sub = b % SUB_BUCKETS;
+        return ( ( uint64_t )( SUB_BUCKETS + sub ) << ( e - SUB_BITS ) ) + ( 1ULL << ( e - SUB_BITS ) ) - 1;
+    }
+
+private:
+    uint64_t m_buckets[ BUCKETS ];
+    uint64_t m_count;
+    uint64_t m_sum;
+    uint64_t m_max;
+};
+
+#endif
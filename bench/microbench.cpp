@@ -0,0 +1,751 @@
+// 微基准测试：请求解析、定时器链表、线程池队列、数据库连接池、访问日志、按IP限速、HPACK解码、路由表
+// 每个用例输出一行JSON，ns_per_op为每次操作的纳秒数，多线程用例为墙钟时间除以总操作数(吞吐的倒数)
+// 用-b指定之前保存的输出作为基线，输出中附带变化百分比，超过-r阈值的变慢用例使退出码为2
+//
+// 用法: ./microbench [options]
+//   ./microbench > baseline.json
+//   ./microbench -b baseline.json -f timer
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "histogram.h"
+#include "../http_conn.h"
+#include "../lst_timer.h"
+#include "../threadpool.h"
+#include "../sqlconnpool.h"
+#include "../capture.h"
+#include "../accesslog.h"
+#include "../iplimit.h"
+#include "../hpack.h"
+#include "../router.h"
+
+using namespace std;
+
+// 用例函数执行iters次操作，返回实际完成的操作数
+typedef uint64_t ( *bench_fn )( void* arg, uint64_t iters );
+
+struct bench_conf
+{
+    double min_time;            // 每个用例至少运行的时间，秒
+    const char* filter;         // 只运行名字包含该子串的用例
+    vector< int > sizes;        // 定时器链表长度
+    vector< int > threads;      // 并发线程数
+    const char* capture_path;   // 解析器语料，来自服务器-c抓取的文件
+    string db_host;
+    int db_port;
+    const char* db_user;
+    const char* db_password;
+    const char* db_name;
+    const char* baseline;
+    double regress_pct;
+};
+
+static bench_conf g_conf;
+static map< string, double > g_baseline;
+static bool g_first = true;
+static int g_regressions = 0;
+
+static bool selected( const string& name )
+{
+    return !g_conf.filter || name.find( g_conf.filter ) != string::npos;
+}
+
+static void report( const string& name, double ns_per_op, uint64_t ops )
+{
+    printf( "%s  {\"name\": \"%s\", \"ns_per_op\": %.2f, \"ops\": %llu", g_first ? "[\n" : ",\n", name.c_str(),
+            ns_per_op, ( unsigned long long )ops );
+    g_first = false;
+    map< string, double >::iterator it = g_baseline.find( name );
+    if( it != g_baseline.end() && it->second > 0 )
+    {
+        double change = ( ns_per_op - it->second ) / it->second * 100;
+        printf( ", \"baseline_ns\": %.2f, \"change_pct\": %.1f", it->second, change );
+        if( change > g_conf.regress_pct )
+        {
+            printf( ", \"regression\": true" );
+            ++g_regressions;
+        }
+    }
+    printf( "}" );
+    fflush( stdout );
+}
+
+// 单线程用例，迭代次数翻倍直到运行时间够长
+static void run_case( const string& name, bench_fn fn, void* arg )
+{
+    if( !selected( name ) )
+    {
+        return;
+    }
+    uint64_t iters = 1;
+    while( true )
+    {
+        uint64_t start = now_us();
+        uint64_t ops = fn( arg, iters );
+        uint64_t elapsed = now_us() - start;
+        if( elapsed >= g_conf.min_time * 1e6 || iters >= ( 1ULL << 40 ) )
+        {
+            report( name, ops ? elapsed * 1000.0 / ops : 0, ops );
+            return;
+        }
+        iters *= 2;
+    }
+}
+
+// ---------------- 请求解析 ----------------
+
+struct parse_arg
+{
+    http_conn* conn;
+    vector< string > corpus;
+};
+
+static uint64_t bench_parse( void* arg, uint64_t iters )
+{
+    parse_arg* p = ( parse_arg* )arg;
+    size_t n = p->corpus.size();
+    for( uint64_t i = 0; i < iters; ++i )
+    {
+        const string& req = p->corpus[ i % n ];
+        p->conn->parse_buffer( req.data(), req.size() );
+    }
+    return iters;
+}
+
+static const char* const builtin_corpus[][2] =
+{
+    { "get_minimal", "GET / HTTP/1.1\r\n\r\n" },
+    { "get_keepalive", "GET /judge.html HTTP/1.1\r\nHost: 127.0.0.1:9006\r\nConnection: keep-alive\r\n\r\n" },
+    { "get_browser",
+      "GET /picture.html HTTP/1.1\r\nHost: 127.0.0.1:9006\r\nConnection: keep-alive\r\nCache-Control: max-age=0\r\n"
+      "Upgrade-Insecure-Requests: 1\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+      "Chrome/120.0.0.0 Safari/537.36\r\nAccept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+      "image/webp,*/*;q=0.8\r\nAccept-Encoding: gzip, deflate\r\nAccept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n\r\n" },
+    { "get_range", "GET /video.mp4 HTTP/1.1\r\nHost: 127.0.0.1:9006\r\nConnection: keep-alive\r\nRange: bytes=1048576-\r\n\r\n" },
+    { "post_login",
+      "POST /2CGISQL.cgi HTTP/1.1\r\nHost: 127.0.0.1:9006\r\nConnection: keep-alive\r\n"
+      "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: 26\r\n\r\nuser=alice&password=secret" },
+    { "post_chunked",
+      "POST /2CGISQL.cgi HTTP/1.1\r\nHost: 127.0.0.1:9006\r\nConnection: keep-alive\r\n"
+      "Content-Type: application/x-www-form-urlencoded\r\nTransfer-Encoding: chunked\r\n\r\n"
+      "a\r\nuser=alice\r\n10;ext=1\r\n&password=secret\r\n0\r\n\r\n" },
+};
+
+// 从抓取文件中取出所有客户端数据段作为语料，一般一段就是一个完整请求
+static bool load_capture( const char* path, vector< string >& corpus )
+{
+    FILE* fp = fopen( path, "rb" );
+    if( !fp )
+    {
+        return false;
+    }
+    char magic[ CAPTURE_MAGIC_LEN ];
+    if( fread( magic, 1, CAPTURE_MAGIC_LEN, fp ) != CAPTURE_MAGIC_LEN || memcmp( magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN ) != 0 )
+    {
+        fclose( fp );
+        return false;
+    }
+    capture_record rec;
+    while( fread( &rec, sizeof( rec ), 1, fp ) == 1 )
+    {
+        string data( rec.len, '\0' );
+        if( rec.len > 0 && fread( &data[0], 1, rec.len, fp ) != rec.len )
+        {
+            break;
+        }
+        if( rec.type == CAP_DATA )
+        {
+            corpus.push_back( data );
+        }
+    }
+    fclose( fp );
+    return !corpus.empty();
+}
+
+static void run_parser()
+{
+    parse_arg arg;
+    arg.conn = new http_conn;
+    for( size_t i = 0; i < sizeof( builtin_corpus ) / sizeof( builtin_corpus[0] ); ++i )
+    {
+        arg.corpus.assign( 1, builtin_corpus[i][1] );
+        if( arg.conn->parse_buffer( arg.corpus[0].data(), arg.corpus[0].size() ) != http_conn::GET_REQUEST )
+        {
+            fprintf( stderr, "parser rejected builtin request %s\n", builtin_corpus[i][0] );
+            continue;
+        }
+        run_case( string( "parse/" ) + builtin_corpus[i][0], bench_parse, &arg );
+    }
+    if( g_conf.capture_path )
+    {
+        arg.corpus.clear();
+        if( !load_capture( g_conf.capture_path, arg.corpus ) )
+        {
+            fprintf( stderr, "cannot read capture file %s\n", g_conf.capture_path );
+        }
+        else
+        {
+            run_case( "parse/capture", bench_parse, &arg );
+        }
+    }
+    delete arg.conn;
+}
+
+// ---------------- 定时器链表 ----------------
+
+static void timer_noop( client_data* )
+{
+}
+
+static util_timer* new_timer( time_t expire )
+{
+    util_timer* timer = new util_timer;
+    timer->expire = expire;
+    timer->cb_func = timer_noop;
+    timer->user_data = NULL;
+    return timer;
+}
+
+// 建立n个超时时间互不相同的定时器，按超时时间从大到小插入，每次都插在头部
+static time_t fill_timers( sort_lst_timer& lst, int n, time_t first )
+{
+    for( int i = n - 1; i >= 0; --i )
+    {
+        lst.add_timer( new_timer( first + i ) );
+    }
+    return first + n - 1;
+}
+
+struct timer_arg
+{
+    sort_lst_timer* lst;
+    time_t last;                // 链表中最大的超时时间
+    util_timer* head;
+};
+
+// 新连接的超时时间总是最晚的，add_timer要走完整个链表，随后删除保持长度不变
+static uint64_t bench_timer_add( void* arg, uint64_t iters )
+{
+    timer_arg* t = ( timer_arg* )arg;
+    for( uint64_t i = 0; i < iters; ++i )
+    {
+        util_timer* timer = new_timer( t->last + 1 );
+        t->lst->add_timer( timer );
+        t->lst->del_timer( timer );
+    }
+    return iters;
+}
+
+// 有数据到达时把最早到期的连接延后到最晚，和主循环中adjust_timer的用法一致
+static uint64_t bench_timer_adjust( void* arg, uint64_t iters )
+{
+    timer_arg* t = ( timer_arg* )arg;
+    for( uint64_t i = 0; i < iters; ++i )
+    {
+        util_timer* timer = t->head;
+        t->head = timer->next;
+        timer->expire = ++t->last;
+        t->lst->adjust_timer( timer );
+    }
+    return iters;
+}
+
+static void run_timers()
+{
+    char name[ 64 ];
+    time_t now = time( NULL );
+    for( size_t s = 0; s < g_conf.sizes.size(); ++s )
+    {
+        int n = g_conf.sizes[s];
+        timer_arg arg;
+
+        snprintf( name, sizeof( name ), "timer/add/%d", n );
+        if( selected( name ) )
+        {
+            sort_lst_timer lst;
+            arg.lst = &lst;
+            arg.last = fill_timers( lst, n, now + 3600 );
+            run_case( name, bench_timer_add, &arg );
+        }
+
+        snprintf( name, sizeof( name ), "timer/adjust/%d", n );
+        if( selected( name ) )
+        {
+            sort_lst_timer lst;
+            arg.lst = &lst;
+            arg.last = fill_timers( lst, n, now + 3600 );
+            // 链表头就是最早插入的now+3600
+            arg.head = NULL;
+            util_timer* first = new_timer( now + 3599 );
+            lst.add_timer( first );
+            arg.head = first;
+            run_case( name, bench_timer_adjust, &arg );
+        }
+
+        // tick按到期的定时器个数计算，每轮让链表前面的一部分到期
+        snprintf( name, sizeof( name ), "timer/tick/%d", n );
+        if( selected( name ) )
+        {
+            int expired = n < 10000 ? n : 10000;
+            uint64_t elapsed = 0;
+            uint64_t ops = 0;
+            for( int round = 0; round < 3; ++round )
+            {
+                sort_lst_timer lst;
+                now = time( NULL );
+                fill_timers( lst, n, now - expired );
+                uint64_t start = now_us();
+                ops += lst.tick();
+                elapsed += now_us() - start;
+            }
+            report( name, ops ? elapsed * 1000.0 / ops : 0, ops );
+        }
+    }
+}
+
+// ---------------- 线程池队列 ----------------
+
+static volatile uint64_t g_task_done;
+
+struct bench_task
+{
+    void process()
+    {
+        __sync_fetch_and_add( &g_task_done, 1 );
+    }
+};
+
+struct producer_arg
+{
+    threadpool< bench_task >* pool;
+    bench_task* tasks;
+    uint64_t count;
+    volatile int* go;
+};
+
+static void* producer( void* arg )
+{
+    producer_arg* p = ( producer_arg* )arg;
+    while( !*p->go )
+    {
+        sched_yield();
+    }
+    for( uint64_t i = 0; i < p->count; ++i )
+    {
+        // 队列满时append返回false，重试
+        while( !p->pool->append( p->tasks + i ) )
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// t个生产者向t个工作线程的线程池投递任务，测量从开始投递到全部执行完的时间
+static void run_threadpool()
+{
+    static const uint64_t TOTAL = 200000;
+    char name[ 64 ];
+    for( size_t i = 0; i < g_conf.threads.size(); ++i )
+    {
+        int t = g_conf.threads[i];
+        snprintf( name, sizeof( name ), "threadpool/append_run/%d", t );
+        if( !selected( name ) )
+        {
+            continue;
+        }
+        // 线程池的工作线程是分离的，析构后仍阻塞在信号量上，这里有意不释放
+        threadpool< bench_task >* pool = new threadpool< bench_task >( t, 10000 );
+        bench_task* tasks = new bench_task[ TOTAL ];
+        vector< pthread_t > tids( t );
+        vector< producer_arg > args( t );
+        volatile int go = 0;
+        g_task_done = 0;
+        for( int j = 0; j < t; ++j )
+        {
+            args[j].pool = pool;
+            args[j].count = TOTAL / t + ( j < ( int )( TOTAL % t ) ? 1 : 0 );
+            args[j].tasks = tasks;
+            args[j].go = &go;
+            pthread_create( &tids[j], NULL, producer, &args[j] );
+        }
+        uint64_t start = now_us();
+        go = 1;
+        for( int j = 0; j < t; ++j )
+        {
+            pthread_join( tids[j], NULL );
+        }
+        while( g_task_done < TOTAL )
+        {
+            sched_yield();
+        }
+        uint64_t elapsed = now_us() - start;
+        report( name, elapsed * 1000.0 / TOTAL, TOTAL );
+        delete[] tasks;
+    }
+}
+
+// ---------------- 数据库连接池 ----------------
+
+struct acquire_arg
+{
+    sqlconnpool* pool;
+    volatile int* go;
+    volatile int* stop;
+    uint64_t ops;
+};
+
+static void* acquirer( void* arg )
+{
+    acquire_arg* a = ( acquire_arg* )arg;
+    while( !*a->go )
+    {
+        sched_yield();
+    }
+    uint64_t ops = 0;
+    while( !*a->stop )
+    {
+        MYSQL* conn = a->pool->get_connection();
+        if( conn )
+        {
+            a->pool->release_connection( conn );
+            ++ops;
+        }
+    }
+    a->ops = ops;
+    return NULL;
+}
+
+static void run_connpool()
+{
+    char name[ 64 ];
+    bool any = false;
+    for( size_t i = 0; i < g_conf.threads.size(); ++i )
+    {
+        snprintf( name, sizeof( name ), "connpool/acquire_release/%d", g_conf.threads[i] );
+        any = any || selected( name );
+    }
+    if( !any )
+    {
+        return;
+    }
+    sqlconnpool* pool = sqlconnpool::get_instance();
+    pool->init( g_conf.db_host, g_conf.db_user, g_conf.db_password, g_conf.db_name, g_conf.db_port, 4, 8 );
+    if( !pool->available() )
+    {
+        fprintf( stderr, "database %s:%d unavailable, skipping connpool cases\n", g_conf.db_host.c_str(), g_conf.db_port );
+        return;
+    }
+    for( size_t i = 0; i < g_conf.threads.size(); ++i )
+    {
+        int t = g_conf.threads[i];
+        snprintf( name, sizeof( name ), "connpool/acquire_release/%d", t );
+        if( !selected( name ) )
+        {
+            continue;
+        }
+        vector< pthread_t > tids( t );
+        vector< acquire_arg > args( t );
+        volatile int go = 0;
+        volatile int stop = 0;
+        for( int j = 0; j < t; ++j )
+        {
+            args[j].pool = pool;
+            args[j].go = &go;
+            args[j].stop = &stop;
+            args[j].ops = 0;
+            pthread_create( &tids[j], NULL, acquirer, &args[j] );
+        }
+        uint64_t start = now_us();
+        go = 1;
+        usleep( ( useconds_t )( g_conf.min_time * 1e6 ) );
+        stop = 1;
+        uint64_t ops = 0;
+        for( int j = 0; j < t; ++j )
+        {
+            pthread_join( tids[j], NULL );
+            ops += args[j].ops;
+        }
+        uint64_t elapsed = now_us() - start;
+        report( name, ops ? elapsed * 1000.0 / ops : 0, ops );
+    }
+    pool->destroy_pool();
+}
+
+// ---------------- 参数和基线 ----------------
+
+static bool parse_list( const char* arg, vector< int >& out )
+{
+    out.clear();
+    const char* p = arg;
+    while( *p )
+    {
+        char* end;
+        long v = strtol( p, &end, 10 );
+        if( end == p || v <= 0 || ( *end && *end != ',' ) )
+        {
+            return false;
+        }
+        out.push_back( v );
+        p = *end ? end + 1 : end;
+    }
+    return !out.empty();
+}
+
+// 基线就是之前的输出，逐行取出name和ns_per_op
+static bool load_baseline( const char* path )
+{
+    FILE* fp = fopen( path, "r" );
+    if( !fp )
+    {
+        return false;
+    }
+    char line[ 512 ];
+    while( fgets( line, sizeof( line ), fp ) )
+    {
+        char name[ 128 ];
+        double ns;
+        const char* p = strstr( line, "{\"name\": \"" );
+        if( p && sscanf( p, "{\"name\": \"%127[^\"]\", \"ns_per_op\": %lf", name, &ns ) == 2 )
+        {
+            g_baseline[ name ] = ns;
+        }
+    }
+    fclose( fp );
+    return true;
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "usage: %s [options]\n", prog );
+    fprintf( stderr, "  -f substr       only run cases whose name contains substr (parse, timer, threadpool, connpool, accesslog, iplimit, hpack, route)\n" );
+    fprintf( stderr, "  -T seconds      minimum time per case (default 0.2)\n" );
+    fprintf( stderr, "  -n n[,n...]     timer list sizes (default 10000,100000,1000000)\n" );
+    fprintf( stderr, "  -t n[,n...]     thread counts (default 1,2,4,8,16,32,64)\n" );
+    fprintf( stderr, "  -c path         add requests from a server capture file (-c) to the parser corpus\n" );
+    fprintf( stderr, "  -d host:port    database for connpool cases (default localhost:3306)\n" );
+    fprintf( stderr, "  -b path         compare against a previous run's output\n" );
+    fprintf( stderr, "  -r pct          slowdown that counts as a regression, exit status 2 (default 10)\n" );
+}
+
+// ---------------- 访问日志 ----------------
+
+static uint64_t bench_access_record( void* arg, uint64_t iters )
+{
+    access_record* rec = ( access_record* )arg;
+    access_log* log = access_log::get_instance();
+    for( uint64_t i = 0; i < iters; ++i )
+    {
+        rec->latency_us = i;
+        log->record( *rec );
+    }
+    return iters;
+}
+
+// 请求线程写一条记录的开销，后台线程同时格式化写入/dev/null，跟不上时的丢弃也计入
+static void run_access_log()
+{
+    if( !selected( "accesslog/record" ) )
+    {
+        return;
+    }
+    access_log* log = access_log::get_instance();
+    if( !log->init( "/dev/null", 0, 0 ) )
+    {
+        return;
+    }
+    access_record rec;
+    memset( &rec, 0, sizeof( rec ) );
+    rec.addr = htonl( 0x7f000001 );
+    rec.status = 200;
+    rec.bytes = 1024;
+    rec.url_len = strlen( "/judge.html" );
+    memcpy( rec.url, "/judge.html", rec.url_len );
+    run_case( "accesslog/record", bench_access_record, &rec );
+    log->stop();
+}
+
+// ---------------- 按IP限速 ----------------
+
+static const uint32_t LIMIT_ADDRS = 4096;
+
+static uint64_t bench_ip_request( void* arg, uint64_t iters )
+{
+    ip_limiter* limiter = ( ip_limiter* )arg;
+    uint64_t ok = 0;
+    for( uint64_t i = 0; i < iters; ++i )
+    {
+        ok += limiter->request( htonl( 0x0a000000 + ( i & ( LIMIT_ADDRS - 1 ) ) ) );
+    }
+    // 令牌足够，全部放行；用结果防止循环被优化掉
+    return ok == iters ? iters : 0;
+}
+
+// 主线程每个请求查一次令牌桶，4096个客户端轮流请求，分片表约占1MB
+static void run_ip_limit()
+{
+    if( !selected( "iplimit/request" ) )
+    {
+        return;
+    }
+    ip_limiter* limiter = ip_limiter::get_instance();
+    limiter->init( 1000000000, 0, 0 );
+    run_case( "iplimit/request", bench_ip_request, limiter );
+}
+
+// ---------------- HPACK解码 ----------------
+
+// 浏览器打开新连接后的第一个请求：9个头部，字符串都是Huffman编码，大部分带索引加入动态表
+static const char hpack_block[] =
+    "\x82\x41\x8a\x08\x9d\x5c\x0b\x81\x70\xdc\x7c\x00\x73\x87\x44\x8a\x62\xb3\x11\x36\xd8\x55\xe7\x4d"
+    "\x34\x7f\x7a\xce\xd0\x7f\x66\xa2\x81\xb0\xda\xe0\x53\xfa\xfc\x08\x7e\xd4\xce\x6a\xad\xf2\xa7\x97"
+    "\x9c\x89\xc6\xbf\xb5\x21\xae\xba\x0b\xc8\xb1\xe6\x32\x58\x6d\x97\x57\x65\xc5\x3f\xac\xd8\xf7\xe8"
+    "\xcf\xf4\xa5\x06\xea\x55\x31\x14\x9d\x4f\xfd\xa9\x7a\x7b\x0f\x49\x58\x08\x80\xb8\x17\x02\xe0\x53"
+    "\x70\xe5\x1d\x86\x61\xb6\x5d\x5d\x97\x3f\x53\xc0\x49\x7c\xa5\x89\xd3\x4d\x1f\x43\xae\xba\x0c\x41"
+    "\xa4\xc7\xa9\x8f\x33\xa6\x9a\x3f\xdf\x9a\x68\xfa\x1d\x75\xd0\x62\x0d\x26\x3d\x4c\x79\xa6\x8f\xbe"
+    "\xd0\x01\x77\xfe\x8d\x48\xe6\x2b\x03\xee\x69\x7e\x8d\x48\xe6\x2b\x1e\x0b\x1d\x7f\x5f\x2c\x7c\xfd"
+    "\xf6\x80\x0b\xbd\x50\x8d\x9b\xd9\xab\xfa\x52\x42\xcb\x40\xd2\x5f\xa5\x23\xb3\x51\x93\xf7\x3a\xd7"
+    "\xb4\xfd\x7b\x9f\xef\xb4\x00\x5d\xff\xa2\xd5\xf7\xda\x00\x2e\xf7\x40\x86\xae\xc3\x1e\xc3\x27\xd7"
+    "\x85\xb6\x00\x7d\x28\x6f";
+
+static uint64_t bench_hpack_decode( void* arg, uint64_t iters )
+{
+    hpack_decoder* decoder = ( hpack_decoder* )arg;
+    vector< hpack_header > headers;
+    for( uint64_t i = 0; i < iters; ++i )
+    {
+        headers.clear();
+        if( !decoder->decode( ( const uint8_t* )hpack_block, sizeof( hpack_block ) - 1, headers ) )
+        {
+            return 0;
+        }
+    }
+    return iters;
+}
+
+// 每个HTTP/2请求在工作线程解码一个头部块，同一个解码器反复解码，动态表满后每次都有淘汰
+static void run_hpack()
+{
+    if( !selected( "hpack/decode" ) )
+    {
+        return;
+    }
+    hpack_decoder decoder;
+    run_case( "hpack/decode", bench_hpack_decode, &decoder );
+}
+
+// ---------------- 路由表 ----------------
+
+// 路由表中的路径和没有匹配的静态文件交替出现
+static const char* const route_paths[] = { "/", "/2CGISQL.cgi", "/picture.html", "/5", "/images/logo.png", "/3CGISQL.cgi" };
+
+static uint64_t bench_route_lookup( void* arg, uint64_t iters )
+{
+    const size_t n = sizeof( route_paths ) / sizeof( route_paths[0] );
+    uint64_t hit = 0;
+    for( uint64_t i = 0; i < iters; ++i )
+    {
+        hit += route_lookup( route_paths[ i % n ] ) != NULL;
+    }
+    // 每轮有4个路径匹配；用结果防止循环被优化掉
+    return hit ? iters : 0;
+}
+
+// 每个本地处理的请求在工作线程查一次路由表
+static void run_route()
+{
+    if( !selected( "route/lookup" ) )
+    {
+        return;
+    }
+    run_case( "route/lookup", bench_route_lookup, NULL );
+}
+
+int main( int argc, char* argv[] )
+{
+    g_conf.min_time = 0.2;
+    g_conf.filter = NULL;
+    parse_list( "10000,100000,1000000", g_conf.sizes );
+    parse_list( "1,2,4,8,16,32,64", g_conf.threads );
+    g_conf.capture_path = NULL;
+    g_conf.db_host = "localhost";
+    g_conf.db_port = 3306;
+    g_conf.db_user = "yim";
+    g_conf.db_password = "123456";
+    g_conf.db_name = "WebDB";
+    g_conf.baseline = NULL;
+    g_conf.regress_pct = 10;
+
+    int opt;
+    while( ( opt = getopt( argc, argv, "f:T:n:t:c:d:b:r:" ) ) != -1 )
+    {
+        bool ok = true;
+        switch( opt )
+        {
+        case 'f':
+            g_conf.filter = optarg;
+            break;
+        case 'T':
+            g_conf.min_time = atof( optarg );
+            ok = g_conf.min_time > 0;
+            break;
+        case 'n':
+            ok = parse_list( optarg, g_conf.sizes );
+            break;
+        case 't':
+            ok = parse_list( optarg, g_conf.threads );
+            break;
+        case 'c':
+            g_conf.capture_path = optarg;
+            break;
+        case 'd':
+        {
+            const char* colon = strrchr( optarg, ':' );
+            ok = colon && colon != optarg && atoi( colon + 1 ) > 0;
+            if( ok )
+            {
+                g_conf.db_host.assign( optarg, colon - optarg );
+                g_conf.db_port = atoi( colon + 1 );
+            }
+            break;
+        }
+        case 'b':
+            g_conf.baseline = optarg;
+            break;
+        case 'r':
+            g_conf.regress_pct = atof( optarg );
+            break;
+        default:
+            ok = false;
+            break;
+        }
+        if( !ok )
+        {
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if( g_conf.baseline && !load_baseline( g_conf.baseline ) )
+    {
+        fprintf( stderr, "cannot read baseline %s\n", g_conf.baseline );
+        return 1;
+    }
+
+    run_parser();
+    run_timers();
+    run_threadpool();
+    run_connpool();
+    run_access_log();
+    run_ip_limit();
+    run_hpack();
+    run_route();
+    printf( g_first ? "[]\n" : "\n]\n" );
+    return g_regressions ? 2 : 0;
+}
@@ -0,0 +1,365 @@
+// 流量重放工具
+// 读取服务器用-c抓取的流量文件，按记录的时间间隔(可加速/减速)重新建立连接、发送原始请求字节、关闭连接，
+// 保留原来的长连接空闲、分段到达和突发，单线程epoll驱动，结果以JSON输出到stdout
+//
+// 用法: ./replay [-s speed] [-g grace_s] capture_file host port
+//   ./replay -s 2 /tmp/traffic.cap 127.0.0.1 9006
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include "histogram.h"
+#include "../capture.h"
+
+using namespace std;
+
+static const int MAX_EVENT_NUMBER = 1024;
+
+struct replay_event
+{
+    uint64_t ts_us;
+    uint32_t conn;
+    uint8_t type;
+    string data;
+};
+
+static bool event_before( const replay_event& a, const replay_event& b )
+{
+    return a.ts_us < b.ts_us;
+}
+
+struct replay_conn
+{
+    int fd;
+    bool connected;
+    string out;
+    size_t out_off;
+    bool awaiting;              // 发了数据还没收到响应
+    uint64_t last_send;
+};
+
+struct replay_stats
+{
+    uint64_t connections;
+    uint64_t sends;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t errors;            // 连接失败或发送失败
+    uint64_t orphaned;          // 连接已被服务器关闭，后续数据无处可发
+    histogram lag;              // 实际执行时间比计划晚了多少
+    histogram ttfb;             // 发出数据到收到第一个响应字节
+};
+
+static int g_epollfd;
+static struct sockaddr_in g_addr;
+static replay_stats g_stats;
+
+static bool load( const char* path, vector< replay_event >& events )
+{
+    FILE* fp = fopen( path, "rb" );
+    if( !fp )
+    {
+        return false;
+    }
+    char magic[ CAPTURE_MAGIC_LEN ];
+    if( fread( magic, 1, CAPTURE_MAGIC_LEN, fp ) != CAPTURE_MAGIC_LEN || memcmp( magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN ) != 0 )
+    {
+        fclose( fp );
+        return false;
+    }
+    capture_record rec;
+    while( fread( &rec, sizeof( rec ), 1, fp ) == 1 )
+    {
+        replay_event ev;
+        ev.ts_us = rec.ts_us;
+        ev.conn = rec.conn;
+        ev.type = rec.type;
+        ev.data.resize( rec.len );
+        // 服务器被强杀时最后一条记录可能不完整，丢掉
+        if( rec.len > 0 && fread( &ev.data[0], 1, rec.len, fp ) != rec.len )
+        {
+            break;
+        }
+        events.push_back( ev );
+    }
+    fclose( fp );
+    // 记录本来就是按时间顺序写的，保险起见再排一次，稳定排序保持同一时刻的先后
+    stable_sort( events.begin(), events.end(), event_before );
+    return true;
+}
+
+static void conn_close( replay_conn* c )
+{
+    if( c->fd >= 0 )
+    {
+        epoll_ctl( g_epollfd, EPOLL_CTL_DEL, c->fd, 0 );
+        close( c->fd );
+        c->fd = -1;
+    }
+    c->connected = false;
+}
+
+static void conn_open( replay_conn* c )
+{
+    c->fd = socket( AF_INET, SOCK_STREAM, 0 );
+    c->connected = false;
+    c->out.clear();
+    c->out_off = 0;
+    c->awaiting = false;
+    if( c->fd < 0 )
+    {
+        ++g_stats.errors;
+        return;
+    }
+    fcntl( c->fd, F_SETFL, fcntl( c->fd, F_GETFL ) | O_NONBLOCK );
+    int one = 1;
+    setsockopt( c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+    if( connect( c->fd, ( struct sockaddr* )&g_addr, sizeof( g_addr ) ) < 0 && errno != EINPROGRESS )
+    {
+        ++g_stats.errors;
+        close( c->fd );
+        c->fd = -1;
+        return;
+    }
+    epoll_event event;
+    event.data.ptr = c;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl( g_epollfd, EPOLL_CTL_ADD, c->fd, &event );
+    ++g_stats.connections;
+}
+
+static void conn_flush( replay_conn* c )
+{
+    while( c->connected && c->out_off < c->out.size() )
+    {
+        ssize_t n = send( c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off, MSG_NOSIGNAL );
+        if( n < 0 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK )
+            {
+                ++g_stats.errors;
+                conn_close( c );
+            }
+            return;
+        }
+        c->out_off += n;
+        g_stats.bytes_sent += n;
+    }
+    if( c->out_off == c->out.size() )
+    {
+        c->out.clear();
+        c->out_off = 0;
+    }
+}
+
+static void conn_event( replay_conn* c, uint32_t events )
+{
+    if( !c->connected )
+    {
+        int err = 0;
+        socklen_t len = sizeof( err );
+        getsockopt( c->fd, SOL_SOCKET, SO_ERROR, &err, &len );
+        if( err )
+        {
+            ++g_stats.errors;
+            conn_close( c );
+            return;
+        }
+        if( !( events & EPOLLOUT ) )
+        {
+            return;
+        }
+        c->connected = true;
+    }
+    conn_flush( c );
+    if( c->fd < 0 || !( events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP ) ) )
+    {
+        return;
+    }
+    char buf[ 65536 ];
+    while( true )
+    {
+        ssize_t n = recv( c->fd, buf, sizeof( buf ), 0 );
+        if( n > 0 )
+        {
+            if( c->awaiting )
+            {
+                g_stats.ttfb.add( now_us() - c->last_send );
+                c->awaiting = false;
+            }
+            g_stats.bytes_received += n;
+            continue;
+        }
+        if( n < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+        {
+            break;
+        }
+        // 服务器关闭了连接，短连接或空闲超时
+        conn_close( c );
+        break;
+    }
+}
+
+static void run_event( map< uint32_t, replay_conn* >& conns, const replay_event& ev )
+{
+    replay_conn*& c = conns[ ev.conn ];
+    if( !c )
+    {
+        c = new replay_conn;
+        c->fd = -1;
+        c->connected = false;
+    }
+    switch( ev.type )
+    {
+    case CAP_OPEN:
+        conn_close( c );
+        conn_open( c );
+        break;
+    case CAP_DATA:
+        if( c->fd < 0 )
+        {
+            ++g_stats.orphaned;
+            break;
+        }
+        ++g_stats.sends;
+        c->out += ev.data;
+        c->awaiting = true;
+        c->last_send = now_us();
+        conn_flush( c );
+        break;
+    case CAP_CLOSE:
+        conn_close( c );
+        break;
+    default:
+        break;
+    }
+}
+
+static void poll_once( int timeout_ms )
+{
+    epoll_event events[ MAX_EVENT_NUMBER ];
+    int number = epoll_wait( g_epollfd, events, MAX_EVENT_NUMBER, timeout_ms );
+    for( int i = 0; i < number; ++i )
+    {
+        replay_conn* c = ( replay_conn* )events[i].data.ptr;
+        if( c->fd >= 0 )
+        {
+            conn_event( c, events[i].events );
+        }
+    }
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "usage: %s [options] capture_file host port\n", prog );
+    fprintf( stderr, "  -s speed        replay speed, 2 is twice as fast as recorded (default 1)\n" );
+    fprintf( stderr, "  -g seconds      wait this long for responses after the last event (default 2)\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+    double speed = 1;
+    double grace = 2;
+    int opt;
+    while( ( opt = getopt( argc, argv, "s:g:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 's':
+            speed = atof( optarg );
+            break;
+        case 'g':
+            grace = atof( optarg );
+            break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if( argc - optind < 3 || speed <= 0 || grace < 0 )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+
+    vector< replay_event > events;
+    if( !load( argv[ optind ], events ) )
+    {
+        fprintf( stderr, "cannot read capture file %s\n", argv[ optind ] );
+        return 1;
+    }
+
+    struct addrinfo hints, *res;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if( getaddrinfo( argv[ optind + 1 ], argv[ optind + 2 ], &hints, &res ) != 0 )
+    {
+        fprintf( stderr, "cannot resolve %s\n", argv[ optind + 1 ] );
+        return 1;
+    }
+    memcpy( &g_addr, res->ai_addr, sizeof( g_addr ) );
+    freeaddrinfo( res );
+
+    signal( SIGPIPE, SIG_IGN );
+    g_epollfd = epoll_create( 5 );
+
+    map< uint32_t, replay_conn* > conns;
+    uint64_t start = now_us();
+    size_t next = 0;
+    while( next < events.size() )
+    {
+        uint64_t due = start + ( uint64_t )( events[ next ].ts_us / speed );
+        uint64_t now = now_us();
+        if( now >= due )
+        {
+            g_stats.lag.add( now - due );
+            run_event( conns, events[ next ] );
+            ++next;
+            continue;
+        }
+        // 不到1ms时不阻塞，只收一下已经就绪的事件
+        poll_once( ( due - now ) / 1000 );
+    }
+    uint64_t replay_end = now_us();
+    uint64_t deadline = replay_end + ( uint64_t )( grace * 1e6 );
+    while( now_us() < deadline )
+    {
+        poll_once( 10 );
+    }
+
+    for( map< uint32_t, replay_conn* >::iterator it = conns.begin(); it != conns.end(); ++it )
+    {
+        conn_close( it->second );
+        delete it->second;
+    }
+    close( g_epollfd );
+
+    double duration = ( replay_end - start ) / 1e6;
+    printf( "{\"events\": %zu, \"speed\": %g, \"duration_s\": %.3f, \"connections\": %llu, \"sends\": %llu, "
+            "\"bytes_sent\": %llu, \"bytes_received\": %llu, \"errors\": %llu, \"orphaned\": %llu,\n",
+            events.size(), speed, duration, ( unsigned long long )g_stats.connections, ( unsigned long long )g_stats.sends,
+            ( unsigned long long )g_stats.bytes_sent, ( unsigned long long )g_stats.bytes_received,
+            ( unsigned long long )g_stats.errors, ( unsigned long long )g_stats.orphaned );
+    printf( " \"lag_us\": {\"p50\": %llu, \"p99\": %llu, \"max\": %llu},\n",
+            ( unsigned long long )g_stats.lag.percentile( 0.5 ), ( unsigned long long )g_stats.lag.percentile( 0.99 ),
+            ( unsigned long long )g_stats.lag.max() );
+    printf( " \"ttfb_us\": {\"mean\": %.1f, \"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}}\n",
+            g_stats.ttfb.mean(), ( unsigned long long )g_stats.ttfb.percentile( 0.5 ),
+            ( unsigned long long )g_stats.ttfb.percentile( 0.99 ), ( unsigned long long )g_stats.ttfb.percentile( 0.999 ),
+            ( unsigned long long )g_stats.ttfb.max() );
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "bloomfilter.h"
+
+bloom_filter::bloom_filter( size_t bits )
+{
+    size_t block_bits = BLOCK_WORDS * 64;
+    m_blocks = ( bits + block_bits - 1 ) / block_bits;
+    if( m_blocks == 0 )
+    {
+        m_blocks = 1;
+    }
+    // 按cache line对齐
+    void* mem = NULL;
+    if( posix_memalign( &mem, 64, bytes() ) != 0 )
+    {
+        throw std::exception();
+    }
+    m_bits = ( uint64_t* )mem;
+    memset( m_bits, 0, bytes() );
+}
+
+bloom_filter::~bloom_filter()
+{
+    free( m_bits );
+}
+
+// FNV-1a之后再做一次混合，让高低位都足够随机
+uint64_t bloom_filter::hash( const string& key )
+{
+    uint64_t h = 14695981039346656037ULL;
+    for( size_t i = 0; i < key.size(); ++i )
+    {
+        h ^= ( unsigned char )key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// 高32位选块，低32位拆成两个9位步长做双重哈希，在块内选K个位
+void bloom_filter::add( const string& key )
+{
+    uint64_t h = hash( key );
+    uint64_t* block = m_bits + ( ( h >> 32 ) % m_blocks ) * BLOCK_WORDS;
+    uint32_t h1 = h & 0x1ff;
+    uint32_t h2 = ( ( h >> 9 ) & 0x1ff ) | 1;
+    for( int i = 0; i < K; ++i )
+    {
+        uint32_t bit = ( h1 + i * h2 ) & 0x1ff;
+        __atomic_fetch_or( &block[ bit >> 6 ], 1ULL << ( bit & 63 ), __ATOMIC_RELAXED );
+    }
+}
+
+bool bloom_filter::may_contain( const string& key ) const
+{
+    uint64_t h = hash( key );
+    const uint64_t* block = m_bits + ( ( h >> 32 ) % m_blocks ) * BLOCK_WORDS;
+    uint32_t h1 = h & 0x1ff;
+    uint32_t h2 = ( ( h >> 9 ) & 0x1ff ) | 1;
+    for( int i = 0; i < K; ++i )
+    {
+        uint32_t bit = ( h1 + i * h2 ) & 0x1ff;
+        if( !( __atomic_load_n( &block[ bit >> 6 ], __ATOMIC_RELAXED ) & ( 1ULL << ( bit & 63 ) ) ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bloom_store::bloom_store( user_store* inner, size_t bits ) : m_inner( inner ), m_filter( bits )
+{
+    m_ready = false;
+    m_exact = true;
+    m_stop = false;
+    m_rejected = 0;
+    m_started = pthread_create( &m_thread, NULL, worker, this ) == 0;
+}
+
+bloom_store::~bloom_store()
+{
+    m_stop = true;
+    if( m_started )
+    {
+        pthread_join( m_thread, NULL );
+    }
+    delete m_inner;
+}
+
+void* bloom_store::worker( void* arg )
+{
+    bloom_store* store = ( bloom_store* )arg;
+    store->build();
+    return store;
+}
+
+void bloom_store::add_name( const string& name, void* arg )
+{
+    ( ( bloom_store* )arg )->add( name );
+}
+
+void bloom_store::add( const string& name )
+{
+    string key;
+    if( m_inner->key( name, key ) )
+    {
+        m_filter.add( key );
+    }
+    else
+    {
+        __atomic_store_n( &m_exact, false, __ATOMIC_RELEASE );
+    }
+}
+
+// 遍历期间注册的用户由regist()加入，位只增不减，不会漏掉
+void bloom_store::build()
+{
+    while( !m_stop )
+    {
+        if( m_inner->scan( add_name, this ) )
+        {
+            __atomic_store_n( &m_ready, true, __ATOMIC_RELEASE );
+            printf( "username filter ready, %lu KB\n", ( unsigned long )( m_filter.bytes() / 1024 ) );
+            if( !m_exact )
+            {
+                printf( "username filter: some usernames cannot be normalised, logins are not filtered\n" );
+            }
+            return;
+        }
+        // 后端暂时不可用，稍后重试
+        for( int i = 0; i < RETRY_INTERVAL && !m_stop; ++i )
+        {
+            sleep( 1 );
+        }
+    }
+}
+
+user_store::RESULT bloom_store::login( const string& name, const string& password )
+{
+    string key;
+    if( __atomic_load_n( &m_ready, __ATOMIC_ACQUIRE ) && __atomic_load_n( &m_exact, __ATOMIC_ACQUIRE )
+        && m_inner->key( name, key ) && !m_filter.may_contain( key ) )
+    {
+        __sync_fetch_and_add( &m_rejected, 1 );
+        return STORE_FAIL;
+    }
+    return m_inner->login( name, password );
+}
+
+user_store::RESULT bloom_store::regist( const string& name, const string& password )
+{
+    // 先置位再插入，否则插入完成到置位之间的登录会被误拒
+    // 插入失败多出来的位只会增加误判，不影响正确性
+    add( name );
+    return m_inner->regist( name, password );
+}
@@ -0,0 +1,76 @@
+#ifndef _BLOOM_FILTER_
+#define _BLOOM_FILTER_
+
+#include <stdint.h>
+#include <string>
+#include <pthread.h>
+#include "userstore.h"
+
+using namespace std;
+
+// 分块布隆过滤器
+// 位数组按64字节(一条cache line)分块，一个用户名的K个位都落在同一块里，查询只访问一条cache line
+// 位只会被置1，用原子或置位，读不加锁，可以被多个线程同时读写
+// 大小在构造时固定，用户数超出预期时误判率上升但内存不增长
+class bloom_filter
+{
+public:
+    // bits为位数组大小，向上取整到整块
+    explicit bloom_filter( size_t bits );
+    ~bloom_filter();
+
+    void add( const string& key );
+    // 返回false说明一定不存在，返回true可能存在
+    bool may_contain( const string& key ) const;
+    size_t bytes() const { return m_blocks * BLOCK_WORDS * sizeof( uint64_t ); }
+
+private:
+    static uint64_t hash( const string& key );
+
+private:
+    static const int K = 7;                 // 每个键置位数
+    static const size_t BLOCK_WORDS = 8;    // 每块8个64位字，共512位
+
+    uint64_t* m_bits;
+    size_t m_blocks;
+};
+
+// 用户名存在性过滤，包在其他凭据存储之外
+// 过滤器确定不存在的用户名，登录直接失败，不访问后端；过滤器里存的是后端的用户名键(user_store::key)，
+// 后端认为相同的用户名不会被拒绝。有用户名无法归一化时过滤器不再拒绝任何登录
+// 启动后由后台线程遍历后端建立过滤器，建好之前所有请求直接透传
+class bloom_store : public user_store
+{
+public:
+    // 接管inner的所有权
+    bloom_store( user_store* inner, size_t bits );
+    ~bloom_store();
+
+    RESULT login( const string& name, const string& password );
+    RESULT regist( const string& name, const string& password );
+    bool scan( scan_cb cb, void* arg ) { return m_inner->scan( cb, arg ); }
+
+    // 被过滤器直接拒绝的登录次数
+    unsigned long long rejected() const { return m_rejected; }
+
+private:
+    static void* worker( void* arg );
+    void build();
+    static void add_name( const string& name, void* arg );
+    void add( const string& name );
+
+private:
+    // 建立失败后重试的间隔，秒
+    static const int RETRY_INTERVAL = 10;
+
+    user_store* m_inner;
+    bloom_filter m_filter;
+    volatile bool m_ready;      // 过滤器已完整建立
+    volatile bool m_exact;      // 所有用户名都能归一化，可以拒绝
+    volatile bool m_stop;
+    pthread_t m_thread;
+    bool m_started;
+    unsigned long long m_rejected;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "metrics.h"
+
+static const size_t CAPTURE_BUF_SIZE = 1 << 20;
+
+traffic_capture* traffic_capture::get_instance()
+{
+    static traffic_capture capture;
+    return &capture;
+}
+
+traffic_capture::traffic_capture()
+{
+    m_file = NULL;
+    m_buf = NULL;
+    m_start_us = 0;
+    m_sample = 1;
+    m_seen = 0;
+}
+
+traffic_capture::~traffic_capture()
+{
+    close();
+}
+
+bool traffic_capture::open( const char* path, int sample )
+{
+    m_file = fopen( path, "wb" );
+    if( !m_file )
+    {
+        return false;
+    }
+    m_buf = ( char* )malloc( CAPTURE_BUF_SIZE );
+    if( m_buf )
+    {
+        setvbuf( m_file, m_buf, _IOFBF, CAPTURE_BUF_SIZE );
+    }
+    fwrite( CAPTURE_MAGIC, 1, CAPTURE_MAGIC_LEN, m_file );
+    m_sample = sample > 0 ? sample : 1;
+    m_start_us = metrics::now_us();
+    return true;
+}
+
+void traffic_capture::close()
+{
+    m_lock.lock();
+    if( m_file )
+    {
+        fclose( m_file );
+        m_file = NULL;
+    }
+    free( m_buf );
+    m_buf = NULL;
+    m_lock.unlock();
+}
+
+bool traffic_capture::sample()
+{
+    if( !m_file )
+    {
+        return false;
+    }
+    return __sync_fetch_and_add( &m_seen, 1 ) % m_sample == 0;
+}
+
+void traffic_capture::record( uint32_t conn, capture_type type, const char* data, uint32_t len )
+{
+    capture_record rec;
+    rec.ts_us = metrics::now_us() - m_start_us;
+    rec.conn = conn;
+    rec.type = type;
+    rec.len = len;
+    m_lock.lock();
+    if( m_file )
+    {
+        fwrite( &rec, sizeof( rec ), 1, m_file );
+        if( len > 0 )
+        {
+            fwrite( data, 1, len, m_file );
+        }
+    }
+    m_lock.unlock();
+}
@@ -0,0 +1,60 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "locker.h"
+
+// 流量抓取文件格式，整数都是小端
+// 文件头: 8字节魔数"WSCAP01\n"
+// 每条记录: capture_record(17字节) + len字节数据
+// 记录按主线程处理的先后顺序写入，时间戳单调递增
+#define CAPTURE_MAGIC "WSCAP01\n"
+#define CAPTURE_MAGIC_LEN 8
+
+enum capture_type
+{
+    CAP_OPEN = 1,           // 接受新连接
+    CAP_DATA = 2,           // 从客户端读到一段数据，原样保存
+    CAP_CLOSE = 3           // 客户端关闭连接
+};
+
+#pragma pack( push, 1 )
+struct capture_record
+{
+    uint64_t ts_us;         // 相对抓取开始的时间，微秒
+    uint32_t conn;          // 连接编号，同一连接的记录编号相同
+    uint8_t type;           // capture_type
+    uint32_t len;           // 后面数据的长度
+};
+#pragma pack( pop )
+
+// 流量抓取，按连接采样，被采中的连接从建立到关闭的所有请求字节和到达时间都记下来，
+// 用bench/replay按原速或加速重放
+class traffic_capture
+{
+public:
+    static traffic_capture* get_instance();
+
+    // sample为N表示每N个连接抓一个
+    bool open( const char* path, int sample );
+    void close();
+    bool enabled() const { return m_file != NULL; }
+    // 新连接是否被采中
+    bool sample();
+    void record( uint32_t conn, capture_type type, const char* data = NULL, uint32_t len = 0 );
+
+private:
+    traffic_capture();
+    ~traffic_capture();
+
+private:
+    locker m_lock;
+    FILE* m_file;
+    char* m_buf;            // 文件缓冲，攒够了再写盘
+    uint64_t m_start_us;
+    int m_sample;
+    unsigned int m_seen;
+};
+
+#endif
@@ -0,0 +1,459 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "coloop.h"
+#include "http_conn.h"
+#include "metrics.h"
+#include "admission.h"
+#include "iplimit.h"
+#include "probes.h"
+
+static const int MAX_EVENT_NUMBER = 10000;
+
+// 帧大小按64字节向上取整分桶，超过上限的直接用malloc
+static const size_t FRAME_ALIGN = 64;
+static const size_t FRAME_BUCKETS = 64;
+static vector< void* > g_free_frames[ FRAME_BUCKETS ];
+
+void* frame_pool::alloc( size_t size )
+{
+    size_t bucket = ( size + FRAME_ALIGN - 1 ) / FRAME_ALIGN;
+    if( bucket < FRAME_BUCKETS && !g_free_frames[ bucket ].empty() )
+    {
+        void* ptr = g_free_frames[ bucket ].back();
+        g_free_frames[ bucket ].pop_back();
+        return ptr;
+    }
+    void* ptr = malloc( bucket * FRAME_ALIGN );
+    if( !ptr )
+    {
+        abort();
+    }
+    return ptr;
+}
+
+void frame_pool::release( void* ptr, size_t size )
+{
+    size_t bucket = ( size + FRAME_ALIGN - 1 ) / FRAME_ALIGN;
+    if( bucket < FRAME_BUCKETS )
+    {
+        g_free_frames[ bucket ].push_back( ptr );
+        return;
+    }
+    free( ptr );
+}
+
+bool co_loop::io_awaiter::await_ready()
+{
+    // 等待之前已经到达的事件直接消费，不挂起
+    if( c->timed_out || ( c->ready & events ) )
+    {
+        c->ready &= ~events;
+        return true;
+    }
+    return false;
+}
+
+void co_loop::io_awaiter::await_suspend( coroutine_handle<> h )
+{
+    c->waiter = h;
+    c->wait_events = events;
+}
+
+bool co_loop::offload_awaiter::await_suspend( coroutine_handle<> h )
+{
+    conn_state& c = loop->m_conns[ fd ];
+    if( streaming )
+    {
+        if( !loop->m_pool->append( loop->m_users + fd ) )
+        {
+            c.result = LOOP_CLOSE;
+            return false;
+        }
+        c.waiter = h;
+        c.wait_events = 0;
+        return true;
+    }
+    admission* adm = admission::get_instance();
+    if( !loop->m_users[ fd ].in_body() && !ip_limiter::get_instance()->request( loop->m_users_timer[ fd ].address.sin_addr.s_addr ) )
+    {
+        // 客户端请求过快，回复429后关闭
+        adm->reject( fd, M_RATE_LIMITED );
+        c.result = LOOP_CLOSE;
+        return false;
+    }
+    if( !adm->admit( loop->m_pool->queue_size() ) || !loop->m_pool->append( loop->m_users + fd ) )
+    {
+        // 过载，回复503后关闭，协程不挂起
+        adm->reject( fd, M_SHED_REQUESTS );
+        c.result = LOOP_CLOSE;
+        return false;
+    }
+    c.waiter = h;
+    c.wait_events = 0;
+    return true;
+}
+
+co_loop* co_loop::get_instance()
+{
+    static co_loop loop;
+    return &loop;
+}
+
+co_loop::co_loop()
+{
+    m_epollfd = -1;
+    m_stop = false;
+}
+
+bool co_loop::init()
+{
+    return init_wake( EFD_NONBLOCK | EFD_CLOEXEC );
+}
+
+co_loop::io_awaiter co_loop::wait_io( int fd, uint32_t events )
+{
+    io_awaiter a = { &m_conns[ fd ], events };
+    return a;
+}
+
+co_loop::offload_awaiter co_loop::offload( int fd, bool streaming )
+{
+    offload_awaiter a = { this, fd, streaming };
+    return a;
+}
+
+// 一个连接从建立到关闭的全部处理
+co_task co_loop::serve( int fd )
+{
+    http_conn* conn = m_users + fd;
+    conn_state& c = m_conns[ fd ];
+    metrics* stat = metrics::get_instance();
+    while( true )
+    {
+        if( !co_await wait_io( fd, EPOLLIN ) )
+        {
+            break;
+        }
+        uint64_t start = metrics::now_us();
+        bool read_ret = conn->read();
+        uint64_t read_us = metrics::now_us() - start;
+        stat->observe( H_READ, read_us );
+        PROBE3( read, fd, read_ret, read_us );
+        if( !read_ret )
+        {
+            break;
+        }
+        // read()已经读到EAGAIN，之前记下的可读事件作废；读缓冲满时socket中可能还有数据，
+        // 工作线程取走消息体之后直接再读
+        if( conn->read_room() == 0 )
+        {
+            c.ready |= EPOLLIN;
+        }
+        else
+        {
+            c.ready &= ~EPOLLIN;
+        }
+        touch( fd );
+
+        loop_notify ev = co_await offload( fd );
+        if( ev == LOOP_CLOSE )
+        {
+            break;
+        }
+        if( ev == LOOP_READ )
+        {
+            // 请求不完整，继续读
+            continue;
+        }
+
+        // 发送响应，发不完就等可写
+        http_conn::SEND_STATUS status = http_conn::SEND_AGAIN;
+        while( status == http_conn::SEND_AGAIN || status == http_conn::SEND_MORE )
+        {
+            if( status == http_conn::SEND_MORE )
+            {
+                // 流式响应的一段发完，工作线程生成下一段之后继续发送
+                if( co_await offload( fd, true ) == LOOP_CLOSE )
+                {
+                    status = http_conn::SEND_CLOSE;
+                    break;
+                }
+                status = http_conn::SEND_AGAIN;
+                continue;
+            }
+            struct iovec* iov;
+            int count = conn->pending_iov( &iov );
+            if( count == 0 )
+            {
+                status = http_conn::SEND_KEEP;
+                break;
+            }
+            start = metrics::now_us();
+            int n = writev( fd, iov, count );
+            if( n < 0 && errno == EAGAIN )
+            {
+                c.ready &= ~EPOLLOUT;
+                if( co_await wait_io( fd, EPOLLOUT ) )
+                {
+                    continue;
+                }
+                errno = ETIMEDOUT;
+            }
+            status = conn->sent( n < 0 ? -errno : n );
+            uint64_t write_us = metrics::now_us() - start;
+            stat->observe( H_WRITE, write_us );
+            PROBE3( write_done, fd, status != http_conn::SEND_CLOSE, write_us );
+            touch( fd );
+        }
+        if( status == http_conn::SEND_CLOSE )
+        {
+            break;
+        }
+    }
+    finish( fd );
+}
+
+void co_loop::run( int epollfd, int listenfd, int sigfd, http_conn* users, client_data* users_timer, int max_fd,
+                   sort_lst_timer* timers, threadpool< http_conn >* pool, void ( *on_alarm )() )
+{
+    m_epollfd = epollfd;
+    m_listenfd = listenfd;
+    m_sigfd = sigfd;
+    m_users = users;
+    m_users_timer = users_timer;
+    m_timers = timers;
+    m_pool = pool;
+    m_on_alarm = on_alarm;
+    m_conns.resize( max_fd );
+
+    epoll_event event;
+    event.data.fd = m_wakefd;
+    event.events = EPOLLIN;
+    epoll_ctl( m_epollfd, EPOLL_CTL_ADD, m_wakefd, &event );
+
+    metrics* stat = metrics::get_instance();
+    epoll_event events[ MAX_EVENT_NUMBER ];
+    while( !m_stop )
+    {
+        int number = epoll_wait( m_epollfd, events, MAX_EVENT_NUMBER, -1 );
+        if( number < 0 && errno != EINTR )
+        {
+            printf( "epoll failure\n" );
+            break;
+        }
+        if( number > 0 )
+        {
+            stat->inc( M_EPOLL_WAKEUPS );
+            stat->observe( H_EPOLL_EVENTS, number );
+        }
+        bool timeout = false;
+        for( int i = 0; i < number; ++i )
+        {
+            int fd = events[i].data.fd;
+            if( fd == m_listenfd )
+            {
+                on_accept();
+            }
+            else if( fd == m_sigfd )
+            {
+                on_signal( timeout );
+            }
+            else if( fd == m_wakefd )
+            {
+                on_wake();
+            }
+            else
+            {
+                on_event( fd, events[i].events );
+            }
+        }
+        if( timeout )
+        {
+            m_on_alarm();
+            close_expired();
+        }
+    }
+    epoll_ctl( m_epollfd, EPOLL_CTL_DEL, m_wakefd, 0 );
+}
+
+void co_loop::on_accept()
+{
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof( client_address );
+    int connfd = accept( m_listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+    admission* adm = admission::get_instance();
+    if( connfd < 0 )
+    {
+        if( errno == EMFILE || errno == ENFILE )
+        {
+            evict( adm->evict_count( http_conn::m_user_count, true ) );
+        }
+        return;
+    }
+    metrics::get_instance()->inc( M_ACCEPTS );
+    PROBE2( accept, connfd, client_address.sin_addr.s_addr );
+    // 超过高水位时先关闭空闲连接，再决定是否接受新连接
+    evict( adm->evict_count( http_conn::m_user_count + 1, false ) );
+    if( connfd >= ( int )m_conns.size() || http_conn::m_user_count >= ( int )m_conns.size() )
+    {
+        adm->reject( connfd, M_SHED_CONNECTIONS );
+        close( connfd );
+        return;
+    }
+    if( !ip_limiter::get_instance()->connect( client_address.sin_addr.s_addr ) )
+    {
+        adm->reject( connfd, M_CONN_LIMITED );
+        close( connfd );
+        return;
+    }
+    m_users[ connfd ].init( connfd, client_address );
+    fcntl( connfd, F_SETFL, fcntl( connfd, F_GETFL ) | O_NONBLOCK );
+    // 读写事件一次注册，之后不再修改
+    epoll_event event;
+    event.data.fd = connfd;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    epoll_ctl( m_epollfd, EPOLL_CTL_ADD, connfd, &event );
+
+    conn_state& c = m_conns[ connfd ];
+    c.waiter = coroutine_handle<>();
+    c.wait_events = 0;
+    c.ready = 0;
+    c.timed_out = false;
+
+    m_users_timer[ connfd ].address = client_address;
+    m_users_timer[ connfd ].sockfd = connfd;
+    util_timer* timer = new util_timer;
+    timer->user_data = &m_users_timer[ connfd ];
+    timer->cb_func = timer_cb;
+    timer->expire = time( NULL ) + admission::get_instance()->idle_timeout( http_conn::m_user_count );
+    m_users_timer[ connfd ].timer = timer;
+    m_timers->add_timer( timer );
+
+    serve( connfd );
+}
+
+void co_loop::on_signal( bool& timeout )
+{
+    char signals[ 1024 ];
+    int ret = recv( m_sigfd, signals, sizeof( signals ), 0 );
+    for( int i = 0; i < ret; ++i )
+    {
+        switch( signals[i] )
+        {
+        case SIGALRM:
+            timeout = true;
+            break;
+        case SIGTERM:
+            m_stop = true;
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+void co_loop::on_wake()
+{
+    uint64_t count;
+    ssize_t ret = read( m_wakefd, &count, sizeof( count ) );
+    ( void )ret;
+    take_ready( m_ready_swap );
+    for( size_t i = 0; i < m_ready_swap.size(); ++i )
+    {
+        int fd = m_ready_swap[i].first;
+        m_conns[ fd ].result = m_ready_swap[i].second;
+        resume( fd );
+    }
+}
+
+void co_loop::on_event( int fd, uint32_t events )
+{
+    conn_state& c = m_conns[ fd ];
+    // 对端关闭或出错时读写都要醒来，由read()/writev()发现错误
+    if( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+    {
+        events |= EPOLLIN | EPOLLOUT;
+    }
+    c.ready |= events & ( EPOLLIN | EPOLLOUT );
+    if( c.wait_events & c.ready )
+    {
+        c.ready &= ~c.wait_events;
+        resume( fd );
+    }
+}
+
+void co_loop::resume( int fd )
+{
+    conn_state& c = m_conns[ fd ];
+    coroutine_handle<> h = c.waiter;
+    if( !h )
+    {
+        return;
+    }
+    c.waiter = coroutine_handle<>();
+    c.wait_events = 0;
+    h.resume();
+}
+
+// 有数据传输，定时器延后
+void co_loop::touch( int fd )
+{
+    util_timer* timer = m_users_timer[ fd ].timer;
+    if( timer )
+    {
+        timer->expire = time( NULL ) + admission::get_instance()->idle_timeout( http_conn::m_user_count );
+        m_timers->adjust_timer( timer );
+    }
+}
+
+void co_loop::finish( int fd )
+{
+    util_timer* timer = m_users_timer[ fd ].timer;
+    if( timer )
+    {
+        m_timers->del_timer( timer );
+        m_users_timer[ fd ].timer = NULL;
+    }
+    // 从epoll删除、关闭socket、连接数减一
+    m_users[ fd ].close_conn();
+}
+
+void co_loop::close_expired()
+{
+    for( size_t i = 0; i < m_expired.size(); ++i )
+    {
+        resume( m_expired[i] );
+    }
+    m_expired.clear();
+}
+
+// 从最早到期的定时器开始关闭n个空闲连接，和超时一样由协程自己结束
+void co_loop::evict( int n )
+{
+    if( n > 0 )
+    {
+        metrics::get_instance()->inc( M_IDLE_EVICTED, m_timers->evict( n, http_conn::idle_cb, m_users ) );
+        close_expired();
+    }
+}
+
+// 空闲超时，tick之后会删除定时器；在工作线程或发送中的连接等回到读的时候再关闭
+void co_loop::timer_cb( client_data* user_data )
+{
+    user_data->timer = NULL;
+    co_loop* loop = get_instance();
+    conn_state& c = loop->m_conns[ user_data->sockfd ];
+    c.timed_out = true;
+    if( c.waiter && c.wait_events )
+    {
+        loop->m_expired.push_back( user_data->sockfd );
+    }
+}
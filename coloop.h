@@ -0,0 +1,127 @@
+#ifndef COLOOP_H
+#define COLOOP_H
+
+#include <stdint.h>
+#include <coroutine>
+#include <vector>
+#include "connloop.h"
+#include "lst_timer.h"
+#include "threadpool.h"
+
+using namespace std;
+
+class http_conn;
+
+// 协程帧分配器，按大小分桶的空闲链表，帧释放后留给下一个连接复用
+// 协程只在主线程创建和销毁，不加锁
+class frame_pool
+{
+public:
+    static void* alloc( size_t size );
+    static void release( void* ptr, size_t size );
+};
+
+// 不等待结果的协程，创建后立即运行到第一个挂起点，结束时自动释放帧
+struct co_task
+{
+    struct promise_type
+    {
+        co_task get_return_object() { return co_task(); }
+        suspend_never initial_suspend() noexcept { return suspend_never(); }
+        suspend_never final_suspend() noexcept { return suspend_never(); }
+        void return_void() {}
+        void unhandled_exception() { abort(); }
+        static void* operator new( size_t size ) { return frame_pool::alloc( size ); }
+        static void operator delete( void* ptr, size_t size ) { frame_pool::release( ptr, size ); }
+    };
+};
+
+// 协程事件循环，启动时用-o选择，代替epoll + EPOLLONESHOT的来回注册
+// 每个连接是一个协程：等待可读 -> read() -> 交给工作线程process() -> writev直到发完 -> 长连接回到开头，
+// 状态都在协程的局部变量里。挂起点是下面几个awaiter，awaiter保存在协程帧中，挂起和恢复不分配内存；
+// 协程帧来自frame_pool，稳定运行后建立连接也不分配内存。
+// 连接注册一次EPOLLIN | EPOLLOUT | EPOLLET，不再需要EPOLL_CTL_MOD；空闲超时仍由sort_lst_timer处理
+class co_loop : public conn_loop
+{
+public:
+    static co_loop* get_instance();
+
+    bool init();
+    // 运行事件循环直到收到SIGTERM，epollfd上已注册listenfd和sigfd(信号管道的读端)
+    // 空闲超时和空闲连接回收由admission决定
+    // SIGALRM时调用on_alarm处理定时器
+    void run( int epollfd, int listenfd, int sigfd, http_conn* users, client_data* users_timer, int max_fd,
+              sort_lst_timer* timers, threadpool< http_conn >* pool, void ( *on_alarm )() );
+
+private:
+    co_loop();
+    ~co_loop() {}
+
+    // 每个连接在事件循环中的状态
+    struct conn_state
+    {
+        coroutine_handle<> waiter;  // 挂起的协程
+        uint32_t wait_events;       // 等待的epoll事件，0表示在等工作线程
+        uint32_t ready;             // 到达后还没有被等待消费的事件
+        bool timed_out;             // 空闲超时
+        loop_notify result;         // 工作线程的处理结果
+    };
+
+    // 等待fd可读或可写，空闲超时返回false
+    struct io_awaiter
+    {
+        conn_state* c;
+        uint32_t events;
+        bool await_ready();
+        void await_suspend( coroutine_handle<> h );
+        bool await_resume() { return !c->timed_out; }
+    };
+
+    // 把请求交给工作线程执行process()，数据库查询也在工作线程中完成，返回处理结果
+    // 过载或客户端请求过快时不挂起，回复503或429并返回LOOP_CLOSE
+    // streaming为true时是流式响应的一段发完，交回工作线程生成下一段，不再检查速率和负载
+    struct offload_awaiter
+    {
+        co_loop* loop;
+        int fd;
+        bool streaming;
+        bool await_ready() { return false; }
+        bool await_suspend( coroutine_handle<> h );
+        loop_notify await_resume() { return loop->m_conns[ fd ].result; }
+    };
+
+    io_awaiter wait_io( int fd, uint32_t events );
+    offload_awaiter offload( int fd, bool streaming = false );
+    co_task serve( int fd );
+
+    void on_accept();
+    void on_signal( bool& timeout );
+    void on_wake();
+    void on_event( int fd, uint32_t events );
+    void resume( int fd );
+    void touch( int fd );
+    void finish( int fd );
+    // 恢复超时或被回收的连接，协程发现timed_out后关闭连接
+    void close_expired();
+    void evict( int n );
+    static void timer_cb( client_data* user_data );
+
+private:
+    int m_epollfd;
+    int m_listenfd;
+    int m_sigfd;
+    bool m_stop;
+
+    http_conn* m_users;
+    client_data* m_users_timer;
+    sort_lst_timer* m_timers;
+    threadpool< http_conn >* m_pool;
+    void ( *m_on_alarm )();
+    vector< conn_state > m_conns;
+
+    // 本次tick或回收中超时、正在等待io的连接，遍历结束后再恢复，避免在链表遍历中途关闭连接
+    vector< int > m_expired;
+    vector< pair< int, loop_notify > > m_ready_swap;
+};
+
+#endif
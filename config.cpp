@@ -0,0 +1,265 @@
+#include "config.h"
+
+config::config()
+{
+    ip = NULL;
+    port = 0;
+
+    sql_batch = false;
+    batch_size = 64;
+    batch_window = 1000;
+
+    min_conn = 4;
+    max_conn = 8;
+    affine_conn = false;
+
+    db_host = "localhost";
+    db_port = 3306;
+
+    store_path = NULL;
+    filter_kb = 0;
+    metrics_path = "/metrics";
+    slow_ms = 0;
+    slow_per_sec = 10;
+    slow_sample = 1;
+    capture_path = NULL;
+    capture_sample = 1;
+    io_uring = false;
+    sqpoll = false;
+    coroutine = false;
+    access_path = NULL;
+    rotate_mb = 100;
+    rotate_s = 86400;
+    max_queue = 0;
+    queue_ms = 0;
+    accept_rate = 0;
+    ip_rate = 0;
+    ip_burst = 0;
+    ip_conns = 0;
+    idle_high = 90;
+    tls_port = 0;
+    tls_cert = NULL;
+    tls_key = NULL;
+    check_path = "/";
+    check_interval = 2;
+    pack_path = NULL;
+    pack_load = "map";
+    pack_lock = false;
+}
+
+void config::usage( const char* prog )
+{
+    printf( "usage: %s ip_address port_number [options]\n", prog );
+    printf( "  -b              coalesce login lookups and register inserts\n" );
+    printf( "  -n batch_size   max requests per batch (default 64)\n" );
+    printf( "  -w window_us    batch window in microseconds (default 1000)\n" );
+    printf( "  -m min_conn     min database connections (default 4)\n" );
+    printf( "  -M max_conn     max database connections (default 8)\n" );
+    printf( "  -a              pin one database connection to each worker thread\n" );
+    printf( "  -d host:port    primary database, receives writes (default localhost:3306)\n" );
+    printf( "  -r host:port    read replica for login lookups, may be repeated\n" );
+    printf( "  -e store_path   use the embedded credential log instead of MySQL\n" );
+    printf( "  -f filter_kb    username Bloom filter size in KB, 0 disables (default 0)\n" );
+    printf( "  -p path         Prometheus metrics path, empty disables (default /metrics)\n" );
+    printf( "  -s slow_ms      log requests slower than this many ms to stderr, 0 disables (default 0)\n" );
+    printf( "  -l per_sec      max slow-request lines per second (default 10)\n" );
+    printf( "  -j n            log one slow request in n (default 1)\n" );
+    printf( "  -c path         record client traffic to path for bench/replay\n" );
+    printf( "  -C n            record one connection in n (default 1)\n" );
+    printf( "  -i              use io_uring instead of epoll, falls back to epoll if unsupported\n" );
+    printf( "  -S              with -i, let a kernel thread poll the submission queue\n" );
+    printf( "  -o              run each connection as one coroutine on the epoll loop, cannot be combined with -i\n" );
+    printf( "  -L path         write an access log to path from a background thread\n" );
+    printf( "  -z mb           rotate the access log after this many MB, 0 disables (default 100)\n" );
+    printf( "  -Z seconds      rotate the access log after this many seconds, 0 disables (default 86400)\n" );
+    printf( "  -q n            answer 503 when n requests are already queued, 0 only when the queue is full (default 0)\n" );
+    printf( "  -Q ms           answer 503 while the average queue wait exceeds ms, 0 disables (default 0)\n" );
+    printf( "  -A n            accept at most n connections per second, 0 disables (default 0)\n" );
+    printf( "  -R n            allow n requests per second from each client IP, 0 disables (default 0)\n" );
+    printf( "  -B n            burst of requests allowed from each client IP (default: same as -R)\n" );
+    printf( "  -N n            allow at most n connections from each client IP, 0 disables (default 0)\n" );
+    printf( "  -H pct          close the longest idle keep-alive connections and shorten idle timeouts\n"
+            "                  above pct%% of the connection capacity, 0 disables (default 90)\n" );
+    printf( "  -t port         also serve HTTPS on port, needs -E and -K, only with the default epoll backend\n" );
+    printf( "  -E path         PEM certificate chain for -t\n" );
+    printf( "  -K path         PEM private key for -t\n" );
+    printf( "  -P prefix=host:port[,host:port...]\n"
+            "                  forward requests under prefix to these upstreams, may be repeated\n" );
+    printf( "  -G path         upstream health check path (default /)\n" );
+    printf( "  -g seconds      upstream health check interval, 0 disables (default 2)\n" );
+    printf( "  -D path         serve files from a site pack built by mkpack instead of the document root\n" );
+    printf( "  -U mode         load the site pack with map, populate or hugepage (default map)\n" );
+    printf( "  -k              lock the site pack's hot region (index and small files) in memory\n" );
+}
+
+bool config::parse_endpoint( const char* arg, string& host, int& port )
+{
+    const char* colon = strrchr( arg, ':' );
+    if( !colon || colon == arg )
+    {
+        return false;
+    }
+    host.assign( arg, colon - arg );
+    port = atoi( colon + 1 );
+    return port > 0;
+}
+
+bool config::parse_arg( int argc, char* argv[] )
+{
+    int opt;
+    const char* str = "bn:w:m:M:ad:r:e:f:p:s:l:j:c:C:iSoL:z:Z:q:Q:A:R:B:N:H:t:E:K:P:G:g:D:U:k";
+    // GNU getopt会把非选项参数(ip和端口)重排到最后
+    while( ( opt = getopt( argc, argv, str ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'b':
+            sql_batch = true;
+            break;
+        case 'n':
+            batch_size = atoi( optarg );
+            break;
+        case 'w':
+            batch_window = atoi( optarg );
+            break;
+        case 'm':
+            min_conn = atoi( optarg );
+            break;
+        case 'M':
+            max_conn = atoi( optarg );
+            break;
+        case 'a':
+            affine_conn = true;
+            break;
+        case 'd':
+            if( !parse_endpoint( optarg, db_host, db_port ) )
+            {
+                return false;
+            }
+            break;
+        case 'r':
+        {
+            string host;
+            int port;
+            if( !parse_endpoint( optarg, host, port ) )
+            {
+                return false;
+            }
+            replica_hosts.push_back( host );
+            replica_ports.push_back( port );
+            break;
+        }
+        case 'e':
+            store_path = optarg;
+            break;
+        case 'f':
+            filter_kb = atoi( optarg );
+            break;
+        case 'p':
+            metrics_path = optarg[0] ? optarg : NULL;
+            break;
+        case 's':
+            slow_ms = atoi( optarg );
+            break;
+        case 'l':
+            slow_per_sec = atoi( optarg );
+            break;
+        case 'j':
+            slow_sample = atoi( optarg );
+            break;
+        case 'c':
+            capture_path = optarg;
+            break;
+        case 'C':
+            capture_sample = atoi( optarg );
+            break;
+        case 'i':
+            io_uring = true;
+            break;
+        case 'S':
+            sqpoll = true;
+            break;
+        case 'o':
+            coroutine = true;
+            break;
+        case 'L':
+            access_path = optarg;
+            break;
+        case 'z':
+            rotate_mb = atoi( optarg );
+            break;
+        case 'Z':
+            rotate_s = atoi( optarg );
+            break;
+        case 'q':
+            max_queue = atoi( optarg );
+            break;
+        case 'Q':
+            queue_ms = atoi( optarg );
+            break;
+        case 'A':
+            accept_rate = atoi( optarg );
+            break;
+        case 'R':
+            ip_rate = atoi( optarg );
+            break;
+        case 'B':
+            ip_burst = atoi( optarg );
+            break;
+        case 'N':
+            ip_conns = atoi( optarg );
+            break;
+        case 'H':
+            idle_high = atoi( optarg );
+            break;
+        case 't':
+            tls_port = atoi( optarg );
+            break;
+        case 'E':
+            tls_cert = optarg;
+            break;
+        case 'K':
+            tls_key = optarg;
+            break;
+        case 'P':
+            proxy_routes.push_back( optarg );
+            break;
+        case 'G':
+            check_path = optarg;
+            break;
+        case 'g':
+            check_interval = atoi( optarg );
+            break;
+        case 'D':
+            pack_path = optarg;
+            break;
+        case 'U':
+            pack_load = optarg;
+            break;
+        case 'k':
+            pack_lock = true;
+            break;
+        default:
+            return false;
+        }
+    }
+
+    if( argc - optind < 2 )
+    {
+        return false;
+    }
+    ip = argv[ optind ];
+    port = atoi( argv[ optind + 1 ] );
+
+    if( batch_size <= 0 || batch_window < 0 || min_conn < 0 || max_conn <= 0 || min_conn > max_conn || filter_kb < 0 || slow_ms < 0 || slow_per_sec <= 0 || slow_sample <= 0 || capture_sample <= 0 || ( io_uring && coroutine ) || rotate_mb < 0 || rotate_s < 0
+        || max_queue < 0 || queue_ms < 0 || accept_rate < 0
+        || ip_rate < 0 || ip_burst < 0 || ip_conns < 0
+        || idle_high < 0 || idle_high > 100
+        || tls_port < 0 || tls_port > 65535 || ( tls_port && ( !tls_cert || !tls_key || io_uring || coroutine ) )
+        || check_interval < 0 || check_path[0] != '/'
+        || ( strcmp( pack_load, "map" ) != 0 && strcmp( pack_load, "populate" ) != 0 && strcmp( pack_load, "hugepage" ) != 0 ) )
+    {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,120 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libgen.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// 服务器启动参数
+// 用法: ./myServer ip_address port_number [-b] [-n batch_size] [-w window_us] [-m min_conn] [-M max_conn] [-a]
+//        [-d host:port] [-r host:port]... [-e store_path] [-f filter_kb] [-p metrics_path]
+//        [-s slow_ms] [-l slow_per_sec] [-j slow_sample] [-c capture_path] [-C sample] [-i] [-S] [-o]
+//        [-L access_log] [-z rotate_mb] [-Z rotate_s] [-q max_queue] [-Q queue_ms] [-A accepts_per_sec]
+//        [-R ip_rate] [-B ip_burst] [-N ip_conns] [-H idle_high_pct]
+//        [-t https_port -E cert_file -K key_file] [-P prefix=host:port[,host:port...]]... [-G check_path] [-g check_s]
+//        [-D site_pack [-U map|populate|hugepage] [-k]]
+class config
+{
+public:
+    config();
+    ~config(){}
+
+    // 解析命令行参数，参数不合法返回false
+    bool parse_arg( int argc, char* argv[] );
+    // 打印用法
+    void usage( const char* prog );
+
+private:
+    // 解析host:port
+    bool parse_endpoint( const char* arg, string& host, int& port );
+
+public:
+    // 监听地址
+    const char* ip;
+    // 监听端口
+    int port;
+
+    // 是否开启数据库查询合并
+    bool sql_batch;
+    // 每批最多合并的请求数
+    int batch_size;
+    // 合并窗口，单位微秒
+    int batch_window;
+
+    // 数据库连接池最小、最大连接数
+    int min_conn;
+    int max_conn;
+    // 工作线程是否独占数据库连接
+    bool affine_conn;
+
+    // 主库地址
+    string db_host;
+    int db_port;
+    // 只读副本地址，可以有多个
+    vector< string > replica_hosts;
+    vector< int > replica_ports;
+
+    // 内嵌凭据存储的日志文件，非NULL时不使用MySQL
+    const char* store_path;
+    // 用户名布隆过滤器大小，KB，0表示不启用
+    int filter_kb;
+    // 指标页面路径，空字符串表示关闭
+    const char* metrics_path;
+    // 慢请求阈值，毫秒，0表示关闭
+    int slow_ms;
+    // 慢请求日志每秒最多输出的行数
+    int slow_per_sec;
+    // 每多少个慢请求输出一个
+    int slow_sample;
+    // 流量抓取文件，NULL表示不抓取
+    const char* capture_path;
+    // 每多少个连接抓取一个
+    int capture_sample;
+    // 使用io_uring代替epoll
+    bool io_uring;
+    // io_uring开启SQPOLL
+    bool sqpoll;
+    // 每个连接用一个协程处理
+    bool coroutine;
+    // 访问日志文件，NULL表示不记录
+    const char* access_path;
+    // 访问日志按大小(MB)和时间(秒)轮转，0表示不轮转
+    int rotate_mb;
+    int rotate_s;
+    // 线程池队列超过这个长度时回复503，0表示只在队列满时回复
+    int max_queue;
+    // 平均排队时间超过这个毫秒数时回复503，0表示关闭
+    int queue_ms;
+    // 每秒最多accept的连接数，0表示不限制
+    int accept_rate;
+    // 每个客户端IP每秒的请求数，0表示不限制
+    int ip_rate;
+    // 每个客户端IP允许的突发请求数，0表示等于ip_rate
+    int ip_burst;
+    // 每个客户端IP的连接数上限，0表示不限制
+    int ip_conns;
+    // 连接数超过容量的这个百分比时关闭最久没有活动的空闲连接并缩短空闲超时，0表示关闭
+    int idle_high;
+    // HTTPS端口，0表示不开启；证书链和私钥都是PEM格式
+    int tls_port;
+    const char* tls_cert;
+    const char* tls_key;
+    // 反向代理规则，prefix=host:port[,host:port...]
+    vector< string > proxy_routes;
+    // 上游健康检查的路径和周期(秒)，0表示不检查
+    const char* check_path;
+    int check_interval;
+    // 站点打包文件，NULL表示从doc_root读文件；加载方式见site_pack::LOAD_MODE
+    const char* pack_path;
+    const char* pack_load;
+    // mlock打包文件的热区
+    bool pack_lock;
+};
+
+#endif
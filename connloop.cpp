@@ -0,0 +1,44 @@
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "connloop.h"
+
+conn_loop::conn_loop()
+{
+    m_wakefd = -1;
+}
+
+conn_loop::~conn_loop()
+{
+    if( m_wakefd >= 0 )
+    {
+        close( m_wakefd );
+    }
+}
+
+bool conn_loop::init_wake( int flags )
+{
+    m_wakefd = eventfd( 0, flags );
+    return m_wakefd >= 0;
+}
+
+void conn_loop::notify( int fd, loop_notify ev )
+{
+    m_lock.lock();
+    bool was_empty = m_ready.empty();
+    m_ready.push_back( make_pair( fd, ev ) );
+    m_lock.unlock();
+    if( was_empty )
+    {
+        uint64_t one = 1;
+        ssize_t ret = write( m_wakefd, &one, sizeof( one ) );
+        ( void )ret;
+    }
+}
+
+void conn_loop::take_ready( vector< pair< int, loop_notify > >& out )
+{
+    out.clear();
+    m_lock.lock();
+    out.swap( m_ready );
+    m_lock.unlock();
+}
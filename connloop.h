@@ -0,0 +1,42 @@
+#ifndef CONNLOOP_H
+#define CONNLOOP_H
+
+#include <vector>
+#include "locker.h"
+
+using namespace std;
+
+// 工作线程处理完请求后通知主线程事件循环
+enum loop_notify
+{
+    LOOP_READ = 1,      // 请求不完整，继续接收
+    LOOP_WRITE,         // 响应已就绪，可以发送
+    LOOP_CLOSE          // 处理失败，关闭连接
+};
+
+// 代替epoll + EPOLLONESHOT重新注册的事件循环(io_uring、协程)的公共部分，http_conn::m_loop非NULL时使用
+// 工作线程把通知放进列表，列表从空变为非空时写eventfd唤醒事件循环，事件循环一次取走整个列表
+class conn_loop
+{
+public:
+    conn_loop();
+    virtual ~conn_loop();
+
+    // 工作线程调用，线程安全
+    void notify( int fd, loop_notify ev );
+
+protected:
+    // 创建唤醒用的eventfd，flags传给eventfd()
+    bool init_wake( int flags );
+    // 取走所有通知，out原来的内容被清空；eventfd的计数由子类读掉
+    void take_ready( vector< pair< int, loop_notify > >& out );
+
+protected:
+    int m_wakefd;
+
+private:
+    locker m_lock;
+    vector< pair< int, loop_notify > > m_ready;
+};
+
+#endif
@@ -0,0 +1,899 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include "h2session.h"
+
+static const char PREFACE[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+// 帧类型
+static const uint8_t FRAME_DATA = 0x0;
+static const uint8_t FRAME_HEADERS = 0x1;
+static const uint8_t FRAME_PRIORITY = 0x2;
+static const uint8_t FRAME_RST_STREAM = 0x3;
+static const uint8_t FRAME_SETTINGS = 0x4;
+static const uint8_t FRAME_PUSH_PROMISE = 0x5;
+static const uint8_t FRAME_PING = 0x6;
+static const uint8_t FRAME_GOAWAY = 0x7;
+static const uint8_t FRAME_WINDOW_UPDATE = 0x8;
+static const uint8_t FRAME_CONTINUATION = 0x9;
+static const uint8_t FRAME_PRIORITY_UPDATE = 0x10;   // RFC 9218
+
+// 标志
+static const uint8_t FLAG_END_STREAM = 0x1;
+static const uint8_t FLAG_ACK = 0x1;
+static const uint8_t FLAG_END_HEADERS = 0x4;
+static const uint8_t FLAG_PADDED = 0x8;
+static const uint8_t FLAG_PRIORITY = 0x20;
+
+// 设置项
+static const uint16_t SETTINGS_ENABLE_PUSH = 0x2;
+static const uint16_t SETTINGS_MAX_CONCURRENT_STREAMS = 0x3;
+static const uint16_t SETTINGS_INITIAL_WINDOW_SIZE = 0x4;
+static const uint16_t SETTINGS_MAX_FRAME_SIZE = 0x5;
+static const uint16_t SETTINGS_MAX_HEADER_LIST_SIZE = 0x6;
+
+// 错误码
+static const uint32_t PROTOCOL_ERROR = 0x1;
+static const uint32_t FLOW_CONTROL_ERROR = 0x3;
+static const uint32_t STREAM_CLOSED = 0x5;
+static const uint32_t FRAME_SIZE_ERROR = 0x6;
+static const uint32_t REFUSED_STREAM = 0x7;
+static const uint32_t COMPRESSION_ERROR = 0x9;
+static const uint32_t ENHANCE_YOUR_CALM = 0xb;
+
+// 本端的SETTINGS_MAX_FRAME_SIZE用默认值，输入中最多只有一个不完整的帧
+static const uint32_t MAX_FRAME = 16384;
+static const int MAX_STREAMS = 100;
+static const size_t MAX_HEADER_BLOCK = 64 * 1024;
+// 解码后的头部列表大小上限，在SETTINGS中声明
+static const size_t MAX_HEADER_LIST = 64 * 1024;
+static const size_t MAX_BODY = 1024 * 1024;
+static const size_t MAX_STASH = 1024 * 1024;
+static const int64_t MAX_WINDOW = 0x7fffffff;
+static const int64_t DEFAULT_WINDOW = 65535;
+// 一批最多的DATA帧数和字节数，和m_frame_heads、m_iov的大小对应
+static const int BATCH_FRAMES = 16;
+static const size_t BATCH_BYTES = 128 * 1024;
+static const int DEFAULT_URGENCY = 3;
+
+struct h2_session::stream
+{
+    uint32_t id;
+    int urgency;
+    // 客户端指定过优先级，不再按文件名修改
+    bool urgency_set;
+    // 收到了END_STREAM，请求已经交给http_conn
+    bool remote_closed;
+    bool closed;
+    int64_t window;
+    h2_request req;
+
+    // 响应的消息体，offset之前的部分已经组成DATA帧
+    bool responded;
+    const char* data;
+    size_t len;
+    size_t offset;
+    bool mapped;
+    string dynamic;
+};
+
+static inline uint32_t get32( const char* p )
+{
+    const uint8_t* u = ( const uint8_t* )p;
+    return ( uint32_t )u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+static inline void put32( char* p, uint32_t v )
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static inline void frame_head( char* p, uint32_t len, uint8_t type, uint8_t flags, uint32_t id )
+{
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32( p + 5, id & 0x7fffffff );
+}
+
+// 去掉PADDED帧的填充长度和填充，格式错误返回false
+static bool strip_padding( uint8_t flags, const char*& p, uint32_t& len )
+{
+    if( !( flags & FLAG_PADDED ) )
+    {
+        return true;
+    }
+    if( len < 1 || ( uint8_t )p[0] >= len )
+    {
+        return false;
+    }
+    len -= 1 + ( uint8_t )p[0];
+    ++p;
+    return true;
+}
+
+// 从priority头部或PRIORITY_UPDATE的值(结构化字段字典，如"u=1, i")中取出urgency，没有返回-1
+static int parse_urgency( const char* p, size_t len )
+{
+    for( size_t i = 0; i + 2 < len; ++i )
+    {
+        if( p[i] == 'u' && p[i + 1] == '=' && ( i == 0 || p[i - 1] == ' ' || p[i - 1] == ',' ) )
+        {
+            char c = p[i + 2];
+            return c >= '0' && c <= '7' ? c - '0' : -1;
+        }
+    }
+    return -1;
+}
+
+bool h2_session::is_preface( const char* data, int len )
+{
+    if( len <= 0 )
+    {
+        return false;
+    }
+    return memcmp( data, PREFACE, len < PREFACE_LEN ? len : PREFACE_LEN ) == 0;
+}
+
+h2_session::h2_session() : m_decoder( 4096, MAX_HEADER_LIST )
+{
+    m_open = 0;
+    m_last_id = 0;
+    m_last_sent = 0;
+    m_preface = false;
+    m_continuation = 0;
+    m_continuation_end = false;
+    m_conn_window = DEFAULT_WINDOW;
+    m_initial_window = DEFAULT_WINDOW;
+    m_max_frame = MAX_FRAME;
+    m_goaway = false;
+    m_peer_goaway = false;
+    m_iov_pos = 0;
+    m_iov_count = 0;
+
+    // 服务端的连接前言，只需要声明并发流和头部列表大小的上限，其他用默认值
+    char settings[ 12 ];
+    settings[0] = SETTINGS_MAX_CONCURRENT_STREAMS >> 8;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32( settings + 2, MAX_STREAMS );
+    settings[6] = SETTINGS_MAX_HEADER_LIST_SIZE >> 8;
+    settings[7] = SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32( settings + 8, MAX_HEADER_LIST );
+    append_frame( FRAME_SETTINGS, 0, 0, settings, sizeof( settings ) );
+}
+
+h2_session::~h2_session()
+{
+    for( map< uint32_t, stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it )
+    {
+        free_stream( it->second );
+    }
+}
+
+void h2_session::free_stream( stream* s )
+{
+    if( s->mapped && s->data )
+    {
+        munmap( ( void* )s->data, s->len );
+    }
+    delete s;
+}
+
+bool h2_session::stash( const char* data, int len )
+{
+    if( m_in.size() + len > MAX_STASH )
+    {
+        return false;
+    }
+    m_in.append( data, len );
+    return true;
+}
+
+void h2_session::feed( const char* data, int len, vector< h2_request >& reqs )
+{
+    if( m_goaway )
+    {
+        m_in.clear();
+        return;
+    }
+    // 没有剩余的输入时直接在调用者的缓冲上解析，只保存最后不完整的帧
+    const char* buf = data;
+    size_t size = len;
+    bool stashed = !m_in.empty();
+    if( stashed )
+    {
+        m_in.append( data, len );
+        buf = m_in.data();
+        size = m_in.size();
+    }
+
+    size_t pos = 0;
+    if( !m_preface )
+    {
+        if( size < ( size_t )PREFACE_LEN )
+        {
+            if( !stashed )
+            {
+                m_in.assign( buf, size );
+            }
+            return;
+        }
+        if( memcmp( buf, PREFACE, PREFACE_LEN ) != 0 )
+        {
+            connection_error( PROTOCOL_ERROR );
+            m_in.clear();
+            return;
+        }
+        m_preface = true;
+        pos = PREFACE_LEN;
+    }
+
+    while( size - pos >= 9 )
+    {
+        const char* p = buf + pos;
+        uint32_t flen = ( uint32_t )( uint8_t )p[0] << 16 | ( uint8_t )p[1] << 8 | ( uint8_t )p[2];
+        if( flen > MAX_FRAME )
+        {
+            connection_error( FRAME_SIZE_ERROR );
+            break;
+        }
+        if( size - pos - 9 < flen )
+        {
+            break;
+        }
+        pos += 9 + flen;
+        if( !process_frame( p[3], p[4], get32( p + 5 ) & 0x7fffffff, p + 9, flen, reqs ) )
+        {
+            break;
+        }
+    }
+
+    if( m_goaway )
+    {
+        m_in.clear();
+    }
+    else if( stashed )
+    {
+        m_in.erase( 0, pos );
+    }
+    else
+    {
+        m_in.assign( buf + pos, size - pos );
+    }
+}
+
+bool h2_session::process_frame( uint8_t type, uint8_t flags, uint32_t id, const char* p, uint32_t len, vector< h2_request >& reqs )
+{
+    // 头部块必须连续，中间不能夹其他帧
+    if( m_continuation && ( type != FRAME_CONTINUATION || id != m_continuation ) )
+    {
+        return connection_error( PROTOCOL_ERROR );
+    }
+    switch( type )
+    {
+        case FRAME_DATA:
+            return on_data( flags, id, p, len, reqs );
+        case FRAME_HEADERS:
+            return on_headers( flags, id, p, len, reqs );
+        case FRAME_CONTINUATION:
+        {
+            if( !m_continuation )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            m_header_block.append( p, len );
+            if( m_header_block.size() > MAX_HEADER_BLOCK )
+            {
+                return connection_error( ENHANCE_YOUR_CALM );
+            }
+            return ( flags & FLAG_END_HEADERS ) ? end_headers( reqs ) : true;
+        }
+        case FRAME_PRIORITY:
+        {
+            // RFC 9113废弃了依赖树，只检查格式
+            if( id == 0 )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            if( len != 5 )
+            {
+                reset_stream( id, FRAME_SIZE_ERROR );
+            }
+            return true;
+        }
+        case FRAME_RST_STREAM:
+        {
+            if( id == 0 || id > m_last_id )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            if( len != 4 )
+            {
+                return connection_error( FRAME_SIZE_ERROR );
+            }
+            stream* s = find( id );
+            if( s )
+            {
+                close_stream( s );
+            }
+            return true;
+        }
+        case FRAME_SETTINGS:
+            return on_settings( flags, id, p, len );
+        case FRAME_PUSH_PROMISE:
+            // 客户端不能推送
+            return connection_error( PROTOCOL_ERROR );
+        case FRAME_PING:
+        {
+            if( id != 0 )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            if( len != 8 )
+            {
+                return connection_error( FRAME_SIZE_ERROR );
+            }
+            if( !( flags & FLAG_ACK ) )
+            {
+                append_frame( FRAME_PING, FLAG_ACK, 0, p, len );
+            }
+            return true;
+        }
+        case FRAME_GOAWAY:
+        {
+            if( id != 0 )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            // 客户端不会再打开新的流，已有的流发完之后关闭连接
+            m_peer_goaway = true;
+            return true;
+        }
+        case FRAME_WINDOW_UPDATE:
+            return on_window_update( id, p, len );
+        case FRAME_PRIORITY_UPDATE:
+        {
+            if( id != 0 || len < 4 )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            stream* s = find( get32( p ) & 0x7fffffff );
+            int urgency = parse_urgency( p + 4, len - 4 );
+            if( s && urgency >= 0 )
+            {
+                s->urgency = urgency;
+                s->urgency_set = true;
+            }
+            return true;
+        }
+        default:
+            // 未知类型的帧忽略
+            return true;
+    }
+}
+
+bool h2_session::on_data( uint8_t flags, uint32_t id, const char* p, uint32_t len, vector< h2_request >& reqs )
+{
+    if( id == 0 )
+    {
+        return connection_error( PROTOCOL_ERROR );
+    }
+    // 整个帧都计入流控，包括填充；收到就归还连接窗口，消息体的大小另有上限
+    uint32_t full = len;
+    if( full > 0 )
+    {
+        window_update( 0, full );
+    }
+    if( !strip_padding( flags, p, len ) )
+    {
+        return connection_error( PROTOCOL_ERROR );
+    }
+    stream* s = find( id );
+    if( !s || s->remote_closed )
+    {
+        if( id > m_last_id )
+        {
+            return connection_error( PROTOCOL_ERROR );
+        }
+        reset_stream( id, STREAM_CLOSED );
+        return true;
+    }
+    if( s->req.body.size() + len > MAX_BODY )
+    {
+        reset_stream( id, ENHANCE_YOUR_CALM );
+        close_stream( s );
+        return true;
+    }
+    s->req.body.append( p, len );
+    if( flags & FLAG_END_STREAM )
+    {
+        complete( s, reqs );
+    }
+    else if( full > 0 )
+    {
+        window_update( id, full );
+    }
+    return true;
+}
+
+bool h2_session::on_headers( uint8_t flags, uint32_t id, const char* p, uint32_t len, vector< h2_request >& reqs )
+{
+    // 客户端打开的流编号是奇数
+    if( id == 0 || !( id & 1 ) )
+    {
+        return connection_error( PROTOCOL_ERROR );
+    }
+    if( !strip_padding( flags, p, len ) )
+    {
+        return connection_error( PROTOCOL_ERROR );
+    }
+    if( flags & FLAG_PRIORITY )
+    {
+        // 依赖和权重，和PRIORITY帧一样忽略
+        if( len < 5 )
+        {
+            return connection_error( FRAME_SIZE_ERROR );
+        }
+        p += 5;
+        len -= 5;
+    }
+    m_header_block.assign( p, len );
+    m_continuation = id;
+    m_continuation_end = flags & FLAG_END_STREAM;
+    return ( flags & FLAG_END_HEADERS ) ? end_headers( reqs ) : true;
+}
+
+bool h2_session::end_headers( vector< h2_request >& reqs )
+{
+    uint32_t id = m_continuation;
+    bool end_stream = m_continuation_end;
+    m_continuation = 0;
+
+    // 被拒绝的流也要解码，动态表才能和对端保持一致
+    vector< hpack_header > headers;
+    if( !m_decoder.decode( ( const uint8_t* )m_header_block.data(), m_header_block.size(), headers ) )
+    {
+        return connection_error( m_decoder.list_too_large() ? ENHANCE_YOUR_CALM : COMPRESSION_ERROR );
+    }
+    m_header_block.clear();
+
+    stream* s = find( id );
+    if( s )
+    {
+        // 已经打开的流上的第二个头部块是trailer，必须结束流，内容不使用
+        if( s->remote_closed || !end_stream )
+        {
+            reset_stream( id, PROTOCOL_ERROR );
+            close_stream( s );
+            return true;
+        }
+        complete( s, reqs );
+        return true;
+    }
+    if( id <= m_last_id )
+    {
+        return connection_error( STREAM_CLOSED );
+    }
+    m_last_id = id;
+    if( m_open >= MAX_STREAMS )
+    {
+        reset_stream( id, REFUSED_STREAM );
+        return true;
+    }
+
+    s = new stream();
+    s->id = id;
+    s->urgency = DEFAULT_URGENCY;
+    s->urgency_set = false;
+    s->remote_closed = false;
+    s->closed = false;
+    s->window = m_initial_window;
+    s->req.stream_id = id;
+    s->responded = false;
+    s->data = NULL;
+    s->len = 0;
+    s->offset = 0;
+    s->mapped = false;
+    for( size_t i = 0; i < headers.size(); ++i )
+    {
+        const string& name = headers[i].first;
+        if( name == ":method" )
+        {
+            s->req.method = headers[i].second;
+        }
+        else if( name == ":path" )
+        {
+            s->req.path = headers[i].second;
+        }
+        else if( name == ":authority" )
+        {
+            s->req.authority = headers[i].second;
+        }
+        else if( name == "priority" )
+        {
+            int urgency = parse_urgency( headers[i].second.data(), headers[i].second.size() );
+            if( urgency >= 0 )
+            {
+                s->urgency = urgency;
+                s->urgency_set = true;
+            }
+        }
+        // 普通头部留给请求，转发给上游时使用
+        if( !name.empty() && name[0] != ':' )
+        {
+            s->req.headers.push_back( hpack_header() );
+            s->req.headers.back().swap( headers[i] );
+        }
+    }
+    if( s->req.method.empty() || s->req.path.empty() )
+    {
+        delete s;
+        reset_stream( id, PROTOCOL_ERROR );
+        return true;
+    }
+    m_streams[ id ] = s;
+    ++m_open;
+    if( end_stream )
+    {
+        complete( s, reqs );
+    }
+    return true;
+}
+
+void h2_session::complete( stream* s, vector< h2_request >& reqs )
+{
+    s->remote_closed = true;
+    reqs.push_back( h2_request() );
+    swap( reqs.back(), s->req );
+}
+
+bool h2_session::on_settings( uint8_t flags, uint32_t id, const char* p, uint32_t len )
+{
+    if( id != 0 )
+    {
+        return connection_error( PROTOCOL_ERROR );
+    }
+    if( flags & FLAG_ACK )
+    {
+        return len == 0 ? true : connection_error( FRAME_SIZE_ERROR );
+    }
+    if( len % 6 )
+    {
+        return connection_error( FRAME_SIZE_ERROR );
+    }
+    for( uint32_t i = 0; i < len; i += 6 )
+    {
+        uint16_t key = ( uint8_t )p[i] << 8 | ( uint8_t )p[i + 1];
+        uint32_t value = get32( p + i + 2 );
+        if( key == SETTINGS_ENABLE_PUSH && value > 1 )
+        {
+            return connection_error( PROTOCOL_ERROR );
+        }
+        else if( key == SETTINGS_INITIAL_WINDOW_SIZE )
+        {
+            if( value > MAX_WINDOW )
+            {
+                return connection_error( FLOW_CONTROL_ERROR );
+            }
+            // 新的初始窗口按差值作用于所有已经打开的流，窗口可能变成负数
+            for( map< uint32_t, stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it )
+            {
+                it->second->window += ( int64_t )value - m_initial_window;
+                if( it->second->window > MAX_WINDOW )
+                {
+                    return connection_error( FLOW_CONTROL_ERROR );
+                }
+            }
+            m_initial_window = value;
+        }
+        else if( key == SETTINGS_MAX_FRAME_SIZE )
+        {
+            if( value < MAX_FRAME || value > 0xffffff )
+            {
+                return connection_error( PROTOCOL_ERROR );
+            }
+            m_max_frame = value;
+        }
+        // 编码器不用动态表，HEADER_TABLE_SIZE不影响；服务端不推送，其他设置和未知的设置忽略
+    }
+    append_frame( FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0 );
+    return true;
+}
+
+bool h2_session::on_window_update( uint32_t id, const char* p, uint32_t len )
+{
+    if( len != 4 )
+    {
+        return connection_error( FRAME_SIZE_ERROR );
+    }
+    uint32_t increment = get32( p ) & 0x7fffffff;
+    if( id == 0 )
+    {
+        if( increment == 0 )
+        {
+            return connection_error( PROTOCOL_ERROR );
+        }
+        m_conn_window += increment;
+        return m_conn_window <= MAX_WINDOW ? true : connection_error( FLOW_CONTROL_ERROR );
+    }
+    stream* s = find( id );
+    if( !s )
+    {
+        // 已经结束的流上还可能收到WINDOW_UPDATE，忽略
+        return id <= m_last_id ? true : connection_error( PROTOCOL_ERROR );
+    }
+    if( increment == 0 || s->window + increment > MAX_WINDOW )
+    {
+        reset_stream( id, increment == 0 ? PROTOCOL_ERROR : FLOW_CONTROL_ERROR );
+        close_stream( s );
+        return true;
+    }
+    s->window += increment;
+    return true;
+}
+
+h2_session::stream* h2_session::find( uint32_t id )
+{
+    map< uint32_t, stream* >::iterator it = m_streams.find( id );
+    if( it == m_streams.end() || it->second->closed )
+    {
+        return NULL;
+    }
+    return it->second;
+}
+
+void h2_session::close_stream( stream* s )
+{
+    if( !s->closed )
+    {
+        s->closed = true;
+        --m_open;
+    }
+}
+
+void h2_session::reset_stream( uint32_t id, uint32_t code )
+{
+    char payload[ 4 ];
+    put32( payload, code );
+    append_frame( FRAME_RST_STREAM, 0, id, payload, sizeof( payload ) );
+}
+
+bool h2_session::connection_error( uint32_t code )
+{
+    if( m_goaway )
+    {
+        return false;
+    }
+    // 已经排好的控制帧照常发出，没发完的消息体不再发送
+    for( map< uint32_t, stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it )
+    {
+        close_stream( it->second );
+    }
+    char payload[ 8 ];
+    put32( payload, m_last_id );
+    put32( payload + 4, code );
+    append_frame( FRAME_GOAWAY, 0, 0, payload, sizeof( payload ) );
+    m_goaway = true;
+    return false;
+}
+
+void h2_session::append_frame( uint8_t type, uint8_t flags, uint32_t id, const char* payload, size_t len )
+{
+    char head[ 9 ];
+    frame_head( head, len, type, flags, id );
+    m_ctrl.append( head, sizeof( head ) );
+    if( len )
+    {
+        m_ctrl.append( payload, len );
+    }
+}
+
+void h2_session::window_update( uint32_t id, uint32_t increment )
+{
+    char payload[ 4 ];
+    put32( payload, increment );
+    append_frame( FRAME_WINDOW_UPDATE, 0, id, payload, sizeof( payload ) );
+}
+
+void h2_session::respond( uint32_t id, int status, const char* content_type, const char* body, size_t len, bool mapped )
+{
+    stream* s = find( id );
+    if( !s || s->responded )
+    {
+        // 流在处理期间被重置，或者连接已经出错
+        if( mapped && body )
+        {
+            munmap( ( void* )body, len );
+        }
+        return;
+    }
+    // 静态表28为content-length，31为content-type
+    string block;
+    hpack_encode_status( block, status );
+    char buf[ 24 ];
+    int n = snprintf( buf, sizeof( buf ), "%zu", len );
+    hpack_encode_literal( block, 28, buf, n );
+    if( content_type )
+    {
+        hpack_encode_literal( block, 31, content_type, strlen( content_type ) );
+    }
+    append_frame( FRAME_HEADERS, FLAG_END_HEADERS | ( len == 0 ? FLAG_END_STREAM : 0 ), id, block.data(), block.size() );
+
+    s->responded = true;
+    s->data = body;
+    s->len = len;
+    s->offset = 0;
+    s->mapped = mapped;
+    if( len == 0 )
+    {
+        close_stream( s );
+    }
+}
+
+void h2_session::respond( uint32_t id, int status, const char* content_type, string& body )
+{
+    stream* s = find( id );
+    if( !s || s->responded )
+    {
+        body.clear();
+        return;
+    }
+    s->dynamic.swap( body );
+    respond( id, status, content_type, s->dynamic.data(), s->dynamic.size(), false );
+}
+
+void h2_session::prioritize( uint32_t id, const char* file )
+{
+    static const struct
+    {
+        const char* ext;
+        int urgency;
+    } defaults[] = {
+        { "html", 0 }, { "htm", 0 },
+        { "css", 1 }, { "js", 1 },
+        { "jpg", 4 }, { "jpeg", 4 }, { "png", 4 }, { "gif", 4 }, { "webp", 4 }, { "ico", 4 }, { "svg", 4 },
+        { "mp4", 6 }, { "webm", 6 }, { "mkv", 6 }, { "avi", 6 }, { "mov", 6 }, { "mp3", 6 },
+    };
+    stream* s = find( id );
+    const char* ext = strrchr( file, '.' );
+    if( !s || s->urgency_set || !ext )
+    {
+        return;
+    }
+    for( size_t i = 0; i < sizeof( defaults ) / sizeof( defaults[0] ); ++i )
+    {
+        if( strcasecmp( ext + 1, defaults[i].ext ) == 0 )
+        {
+            s->urgency = defaults[i].urgency;
+            return;
+        }
+    }
+}
+
+h2_session::stream* h2_session::next_stream()
+{
+    // 先找最高的urgency，同一urgency中取上次发送的流之后的第一个，没有就从头开始
+    stream* next = NULL;
+    stream* first = NULL;
+    int urgency = 8;
+    for( map< uint32_t, stream* >::iterator it = m_streams.begin(); it != m_streams.end(); ++it )
+    {
+        stream* s = it->second;
+        if( s->closed || !s->responded || s->window <= 0 || s->urgency > urgency )
+        {
+            continue;
+        }
+        if( s->urgency < urgency )
+        {
+            urgency = s->urgency;
+            next = NULL;
+            first = NULL;
+        }
+        if( !first )
+        {
+            first = s;
+        }
+        if( !next && s->id > m_last_sent )
+        {
+            next = s;
+        }
+    }
+    return next ? next : first;
+}
+
+void h2_session::build_batch()
+{
+    m_iov_pos = 0;
+    m_iov_count = 0;
+    // 上一批已经发完，结束的流不再被iovec引用，可以释放
+    for( map< uint32_t, stream* >::iterator it = m_streams.begin(); it != m_streams.end(); )
+    {
+        if( it->second->closed )
+        {
+            free_stream( it->second );
+            m_streams.erase( it++ );
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    m_batch_ctrl.clear();
+    m_batch_ctrl.swap( m_ctrl );
+    if( !m_batch_ctrl.empty() )
+    {
+        m_iov[0].iov_base = &m_batch_ctrl[0];
+        m_iov[0].iov_len = m_batch_ctrl.size();
+        m_iov_count = 1;
+    }
+
+    size_t budget = BATCH_BYTES;
+    for( int n = 0; n < BATCH_FRAMES && budget > 0 && m_conn_window > 0; ++n )
+    {
+        stream* s = next_stream();
+        if( !s )
+        {
+            break;
+        }
+        size_t len = s->len - s->offset;
+        len = min( len, ( size_t )s->window );
+        len = min( len, ( size_t )m_conn_window );
+        len = min( len, ( size_t )m_max_frame );
+        len = min( len, budget );
+        bool last = s->offset + len == s->len;
+        frame_head( m_frame_heads[n], len, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id );
+        m_iov[ m_iov_count ].iov_base = m_frame_heads[n];
+        m_iov[ m_iov_count ].iov_len = 9;
+        m_iov[ m_iov_count + 1 ].iov_base = ( void* )( s->data + s->offset );
+        m_iov[ m_iov_count + 1 ].iov_len = len;
+        m_iov_count += 2;
+
+        s->offset += len;
+        s->window -= len;
+        m_conn_window -= len;
+        budget -= len;
+        m_last_sent = s->id;
+        if( last )
+        {
+            close_stream( s );
+        }
+    }
+}
+
+int h2_session::pending_iov( struct iovec** iov )
+{
+    if( m_iov_pos == m_iov_count )
+    {
+        build_batch();
+    }
+    *iov = m_iov + m_iov_pos;
+    return m_iov_count - m_iov_pos;
+}
+
+void h2_session::sent( size_t n )
+{
+    while( n > 0 && m_iov_pos < m_iov_count )
+    {
+        struct iovec& v = m_iov[ m_iov_pos ];
+        if( n < v.iov_len )
+        {
+            v.iov_base = ( char* )v.iov_base + n;
+            v.iov_len -= n;
+            return;
+        }
+        n -= v.iov_len;
+        ++m_iov_pos;
+    }
+}
+
+bool h2_session::finished() const
+{
+    return ( m_goaway || m_peer_goaway ) && m_open == 0 && m_ctrl.empty() && m_iov_pos == m_iov_count;
+}
@@ -0,0 +1,127 @@
+#ifndef H2SESSION_H
+#define H2SESSION_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "hpack.h"
+
+using namespace std;
+
+// 一个收完整的HTTP/2请求，由http_conn交给do_request
+struct h2_request
+{
+    uint32_t stream_id;
+    string method;
+    string path;
+    string authority;               // :authority，没有时为空
+    vector< hpack_header > headers; // 普通头部，名字都是小写，不含伪头部
+    string body;
+};
+
+// HTTP/2连接(RFC 9113)
+// 明文连接靠连接前言识别(h2c prior knowledge)，HTTPS连接由ALPN协商h2之后客户端同样先发前言。
+// 会话只负责帧的解析和组装：收到的数据按帧处理，头部块经HPACK解码，请求收完整后交给http_conn，
+// 和HTTP/1一样经过do_request；响应的消息体仍然是mmap的文件或动态生成的字符串，会话只保存指针，
+// DATA帧的头部和消息体切片组成iovec，用一次writev发送，不复制文件内容。
+// 发送按批进行：一批包含所有待发的控制帧和HEADERS帧，以及按优先级挑选的若干DATA帧，
+// 受连接和流两级发送窗口限制；一批发完才组下一批，新到的高优先级请求最多等一批。
+// 优先级用RFC 9218的urgency(0最高，7最低)：客户端的priority头部或PRIORITY_UPDATE帧优先，
+// 否则按文件扩展名给默认值，页面高于样式脚本，高于图片，视频最低；
+// 低urgency的流只在所有高urgency的流都没有数据可发或窗口用完时才发送，同一urgency之间轮转。
+// 会话不加锁，和http_conn的其他状态一样依靠EPOLLONESHOT保证同一时刻只有一个线程访问。
+class h2_session
+{
+public:
+    static const int PREFACE_LEN = 24;
+    // data是否是连接前言的开头，len不足时只比较已有的部分
+    static bool is_preface( const char* data, int len );
+
+    h2_session();
+    ~h2_session();
+
+    // 主线程读缓冲满时先把数据转存到会话，超过上限返回false
+    bool stash( const char* data, int len );
+    // 处理转存的数据和data，收完整的请求追加到reqs；协议错误时排好GOAWAY，之后的数据都被丢弃
+    void feed( const char* data, int len, vector< h2_request >& reqs );
+    // 回复一个流，body在流结束之前必须有效；mapped为true时body是mmap得到的，流结束时由会话munmap
+    void respond( uint32_t id, int status, const char* content_type, const char* body, size_t len, bool mapped );
+    // 动态生成的消息体交给会话保管，body被清空
+    void respond( uint32_t id, int status, const char* content_type, string& body );
+    // 客户端没有指定优先级时，按响应的文件名决定urgency
+    void prioritize( uint32_t id, const char* file );
+
+    // 待发送的iovec，返回块数，0表示没有可以发送的数据(全部发完，或者被流控窗口挡住)
+    int pending_iov( struct iovec** iov );
+    // 发送了n字节
+    void sent( size_t n );
+    // 没有未结束的流，可以被空闲连接回收关闭
+    bool idle() const { return m_open == 0 && m_in.empty(); }
+    // 已经发出GOAWAY或收到对端的GOAWAY，所有流都结束、数据都已发出，连接应当关闭
+    bool finished() const;
+
+private:
+    struct stream;
+
+    bool process_frame( uint8_t type, uint8_t flags, uint32_t id, const char* p, uint32_t len, vector< h2_request >& reqs );
+    bool on_data( uint8_t flags, uint32_t id, const char* p, uint32_t len, vector< h2_request >& reqs );
+    bool on_headers( uint8_t flags, uint32_t id, const char* p, uint32_t len, vector< h2_request >& reqs );
+    bool on_settings( uint8_t flags, uint32_t id, const char* p, uint32_t len );
+    bool on_window_update( uint32_t id, const char* p, uint32_t len );
+    // 头部块收完整(END_HEADERS)之后解码，创建流
+    bool end_headers( vector< h2_request >& reqs );
+    void complete( stream* s, vector< h2_request >& reqs );
+
+    stream* find( uint32_t id );
+    // 流结束，数据可能还在当前批次中，批次发完之后才释放
+    void close_stream( stream* s );
+    static void free_stream( stream* s );
+    void reset_stream( uint32_t id, uint32_t code );
+    // 排好GOAWAY，返回false供处理函数直接返回
+    bool connection_error( uint32_t code );
+    void append_frame( uint8_t type, uint8_t flags, uint32_t id, const char* payload, size_t len );
+    void window_update( uint32_t id, uint32_t increment );
+
+    // 按优先级挑选下一个可以发送DATA的流
+    stream* next_stream();
+    void build_batch();
+
+private:
+    map< uint32_t, stream* > m_streams;
+    // 未结束的流数
+    int m_open;
+    // 客户端打开过的最大流编号
+    uint32_t m_last_id;
+    // 上一个发送DATA的流，同一urgency的流从它之后开始轮转
+    uint32_t m_last_sent;
+
+    // 未处理完的输入，最多一个不完整的帧
+    string m_in;
+    bool m_preface;
+    // 正在接收CONTINUATION的流，0表示没有
+    uint32_t m_continuation;
+    bool m_continuation_end;
+    string m_header_block;
+    hpack_decoder m_decoder;
+
+    // 对端的设置和发送窗口
+    int64_t m_conn_window;
+    int64_t m_initial_window;
+    uint32_t m_max_frame;
+
+    bool m_goaway;
+    bool m_peer_goaway;
+
+    // 待发送的控制帧和HEADERS帧，组批时整体移到m_batch_ctrl
+    string m_ctrl;
+    string m_batch_ctrl;
+    // 当前批次，DATA帧的9字节头部放在m_frame_heads中
+    struct iovec m_iov[ 40 ];
+    int m_iov_pos;
+    int m_iov_count;
+    char m_frame_heads[ 16 ][ 9 ];
+};
+
+#endif
@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include "hpack.h"
+
+// 静态表，RFC 7541附录A，索引从1开始
+static const char* const STATIC_TABLE[][2] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+static const uint64_t STATIC_COUNT = sizeof( STATIC_TABLE ) / sizeof( STATIC_TABLE[0] );
+
+// 每项的大小按名字和值的长度加32计算
+static const size_t ENTRY_OVERHEAD = 32;
+
+// Huffman码长，RFC 7541附录B，下标为符号，256为EOS
+// 附录B的编码是规范Huffman编码：按(码长, 符号)排序后依次加一得到，所以只需要码长
+static const uint8_t HUFFMAN_LENGTHS[ 257 ] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+static const int HUFFMAN_MIN_LEN = 5;
+static const int HUFFMAN_MAX_LEN = 30;
+static const int HUFFMAN_EOS = 256;
+
+// 规范Huffman解码表
+// 码字左对齐到32位之后，长度为len的码字都小于limit[len]、不小于limit[len - 1]，
+// 所以从最短的长度开始比较就能确定下一个码字的长度，不需要逐位查找
+struct huffman_table
+{
+    uint32_t first[ HUFFMAN_MAX_LEN + 1 ];      // 每种长度的第一个码字
+    uint32_t offset[ HUFFMAN_MAX_LEN + 1 ];     // 在symbols中的起点
+    uint64_t limit[ HUFFMAN_MAX_LEN + 1 ];
+    uint16_t symbols[ 257 ];                    // 按(码长, 符号)排序
+
+    huffman_table()
+    {
+        int n = 0;
+        uint32_t code = 0;
+        for( int len = 1; len <= HUFFMAN_MAX_LEN; ++len )
+        {
+            first[len] = code;
+            offset[len] = n;
+            for( int sym = 0; sym < 257; ++sym )
+            {
+                if( HUFFMAN_LENGTHS[sym] == len )
+                {
+                    symbols[ n++ ] = sym;
+                    ++code;
+                }
+            }
+            limit[len] = ( uint64_t )code << ( 32 - len );
+            code <<= 1;
+        }
+    }
+};
+
+bool hpack_huffman_decode( const uint8_t* p, size_t len, string& out )
+{
+    static const huffman_table table;
+    // acc的高bits位是还没解码的输入
+    uint64_t acc = 0;
+    int bits = 0;
+    size_t i = 0;
+    while( true )
+    {
+        while( bits <= 56 && i < len )
+        {
+            acc |= ( uint64_t )p[ i++ ] << ( 56 - bits );
+            bits += 8;
+        }
+        if( bits == 0 )
+        {
+            return true;
+        }
+        uint32_t top = acc >> 32;
+        int n = HUFFMAN_MIN_LEN;
+        while( top >= table.limit[n] )
+        {
+            ++n;
+        }
+        if( n > bits )
+        {
+            // 输入已经用完，剩下的只能是填充：不超过7位，且是EOS码字的前缀(全1)
+            return bits < 8 && ( top >> ( 32 - bits ) ) == ( 1u << bits ) - 1;
+        }
+        int sym = table.symbols[ table.offset[n] + ( top >> ( 32 - n ) ) - table.first[n] ];
+        if( sym == HUFFMAN_EOS )
+        {
+            return false;
+        }
+        out += ( char )sym;
+        acc <<= n;
+        bits -= n;
+    }
+}
+
+static bool decode_int( const uint8_t*& p, const uint8_t* end, int prefix, uint64_t& value )
+{
+    uint64_t mask = ( 1u << prefix ) - 1;
+    value = *p++ & mask;
+    if( value < mask )
+    {
+        return true;
+    }
+    // 超过32位的整数没有合法用途，按错误处理
+    for( int shift = 0; p < end && shift < 32; shift += 7 )
+    {
+        uint8_t b = *p++;
+        value += ( uint64_t )( b & 0x7f ) << shift;
+        if( !( b & 0x80 ) )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool decode_string( const uint8_t*& p, const uint8_t* end, string& out )
+{
+    if( p >= end )
+    {
+        return false;
+    }
+    bool huffman = *p & 0x80;
+    uint64_t len;
+    if( !decode_int( p, end, 7, len ) || len > ( uint64_t )( end - p ) )
+    {
+        return false;
+    }
+    out.clear();
+    if( huffman )
+    {
+        if( !hpack_huffman_decode( p, len, out ) )
+        {
+            return false;
+        }
+    }
+    else
+    {
+        out.assign( ( const char* )p, len );
+    }
+    p += len;
+    return true;
+}
+
+hpack_decoder::hpack_decoder( size_t max_size, size_t max_list )
+{
+    m_size = 0;
+    m_max_size = max_size;
+    m_limit = max_size;
+    m_max_list = max_list;
+    m_list_too_large = false;
+}
+
+bool hpack_decoder::lookup( uint64_t index, hpack_header& h ) const
+{
+    if( index == 0 )
+    {
+        return false;
+    }
+    if( index <= STATIC_COUNT )
+    {
+        h.first = STATIC_TABLE[ index - 1 ][0];
+        h.second = STATIC_TABLE[ index - 1 ][1];
+        return true;
+    }
+    index -= STATIC_COUNT + 1;
+    if( index >= m_table.size() )
+    {
+        return false;
+    }
+    h = m_table[ index ];
+    return true;
+}
+
+void hpack_decoder::evict( size_t limit )
+{
+    while( m_size > limit && !m_table.empty() )
+    {
+        const hpack_header& h = m_table.back();
+        m_size -= h.first.size() + h.second.size() + ENTRY_OVERHEAD;
+        m_table.pop_back();
+    }
+}
+
+void hpack_decoder::insert( const hpack_header& h )
+{
+    size_t size = h.first.size() + h.second.size() + ENTRY_OVERHEAD;
+    // 比整个表还大的项使表清空，本身也不插入
+    if( size > m_max_size )
+    {
+        evict( 0 );
+        return;
+    }
+    evict( m_max_size - size );
+    m_table.push_front( h );
+    m_size += size;
+}
+
+bool hpack_decoder::decode( const uint8_t* p, size_t len, vector< hpack_header >& headers )
+{
+    const uint8_t* end = p + len;
+    size_t list = 0;
+    m_list_too_large = false;
+    while( p < end )
+    {
+        uint8_t b = *p;
+        uint64_t index;
+        hpack_header h;
+        if( b & 0x80 )
+        {
+            // 1xxxxxxx 索引的头部
+            if( !decode_int( p, end, 7, index ) || !lookup( index, h ) )
+            {
+                return false;
+            }
+            list += h.first.size() + h.second.size() + 32;
+            if( list > m_max_list )
+            {
+                m_list_too_large = true;
+                return false;
+            }
+            headers.push_back( h );
+            continue;
+        }
+        if( ( b & 0xe0 ) == 0x20 )
+        {
+            // 001xxxxx 动态表大小更新
+            if( !decode_int( p, end, 5, index ) || index > m_limit )
+            {
+                return false;
+            }
+            m_max_size = index;
+            evict( m_max_size );
+            continue;
+        }
+        // 01xxxxxx 加入动态表的字面值，0000xxxx 不索引，0001xxxx 永不索引
+        bool indexing = ( b & 0xc0 ) == 0x40;
+        if( !decode_int( p, end, indexing ? 6 : 4, index ) )
+        {
+            return false;
+        }
+        if( index == 0 )
+        {
+            if( !decode_string( p, end, h.first ) )
+            {
+                return false;
+            }
+        }
+        else if( !lookup( index, h ) )
+        {
+            return false;
+        }
+        if( !decode_string( p, end, h.second ) )
+        {
+            return false;
+        }
+        if( indexing )
+        {
+            insert( h );
+        }
+        list += h.first.size() + h.second.size() + 32;
+        if( list > m_max_list )
+        {
+            m_list_too_large = true;
+            return false;
+        }
+        headers.push_back( h );
+    }
+    return true;
+}
+
+static void encode_int( string& out, uint8_t first, int prefix, uint64_t value )
+{
+    uint64_t mask = ( 1u << prefix ) - 1;
+    if( value < mask )
+    {
+        out += ( char )( first | value );
+        return;
+    }
+    out += ( char )( first | mask );
+    value -= mask;
+    while( value >= 0x80 )
+    {
+        out += ( char )( ( value & 0x7f ) | 0x80 );
+        value >>= 7;
+    }
+    out += ( char )value;
+}
+
+void hpack_encode_literal( string& out, int name_index, const char* value, size_t len )
+{
+    encode_int( out, 0x00, 4, name_index );
+    encode_int( out, 0x00, 7, len );
+    out.append( value, len );
+}
+
+void hpack_encode_status( string& out, int status )
+{
+    // 静态表第8到14项
+    static const int indexed[] = { 200, 204, 206, 304, 400, 404, 500 };
+    for( size_t i = 0; i < sizeof( indexed ) / sizeof( indexed[0] ); ++i )
+    {
+        if( indexed[i] == status )
+        {
+            encode_int( out, 0x80, 7, 8 + i );
+            return;
+        }
+    }
+    char buf[ 8 ];
+    int len = snprintf( buf, sizeof( buf ), "%03d", status );
+    hpack_encode_literal( out, 8, buf, len );
+}
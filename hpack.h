@@ -0,0 +1,54 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+
+using namespace std;
+
+typedef pair< string, string > hpack_header;
+
+// HPACK头部压缩(RFC 7541)
+// 解码器维护对端的动态表，支持Huffman编码的字符串。
+// 编码器只用静态表中的名字加不索引的字面值，不维护动态表也不用Huffman：响应头只有两三项，
+// 省下的几个字节不值得为每个连接再维护一份状态。
+class hpack_decoder
+{
+public:
+    // max_size为本端SETTINGS_HEADER_TABLE_SIZE，默认4096；max_list为本端SETTINGS_MAX_HEADER_LIST_SIZE
+    explicit hpack_decoder( size_t max_size = 4096, size_t max_list = 65536 );
+    // 解码一个完整的头部块，追加到headers；出错返回false，连接必须以COMPRESSION_ERROR关闭
+    // 解出的头部按RFC 7541计算的大小(名字+值+32)超过max_list时也返回false，list_too_large()为true，
+    // 这时动态表已经和对端不一致，连接以ENHANCE_YOUR_CALM关闭
+    bool decode( const uint8_t* p, size_t len, vector< hpack_header >& headers );
+    bool list_too_large() const { return m_list_too_large; }
+
+private:
+    bool lookup( uint64_t index, hpack_header& h ) const;
+    void insert( const hpack_header& h );
+    // 从最旧的项开始删除，直到表的大小不超过limit
+    void evict( size_t limit );
+
+private:
+    // 最新插入的项在最前面，和索引顺序一致
+    deque< hpack_header > m_table;
+    size_t m_size;
+    // 当前上限，由头部块中的动态表大小更新修改，不能超过m_limit
+    size_t m_max_size;
+    size_t m_limit;
+    // 一个头部块解出的头部列表大小上限，引用动态表的一个字节可以解出整个表项，不限制时几十KB的头部块能解出上百MB
+    size_t m_max_list;
+    bool m_list_too_large;
+};
+
+// 追加一个不索引的字面值头部，name_index为名字在静态表中的索引
+void hpack_encode_literal( string& out, int name_index, const char* value, size_t len );
+// 追加:status，静态表中有的状态码只用一个字节
+void hpack_encode_status( string& out, int status );
+// 解码Huffman编码的字符串，追加到out，出错返回false
+bool hpack_huffman_decode( const uint8_t* p, size_t len, string& out );
+
+#endif
@@ -1,4 +1,5 @@
 #include "http_conn.h"
+#include "probes.h"
 
 // 定义http响应的状态信息
 const char* ok_200_title = "OK";
@@ -8,17 +9,37 @@ const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_405_title = "Method Not Allowed";
+const char* error_405_form = "The request method is not supported by the target resource.\n";
+const char* error_304_title = "Not Modified";
+const char* error_413_title = "Payload Too Large";
+const char* error_413_form = "The request body is larger than the server is willing to process.\n";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the requested file.\n";
+const char* error_503_title = "Service Unavailable";
+const char* error_503_form = "The database is temporarily unavailable, please try again later.\n";
+const char* error_502_title = "Bad Gateway";
+const char* error_502_form = "The upstream server is unavailable or sent an invalid response.\n";
 
 #define LT 0
 #define ET 1
 
-// INSERT 操作时加锁
-locker m_lock;
 // 网站根目录
 const char* doc_root = "/home/yim/WorkSpace/resources";
 
+// HTTP/2的反向代理响应读进内存，超过这个大小回复502
+static const size_t PROXY_BUFFER_SIZE = 8 * 1024 * 1024;
+// 流式响应每段的最大长度
+static const size_t STREAM_PIECE_SIZE = 64 * 1024;
+// 分块编码的流式响应在每段前面预留的分块大小行，固定8位十六进制
+static const size_t CHUNK_HEAD_LEN = 10;
+// 不转发的请求，消息体存在m_string中的上限
+static const int64_t MAX_BODY_SIZE = 64 * 1024;
+// 请求的分块大小行和尾部头部每行的上限
+static const int MAX_CHUNK_LINE = 1024;
+// 工作线程处理一次请求时最多接着读多少次消息体
+static const int MAX_BODY_READS = 64;
+
 // 将文件描述符设置为非阻塞的
 int setnonblocking(int fd)
 {
@@ -66,6 +87,10 @@ void modfd( int epollfd, int fd, int ev )
 
 int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+user_store* http_conn::m_store = NULL;
+const char* http_conn::m_metrics_path = "/metrics";
+unsigned int http_conn::m_conn_seq = 0;
+conn_loop* http_conn::m_loop = NULL;
 
 // 关闭连接
 void http_conn::close_conn( bool real_close )
@@ -75,8 +100,123 @@ void http_conn::close_conn( bool real_close )
         //modfd( m_epollfd, m_sockfd, EPOLLIN );
         removefd( m_epollfd, m_sockfd );
         m_sockfd = -1;
-        m_user_count--; // 关闭连接，客户端数量-1
+        __sync_fetch_and_sub( &m_user_count, 1 ); // 关闭连接，客户端数量-1，主线程和工作线程都会修改
+        ip_limiter::get_instance()->release( m_address.sin_addr.s_addr );
+        release();
+    }
+}
+
+void http_conn::release()
+{
+    free_tls();
+    free_h2();
+    m_proxy.finish( false );
+}
+
+void http_conn::reject( metric_counter reason )
+{
+    admission* adm = admission::get_instance();
+    // HTTP/2连接上插入HTTP/1.1响应会被当成帧解析，只计数并关闭，客户端按连接断开重试
+    bool h2 = m_h2 || h2_session::is_preface( m_read_buf, m_read_idx );
+    if( !m_ssl && !h2 )
+    {
+        adm->reject( m_sockfd, reason );
+        return;
+    }
+    adm->reject( -1, reason );
+    // 握手没完成时不能发送应用数据，直接关闭
+    if( m_tls_ready && !h2 )
+    {
+        const string& res = adm->response( reason );
+        struct iovec iv = { ( void* )res.data(), res.size() };
+        send_iov( &iv, 1 );
+    }
+}
+
+void http_conn::peer_closed()
+{
+    // 接收缓冲中还有数据时close()会发RST，读空之后正常挥手
+    char buf[ 4096 ];
+    while( true )
+    {
+        int n = m_ssl ? tls_recv( m_ssl, buf, sizeof( buf ) ) : recv( m_sockfd, buf, sizeof( buf ), 0 );
+        if( n <= 0 )
+        {
+            break;
+        }
+        if( m_capture )
+        {
+            traffic_capture::get_instance()->record( m_conn_id, CAP_DATA, buf, n );
+        }
+    }
+    if( m_capture )
+    {
+        traffic_capture::get_instance()->record( m_conn_id, CAP_CLOSE );
+    }
+}
+
+void http_conn::start_tls( SSL* ssl )
+{
+    m_ssl = ssl;
+    m_tls_ready = false;
+    m_ktls_tx = false;
+}
+
+void http_conn::free_tls()
+{
+    if( m_ssl )
+    {
+        SSL_free( m_ssl );
+        m_ssl = NULL;
+    }
+}
+
+int http_conn::tls_handshake()
+{
+    int ret = SSL_do_handshake( m_ssl );
+    if( ret == 1 )
+    {
+        m_tls_ready = true;
+        m_ktls_tx = tls_context::get_instance()->established( m_ssl );
+        return 1;
+    }
+    int err = SSL_get_error( m_ssl, ret );
+    if( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE )
+    {
+        rearm( err == SSL_ERROR_WANT_READ ? EPOLLIN : EPOLLOUT );
+        return 0;
+    }
+    ERR_clear_error();
+    metrics::get_instance()->inc( M_TLS_FAILED );
+    return -1;
+}
+
+void http_conn::free_h2()
+{
+    if( m_h2 )
+    {
+        delete m_h2;
+        m_h2 = NULL;
+    }
+}
+
+int http_conn::send_iov( const struct iovec* iov, int count )
+{
+    if( !m_ssl || m_ktls_tx )
+    {
+        return writev( m_sockfd, iov, count );
     }
+    return tls_writev( m_ssl, iov, count );
+}
+
+bool http_conn::idle_cb( client_data* data, void* users )
+{
+    return ( ( http_conn* )users )[ data->sockfd ].idle();
+}
+
+bool http_conn::busy_cb( client_data* data, void* users )
+{
+    return ( ( http_conn* )users )[ data->sockfd ].worker_owned();
 }
 
 // 初始化连接
@@ -84,21 +224,32 @@ void http_conn::init( int sockfd, const sockaddr_in& addr )
 {
     m_sockfd = sockfd;
     m_address = addr;
-    int error = 0;
-    socklen_t len = sizeof( error );
-    getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
-    int reuse = 1;
-    // 端口复用
-    setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
-    addfd( m_epollfd, sockfd, true, ET );
-    m_user_count++;
+    // 其他后端由事件循环自己注册和收发
+    if( !m_loop )
+    {
+        int error = 0;
+        socklen_t len = sizeof( error );
+        getsockopt( m_sockfd, SOL_SOCKET, SO_ERROR, &error, &len );
+        int reuse = 1;
+        // 端口复用
+        setsockopt( m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+        addfd( m_epollfd, sockfd, true, ET );
+    }
+    __sync_fetch_and_add( &m_user_count, 1 );
+
+    // 流量抓取按连接采样，保留完整的长连接会话
+    m_conn_id = ++m_conn_seq;
+    m_capture = traffic_capture::get_instance()->sample();
+    if( m_capture )
+    {
+        traffic_capture::get_instance()->record( m_conn_id, CAP_OPEN );
+    }
 
     init();
 }
 
 void http_conn::init()
 {
-    mysql = NULL;
     bytes_to_send = 0;
     bytes_have_send = 0;
     m_check_state = CHECK_STATE_REQUESTLINE;
@@ -107,11 +258,37 @@ void http_conn::init()
     m_url = 0;
     m_version = 0;
     m_content_length = 0;
+    m_body_start = 0;
+    m_body_state = BODY_DATA;
+    m_body_remaining = 0;
+    m_chunked = false;
+    m_expect_continue = false;
+    m_string.clear();
     m_host = 0;
     m_start_line = 0;
     m_checked_idx = 0;
     m_read_idx = 0;
     m_write_idx = 0;
+    m_body = NULL;
+    m_content_type = NULL;
+    m_streaming = false;
+    m_stream_chunked = false;
+    m_stream_end = false;
+    m_dynamic.clear();
+    m_start_us = 0;
+    m_ready_us = 0;
+    m_response_us = 0;
+    m_queue_us = 0;
+    m_parse_us = 0;
+    m_code = NO_REQUEST;
+    m_status = 0;
+    m_route = -1;
+    m_local_route = NULL;
+    m_if_none_match = NULL;
+    m_accept_gzip = false;
+    m_pack_entry = NULL;
+    m_pack_variant = NULL;
+    m_forward_headers.clear();
     memset( m_read_buf, '\0', READ_BUFFER_SIZE );
     memset( m_write_buf, '\0', WRITE_BUFFER_SIZE );
     memset( m_real_file, '\0', FILENAME_LEN );
@@ -171,13 +348,58 @@ bool http_conn::read()
     {
         return false;
     }
+    if( handshaking() )
+    {
+        int ret = tls_handshake();
+        if( ret < 0 )
+        {
+            return false;
+        }
+        if( ret == 0 )
+        {
+            // 握手没完成，已重新注册事件，调用者看到handshaking()后不交给线程池
+            return true;
+        }
+    }
+
+    if( m_start_us == 0 )
+    {
+        m_start_us = metrics::now_us();
+    }
 
     int bytes_read = 0;
     // 循环读取，直到遇到EAGAIN错误
     // ET模式
     while( true )
     {
-        bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        if( m_read_idx == READ_BUFFER_SIZE && !m_loop && ( m_h2 || h2_session::is_preface( m_read_buf, m_read_idx ) ) )
+        {
+            // HTTP/2连接要把socket和TLS缓冲都读空，读缓冲满时先转存到会话中
+            // 客户端可能不等服务端的SETTINGS就发出大量请求，这时在主线程创建会话
+            if( !m_h2 )
+            {
+                start_h2();
+            }
+            if( !m_h2->stash( m_read_buf, m_read_idx ) )
+            {
+                return false;
+            }
+            m_read_idx = 0;
+        }
+        if( m_read_idx == READ_BUFFER_SIZE )
+        {
+            // 读缓冲满，先交给工作线程：消息体被取走之后重新注册EPOLLIN，socket中剩下的数据会再次触发事件；
+            // 请求头超过读缓冲时回复400
+            break;
+        }
+        if( m_ssl )
+        {
+            bytes_read = tls_recv( m_ssl, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx );
+        }
+        else
+        {
+            bytes_read = recv( m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0 );
+        }
         if ( bytes_read == -1 )
         {
             // EPOLLIN事件则只有当对端有数据写入时才会触发，所以触发一次后需要不断读取所有数据直到读完EAGAIN为止。
@@ -193,11 +415,26 @@ bool http_conn::read()
         else if ( bytes_read == 0 )
         {
             // 客户端关闭了连接？
+            if( m_capture )
+            {
+                traffic_capture::get_instance()->record( m_conn_id, CAP_CLOSE );
+            }
             return false;
         }
 
+        if( m_capture )
+        {
+            traffic_capture::get_instance()->record( m_conn_id, CAP_DATA, m_read_buf + m_read_idx, bytes_read );
+        }
         m_read_idx += bytes_read;
     }
+    if( no_data() )
+    {
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return true;
+    }
+    PROBE2( recv, m_sockfd, m_read_idx );
+    m_ready_us = metrics::now_us();
     return true;
 }
 
@@ -260,15 +497,133 @@ http_conn::HTTP_CODE http_conn::parse_request_line( char* text )
     {
         return BAD_REQUEST;
     }
-    // 当url为/时,返回默认文件
-    if(strlen(m_url) == 1)
-        strcat(m_url, "judge.html");    // m_url = "/judge.html"
+    // 反向代理的路径原样转发，不替换默认文件
+    proxy* px = proxy::get_instance();
+    m_route = px->enabled() ? px->match( m_url ) : -1;
 
     // 状态转移
     m_check_state = CHECK_STATE_HEADER;
     return NO_REQUEST;
 }
 
+// 逐跳头部只对客户端这一段连接有效，不转发给上游；Connection、Content-Length和Host单独处理
+static bool hop_by_hop( const char* text )
+{
+    static const char* const names[] = { "Keep-Alive:", "Proxy-Connection:", "TE:", "Upgrade:", "Transfer-Encoding:", "Expect:" };
+    for ( size_t i = 0; i < sizeof( names ) / sizeof( names[0] ); ++i )
+    {
+        if ( strncasecmp( text, names[i], strlen( names[i] ) ) == 0 )
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// HTTP/2请求转发给上游的头部：和HTTP/1一样去掉逐跳头部，Content-Length由转发时重新生成；
+// host只在没有:authority时使用，拆开的多个cookie按RFC 9113 8.2.3用"; "合并
+static void h2_forward_headers( const h2_request& req, string& out, const char*& host )
+{
+    string cookie;
+    for ( size_t i = 0; i < req.headers.size(); ++i )
+    {
+        const string& name = req.headers[i].first;
+        const string& value = req.headers[i].second;
+        if ( name == "host" )
+        {
+            if ( !host )
+            {
+                host = value.c_str();
+            }
+            continue;
+        }
+        if ( name == "cookie" )
+        {
+            if ( !cookie.empty() )
+            {
+                cookie += "; ";
+            }
+            cookie += value;
+            continue;
+        }
+        if ( name == "content-length" || name == "connection" )
+        {
+            continue;
+        }
+        size_t start = out.size();
+        out += name;
+        out += ": ";
+        if ( hop_by_hop( out.c_str() + start ) )
+        {
+            out.resize( start );
+            continue;
+        }
+        out += value;
+        out += "\r\n";
+    }
+    if ( !cookie.empty() )
+    {
+        out += "cookie: ";
+        out += cookie;
+        out += "\r\n";
+    }
+}
+
+// Accept-Encoding的列表中有q不为0的gzip或*
+static bool accepts_gzip( const char* text )
+{
+    while ( *text )
+    {
+        text += strspn( text, " \t," );
+        size_t len = strcspn( text, " \t;," );
+        bool gzip = ( len == 4 && strncasecmp( text, "gzip", 4 ) == 0 ) || ( len == 1 && *text == '*' );
+        text += len;
+        text += strspn( text, " \t" );
+        // q=0表示不接受，q=0.000也是0
+        bool refused = false;
+        if ( *text == ';' )
+        {
+            const char* q = text + 1;
+            q += strspn( q, " \t" );
+            if ( strncasecmp( q, "q=", 2 ) == 0 )
+            {
+                q += 2;
+                refused = q[0] == '0' && strspn( q + 1, ".0" ) == strcspn( q + 1, " \t," );
+            }
+        }
+        if ( gzip && !refused )
+        {
+            return true;
+        }
+        text += strcspn( text, "," );
+    }
+    return false;
+}
+
+// If-None-Match的列表中有和etag相同的项，或者是*；按弱比较，忽略W/前缀
+static bool etag_match( const char* list, const char* etag, size_t etag_len )
+{
+    while ( *list )
+    {
+        list += strspn( list, " \t," );
+        if ( *list == '*' )
+        {
+            return true;
+        }
+        if ( strncmp( list, "W/", 2 ) == 0 )
+        {
+            list += 2;
+        }
+        size_t len = strcspn( list, " \t," );
+        if ( len == etag_len && strncmp( list, etag, len ) == 0 )
+        {
+            return true;
+        }
+        list += len;
+    }
+    return false;
+}
+
 // 解析头部信息
 http_conn::HTTP_CODE http_conn::parse_headers( char* text )
 {
@@ -281,9 +636,28 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
             return GET_REQUEST;
         }
 
-        if ( m_content_length != 0 )
+        // 同时带Content-Length和分块编码的请求可能被前后两级服务器按不同的长度解析，直接拒绝
+        if ( m_chunked && m_content_length != 0 )
+        {
+            return BAD_REQUEST;
+        }
+        if ( m_route < 0 && m_content_length > MAX_BODY_SIZE )
+        {
+            return PAYLOAD_TOO_LARGE;
+        }
+        if ( m_chunked || m_content_length != 0 )
         {
             m_check_state = CHECK_STATE_CONTENT;
+            m_body_start = m_checked_idx;
+            m_body_state = m_chunked ? BODY_CHUNK_SIZE : BODY_DATA;
+            m_body_remaining = m_content_length;
+            // 客户端等待100 Continue才发送消息体；只有epoll后端可以在工作线程直接发送，其他后端的客户端等待超时后照常发送
+            if ( m_expect_continue && !m_loop && m_read_idx == m_checked_idx )
+            {
+                static const char continue_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+                struct iovec iv = { ( void* )continue_100, sizeof( continue_100 ) - 1 };
+                send_iov( &iv, 1 );
+            }
             return NO_REQUEST;
         }
 
@@ -304,7 +678,30 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
     {
         text += 15;
         text += strspn( text, " \t" );
-        m_content_length = atol( text );
+        char* end;
+        m_content_length = strtoll( text, &end, 10 );
+        end += strspn( end, " \t" );
+        if ( end == text || *end != '\0' || m_content_length < 0 )
+        {
+            return BAD_REQUEST;
+        }
+    }
+    // 只支持分块编码，其他传输编码无法确定消息体的长度
+    else if ( strncasecmp( text, "Transfer-Encoding:", 18 ) == 0 )
+    {
+        text += 18;
+        text += strspn( text, " \t" );
+        if ( strcasecmp( text, "chunked" ) != 0 )
+        {
+            return BAD_REQUEST;
+        }
+        m_chunked = true;
+    }
+    else if ( strncasecmp( text, "Expect:", 7 ) == 0 )
+    {
+        text += 7;
+        text += strspn( text, " \t" );
+        m_expect_continue = strcasecmp( text, "100-continue" ) == 0;
     }
     // 处理Host字段
     else if ( strncasecmp( text, "Host:", 5 ) == 0 )
@@ -313,6 +710,23 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
         text += strspn( text, " \t" );
         m_host = text;
     }
+    // 打包文件的条件请求和压缩协商，转发的请求原样交给上游
+    else if ( m_route < 0 && strncasecmp( text, "If-None-Match:", 14 ) == 0 )
+    {
+        text += 14;
+        text += strspn( text, " \t" );
+        m_if_none_match = text;
+    }
+    else if ( m_route < 0 && strncasecmp( text, "Accept-Encoding:", 16 ) == 0 )
+    {
+        m_accept_gzip = accepts_gzip( text + 16 );
+    }
+    // 转发给上游的请求保留其他端到端头部
+    else if ( m_route >= 0 && !hop_by_hop( text ) )
+    {
+        m_forward_headers += text;
+        m_forward_headers += "\r\n";
+    }
     else
     {
         // printf( "oop! unknow header %s\n", text );
@@ -322,23 +736,121 @@ http_conn::HTTP_CODE http_conn::parse_headers( char* text )
 
 }
 
-// 并没有真正解析http请求的消息体,只是判断是否被完整读入
-// 修改之后，获取post内容
-http_conn::HTTP_CODE http_conn::parse_content( char* text )
+// 解析读缓冲中已经收到的消息体，分块编码被解开，数据交给consume_body
+// 处理过的部分从读缓冲中移走，消息体再大也只占用读缓冲，请求行和头部留在原处(m_url等指针指向它们)
+http_conn::HTTP_CODE http_conn::parse_content()
 {
-    if ( m_read_idx >= ( m_content_length + m_checked_idx ) )
+    while ( m_checked_idx < m_read_idx )
     {
-        text[ m_content_length ] = '\0';
-        // POST请求中最后为输入的用户名和密码
-        m_string = text;
-        return GET_REQUEST;
+        char* p = m_read_buf + m_checked_idx;
+        int avail = m_read_idx - m_checked_idx;
+        if ( m_body_state == BODY_DATA )
+        {
+            // 不转发的请求，比如登录注册，消息体存在m_string中，有大小上限；
+            // 转发的请求在这一轮处理完之后发给上游，m_string中最多是一个读缓冲的数据
+            int n = m_body_remaining < avail ? ( int )m_body_remaining : avail;
+            if ( m_route < 0 && ( int64_t )m_string.size() + n > MAX_BODY_SIZE )
+            {
+                return PAYLOAD_TOO_LARGE;
+            }
+            m_string.append( p, n );
+            m_checked_idx += n;
+            m_body_remaining -= n;
+            if ( m_body_remaining == 0 )
+            {
+                if ( !m_chunked )
+                {
+                    return GET_REQUEST;
+                }
+                m_body_state = BODY_CHUNK_END;
+            }
+            continue;
+        }
+
+        // 分块大小行、分块数据之后的CRLF和尾部头部都按行处理
+        char* eol = ( char* )memchr( p, '\n', avail );
+        if ( !eol )
+        {
+            // 挪到消息体起点之后读缓冲仍然是满的，这一行永远收不完
+            if ( avail > MAX_CHUNK_LINE || ( m_checked_idx == m_body_start && m_read_idx == READ_BUFFER_SIZE ) )
+            {
+                return BAD_REQUEST;
+            }
+            break;
+        }
+        *eol = '\0';
+        if ( eol > p && eol[ -1 ] == '\r' )
+        {
+            eol[ -1 ] = '\0';
+        }
+        m_checked_idx += eol - p + 1;
+        if ( m_body_state == BODY_CHUNK_END )
+        {
+            if ( *p != '\0' )
+            {
+                return BAD_REQUEST;
+            }
+            m_body_state = BODY_CHUNK_SIZE;
+        }
+        else if ( m_body_state == BODY_CHUNK_SIZE )
+        {
+            // 分号之后是分块扩展，忽略
+            char* end;
+            errno = 0;
+            unsigned long long size = strtoull( p, &end, 16 );
+            if ( !isxdigit( ( unsigned char )*p ) || errno || !strchr( "; \t", *end ) || size > ( 1ULL << 62 ) )
+            {
+                return BAD_REQUEST;
+            }
+            m_body_remaining = size;
+            m_body_state = size == 0 ? BODY_TRAILER : BODY_DATA;
+        }
+        else if ( *p == '\0' )
+        {
+            // 尾部头部以空行结束，尾部头部本身忽略
+            return GET_REQUEST;
+        }
     }
 
+    // 读缓冲中剩下的是不完整的一行，挪到消息体的起点
+    int left = m_read_idx - m_checked_idx;
+    memmove( m_read_buf + m_body_start, m_read_buf + m_checked_idx, left );
+    m_read_idx = m_body_start + left;
+    m_checked_idx = m_body_start;
+    m_start_line = m_body_start;
+
+    // 消息体没有一次收完，转发的请求开始流式上传，这一轮收到的部分发给上游
+    if ( m_route >= 0 )
+    {
+        if ( !m_proxy.uploading() )
+        {
+            add_forwarded();
+            if ( !m_proxy.begin( m_route, m_method == POST ? "POST" : "GET", m_url, m_host,
+                                 m_forward_headers, m_chunked ? -1 : m_content_length ) )
+            {
+                metrics::get_instance()->inc( M_PROXY_FAILED );
+                return BAD_GATEWAY;
+            }
+        }
+        if ( !m_proxy.send_body( m_string.data(), m_string.size() ) )
+        {
+            metrics::get_instance()->inc( M_PROXY_FAILED );
+            return BAD_GATEWAY;
+        }
+        m_string.clear();
+    }
     return NO_REQUEST;
 }
 
 // 主状态机
 http_conn::HTTP_CODE http_conn::process_read()
+{
+    HTTP_CODE ret = parse_message();
+    return ret == GET_REQUEST ? timed_do_request() : ret;
+}
+
+// 解析读缓冲中的请求，请求完整时返回GET_REQUEST，不执行do_request
+http_conn::HTTP_CODE http_conn::parse_message()
 {
     LINE_STATUS line_status = LINE_OK;
     HTTP_CODE ret = NO_REQUEST;
@@ -367,26 +879,27 @@ http_conn::HTTP_CODE http_conn::process_read()
             case CHECK_STATE_HEADER:
             {
                 ret = parse_headers( text );
-                if ( ret == BAD_REQUEST )
+                if ( ret == BAD_REQUEST || ret == PAYLOAD_TOO_LARGE )
                 {
-                    return BAD_REQUEST;
+                    return ret;
                 }
                 else if ( ret == GET_REQUEST )
                 {
-                    return do_request();
+                    return GET_REQUEST;
                 }
                 break;
             }
-            // 第三个状态,分析主体内容
+            // 第三个状态,分析主体内容，已经收到的部分一次处理完
             case CHECK_STATE_CONTENT:
             {
-                ret = parse_content( text );
-                if ( ret == GET_REQUEST )
+                ret = parse_content();
+                if ( ret != NO_REQUEST && ret != GET_REQUEST )
                 {
-                    return do_request();
+                    // 消息体没有读完，连接上剩下的数据无法解析
+                    m_linger = false;
+                    m_proxy.finish( false );
                 }
-                line_status = LINE_OPEN;
-                break;
+                return ret;
             }
             default:
             {
@@ -395,9 +908,92 @@ http_conn::HTTP_CODE http_conn::process_read()
         }
     }
 
+    // 请求行和头部超过读缓冲
+    if ( m_read_idx == READ_BUFFER_SIZE && line_status == LINE_OPEN )
+    {
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
 }
 
+// 解析内存中的请求，请求完整时返回GET_REQUEST
+// 不走process_read，不会执行do_request；没有socket，没有配置转发规则，100 Continue和流式上传都不会发生
+http_conn::HTTP_CODE http_conn::parse_buffer( const char* buf, int len )
+{
+    init();
+    m_sockfd = -1;
+    m_capture = false;
+    if( len > READ_BUFFER_SIZE )
+    {
+        len = READ_BUFFER_SIZE;
+    }
+    memcpy( m_read_buf, buf, len );
+    m_read_idx = len;
+    return parse_message();
+}
+
+// 记录do_request耗时
+http_conn::HTTP_CODE http_conn::timed_do_request()
+{
+    PROBE3( request_start, m_sockfd, m_method, m_url );
+    uint64_t start = metrics::now_us();
+    HTTP_CODE ret = do_request();
+    m_process_us = metrics::now_us() - start;
+    PROBE4( request, m_sockfd, ret, m_url, m_process_us );
+    return ret;
+}
+
+void http_conn::log_request( bool aborted )
+{
+    if( m_start_us == 0 )
+    {
+        return;
+    }
+    uint64_t now = metrics::now_us();
+    access_log* alog = access_log::get_instance();
+    if( alog->enabled() )
+    {
+        access_record rec;
+        struct timeval tv;
+        gettimeofday( &tv, NULL );
+        rec.time_us = ( uint64_t )tv.tv_sec * 1000000 + tv.tv_usec;
+        rec.bytes = bytes_have_send;
+        rec.addr = m_address.sin_addr.s_addr;
+        rec.latency_us = now - m_start_us;
+        rec.fd = m_sockfd;
+        rec.status = m_status;
+        rec.method = m_method;
+        rec.aborted = aborted;
+        rec.url_len = 0;
+        if( m_url )
+        {
+            size_t len = strnlen( m_url, ACCESS_URL_LEN );
+            memcpy( rec.url, m_url, len );
+            rec.url_len = len;
+        }
+        alog->record( rec );
+    }
+    slow_log* log = slow_log::get_instance();
+    if( !log->enabled() )
+    {
+        return;
+    }
+    slow_request req;
+    req.fd = m_sockfd;
+    req.method = m_method == POST ? "POST" : "GET";
+    req.url = m_url;
+    req.code = m_code;
+    req.aborted = aborted;
+    req.total_us = now - m_start_us;
+    req.recv_us = m_ready_us - m_start_us;
+    req.queue_us = m_queue_us;
+    req.parse_us = m_parse_us;
+    req.process_us = m_process_us;
+    req.write_us = now - m_response_us;
+    req.bytes = bytes_have_send;
+    log->record( req );
+}
+
 // 当得到一个完整、正确的http请求时，就分析目标文件的属性，
 // 如果目标文件存在,对所有用户可读,且不是目录,则使用mmap将其映射到内存地址m_file_address
 // 并告诉调用者获取文件成功
@@ -405,84 +1001,59 @@ http_conn::HTTP_CODE http_conn::do_request()
 {
     strcpy( m_real_file, doc_root );    // m_real_file = "/var/WebServer/html"
     int len = strlen( doc_root );
-    // 返回最后一次出现'/'的位置
-    const char *p = strrchr(m_url, '/');    // m_url = "/judge.html"  p = "/judge.html"
-
-    // 处理POST方法
-    if(m_method == POST && (*(p + 1) == '2' || *(p + 1) == '3')){
-        // 提取用户名和密码
-        // user=123&password=123
-        // 找到分割符的位置，下标
-        int idx = m_string.find('&');
-        string name(m_string.begin() + 5, m_string.begin() + idx);
-        string password(m_string.begin() + idx + 10, m_string.end());
-        // cout << name << " " << password << endl;
-
-        // 判断登录还是注册
-        // '3'是注册
-        // 注册之后跳转到登录页面
-        if(*(p + 1) == '3'){
-            // 插入数据
-            // 表必须设置了主键
-            string sql_insert = "INSERT INTO user(username, password) VALUES('" + name + "', '" + password + "');";
-            // cout << sql_insert << endl;
-            m_lock.lock();
-            int res = mysql_real_query(mysql, sql_insert.c_str(), sql_insert.size());
-            m_lock.unlock();
-            if(!res){
-                strcpy(m_url, "/log.html");
-            }
-            else{
-                strcpy(m_url, "/registerError.html");
-            }
-        }
-        // '2'是登录
-        else{
-            // 判断数据是否存在
-            string sql_query = "SELECT * FROM user WHERE username='" + name + "' and password='" + password + "';";
-            int res = mysql_real_query(mysql, sql_query.c_str(), sql_query.size());
-            // 获取完整的结果集
-            MYSQL_RES *result = mysql_store_result(mysql);
-            //返回结果集中的列数
-            int num_fields = mysql_num_rows(result);
-            if(num_fields == 0){
-                strcpy(m_url, "/logError.html");
-            }
-            else{
-                strcpy(m_url, "/welcome.html");
-            }
-        }
-    }
-    // '0'跳转注册界面
-    if(*(p + 1) == '0'){
-        // // C库函数
-        // char *m_url_real = (char *)malloc(sizeof(char) * 200);
-        // strcpy(m_url_real, "/register.html");
-        // strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-        // free(m_url_real);
-        string m_url_real = "/register.html";
-        strncpy(m_real_file + len, m_url_real.c_str(), m_url_real.size());
-    }
-    // '1'跳转登录界面
-    else if(*(p + 1) == '1'){
-        string m_url_real = "/log.html";
-        strncpy(m_real_file + len, m_url_real.c_str(), m_url_real.size());
-    }
-    else if(*(p + 1) == '5'){
-        string m_url_real = "/picture.html";
-        strncpy(m_real_file + len, m_url_real.c_str(), m_url_real.size());
-    }
-    else if(*(p + 1) == '6'){
-        string m_url_real = "/video.html";
-        strncpy(m_real_file + len, m_url_real.c_str(), m_url_real.size());
-    }
-    else if(*(p + 1) == '7'){
-        string m_url_real = "/fans.html";
-        strncpy(m_real_file + len, m_url_real.c_str(), m_url_real.size());
+
+    // 匹配反向代理规则的请求转发给上游
+    if( m_route >= 0 ){
+        return forward();
     }
-    else
-        strncpy( m_real_file + len, m_url, FILENAME_LEN - len - 1 );
-    
+
+    // 运行指标，Prometheus文本格式
+    if(m_method == GET && m_metrics_path && strcmp(m_url, m_metrics_path) == 0){
+        metrics::get_instance()->scrape(m_dynamic);
+        m_content_type = "text/plain; version=0.0.4";
+        return DYNAMIC_REQUEST;
+    }
+
+    // 路由表按完整路径匹配，没有匹配的路径就是doc_root下的文件
+    const char* file = m_url;
+    m_pack_entry = NULL;
+    m_pack_variant = NULL;
+    m_local_route = route_lookup( m_url );
+    if( m_local_route ){
+        const route_entry* r = m_local_route;
+        if( !( r->methods & ( m_method == POST ? ROUTE_POST : ROUTE_GET ) ) ){
+            return METHOD_NOT_ALLOWED;
+        }
+        file = r->target;
+        if( r->action == ROUTE_LOGIN || r->action == ROUTE_REGISTER ){
+            // 提取用户名和密码
+            // user=123&password=123，只按位置截取，长度不够的消息体是错误的请求
+            size_t idx = m_string.find( '&' );
+            if( idx == string::npos || idx < 5 || m_string.size() < idx + 10 ){
+                return BAD_REQUEST;
+            }
+            string name( m_string, 5, idx - 5 );
+            string password( m_string, idx + 10 );
+
+            // 注册成功跳转到登录页面，登录成功跳转到欢迎页面
+            user_store::RESULT ret = r->action == ROUTE_REGISTER ? m_store->regist( name, password )
+                                                                 : m_store->login( name, password );
+            // 后端不可用(如数据库降级)时，静态资源照常服务，登录注册返回503
+            if( ret == user_store::STORE_UNAVAILABLE ){
+                return SERVICE_UNAVAILABLE;
+            }
+            if( ret != user_store::STORE_OK ){
+                file = r->error;
+            }
+        }
+    }
+    strncpy( m_real_file + len, file, FILENAME_LEN - len - 1 );
+
+    // 打包文件代替文档目录，找不到的文件就是不存在
+    if( site_pack::get_instance()->enabled() ){
+        return pack_request( file );
+    }
+
     // 判断资源是否存在
     if ( stat( m_real_file, &m_file_stat ) < 0 )
     {
@@ -505,21 +1076,153 @@ http_conn::HTTP_CODE http_conn::do_request()
     return FILE_REQUEST;
 }
 
-// 对内存映射块执行munmap操作
-void http_conn::unmap()
+http_conn::HTTP_CODE http_conn::pack_request( const char* file )
 {
-    if( m_file_address )
+    site_pack* pack = site_pack::get_instance();
+    metrics* m = metrics::get_instance();
+    const pack_entry* e = pack->find( file );
+    if( !e )
     {
-        munmap( m_file_address, m_file_stat.st_size );
-        m_file_address = 0;
+        return NO_RESOURCE;
     }
-}
-
-// 写http响应
+    m->inc( M_PACK_HITS );
+    m_pack_entry = e;
+    // 每个变体有自己的ETag，和将要返回的变体比较
+    int v = m_accept_gzip && e->variants[ PACK_GZIP ].head_len ? PACK_GZIP : PACK_IDENTITY;
+    m_pack_variant = &e->variants[ v ];
+    if( m_if_none_match && etag_match( m_if_none_match, pack->at( m_pack_variant->etag_off ), m_pack_variant->etag_len ) )
+    {
+        m->inc( M_NOT_MODIFIED );
+        return NOT_MODIFIED;
+    }
+    if( v == PACK_GZIP )
+    {
+        m->inc( M_PACK_GZIP );
+    }
+    m_file_address = ( char* )pack->at( m_pack_variant->body_off );
+    m_file_stat.st_size = m_pack_variant->body_len;
+    return FILE_REQUEST;
+}
+
+void http_conn::add_forwarded()
+{
+    metrics::get_instance()->inc( M_PROXY_REQUESTS );
+    char addr[ INET_ADDRSTRLEN ];
+    inet_ntop( AF_INET, &m_address.sin_addr, addr, sizeof( addr ) );
+    // 客户端带来的X-Forwarded-For在前面，多行等同于逗号连接的列表
+    m_forward_headers += "X-Forwarded-For: ";
+    m_forward_headers += addr;
+    m_forward_headers += m_ssl ? "\r\nX-Forwarded-Proto: https\r\n" : "\r\nX-Forwarded-Proto: http\r\n";
+}
+
+// 反向代理：请求行、保留的头部和消息体发给上游，读到响应头之后返回；流式上传的请求在这里发完消息体
+// epoll后端的明文连接和内核接管加密的TLS连接由relay_proxy把消息体从上游splice给客户；
+// 其他后端和用户态TLS不能splice到客户socket，消息体由next_piece逐段读出，作为流式响应发送；
+// HTTP/2的响应交给会话，消息体读进m_dynamic，和动态页面一样发送
+// epoll后端的HTTP/1连接等上游数据时不阻塞工作线程，注册上游socket之后返回；
+// 其他后端和HTTP/2仍然在工作线程等待，最多IO_TIMEOUT_MS
+http_conn::HTTP_CODE http_conn::forward()
+{
+    m_proxy.set_wait( m_loop || m_h2 );
+    bool ok;
+    if( m_proxy.uploading() )
+    {
+        ok = m_proxy.send_body( m_string.data(), m_string.size() ) && m_proxy.end_body();
+    }
+    else
+    {
+        add_forwarded();
+        static const string no_body;
+        ok = m_proxy.start( m_route, m_method == POST ? "POST" : "GET", m_url, m_host, m_forward_headers,
+                            m_method == POST ? m_string : no_body );
+    }
+    return proxy_result( ok );
+}
+
+http_conn::HTTP_CODE http_conn::proxy_result( bool ok )
+{
+    metrics* m = metrics::get_instance();
+    if( !ok && m_proxy.blocked() )
+    {
+        return PROXY_WAIT;
+    }
+    if( !ok )
+    {
+        m->inc( M_PROXY_FAILED );
+        return BAD_GATEWAY;
+    }
+    if( m_h2 )
+    {
+        ok = m_proxy.read_body( m_dynamic, PROXY_BUFFER_SIZE );
+        m_proxy.finish( ok );
+        if( !ok )
+        {
+            m->inc( M_PROXY_FAILED );
+            return BAD_GATEWAY;
+        }
+    }
+    else if( m_loop || ( m_ssl && !m_ktls_tx ) )
+    {
+        if( m_proxy.has_body() )
+        {
+            m_streaming = true;
+        }
+        else
+        {
+            m_proxy.finish( true );
+        }
+    }
+    else if( m_proxy.until_close() )
+    {
+        // 上游以关闭连接结束消息体，客户端也只能这样判断结束
+        m_linger = false;
+    }
+    return PROXY_REQUEST;
+}
+
+void http_conn::wait_upstream()
+{
+    if( !m_proxy.watch( m_epollfd, -1 - m_sockfd ) )
+    {
+        log_request( true );
+        shutdown( m_sockfd, SHUT_RDWR );
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+    }
+}
+
+// 对内存映射块执行munmap操作
+void http_conn::unmap()
+{
+    if( m_file_address )
+    {
+        if( !m_pack_variant )
+        {
+            munmap( m_file_address, m_file_stat.st_size );
+        }
+        m_file_address = 0;
+    }
+}
+
+// 写http响应
 // 解决大文件传输问题
 bool http_conn::write()
 {
     int temp = 0;
+    if( handshaking() )
+    {
+        // 握手中等待可写，完成后注册EPOLLIN读请求
+        int ret = tls_handshake();
+        if( ret > 0 )
+        {
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+        }
+        return ret >= 0;
+    }
+    if( m_h2 )
+    {
+        return flush_h2();
+    }
+
     if (bytes_to_send == 0)
     {
         // 没有需要发送的数据,不关闭连接
@@ -530,7 +1233,7 @@ bool http_conn::write()
 
     while( 1 )
     {
-        temp = writev( m_sockfd, m_iv, m_iv_count );
+        temp = send_iov( m_iv, m_iv_count );
         if(temp < 0){
             // 如果tcp写缓冲没有空间,则等待下一轮EPOLLOUT事件
             // 虽然在此期间,服务器没法接受到同一个客户的下一个请求,但可以保持连接的完整性
@@ -542,49 +1245,293 @@ bool http_conn::write()
                 modfd( m_epollfd, m_sockfd, EPOLLOUT );
                 return true;
             }
+            log_request( true );
             unmap();
             return false;
         }
 
-        bytes_have_send += temp;
-        bytes_to_send -= temp;
-        /*
-        当请求小文件，也就是调用一次writev函数就可以将数据全部发送出去的时候，不会报错，
-        此时不会再次进入while循环。
-        一旦请求服务器文件较大文件时，需要多次调用writev函数，便会出现问题，
-        不是文件显示不全，就是无法显示。
-        1 如果报文消息报头较小，第一次就传输完毕，m_iv[0]内容全部被发送，需要更新m_iv[1].iov_base和iov_len，m_iv[0].iov_len置成0，
-        后续只传输文件内容，不用传输响应消息头
-        2 每次传输后都要更新下次传输的文件起始位置和长度
-        */
-        if(bytes_have_send >= m_iv[0].iov_len){
-            m_iv[0].iov_len = 0;
-            m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-            m_iv[1].iov_len = bytes_to_send;
-        }
-        else{
-            m_iv[0].iov_base = m_write_buf + bytes_have_send;
-            m_iv[0].iov_len = m_iv[0].iov_len - bytes_have_send;
-        }
-
-        if(bytes_to_send <= 0)
+        if( advance( temp ) )
         {
             // 发送http响应成功,根据http请求中的Connection字段决定是否立即关闭连接
-            unmap();
             modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return finish();
+        }
+    }
+}
 
-            if( m_linger )
+// 头部用sendmsg发送，消息体由上游socket经管道splice到客户socket，不经过用户态；
+// 上游没有数据时注册上游socket，客户socket发送缓冲满时注册EPOLLOUT，
+// 主线程收到事件之后把连接交回线程池，由process()回到这里继续
+void http_conn::relay_proxy()
+{
+    if( m_streaming )
+    {
+        // epoll后端接着在工作线程发送当前一段；其他后端的事件循环发完一段之后交回来，生成下一段再交给它发送
+        if( !m_loop )
+        {
+            write_early();
+        }
+        else if( next_piece() )
+        {
+            rearm( EPOLLOUT );
+        }
+        else
+        {
+            log_request( true );
+            m_loop->notify( m_sockfd, LOOP_CLOSE );
+        }
+        return;
+    }
+    int ret = 1;
+    while( bytes_to_send > 0 )
+    {
+        // 有消息体时带MSG_MORE，头部和第一段消息体合成一个报文，不会单独发出后被Nagle算法压住消息体
+        struct msghdr msg;
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = m_iv;
+        msg.msg_iovlen = m_iv_count;
+        int n = sendmsg( m_sockfd, &msg, MSG_NOSIGNAL | ( m_proxy.has_body() ? MSG_MORE : 0 ) );
+        if( n < 0 )
+        {
+            ret = errno == EAGAIN ? 0 : -1;
+            break;
+        }
+        advance( n );
+    }
+    if( ret > 0 )
+    {
+        uint64_t sent = 0;
+        ret = m_proxy.splice_body( m_sockfd, sent );
+        bytes_have_send += sent;
+        metrics::get_instance()->inc( M_BYTES_SENT, sent );
+    }
+    if( ret == 0 )
+    {
+        modfd( m_epollfd, m_sockfd, EPOLLOUT );
+        return;
+    }
+    if( ret == 2 )
+    {
+        wait_upstream();
+        return;
+    }
+    m_proxy.finish( ret > 0 );
+    if( ret < 0 )
+    {
+        log_request( true );
+        shutdown( m_sockfd, SHUT_RDWR );
+    }
+    else if( !finish() )
+    {
+        shutdown( m_sockfd, SHUT_RDWR );
+    }
+    modfd( m_epollfd, m_sockfd, EPOLLIN );
+}
+
+// 流式响应的下一段：从上游读出一段消息体放进m_dynamic，长度未知时加上分块大小行和CRLF，
+// 上游的消息体读完时上游连接放回连接池，分块编码再带上最后的空块
+// 一段发完才生成下一段，客户端接收慢时不再从上游读，上游连接的接收窗口满了之后上游也就停止发送
+// 上游还没有数据时返回false，m_proxy.blocked()为true，上游连接保留
+bool http_conn::next_piece()
+{
+    do
+    {
+        size_t head = m_stream_chunked ? CHUNK_HEAD_LEN : 0;
+        m_dynamic.assign( head, '0' );
+        if( !m_proxy.read_piece( m_dynamic, STREAM_PIECE_SIZE ) )
+        {
+            if( m_proxy.blocked() )
             {
-                // 如果保持长连接,重新初始化,返回true,主线程不会关闭连接
-                init();
-                return true;
+                return false;
+            }
+            metrics::get_instance()->inc( M_PROXY_FAILED );
+            m_proxy.finish( false );
+            return false;
+        }
+        size_t len = m_dynamic.size() - head;
+        if( m_stream_chunked )
+        {
+            if( len > 0 )
+            {
+                char line[ 24 ];
+                snprintf( line, sizeof( line ), "%08zx\r\n", len );
+                memcpy( &m_dynamic[0], line, CHUNK_HEAD_LEN );
+                m_dynamic += "\r\n";
             }
             else
             {
-                return false;
-            } 
+                m_dynamic.clear();
+            }
+        }
+        if( !m_proxy.has_body() )
+        {
+            m_proxy.finish( true );
+            m_stream_end = true;
+            if( m_stream_chunked )
+            {
+                m_dynamic += "0\r\n\r\n";
+            }
+        }
+    } while( m_dynamic.empty() && !m_stream_end );
+    // 之前各段已经发送的字节数当作头部，advance按它计算m_body中的位置
+    m_write_idx = bytes_have_send;
+    m_body = &m_dynamic[0];
+    m_iv[ 0 ].iov_len = 0;
+    m_iv[ 1 ].iov_base = m_body;
+    m_iv[ 1 ].iov_len = m_dynamic.size();
+    m_iv_count = 2;
+    bytes_to_send = m_dynamic.size();
+    return true;
+}
+
+// 响应生成后先在工作线程直接发送，小响应一次writev就能发完，省掉一次epoll_wait唤醒和线程切换
+// 发送缓冲满、出错或者要关闭连接时注册EPOLLOUT交给主线程的write()
+void http_conn::write_early()
+{
+    uint64_t start = metrics::now_us();
+    while( true )
+    {
+        if( m_streaming && !m_stream_end && bytes_to_send == 0 )
+        {
+            // 流式响应的一段发完，接着生成下一段，上游没有数据时等上游可读再回到这里
+            if( !next_piece() )
+            {
+                if( m_proxy.blocked() )
+                {
+                    wait_upstream();
+                    return;
+                }
+                log_request( true );
+                shutdown( m_sockfd, SHUT_RDWR );
+                modfd( m_epollfd, m_sockfd, EPOLLIN );
+                return;
+            }
+        }
+        int temp = send_iov( m_iv, m_iv_count );
+        if( temp < 0 )
+        {
+            // EAGAIN等可写后由主线程继续，其他错误也由主线程的write()发现并关闭连接
+            break;
+        }
+        if( advance( temp ) )
+        {
+            if( m_streaming && !m_stream_end )
+            {
+                continue;
+            }
+            metrics::get_instance()->observe( H_WRITE, metrics::now_us() - start );
+            if( !finish() )
+            {
+                // 短连接的关闭和定时器由主线程处理，shutdown之后主线程马上收到EPOLLHUP
+                shutdown( m_sockfd, SHUT_RDWR );
+            }
+            // 注册之后这个连接可能已经被别的工作线程处理，不能再访问成员
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return;
         }
     }
+    metrics::get_instance()->observe( H_WRITE, metrics::now_us() - start );
+    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+}
+
+bool http_conn::feed( const char* data, int len )
+{
+    if( len == 0 )
+    {
+        if( m_capture )
+        {
+            traffic_capture::get_instance()->record( m_conn_id, CAP_CLOSE );
+        }
+        return false;
+    }
+    if( m_start_us == 0 )
+    {
+        m_start_us = metrics::now_us();
+    }
+    if( m_read_idx + len > READ_BUFFER_SIZE )
+    {
+        return false;
+    }
+    if( m_capture )
+    {
+        traffic_capture::get_instance()->record( m_conn_id, CAP_DATA, data, len );
+    }
+    memcpy( m_read_buf + m_read_idx, data, len );
+    m_read_idx += len;
+    PROBE2( recv, m_sockfd, m_read_idx );
+    m_ready_us = metrics::now_us();
+    return true;
+}
+
+int http_conn::pending_iov( struct iovec** iov )
+{
+    if( bytes_to_send == 0 )
+    {
+        init();
+        return 0;
+    }
+    *iov = m_iv;
+    return m_iv_count;
+}
+
+http_conn::SEND_STATUS http_conn::sent( int n )
+{
+    if( n < 0 )
+    {
+        log_request( true );
+        unmap();
+        return SEND_CLOSE;
+    }
+    if( !advance( n ) )
+    {
+        return SEND_AGAIN;
+    }
+    if( m_streaming && !m_stream_end )
+    {
+        return SEND_MORE;
+    }
+    return finish() ? SEND_KEEP : SEND_CLOSE;
+}
+
+// 发送了n字节后更新待发送的位置，全部发完返回true
+bool http_conn::advance( int n )
+{
+    bytes_have_send += n;
+    metrics::get_instance()->inc( M_BYTES_SENT, n );
+    bytes_to_send -= n;
+    PROBE3( write, m_sockfd, n, bytes_to_send );
+    /*
+    当请求小文件，也就是调用一次writev函数就可以将数据全部发送出去的时候，不会报错，
+    此时不会再次进入while循环。
+    一旦请求服务器文件较大文件时，需要多次调用writev函数，便会出现问题，
+    不是文件显示不全，就是无法显示。
+    1 如果报文消息报头较小，第一次就传输完毕，m_iv[0]内容全部被发送，需要更新m_iv[1].iov_base和iov_len，m_iv[0].iov_len置成0，
+    后续只传输文件内容，不用传输响应消息头
+    2 每次传输后都要更新下次传输的文件起始位置和长度
+    */
+    if(bytes_have_send >= m_write_idx){
+        m_iv[0].iov_len = 0;
+        m_iv[1].iov_base = m_body + (bytes_have_send - m_write_idx);
+        m_iv[1].iov_len = bytes_to_send;
+    }
+    else{
+        m_iv[0].iov_base = m_write_buf + bytes_have_send;
+        m_iv[0].iov_len = m_write_idx - bytes_have_send;
+    }
+    return bytes_to_send <= 0;
+}
+
+// 响应发完，长连接重新初始化返回true，否则返回false由调用者关闭连接
+bool http_conn::finish()
+{
+    log_request( false );
+    unmap();
+    if( m_linger )
+    {
+        init();
+        return true;
+    }
+    return false;
 }
 
 // bool http_conn::write()
@@ -659,6 +1606,7 @@ bool http_conn::add_response( const char* format, ... )
 
 bool http_conn::add_status_line( int status, const char* title )
 {
+    m_status = status;
     return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
 }
 
@@ -670,6 +1618,16 @@ bool http_conn::add_headers( int content_len )
     return true;
 }
 
+bool http_conn::add_content_type()
+{
+    // 静态文件不带Content-Type，由浏览器自行判断
+    if( !m_content_type )
+    {
+        return true;
+    }
+    return add_response( "Content-Type: %s\r\n", m_content_type );
+}
+
 bool http_conn::add_content_length( int content_len )
 {
     return add_response( "Content-Length: %d\r\n", content_len );
@@ -705,6 +1663,93 @@ bool http_conn::process_write( HTTP_CODE ret )
             }
             break;
         }
+        case SERVICE_UNAVAILABLE:
+        {
+            add_status_line( 503, error_503_title );
+            add_headers( strlen( error_503_form ) );
+            if ( ! add_content( error_503_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case BAD_GATEWAY:
+        {
+            add_status_line( 502, error_502_title );
+            add_headers( strlen( error_502_form ) );
+            if ( ! add_content( error_502_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case PROXY_REQUEST:
+        {
+            // 上游的头部可能超过写缓冲，状态行和头部放在m_dynamic的开头，写缓冲不用；
+            // 直接转发和流式响应时m_dynamic中只有头部，消息体随后由relay_proxy发送或者next_piece逐段生成
+            // 流式响应在长度未知时重新按分块编码，上游以关闭连接结束消息体时客户端连接也能保持
+            string head;
+            if( m_streaming )
+            {
+                m_stream_chunked = m_proxy.length() < 0;
+                m_proxy.client_head( head, m_linger, m_proxy.length(), m_stream_chunked );
+            }
+            else if( m_proxy.active() )
+            {
+                m_proxy.client_head( head, m_linger, m_proxy.length(), m_proxy.chunked() );
+            }
+            else
+            {
+                m_proxy.client_head( head, m_linger, m_dynamic.size(), false );
+            }
+            m_dynamic.insert( 0, head );
+            m_status = m_proxy.status();
+            m_write_idx = 0;
+            m_body = &m_dynamic[0];
+            m_iv[ 0 ].iov_base = m_write_buf;
+            m_iv[ 0 ].iov_len = 0;
+            m_iv[ 1 ].iov_base = m_body;
+            m_iv[ 1 ].iov_len = m_dynamic.size();
+            m_iv_count = 2;
+            bytes_to_send = m_dynamic.size();
+            return true;
+        }
+        case NOT_MODIFIED:
+        {
+            // 304没有消息体，也不带Content-Length；Vary和200一样，有gzip变体时才带
+            add_status_line( 304, error_304_title );
+            add_response( "ETag: %s\r\n", site_pack::get_instance()->at( m_pack_variant->etag_off ) );
+            if( m_pack_entry->variants[ PACK_GZIP ].head_len )
+            {
+                add_response( "Vary: Accept-Encoding\r\n" );
+            }
+            add_linger();
+            add_blank_line();
+            break;
+        }
+        case METHOD_NOT_ALLOWED:
+        {
+            add_status_line( 405, error_405_title );
+            add_response( "Allow: %s\r\n", route_allow( m_local_route ) );
+            add_headers( strlen( error_405_form ) );
+            if ( ! add_content( error_405_form ) )
+            {
+                return false;
+            }
+            break;
+        }
+        case PAYLOAD_TOO_LARGE:
+        {
+            // 消息体没有读完，回复之后关闭连接
+            m_linger = false;
+            add_status_line( 413, error_413_title );
+            add_headers( strlen( error_413_form ) );
+            if ( ! add_content( error_413_form ) )
+            {
+                return false;
+            }
+            break;
+        }
         case BAD_REQUEST:
         {
             add_status_line( 400, error_400_title );
@@ -737,10 +1782,28 @@ bool http_conn::process_write( HTTP_CODE ret )
         }
         case FILE_REQUEST:
         {
+            if ( m_pack_variant )
+            {
+                // 打包文件的状态行和头部是预先生成的，只补上Connection；空文件的消息体也是空的
+                const pack_variant* v = m_pack_variant;
+                m_status = 200;
+                add_response( "%.*s", ( int )v->head_len, site_pack::get_instance()->at( v->head_off ) );
+                add_linger();
+                add_blank_line();
+                m_body = m_file_address;
+                m_iv[ 0 ].iov_base = m_write_buf;
+                m_iv[ 0 ].iov_len = m_write_idx;
+                m_iv[ 1 ].iov_base = m_file_address;
+                m_iv[ 1 ].iov_len = v->body_len;
+                m_iv_count = 2;
+                bytes_to_send = m_write_idx + v->body_len;
+                return true;
+            }
             add_status_line( 200, ok_200_title );
             if ( m_file_stat.st_size != 0 )
             {
                 add_headers( m_file_stat.st_size );
+                m_body = m_file_address;
                 m_iv[ 0 ].iov_base = m_write_buf;
                 m_iv[ 0 ].iov_len = m_write_idx;
                 m_iv[ 1 ].iov_base = m_file_address;
@@ -760,6 +1823,21 @@ bool http_conn::process_write( HTTP_CODE ret )
             }
 	    break;
         }
+        case DYNAMIC_REQUEST:
+        {
+            // 动态生成的消息体放在m_dynamic中，和文件一样作为第二块发送
+            add_status_line( 200, ok_200_title );
+            add_content_type();
+            add_headers( m_dynamic.size() );
+            m_body = &m_dynamic[0];
+            m_iv[ 0 ].iov_base = m_write_buf;
+            m_iv[ 0 ].iov_len = m_write_idx;
+            m_iv[ 1 ].iov_base = m_body;
+            m_iv[ 1 ].iov_len = m_dynamic.size();
+            m_iv_count = 2;
+            bytes_to_send = m_write_idx + m_dynamic.size();
+            return true;
+        }
         default:
         {
             return false;
@@ -775,25 +1853,328 @@ bool http_conn::process_write( HTTP_CODE ret )
 
 // 由线程池中的工作线程调用,处理http请求的入口函数
 void http_conn::process()
+{
+    process_conn();
+    // 最后一步，之后主线程才能关闭连接；这时事件已经重新注册，连接可能已经交给下一个工作线程，计数要用原子操作
+    if( !m_loop )
+    {
+        __atomic_add_fetch( &m_finished, 1, __ATOMIC_RELEASE );
+    }
+}
+
+void http_conn::process_conn()
 {
     // 主线程read()之后加入线程池，线程池中的某个线程process_read()之后得到read_ret
-    // 根据read_ret进行process_write()处理，然后注册EPOLLOUT可写
+    // 根据read_ret进行process_write()处理，epoll后端直接在工作线程发送，发不完再注册EPOLLOUT
     // 之后主线程获取事件进行write()
+    // 反向代理的消息体没转发完，客户端可写或者上游可读之后主线程又把连接交给线程池
+    if( m_proxy.active() )
+    {
+        relay_proxy();
+        return;
+    }
+    // 上游的响应头到了
+    if( m_proxy.pending() )
+    {
+        HTTP_CODE ret = proxy_result( m_proxy.resume_head() );
+        if( ret == PROXY_WAIT )
+        {
+            wait_upstream();
+            return;
+        }
+        respond( ret );
+        return;
+    }
+    uint64_t start = metrics::now_us();
+    m_queue_us = start - m_ready_us;
+    admission::get_instance()->observe_queue( m_queue_us );
+    // 连接前言开头的数据交给HTTP/2会话，只支持epoll后端
+    if( !m_loop && ( m_h2 || h2_session::is_preface( m_read_buf, m_read_idx ) ) )
+    {
+        process_h2();
+        return;
+    }
+    m_process_us = 0;
+    bool full = m_read_idx == READ_BUFFER_SIZE;
     HTTP_CODE read_ret = process_read();
+    // 消息体比读缓冲大时，读缓冲满了就交给工作线程；消息体被取走之后在这里接着读，最多MAX_BODY_READS次再回到epoll，
+    // 不用每满一次读缓冲都经过一次epoll和线程池；用户态TLS中已经解密的数据不会触发EPOLLIN，要先读完
+    for( int reads = 0; read_ret == NO_REQUEST && full && !m_loop && m_check_state == CHECK_STATE_CONTENT
+                        && ( reads < MAX_BODY_READS || ( m_ssl && SSL_pending( m_ssl ) > 0 ) ); ++reads )
+    {
+        if( !read() )
+        {
+            // 连接由主线程关闭，它同时删除定时器；shutdown之后主线程马上收到EPOLLHUP
+            shutdown( m_sockfd, SHUT_RDWR );
+            modfd( m_epollfd, m_sockfd, EPOLLIN );
+            return;
+        }
+        full = m_read_idx == READ_BUFFER_SIZE;
+        read_ret = process_read();
+    }
+    // 解析时间不含do_request
+    metrics* m = metrics::get_instance();
+    uint64_t parse_us = metrics::now_us() - start - m_process_us;
+    m->observe( H_PARSE, parse_us );
+    m_parse_us += parse_us;
+    PROBE3( parse, m_sockfd, m_url, parse_us );
     if ( read_ret == NO_REQUEST )
     {
         // 没有获得请求方法,注册可读事件
-        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        rearm( EPOLLIN );
         return;
     }
+    if( read_ret == PROXY_WAIT )
+    {
+        wait_upstream();
+        return;
+    }
+    respond( read_ret );
+}
 
+void http_conn::respond( HTTP_CODE read_ret )
+{
+    metrics* m = metrics::get_instance();
+    m->inc( M_REQUESTS );
+    m->observe( H_PROCESS, m_process_us );
+    m_code = read_ret;
     bool write_ret = process_write( read_ret );
+    m_response_us = metrics::now_us();
     if ( ! write_ret )
     {
         // 处理失败,关闭连接
-        close_conn();
+        if( m_loop )
+        {
+            m_loop->notify( m_sockfd, LOOP_CLOSE );
+            return;
+        }
+        shutdown( m_sockfd, SHUT_RDWR );
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+        return;
     }
-    // 处理完之后注册EPOLLOUT,主线程可写
-    modfd( m_epollfd, m_sockfd, EPOLLOUT );
+    if( !m_loop )
+    {
+        if( m_proxy.active() )
+        {
+            relay_proxy();
+            return;
+        }
+        write_early();
+        return;
+    }
+    // 处理完之后交给事件循环发送
+    rearm( EPOLLOUT );
 }
 
+void http_conn::rearm( int ev )
+{
+    if( m_loop )
+    {
+        m_loop->notify( m_sockfd, ev == EPOLLOUT ? LOOP_WRITE : LOOP_READ );
+        return;
+    }
+    modfd( m_epollfd, m_sockfd, ev );
+}
+
+// HTTP/2连接由会话解析帧，收完整的请求和HTTP/1一样经过do_request，响应交给会话按优先级排队，
+// 然后在工作线程直接发送，发不完注册EPOLLOUT由主线程的write()继续
+void http_conn::process_h2()
+{
+    if( !m_h2 )
+    {
+        if( m_read_idx < h2_session::PREFACE_LEN )
+        {
+            // 连接前言还没收全
+            rearm( EPOLLIN );
+            return;
+        }
+        start_h2();
+    }
+    vector< h2_request > reqs;
+    m_h2->feed( m_read_buf, m_read_idx, reqs );
+    m_read_idx = 0;
+    for( size_t i = 0; i < reqs.size(); ++i )
+    {
+        serve_h2( reqs[i] );
+    }
+    if( !flush_h2() )
+    {
+        // 和write_early一样，shutdown之后由主线程收到EPOLLHUP关闭连接
+        shutdown( m_sockfd, SHUT_RDWR );
+        modfd( m_epollfd, m_sockfd, EPOLLIN );
+    }
+}
+
+void http_conn::serve_h2( h2_request& req )
+{
+    metrics* m = metrics::get_instance();
+    m->inc( M_REQUESTS );
+    m->inc( M_H2_STREAMS );
+    m_start_us = m_ready_us;
+    m_process_us = 0;
+    m_content_type = NULL;
+    m_dynamic.clear();
+    memset( m_real_file, '\0', FILENAME_LEN );
+    // 读缓冲中的数据已经交给会话，m_url放在读缓冲中，do_request可以改写
+    m_url = m_read_buf;
+    snprintf( m_url, FILENAME_LEN, "%s", req.path.c_str() );
+    m_method = req.method == "POST" ? POST : GET;
+    m_host = req.authority.empty() ? NULL : req.authority.c_str();
+    m_forward_headers.clear();
+    m_if_none_match = NULL;
+    m_accept_gzip = false;
+    HTTP_CODE ret = BAD_REQUEST;
+    // 和parse_request_line一样只支持GET和POST
+    if( ( req.method == "GET" || req.method == "POST" ) && req.path[0] == '/' && req.path.size() < FILENAME_LEN )
+    {
+        proxy* px = proxy::get_instance();
+        m_route = px->enabled() ? px->match( m_url ) : -1;
+        if( m_route >= 0 )
+        {
+            h2_forward_headers( req, m_forward_headers, m_host );
+        }
+        m_string.swap( req.body );
+        ret = timed_do_request();
+    }
+    m->observe( H_PROCESS, m_process_us );
+    m_code = ret;
+
+    // 错误页面和空文件的消息体是常量，不需要会话保管
+    const char* form = NULL;
+    switch( ret )
+    {
+        case FILE_REQUEST:
+        {
+            m_status = 200;
+            m_h2->prioritize( req.stream_id, m_real_file );
+            if( m_file_stat.st_size == 0 )
+            {
+                form = "<html><body></body></html>";
+                break;
+            }
+            bytes_have_send = m_file_stat.st_size;
+            if( m_pack_variant )
+            {
+                // 打包文件一直映射着，会话不释放；HTTP/2不带Accept-Encoding，总是原文
+                m_h2->respond( req.stream_id, 200, site_pack::get_instance()->at( m_pack_entry->type_off ),
+                               m_file_address, m_file_stat.st_size, false );
+                m_file_address = 0;
+                break;
+            }
+            // 映射交给会话，流结束时释放
+            m_h2->respond( req.stream_id, 200, NULL, m_file_address, m_file_stat.st_size, true );
+            m_file_address = 0;
+            break;
+        }
+        case DYNAMIC_REQUEST:
+        {
+            m_status = 200;
+            bytes_have_send = m_dynamic.size();
+            m_h2->respond( req.stream_id, 200, m_content_type, m_dynamic );
+            break;
+        }
+        case PROXY_REQUEST:
+        {
+            // 上游的其他头部不转发，只保留Content-Type
+            m_status = m_proxy.status();
+            bytes_have_send = m_dynamic.size();
+            const string& ctype = m_proxy.content_type();
+            m_h2->respond( req.stream_id, m_status, ctype.empty() ? NULL : ctype.c_str(), m_dynamic );
+            break;
+        }
+        case BAD_GATEWAY:
+        {
+            m_status = 502;
+            form = error_502_form;
+            break;
+        }
+        case SERVICE_UNAVAILABLE:
+        {
+            m_status = 503;
+            form = error_503_form;
+            break;
+        }
+        case NO_RESOURCE:
+        {
+            m_status = 404;
+            form = error_404_form;
+            break;
+        }
+        case METHOD_NOT_ALLOWED:
+        {
+            // 会话的响应头只有状态码和Content-Type，不带Allow
+            m_status = 405;
+            form = error_405_form;
+            break;
+        }
+        case FORBIDDEN_REQUEST:
+        {
+            m_status = 403;
+            form = error_403_form;
+            break;
+        }
+        case INTERNAL_ERROR:
+        {
+            m_status = 500;
+            form = error_500_form;
+            break;
+        }
+        default:
+        {
+            m_status = 400;
+            form = error_400_form;
+            break;
+        }
+    }
+    if( form )
+    {
+        bytes_have_send = strlen( form );
+        m_h2->respond( req.stream_id, m_status, NULL, form, bytes_have_send, false );
+    }
+    // 访问日志在响应排队时记录，字节数是消息体的大小
+    m_response_us = metrics::now_us();
+    log_request( false );
+}
+
+void http_conn::start_h2()
+{
+    m_h2 = new h2_session();
+    metrics::get_instance()->inc( M_H2_CONNECTIONS );
+    // 多个流的小帧交错发送，不能让Nagle算法把控制帧和最后一个DATA帧压到对端ACK之后
+    int nodelay = 1;
+    setsockopt( m_sockfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof( nodelay ) );
+}
+
+bool http_conn::flush_h2()
+{
+    int ev = EPOLLIN;
+    while( true )
+    {
+        struct iovec* iov;
+        int count = m_h2->pending_iov( &iov );
+        if( count == 0 )
+        {
+            break;
+        }
+        int n = send_iov( iov, count );
+        if( n < 0 )
+        {
+            if( errno != EAGAIN )
+            {
+                return false;
+            }
+            // 发送缓冲满时同时等待可读，新请求和WINDOW_UPDATE照常处理
+            ev |= EPOLLOUT;
+            break;
+        }
+        metrics::get_instance()->inc( M_BYTES_SENT, n );
+        m_h2->sent( n );
+    }
+    if( m_h2->finished() )
+    {
+        // GOAWAY已经发出，shutdown之后主线程收到EPOLLHUP关闭连接
+        shutdown( m_sockfd, SHUT_RDWR );
+    }
+    modfd( m_epollfd, m_sockfd, ev );
+    return true;
+}
@@ -8,6 +8,7 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <assert.h>
 #include <sys/stat.h>
@@ -19,11 +20,24 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <sys/uio.h>
+#include <sys/time.h>
 #include <string>
 #include <iostream>
 #include "locker.h"
-#include "sqlconnpool.h"
-#include "sqlconnRAII.h"
+#include "userstore.h"
+#include "metrics.h"
+#include "slowlog.h"
+#include "capture.h"
+#include "connloop.h"
+#include "accesslog.h"
+#include "admission.h"
+#include "iplimit.h"
+#include "lst_timer.h"
+#include "tlsctx.h"
+#include "h2session.h"
+#include "proxy.h"
+#include "router.h"
+#include "sitepack.h"
 
 using namespace std;
 
@@ -41,41 +55,130 @@ public:
     // 解析客户请求，主状态机的状态
     enum CHECK_STATE { CHECK_STATE_REQUESTLINE = 0, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
     // 服务器处理http请求的可能结果
-    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+    enum HTTP_CODE { NO_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, FORBIDDEN_REQUEST, FILE_REQUEST, DYNAMIC_REQUEST, INTERNAL_ERROR, SERVICE_UNAVAILABLE, CLOSED_CONNECTION, PROXY_REQUEST, BAD_GATEWAY, PAYLOAD_TOO_LARGE, METHOD_NOT_ALLOWED, NOT_MODIFIED, PROXY_WAIT };
     // 行的读取状态
     enum LINE_STATUS { LINE_OK = 0, LINE_BAD, LINE_OPEN };
+    // 请求消息体的解析状态，Content-Length的消息体只用BODY_DATA
+    enum BODY_STATE { BODY_DATA = 0, BODY_CHUNK_SIZE, BODY_CHUNK_END, BODY_TRAILER };
+    // 事件循环自己发送时每次发送之后的状态
+    // SEND_MORE表示流式响应的一段发完，要交回线程池由process()生成下一段
+    enum SEND_STATUS { SEND_AGAIN = 0, SEND_KEEP, SEND_CLOSE, SEND_MORE };
 
 public:
-    http_conn() {}
-    ~http_conn() {}
+    http_conn() : m_dispatched( 0 ), m_finished( 0 ), m_ssl( NULL ), m_h2( NULL ) {}
+    ~http_conn() { free_tls(); free_h2(); }
 
 public:
     // 初始化新接受的连接
     void init( int sockfd, const sockaddr_in& addr );
     // 关闭连接
     void close_conn( bool real_close = true );
+    // 释放SSL对象、HTTP/2会话和没转发完的上游连接，事件循环关闭fd之前调用
+    void release();
+    // 从HTTPS监听socket接受的连接在init之后调用，之后的读写先完成握手
+    void start_tls( SSL* ssl );
+    bool handshaking() const { return m_ssl && !m_tls_ready; }
+    // HTTPS连接这次只读到握手的结尾或者不完整的TLS记录，没有请求数据，read()已经重新注册了事件
+    bool no_data() const { return m_ssl && m_read_idx == 0 && !m_h2; }
     // 处理客户请求
     void process();
     // 非阻塞读操作
     bool read();
     // 非阻塞写操作
     bool write();
+    // 主线程拒绝请求时调用，计数并回复429/503，HTTPS连接的响应经过TLS加密，HTTP/2连接不回复；调用者随后关闭连接
+    void reject( metric_counter reason );
+    // 事件循环收到EPOLLRDHUP/EPOLLHUP/EPOLLERR，关闭之前读走随FIN到达的数据，抓取时记录数据和关闭
+    void peer_closed();
     sockaddr_in *get_address(){return &m_address;}
-    void initmysql_result(sqlconnpool *connPool);
+    // 反向代理正在等上游的响应头，或者消息体正在直接转发、流式发送；
+    // 客户端可写或者上游可读之后由主线程交回线程池继续
+    bool relaying() const { return m_proxy.active() || m_proxy.pending(); }
+    // epoll后端的主线程把连接交给线程池之后调用，工作线程的process()返回时也计一次数；
+    // 两者不等说明工作线程还持有连接，定时器和空闲回收都不能关闭它。计数跟着对象不跟着连接，不清零，
+    // 工作线程重新注册事件之后才计数，即使fd已经被新连接复用，两边的次数也能对上
+    void dispatched() { ++m_dispatched; }
+    bool worker_owned() const { return m_dispatched != __atomic_load_n( &m_finished, __ATOMIC_ACQUIRE ); }
+    // sort_lst_timer::tick的回调，users为http_conn数组
+    static bool busy_cb( client_data* data, void* users );
+    // 读缓冲的剩余空间，消息体被工作线程取走之后腾出
+    int read_room() const { return READ_BUFFER_SIZE - m_read_idx; }
+    // 正在接收请求的消息体，之后收到的数据不是新请求，不计入请求速率
+    bool in_body() const { return m_check_state == CHECK_STATE_CONTENT; }
+    // 处在两个请求之间，没有读到未处理的数据，可以被空闲连接回收关闭；HTTP/2连接还要求没有未结束的流，
+    // 正在转发的连接不算空闲
+    bool idle() const { return !worker_owned() && m_read_idx == 0 && ( !m_h2 || m_h2->idle() ) && !relaying(); }
+    // sort_lst_timer::evict的回调，users为http_conn数组
+    static bool idle_cb( client_data* data, void* users );
+    // 解析内存中的一段请求，不经过socket，也不执行do_request，供微基准测试解析器
+    HTTP_CODE parse_buffer( const char* buf, int len );
+
+    // 下面三个函数供io_uring后端使用，数据由主线程的io_uring收发，不经过read()/write()
+    // 协程后端用read()接收，用pending_iov()/sent()发送
+    // 收到一段客户数据，len为0表示客户端关闭，缓冲区满或客户端关闭返回false
+    bool feed( const char* data, int len );
+    // 待发送的iovec，返回块数，没有数据要发送时返回0
+    int pending_iov( struct iovec** iov );
+    // 发送完成n字节(负数为错误码)后更新状态
+    SEND_STATUS sent( int n );
 
 private:
     // 初始化连接
     void init();
-    // 解析http请求
+    // process()的实际处理
+    void process_conn();
+    // 解析http请求，请求完整时执行do_request
     HTTP_CODE process_read();
+    // 只解析，process_read和parse_buffer共用
+    HTTP_CODE parse_message();
     // 填充http应答
     bool process_write( HTTP_CODE ret );
 
     // 下面的函数被process_read调用来分析http请求
     HTTP_CODE parse_request_line(char* text);
     HTTP_CODE parse_headers(char* text);
-    HTTP_CODE parse_content(char* text);
+    // 解开已经收到的消息体存进m_string，转发的请求每一轮流式上传给上游
+    HTTP_CODE parse_content();
     HTTP_CODE do_request();
+    HTTP_CODE timed_do_request();
+    // 从打包文件中取file，If-None-Match匹配时返回NOT_MODIFIED，客户端接受gzip时选压缩变体
+    HTTP_CODE pack_request( const char* file );
+    // 转发给上游，读到响应头返回PROXY_REQUEST，HTTP/2的消息体也已经读进m_dynamic；
+    // epoll后端的HTTP/1连接不等上游，响应头还没到时返回PROXY_WAIT
+    HTTP_CODE forward();
+    // 读响应头的结果，ok为false时上游还没有数据返回PROXY_WAIT，否则是转发失败
+    HTTP_CODE proxy_result( bool ok );
+    // 注册上游socket，上游可读之后主线程把连接交回线程池；之后不能再访问成员
+    void wait_upstream();
+    // 请求处理完之后生成响应并发送
+    void respond( HTTP_CODE ret );
+    // 转发的头部加上X-Forwarded-For和X-Forwarded-Proto，计入转发的请求数
+    void add_forwarded();
+    // 直接转发的响应：发送头部，然后把消息体从上游splice给客户，发送缓冲满时注册EPOLLOUT
+    void relay_proxy();
+    // 流式响应的下一段放进m_dynamic，失败时上游连接已经关闭
+    bool next_piece();
+    // 处理完成后通知主线程，epoll后端重新注册事件，其他后端交给事件循环
+    void rearm( int ev );
+    // 工作线程生成响应后直接发送
+    void write_early();
+    // 非阻塞TLS握手，返回1完成，0等待下一次事件(已重新注册)，-1失败
+    int tls_handshake();
+    void free_tls();
+    // 发送iovec，明文连接和内核接管加密的TLS连接直接writev
+    int send_iov( const struct iovec* iov, int count );
+    // HTTP/2连接的请求处理：解析帧，逐个处理收完整的请求，然后发送
+    void process_h2();
+    void start_h2();
+    void serve_h2( h2_request& req );
+    // 发送会话中排好的帧，直到发完、发送缓冲满或者流控窗口用完，然后重新注册事件；出错返回false
+    bool flush_h2();
+    void free_h2();
+    // 写操作的公共部分
+    bool advance( int n );
+    bool finish();
+    // 请求结束时写访问日志，并把各阶段耗时交给慢请求日志
+    void log_request( bool aborted );
     char* get_line() {return m_read_buf + m_start_line;}
     LINE_STATUS parse_line();
 
@@ -94,9 +197,16 @@ public:
     // 所有socket上的事件都被注册到同一个epoll内核事件表中，
     // 所以将epoll文件描述符设置为静态的
     static int m_epollfd;
-    // 统计用户数量
+    // 统计用户数量，用原子操作修改
     static int m_user_count;
-    MYSQL* mysql;
+    // 登录注册使用的凭据存储后端
+    static user_store* m_store;
+    // 指标页面的路径，NULL表示不提供
+    static const char* m_metrics_path;
+    // 连接编号，只在主线程accept时递增
+    static unsigned int m_conn_seq;
+    // 非NULL时使用io_uring或协程后端
+    static conn_loop* m_loop;
 
 private:
     // 读http连接的socket和对方的socket地址
@@ -122,6 +232,15 @@ private:
     
     // 主状态机当前所处的状态
     CHECK_STATE m_check_state;
+    // 消息体在读缓冲中的起点，已经处理的消息体被移走，之后的数据挪到这里
+    int m_body_start;
+    BODY_STATE m_body_state;
+    // 当前一段(整个消息体或者一个分块)还没收到的字节数
+    int64_t m_body_remaining;
+    // Transfer-Encoding: chunked
+    bool m_chunked;
+    // Expect: 100-continue
+    bool m_expect_continue;
     // 请求方法
     METHOD m_method;
     // // 是否启用的POST
@@ -137,9 +256,9 @@ private:
     // http协议版本号，仅仅支持HTTP/1.1
     char* m_version;
     // 主机名
-    char* m_host;
+    const char* m_host;
     // http请求消息体的长度
-    int m_content_length;
+    int64_t m_content_length;
     // http请求是否保持连接
     bool m_linger;
 
@@ -151,6 +270,56 @@ private:
     // 采用writeev来执行写操作，定义下面两个成员，其中m_iv_count表示被写内存块的数量
     struct iovec m_iv[2];
     int m_iv_count;
+    // 第二块iovec的起始位置，指向m_file_address或m_dynamic
+    char* m_body;
+    // 动态生成的消息体，如指标页面
+    string m_dynamic;
+    // 动态消息体的Content-Type
+    const char* m_content_type;
+    // 流式响应：消息体分段生成，一段发完再生成下一段，内存中最多一段
+    // 长度未知时按分块编码，m_stream_end表示最后一段已经生成
+    bool m_streaming;
+    bool m_stream_chunked;
+    bool m_stream_end;
+    // 本次请求do_request的耗时，微秒
+    uint64_t m_process_us;
+    // 下面是慢请求日志用的时间点和耗时，微秒
+    // 第一次读到请求数据、最后一次读完交给线程池、响应就绪的时间点
+    uint64_t m_start_us;
+    uint64_t m_ready_us;
+    uint64_t m_response_us;
+    // 线程池队列等待和解析的耗时
+    uint64_t m_queue_us;
+    uint64_t m_parse_us;
+    // 请求的处理结果和响应的状态码
+    HTTP_CODE m_code;
+    int m_status;
+    // 连接编号和是否被流量抓取采中
+    unsigned int m_conn_id;
+    // 交给线程池和工作线程处理完的次数，见worker_owned()
+    unsigned int m_dispatched;
+    unsigned int m_finished;
+    bool m_capture;
+    // HTTPS连接，握手是否完成，内核是否接管了发送方向的加密
+    SSL* m_ssl;
+    bool m_tls_ready;
+    bool m_ktls_tx;
+    // 识别出连接前言之后创建，连接关闭时释放
+    h2_session* m_h2;
+    // 匹配的反向代理规则，-1表示不转发
+    int m_route;
+    // 匹配的本地路由，NULL表示按静态文件处理
+    const route_entry* m_local_route;
+    // If-None-Match的值，指向读缓冲
+    const char* m_if_none_match;
+    // Accept-Encoding包含gzip
+    bool m_accept_gzip;
+    // 从打包文件返回的文件和选中的变体，m_file_address指向打包文件，不需要munmap
+    const pack_entry* m_pack_entry;
+    const pack_variant* m_pack_variant;
+    // 转发给上游的端到端头部
+    string m_forward_headers;
+    proxy_exchange m_proxy;
 };
 
 #endif
@@ -0,0 +1,269 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iplimit.h"
+
+static const int SHARD_BITS = 6;
+static const int SHARD_COUNT = 1 << SHARD_BITS;
+// 每个分片的槽数，装载率超过3/4时不再插入
+static const uint32_t SLOTS = 1024;
+static const uint32_t MAX_FILL = SLOTS * 3 / 4;
+
+struct ip_limiter::shard
+{
+    int lock __attribute__(( aligned( 64 ) ));
+    uint32_t count;
+    entry slots[ SLOTS ];
+};
+
+// 令牌桶只需要毫秒精度，粗粒度时钟不进内核，比CLOCK_MONOTONIC快
+static inline uint32_t now_ms()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t hash_addr( uint32_t addr )
+{
+    return addr * 0x9E3779B97F4A7C15ull;
+}
+
+static inline uint32_t home_slot( uint32_t addr )
+{
+    return ( hash_addr( addr ) >> 32 ) & ( SLOTS - 1 );
+}
+
+static inline void spin_lock( int* lock )
+{
+    while( __atomic_exchange_n( lock, 1, __ATOMIC_ACQUIRE ) )
+    {
+        while( __atomic_load_n( lock, __ATOMIC_RELAXED ) )
+        {
+        }
+    }
+}
+
+static inline void spin_unlock( int* lock )
+{
+    __atomic_store_n( lock, 0, __ATOMIC_RELEASE );
+}
+
+ip_limiter* ip_limiter::get_instance()
+{
+    static ip_limiter limiter;
+    return &limiter;
+}
+
+ip_limiter::ip_limiter()
+{
+    m_shards = NULL;
+    m_rate = 0;
+    m_burst = 0;
+    m_max_conns = 0;
+}
+
+ip_limiter::~ip_limiter()
+{
+    free( m_shards );
+}
+
+void ip_limiter::init( int rate, int burst, int max_conns )
+{
+    m_rate = rate / 1000.0f;
+    m_burst = burst > 0 ? burst : rate;
+    m_max_conns = max_conns;
+    if( !enabled() || m_shards )
+    {
+        return;
+    }
+    if( posix_memalign( ( void** )&m_shards, 64, sizeof( shard ) * SHARD_COUNT ) != 0 )
+    {
+        abort();
+    }
+    memset( m_shards, 0, sizeof( shard ) * SHARD_COUNT );
+}
+
+ip_limiter::shard* ip_limiter::find_shard( uint32_t addr, uint32_t* slot )
+{
+    *slot = home_slot( addr );
+    return m_shards + ( hash_addr( addr ) >> ( 64 - SHARD_BITS ) );
+}
+
+ip_limiter::entry* ip_limiter::lookup( shard* s, uint32_t slot, uint32_t addr, bool create )
+{
+    for( uint32_t i = slot; ; i = ( i + 1 ) & ( SLOTS - 1 ) )
+    {
+        entry* e = s->slots + i;
+        if( !e->used )
+        {
+            if( !create || s->count >= MAX_FILL )
+            {
+                return NULL;
+            }
+            e->addr = addr;
+            e->used = 1;
+            e->conns = 0;
+            e->last_ms = now_ms();
+            e->tokens = m_burst;
+            ++s->count;
+            return e;
+        }
+        if( e->addr == addr )
+        {
+            return e;
+        }
+    }
+}
+
+void ip_limiter::refill( entry* e, uint32_t now )
+{
+    e->tokens += ( uint32_t )( now - e->last_ms ) * m_rate;
+    if( e->tokens > m_burst )
+    {
+        e->tokens = m_burst;
+    }
+    e->last_ms = now;
+}
+
+bool ip_limiter::connect( uint32_t addr )
+{
+    if( !enabled() )
+    {
+        return true;
+    }
+    uint32_t slot;
+    shard* s = find_shard( addr, &slot );
+    spin_lock( &s->lock );
+    bool ok = true;
+    entry* e = lookup( s, slot, addr, true );
+    if( e )
+    {
+        if( m_max_conns && e->conns >= m_max_conns )
+        {
+            ok = false;
+        }
+        else if( e->conns < UINT16_MAX )
+        {
+            ++e->conns;
+        }
+    }
+    spin_unlock( &s->lock );
+    return ok;
+}
+
+void ip_limiter::release( uint32_t addr )
+{
+    if( !enabled() )
+    {
+        return;
+    }
+    uint32_t slot;
+    shard* s = find_shard( addr, &slot );
+    spin_lock( &s->lock );
+    entry* e = lookup( s, slot, addr, false );
+    // 连接建立时分片已满就没有记录，这里也找不到
+    if( e && e->conns )
+    {
+        --e->conns;
+    }
+    spin_unlock( &s->lock );
+}
+
+bool ip_limiter::request( uint32_t addr )
+{
+    if( m_rate <= 0 )
+    {
+        return true;
+    }
+    uint32_t slot;
+    shard* s = find_shard( addr, &slot );
+    spin_lock( &s->lock );
+    bool ok = true;
+    entry* e = lookup( s, slot, addr, true );
+    if( e )
+    {
+        refill( e, now_ms() );
+        if( e->tokens >= 1 )
+        {
+            e->tokens -= 1;
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+    spin_unlock( &s->lock );
+    return ok;
+}
+
+void ip_limiter::erase( shard* s, uint32_t i )
+{
+    uint32_t j = i;
+    while( true )
+    {
+        j = ( j + 1 ) & ( SLOTS - 1 );
+        entry* e = s->slots + j;
+        if( !e->used )
+        {
+            break;
+        }
+        // 探测起点不在(i, j]之间的项可以前移到i，查找时仍然能找到
+        uint32_t k = home_slot( e->addr );
+        bool movable = i <= j ? ( k <= i || k > j ) : ( k <= i && k > j );
+        if( movable )
+        {
+            s->slots[i] = *e;
+            i = j;
+        }
+    }
+    s->slots[i].used = 0;
+    --s->count;
+}
+
+int ip_limiter::expire()
+{
+    if( !m_shards )
+    {
+        return 0;
+    }
+    uint32_t now = now_ms();
+    int removed = 0;
+    for( int n = 0; n < SHARD_COUNT; ++n )
+    {
+        shard* s = m_shards + n;
+        spin_lock( &s->lock );
+        for( uint32_t i = 0; i < SLOTS && s->count; )
+        {
+            entry* e = s->slots + i;
+            if( e->used && !e->conns )
+            {
+                refill( e, now );
+                if( m_rate <= 0 || e->tokens >= m_burst )
+                {
+                    // 后面的项会前移到i，i不前进
+                    erase( s, i );
+                    ++removed;
+                    continue;
+                }
+            }
+            ++i;
+        }
+        spin_unlock( &s->lock );
+    }
+    return removed;
+}
+
+int ip_limiter::size()
+{
+    if( !m_shards )
+    {
+        return 0;
+    }
+    int total = 0;
+    for( int n = 0; n < SHARD_COUNT; ++n )
+    {
+        total += __atomic_load_n( &m_shards[n].count, __ATOMIC_RELAXED );
+    }
+    return total;
+}
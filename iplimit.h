@@ -0,0 +1,62 @@
+#ifndef IPLIMIT_H
+#define IPLIMIT_H
+
+#include <stdint.h>
+
+using namespace std;
+
+// 按客户端IP限制请求速率和并发连接数
+// 以IPv4地址为键的哈希表分成64个分片，每个分片一把自旋锁和一块开放寻址的数组；每项16字节，
+// 一个缓存行放4项，查找通常只访问一个缓存行。请求速率用令牌桶，按毫秒补充；连接数在accept时加一、关闭时减一。
+// 连接数为0、令牌已经补满的项和不存在没有区别，由定时器清理。
+// 分片满时不再记录新的地址，直接放行，宁可漏限也不误伤。
+class ip_limiter
+{
+public:
+    static ip_limiter* get_instance();
+
+    // rate为每个IP每秒的请求数，burst为允许的突发请求数(0表示等于rate)，max_conns为每个IP的连接数上限，0表示不限制
+    void init( int rate, int burst, int max_conns );
+    bool enabled() const { return m_rate > 0 || m_max_conns > 0; }
+
+    // accept之后调用，超过连接数上限返回false，调用者回复429并关闭连接，不再调用release
+    bool connect( uint32_t addr );
+    // 连接关闭时调用
+    void release( uint32_t addr );
+    // 请求交给线程池之前调用，令牌用完返回false
+    bool request( uint32_t addr );
+    // 删除不再需要的项，返回删除的项数，由定时器调用
+    int expire();
+    // 当前记录的IP数
+    int size();
+
+private:
+    ip_limiter();
+    ~ip_limiter();
+
+    struct entry
+    {
+        uint32_t addr;
+        uint16_t used;
+        uint16_t conns;
+        uint32_t last_ms;       // 上次补充令牌的时间
+        float tokens;
+    };
+
+    struct shard;
+
+    shard* find_shard( uint32_t addr, uint32_t* slot );
+    // 查找addr，create为true时不存在就插入，分片满时返回NULL
+    entry* lookup( shard* s, uint32_t slot, uint32_t addr, bool create );
+    void refill( entry* e, uint32_t now );
+    // 删除第i项，后面同一探测链上的项前移
+    void erase( shard* s, uint32_t i );
+
+private:
+    shard* m_shards;
+    float m_rate;               // 每毫秒补充的令牌数
+    float m_burst;
+    int m_max_conns;
+};
+
+#endif
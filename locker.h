@@ -4,6 +4,7 @@
 #include <exception>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 
 /*封装信号量*/
 class sem
@@ -75,11 +76,50 @@ public:
     {
         return pthread_mutex_unlock( &m_mutex ) == 0;
     }
+    // 获取底层互斥锁，供条件变量使用
+    pthread_mutex_t* get()
+    {
+        return &m_mutex;
+    }
 
 private:
     pthread_mutex_t m_mutex;
 };
 
+/*封装读写锁的类*/
+class rwlocker
+{
+public:
+    rwlocker()
+    {
+        if( pthread_rwlock_init( &m_rwlock, NULL ) != 0 )
+        {
+            throw std::exception();
+        }
+    }
+    ~rwlocker()
+    {
+        pthread_rwlock_destroy( &m_rwlock );
+    }
+    // 获取读锁，多个读者可以同时持有
+    bool rdlock()
+    {
+        return pthread_rwlock_rdlock( &m_rwlock ) == 0;
+    }
+    // 获取写锁
+    bool wrlock()
+    {
+        return pthread_rwlock_wrlock( &m_rwlock ) == 0;
+    }
+    bool unlock()
+    {
+        return pthread_rwlock_unlock( &m_rwlock ) == 0;
+    }
+
+private:
+    pthread_rwlock_t m_rwlock;
+};
+
 /*封装条件变量的类*/
 class cond
 {
@@ -87,39 +127,38 @@ public:
     // 创建并初始化条件变量
     cond()
     {
-        if( pthread_mutex_init( &m_mutex, NULL ) != 0 )
-        {
-            throw std::exception();
-        }
         if ( pthread_cond_init( &m_cond, NULL ) != 0 )
         {
-            pthread_mutex_destroy( &m_mutex );
             throw std::exception();
         }
     }
     // 销毁条件变量
     ~cond()
     {
-        pthread_mutex_destroy( &m_mutex );
         pthread_cond_destroy( &m_cond );
     }
-    // 等待条件变量
-    bool wait()
+    // 等待条件变量，调用前需持有m_mutex
+    bool wait( pthread_mutex_t* m_mutex )
+    {
+        return pthread_cond_wait( &m_cond, m_mutex ) == 0;
+    }
+    // 带超时的等待，t为绝对时间，超时返回false
+    bool timewait( pthread_mutex_t* m_mutex, struct timespec t )
     {
-        int ret = 0;
-        pthread_mutex_lock( &m_mutex );
-        ret = pthread_cond_wait( &m_cond, &m_mutex );
-        pthread_mutex_unlock( &m_mutex );
-        return ret == 0;
+        return pthread_cond_timedwait( &m_cond, m_mutex, &t ) == 0;
     }
     // 唤醒等待条件变量的线程
     bool signal()
     {
         return pthread_cond_signal( &m_cond ) == 0;
     }
+    // 唤醒所有等待的线程
+    bool broadcast()
+    {
+        return pthread_cond_broadcast( &m_cond ) == 0;
+    }
 
 private:
-    pthread_mutex_t m_mutex;
     pthread_cond_t m_cond;
 };
 
@@ -0,0 +1,178 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <vector>
+#include "logstore.h"
+
+log_store::log_store()
+{
+    m_fd = -1;
+    m_end = 0;
+    m_sync = true;
+}
+
+log_store::~log_store()
+{
+    if( m_fd != -1 )
+    {
+        close( m_fd );
+    }
+}
+
+// FNV-1a
+uint32_t log_store::checksum( const char* data, size_t len )
+{
+    uint32_t hash = 2166136261u;
+    for( size_t i = 0; i < len; ++i )
+    {
+        hash ^= ( unsigned char )data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+bool log_store::open( const char* path, bool sync )
+{
+    m_sync = sync;
+    m_fd = ::open( path, O_RDWR | O_CREAT | O_APPEND, 0600 );
+    if( m_fd < 0 )
+    {
+        return false;
+    }
+    off_t end = replay();
+    if( end < 0 )
+    {
+        return false;
+    }
+    m_end = end;
+    // 上次崩溃时写了一半的记录直接丢掉
+    struct stat st;
+    if( fstat( m_fd, &st ) == 0 && st.st_size > end )
+    {
+        printf( "truncate %ld bytes of partial record in %s\n", ( long )( st.st_size - end ), path );
+        if( ftruncate( m_fd, end ) != 0 )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+off_t log_store::replay()
+{
+    struct stat st;
+    if( fstat( m_fd, &st ) < 0 )
+    {
+        return -1;
+    }
+    vector< char > buf( st.st_size );
+    size_t have = 0;
+    while( have < buf.size() )
+    {
+        ssize_t n = pread( m_fd, &buf[0] + have, buf.size() - have, have );
+        if( n <= 0 )
+        {
+            break;
+        }
+        have += n;
+    }
+
+    size_t pos = 0;
+    while( pos + HEADER_LEN <= have )
+    {
+        uint16_t name_len, password_len;
+        uint32_t sum;
+        memcpy( &name_len, &buf[pos], 2 );
+        memcpy( &password_len, &buf[pos + 2], 2 );
+        memcpy( &sum, &buf[pos + 4], 4 );
+        size_t body = name_len + password_len;
+        if( name_len == 0 || name_len > MAX_FIELD_LEN || password_len > MAX_FIELD_LEN
+                || pos + HEADER_LEN + body > have
+                || checksum( &buf[pos + HEADER_LEN], body ) != sum )
+        {
+            break;
+        }
+        const char* p = &buf[pos + HEADER_LEN];
+        m_index[ string( p, name_len ) ] = string( p + name_len, password_len );
+        pos += HEADER_LEN + body;
+    }
+    return pos;
+}
+
+user_store::RESULT log_store::login( const string& name, const string& password )
+{
+    RESULT ret = STORE_FAIL;
+    m_lock.rdlock();
+    unordered_map< string, string >::const_iterator it = m_index.find( name );
+    if( it != m_index.end() && it->second == password )
+    {
+        ret = STORE_OK;
+    }
+    m_lock.unlock();
+    return ret;
+}
+
+user_store::RESULT log_store::regist( const string& name, const string& password )
+{
+    if( name.empty() || name.size() > MAX_FIELD_LEN || password.size() > MAX_FIELD_LEN )
+    {
+        return STORE_FAIL;
+    }
+
+    // 一条记录一次write，O_APPEND保证追加到末尾
+    char record[ HEADER_LEN + 2 * MAX_FIELD_LEN ];
+    uint16_t name_len = name.size();
+    uint16_t password_len = password.size();
+    memcpy( record + HEADER_LEN, name.data(), name_len );
+    memcpy( record + HEADER_LEN + name_len, password.data(), password_len );
+    uint32_t sum = checksum( record + HEADER_LEN, name_len + password_len );
+    memcpy( record, &name_len, 2 );
+    memcpy( record + 2, &password_len, 2 );
+    memcpy( record + 4, &sum, 4 );
+    size_t len = HEADER_LEN + name_len + password_len;
+
+    RESULT ret = STORE_OK;
+    m_lock.wrlock();
+    if( m_index.find( name ) != m_index.end() )
+    {
+        ret = STORE_FAIL;
+    }
+    else if( ::write( m_fd, record, len ) != ( ssize_t )len || ( m_sync && fdatasync( m_fd ) != 0 ) )
+    {
+        // 写失败时截掉残缺的记录，否则后面追加的记录在重放时都会丢失
+        if( ftruncate( m_fd, m_end ) != 0 )
+        {
+            printf( "log store truncate failed\n" );
+        }
+        ret = STORE_UNAVAILABLE;
+    }
+    else
+    {
+        m_end += len;
+        m_index[ name ] = password;
+    }
+    m_lock.unlock();
+    return ret;
+}
+
+bool log_store::scan( scan_cb cb, void* arg )
+{
+    m_lock.rdlock();
+    unordered_map< string, string >::const_iterator it;
+    for( it = m_index.begin(); it != m_index.end(); ++it )
+    {
+        cb( it->first, arg );
+    }
+    m_lock.unlock();
+    return true;
+}
+
+size_t log_store::size()
+{
+    m_lock.rdlock();
+    size_t n = m_index.size();
+    m_lock.unlock();
+    return n;
+}
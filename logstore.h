@@ -0,0 +1,50 @@
+#ifndef _LOG_STORE_
+#define _LOG_STORE_
+
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include "locker.h"
+#include "userstore.h"
+
+using namespace std;
+
+// 内嵌的凭据存储：本地磁盘上的追加写日志 + 内存哈希索引
+// 不依赖MySQL，用于离线压测登录注册以及单机部署
+//
+// 日志由连续的记录组成，每条记录:
+//   name_len(2字节) | password_len(2字节) | checksum(4字节) | name | password
+// 只追加不修改，启动时顺序重放重建索引，末尾写了一半的记录会被截断
+class log_store : public user_store
+{
+public:
+    log_store();
+    ~log_store();
+
+    // 打开或创建日志文件并重建索引，sync为true时每次注册都落盘
+    bool open( const char* path, bool sync );
+
+    RESULT login( const string& name, const string& password );
+    RESULT regist( const string& name, const string& password );
+    bool scan( scan_cb cb, void* arg );
+
+    // 已注册用户数
+    size_t size();
+
+private:
+    // 重放日志，返回最后一条完整记录的结束位置
+    off_t replay();
+    static uint32_t checksum( const char* data, size_t len );
+
+private:
+    static const size_t HEADER_LEN = 8;
+    static const size_t MAX_FIELD_LEN = 255;
+
+    int m_fd;
+    off_t m_end;            // 最后一条完整记录的结束位置
+    bool m_sync;
+    rwlocker m_lock;        // 登录持读锁，注册持写锁
+    unordered_map< string, string > m_index;    // 用户名 -> 密码
+};
+
+#endif
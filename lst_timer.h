@@ -122,9 +122,11 @@ public:
         delete timer;
         return;
     }
-    // 处理链表上的到期任务
-    void tick(){
-        if(!head) return;
+    // 处理链表上的到期任务，返回到期的个数
+    // busy对到期的连接返回true时不关闭，定时器延后extend秒，用于工作线程还在处理的连接
+    int tick(bool (*busy)(client_data*, void*) = NULL, void* arg = NULL, int extend = 1){
+        int count = 0;
+        if(!head) return count;
         // cout << "time tick" << endl;
         time_t cur_time = time(NULL);
         util_timer* tmp = head;
@@ -133,12 +135,38 @@ public:
             if(cur_time < tmp->expire){
                 break;
             }
+            if(busy && busy(tmp->user_data, arg)){
+                // 延后之后的超时时间大于cur_time，插到后面，不会再被这一轮处理
+                tmp->expire = cur_time + (extend > 0 ? extend : 1);
+                adjust_timer(tmp);
+                tmp = head;
+                continue;
+            }
             tmp->cb_func(tmp->user_data);
+            ++count;
             head = head->next;
             if(head) head->prev = NULL;
             delete tmp;
             tmp = head;
         }
+        return count;
+    }
+    // 从最早到期的定时器开始，对idle返回true的连接调用回调并删除定时器，最多n个，返回删除的个数
+    // 空闲超时相同时链表越靠前的连接越久没有活动；最多检查8n个定时器，忙的连接很多时不遍历整个链表
+    int evict(int n, bool (*idle)(client_data*, void*), void* arg){
+        int count = 0;
+        int budget = n * 8;
+        util_timer* tmp = head;
+        while(tmp && count < n && budget-- > 0){
+            util_timer* next = tmp->next;
+            if(idle(tmp->user_data, arg)){
+                tmp->cb_func(tmp->user_data);
+                del_timer(tmp);
+                ++count;
+            }
+            tmp = next;
+        }
+        return count;
     }
 
 private:
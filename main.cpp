@@ -15,6 +15,21 @@
 #include "sqlconnpool.h"
 #include "http_conn.h"
 #include "lst_timer.h"
+#include "sqlbatch.h"
+#include "sqlrouter.h"
+#include "userstore.h"
+#include "logstore.h"
+#include "bloomfilter.h"
+#include "metrics.h"
+#include "probes.h"
+#include "config.h"
+#include "uringloop.h"
+#include "coloop.h"
+#include "admission.h"
+#include "iplimit.h"
+#include "tlsctx.h"
+#include "proxy.h"
+#include "sitepack.h"
 
 #define MAX_FD 65536
 #define MAX_EVENT_NUMBER 10000
@@ -32,6 +47,8 @@ static int epollfd = 0;
 static int pipefd[2];
 // 定时器链表
 static sort_lst_timer lst_timer;
+// 每个可能的客户连接一个http_conn对象，按fd索引
+static http_conn* users = NULL;
 
 // 信号处理函数
 void sig_handler(int sig){
@@ -60,7 +77,11 @@ void addsig( int sig, void( handler )(int), bool restart = true )
 
 // 定时处理任务
 void timer_hander(){
-    lst_timer.tick();
+    // 工作线程还持有的连接(比如正在转发上游的消息体)不关闭，定时器延后
+    metrics::get_instance()->inc(M_TIMER_EXPIRED, lst_timer.tick(http_conn::busy_cb, users,
+                                 admission::get_instance()->idle_timeout(http_conn::m_user_count)));
+    // 清理不再需要限速的客户端IP
+    ip_limiter::get_instance()->expire();
     // 5s产生一个alarm信号
     alarm(TIMESLOT);
 }
@@ -70,48 +91,239 @@ void cb_func(client_data* user_data){
     // cout << "delete sockfd timer" << endl;
     epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
     assert(user_data);
+    users[user_data->sockfd].release();
     close(user_data->sockfd);
-    http_conn::m_user_count--;
+    __sync_fetch_and_sub(&http_conn::m_user_count, 1);
+    ip_limiter::get_instance()->release(user_data->address.sin_addr.s_addr);
 }
 
-void show_error( int connfd, const char* info )
+// 把连接交给线程池，之后工作线程持有连接，直到process()返回
+static bool dispatch( threadpool< http_conn >* pool, int sockfd )
 {
-    printf( "%s", info );
-    send( connfd, info, strlen( info ), 0 );
-    close( connfd );
+    if( !pool->append( users + sockfd ) )
+    {
+        return false;
+    }
+    users[sockfd].dispatched();
+    return true;
+}
+
+// 暂停或恢复监听socket上的accept
+static void set_listening( int fd, bool on )
+{
+    if( fd < 0 )
+    {
+        return;
+    }
+    epoll_event event;
+    event.data.fd = fd;
+    event.events = on ? EPOLLIN | EPOLLRDHUP : 0;
+    epoll_ctl( epollfd, EPOLL_CTL_MOD, fd, &event );
+}
+
+// 抓取指标时计算的瞬时值
+static double gauge_user_count( void* )
+{
+    return http_conn::m_user_count;
+}
+
+static double gauge_queue_size( void* arg )
+{
+    return ( ( threadpool< http_conn >* )arg )->queue_size();
+}
+
+static double gauge_db_busy( void* )
+{
+    return sqlconnpool::get_instance()->get_stats().busy_conn;
+}
+
+static double gauge_db_total( void* )
+{
+    return sqlconnpool::get_instance()->get_stats().total_conn;
+}
+
+static double gauge_db_available( void* )
+{
+    return sqlconnpool::get_instance()->available() ? 1 : 0;
+}
+
+static double gauge_ip_entries( void* )
+{
+    return ip_limiter::get_instance()->size();
+}
+
+static double gauge_idle_timeout( void* )
+{
+    return admission::get_instance()->idle_timeout( http_conn::m_user_count );
+}
+
+static double gauge_pack_files( void* )
+{
+    return site_pack::get_instance()->count();
+}
+
+static double gauge_proxy_healthy( void* )
+{
+    return proxy::get_instance()->healthy_count();
 }
 
 
 /*只负责I/O读写*/
 int main( int argc, char* argv[] )
 {
-    if( argc <= 2 )
+    config conf;
+    if( !conf.parse_arg( argc, argv ) )
     {
-        printf( "usage: %s ip_address port_number\n", basename( argv[0] ) );
+        conf.usage( basename( argv[0] ) );
         return 1;
     }
-    const char* ip = argv[1];
-    int port = atoi( argv[2] );
+    const char* ip = conf.ip;
+    int port = conf.port;
 
-    // cout << "123" << endl;
-    // 创建sql数据库连接池 
-    sqlconnpool* connpool = sqlconnpool::get_instance();
-    connpool->init("localhost", "yim", "123456", "WebDB", 3306, 8);
-    // cout << "123" << endl;
+    // 选择凭据存储后端
+    user_store* store = NULL;
+    sqlbatcher* batcher = sqlbatcher::get_instance();
+    if( conf.store_path )
+    {
+        // 内嵌存储，不连接MySQL
+        log_store* lstore = new log_store;
+        if( !lstore->open( conf.store_path, true ) )
+        {
+            printf( "open user store %s failed\n", conf.store_path );
+            return 1;
+        }
+        store = lstore;
+    }
+    else
+    {
+        // 创建sql数据库连接池 
+        sqlconnpool* connpool = sqlconnpool::get_instance();
+        // 数据库连不上时不退出，降级为只提供静态资源
+        connpool->init(conf.db_host, "yim", "123456", "WebDB", conf.db_port, conf.min_conn, conf.max_conn);
+        // 工作线程数和连接数相当时，每个线程独占一个连接，绕过连接池的锁
+        connpool->set_affine( conf.affine_conn );
+        // 读写分离，登录查询分散到各个只读副本
+        sqlrouter::get_instance()->init( connpool, conf.replica_hosts, conf.replica_ports,
+                                         "yim", "123456", "WebDB", conf.min_conn, conf.max_conn, conf.affine_conn );
+
+        // 开启合并时，登录注册请求交给sqlbatcher
+        if( conf.sql_batch )
+        {
+            try
+            {
+                batcher->init( connpool, conf.batch_size, conf.batch_window );
+            }
+            catch( ... )
+            {
+                return 1;
+            }
+        }
+        store = new mysql_store( conf.sql_batch );
+    }
+    // 用户名过滤器挡在后端前面，不存在的用户登录不访问后端
+    if( conf.filter_kb > 0 )
+    {
+        store = new bloom_store( store, ( size_t )conf.filter_kb * 1024 * 8 );
+    }
+    http_conn::m_store = store;
 
     // 创建线程池
     threadpool< http_conn >* pool = NULL;
     try
     {
-        // 线程池中有一个指向数据库连接池的指针
-        pool = new threadpool< http_conn >(connpool);
+        pool = new threadpool< http_conn >;
     }
     catch( ... )
     {
         return 1;
     }
+
+    // 慢请求日志
+    slow_log::get_instance()->init( conf.slow_ms, conf.slow_per_sec, conf.slow_sample );
+
+    // 流量抓取
+    if( conf.capture_path && !traffic_capture::get_instance()->open( conf.capture_path, conf.capture_sample ) )
+    {
+        printf( "cannot open capture file %s\n", conf.capture_path );
+        return 1;
+    }
+
+    // 过载保护
+    admission::get_instance()->init( conf.max_queue, conf.queue_ms, conf.accept_rate );
+    // 按客户端IP限速
+    ip_limiter::get_instance()->init( conf.ip_rate, conf.ip_burst, conf.ip_conns );
+    // 连接数超过高水位时回收空闲连接
+    admission::get_instance()->init_idle( MAX_FD, conf.idle_high, 3 * TIMESLOT );
+
+    // 访问日志
+    if( conf.access_path && !access_log::get_instance()->init( conf.access_path, conf.rotate_mb, conf.rotate_s ) )
+    {
+        printf( "cannot open access log %s\n", conf.access_path );
+        return 1;
+    }
+
+    // 反向代理规则和上游健康检查
+    proxy* px = proxy::get_instance();
+    for( size_t i = 0; i < conf.proxy_routes.size(); ++i )
+    {
+        if( !px->add_route( conf.proxy_routes[i].c_str() ) )
+        {
+            printf( "bad proxy route %s\n", conf.proxy_routes[i].c_str() );
+            return 1;
+        }
+    }
+    if( px->enabled() && !px->start( conf.check_path, conf.check_interval ) )
+    {
+        printf( "cannot start upstream health checks\n" );
+        return 1;
+    }
+
+    // 站点打包文件，启动时加载一次
+    site_pack* pack = site_pack::get_instance();
+    if( conf.pack_path )
+    {
+        site_pack::LOAD_MODE mode = site_pack::LOAD_MAP;
+        if( strcmp( conf.pack_load, "populate" ) == 0 )
+        {
+            mode = site_pack::LOAD_POPULATE;
+        }
+        else if( strcmp( conf.pack_load, "hugepage" ) == 0 )
+        {
+            mode = site_pack::LOAD_HUGEPAGE;
+        }
+        if( !pack->open( conf.pack_path, mode, conf.pack_lock ) )
+        {
+            return 1;
+        }
+    }
+
+    // 指标页面
+    http_conn::m_metrics_path = conf.metrics_path;
+    metrics* stat = metrics::get_instance();
+    stat->add_gauge( "webserver_connections", "Open client connections", gauge_user_count, NULL );
+    stat->add_gauge( "webserver_queue_depth", "Requests waiting in the thread pool queue", gauge_queue_size, pool );
+    stat->add_gauge( "webserver_idle_timeout_seconds", "Idle timeout currently given to keep-alive connections", gauge_idle_timeout, NULL );
+    if( pack->enabled() )
+    {
+        stat->add_gauge( "webserver_pack_files", "Files in the loaded site pack", gauge_pack_files, NULL );
+    }
+    if( px->enabled() )
+    {
+        stat->add_gauge( "webserver_proxy_healthy_upstreams", "Upstreams that passed the last health check", gauge_proxy_healthy, NULL );
+    }
+    if( ip_limiter::get_instance()->enabled() )
+    {
+        stat->add_gauge( "webserver_ip_limit_entries", "Client IPs tracked by the per-IP limiter", gauge_ip_entries, NULL );
+    }
+    if( !conf.store_path )
+    {
+        stat->add_gauge( "webserver_db_busy_connections", "Primary pool connections in use", gauge_db_busy, NULL );
+        stat->add_gauge( "webserver_db_connections", "Primary pool connections open", gauge_db_total, NULL );
+        stat->add_gauge( "webserver_db_available", "1 when the primary database is reachable", gauge_db_available, NULL );
+    }
+
     // 预先为每个可能的客户连接分配一个http_conn对象
-    http_conn* users = new http_conn[ MAX_FD ];
+    users = new http_conn[ MAX_FD ];
     assert( users );
     int user_count = 0;
 
@@ -143,12 +355,34 @@ int main( int argc, char* argv[] )
     ret = listen( listenfd, 5 );
     assert( ret >= 0 );
 
+    // HTTPS监听socket，和明文端口共用事件循环
+    int tls_listenfd = -1;
+    if( conf.tls_port )
+    {
+        if( !tls_context::get_instance()->init( conf.tls_cert, conf.tls_key ) )
+        {
+            printf( "cannot load certificate %s and key %s\n", conf.tls_cert, conf.tls_key );
+            return 1;
+        }
+        tls_listenfd = socket( PF_INET, SOCK_STREAM, 0 );
+        assert( tls_listenfd >= 0 );
+        address.sin_port = htons( conf.tls_port );
+        ret = bind( tls_listenfd, ( struct sockaddr* )&address, sizeof( address ) );
+        assert( ret >= 0 );
+        ret = listen( tls_listenfd, 5 );
+        assert( ret >= 0 );
+    }
+
     // 创建内核时间表
     epoll_event events[ MAX_EVENT_NUMBER ];
     epollfd = epoll_create( 5 );
     assert( epollfd != -1 );
     // 监听socket注册到内核事件表
     addfd( epollfd, listenfd, false, LT );
+    if( tls_listenfd >= 0 )
+    {
+        addfd( epollfd, tls_listenfd, false, LT );
+    }
     // 静态的，初始化
     http_conn::m_epollfd = epollfd;
 
@@ -170,36 +404,135 @@ int main( int argc, char* argv[] )
     alarm(TIMESLOT);
 
     bool stop_server = false;
+    if( conf.io_uring )
+    {
+        uring_loop* loop = uring_loop::get_instance();
+        if( loop->init( 4096, conf.sqpoll ) )
+        {
+            // io_uring事件循环代替下面的epoll循环，收到SIGTERM后返回
+            http_conn::m_loop = loop;
+            loop->run( listenfd, pipefd[0], users, users_timer, MAX_FD, &lst_timer, pool, timer_hander );
+            stop_server = true;
+        }
+        else
+        {
+            printf( "io_uring unavailable, using epoll\n" );
+        }
+    }
+    if( conf.coroutine )
+    {
+        co_loop* loop = co_loop::get_instance();
+        if( loop->init() )
+        {
+            // 协程事件循环代替下面的epoll循环，共用同一个epollfd
+            http_conn::m_loop = loop;
+            loop->run( epollfd, listenfd, pipefd[0], users, users_timer, MAX_FD, &lst_timer, pool, timer_hander );
+            stop_server = true;
+        }
+    }
+    admission* adm = admission::get_instance();
+    ip_limiter* limiter = ip_limiter::get_instance();
+    // 监听socket是否因为accept限速暂停
+    bool accept_paused = false;
+    // 本轮事件处理完之后要关闭的空闲连接数
+    int evict = 0;
     while(!stop_server)
     {
-        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, -1 );
+        // 暂停监听时每10ms检查一次令牌
+        int number = epoll_wait( epollfd, events, MAX_EVENT_NUMBER, accept_paused ? 10 : -1 );
         if ( ( number < 0 ) && ( errno != EINTR ) )
         {
             printf( "epoll failure\n" );
             break;
         }
+        if( number > 0 )
+        {
+            stat->inc( M_EPOLL_WAKEUPS );
+            stat->observe( H_EPOLL_EVENTS, number );
+        }
+        if( accept_paused && adm->accept_ready() )
+        {
+            set_listening( listenfd, true );
+            set_listening( tls_listenfd, true );
+            accept_paused = false;
+        }
 
         for ( int i = 0; i < number; i++ )
         {
             int sockfd = events[i].data.fd;
-            if( sockfd == listenfd )
+            if( sockfd < 0 )
+            {
+                // 反向代理等待的上游socket可读，标记是-1-客户连接的fd，连接交回线程池继续转发
+                sockfd = -1 - sockfd;
+                util_timer* timer = users_timer[sockfd].timer;
+                if( !users[sockfd].relaying() || !timer )
+                {
+                    // 客户连接已经关闭，上游socket随之关闭，这是同一轮中残留的事件
+                }
+                else if( dispatch( pool, sockfd ) )
+                {
+                    timer->expire = time( NULL ) + adm->idle_timeout( http_conn::m_user_count );
+                    lst_timer.adjust_timer( timer );
+                }
+                else
+                {
+                    timer->cb_func( &users_timer[sockfd] );
+                    lst_timer.del_timer( timer );
+                }
+            }
+            else if( sockfd == listenfd || sockfd == tls_listenfd )
             {
                 // cout << "new client" << endl;
+                if( !adm->accept_allowed() )
+                {
+                    // 令牌用完，暂停监听，新连接在backlog中等待
+                    set_listening( listenfd, false );
+                    set_listening( tls_listenfd, false );
+                    accept_paused = true;
+                    stat->inc( M_ACCEPT_THROTTLED );
+                    continue;
+                }
                 struct sockaddr_in client_address;
                 socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
+                int connfd = accept( sockfd, ( struct sockaddr* )&client_address, &client_addrlength );
                 if ( connfd < 0 )
                 {
                     printf( "errno is: %d\n", errno );
+                    if( errno == EMFILE || errno == ENFILE )
+                    {
+                        evict = adm->evict_count( http_conn::m_user_count, true );
+                    }
                     continue;
                 }
+                stat->inc( M_ACCEPTS );
+                PROBE2( accept, connfd, client_address.sin_addr.s_addr );
+                evict = adm->evict_count( http_conn::m_user_count + 1, false );
+                // HTTPS连接还没有握手，不能回复明文，只计数并关闭
+                int reply_fd = sockfd == tls_listenfd ? -1 : connfd;
                 if( http_conn::m_user_count >= MAX_FD )
                 {
-                    show_error( connfd, "Internal server busy" );
+                    adm->reject( reply_fd, M_SHED_CONNECTIONS );
+                    close( connfd );
+                    continue;
+                }
+                if( !limiter->connect( client_address.sin_addr.s_addr ) )
+                {
+                    adm->reject( reply_fd, M_CONN_LIMITED );
+                    close( connfd );
                     continue;
                 }
                 // 初始化客户端连接
                 users[connfd].init( connfd, client_address );
+                if( sockfd == tls_listenfd )
+                {
+                    SSL* ssl = tls_context::get_instance()->accept( connfd );
+                    if( !ssl )
+                    {
+                        users[connfd].close_conn();
+                        continue;
+                    }
+                    users[connfd].start_tls( ssl );
+                }
                 
                 // 初始化client_data
                 users_timer[connfd].address = client_address;
@@ -208,7 +541,7 @@ int main( int argc, char* argv[] )
                 timer->user_data = &users_timer[connfd];
                 timer->cb_func = cb_func;
                 time_t cur_time = time(NULL);
-                timer->expire = cur_time + 3 * TIMESLOT;
+                timer->expire = cur_time + adm->idle_timeout( http_conn::m_user_count );
                 users_timer[connfd].timer = timer;
                 lst_timer.add_timer(timer);                 
             }
@@ -218,6 +551,7 @@ int main( int argc, char* argv[] )
                 // users[sockfd].close_conn();
                 // 首先调用回调函数，删除注册的socket并且关闭socket，然后移除定时器
                 util_timer* timer = users_timer[sockfd].timer;
+                users[sockfd].peer_closed();
                 timer->cb_func(&users_timer[sockfd]);
                 if(timer) 
                     lst_timer.del_timer(timer);
@@ -256,14 +590,32 @@ int main( int argc, char* argv[] )
             {
                 util_timer* timer = users_timer[sockfd].timer;
                 // 根据读的结果，决定是讲任务加入到线程池，还是关闭连接
-                if( users[sockfd].read() )
+                uint64_t start = metrics::now_us();
+                bool read_ret = users[sockfd].read();
+                uint64_t read_us = metrics::now_us() - start;
+                stat->observe( H_READ, read_us );
+                PROBE3( read, sockfd, read_ret, read_us );
+                // 客户端请求过快回复429，过载回复503，都由主线程直接回复并关闭连接，不进入线程池
+                if( read_ret && ( users[sockfd].handshaking() || users[sockfd].no_data() ) )
                 {
-                    pool->append( users + sockfd );
-                    
-                    // 有数据传输，定时器延后3个TIMESLOT
+                    // TLS握手还没完成或者没有读到请求数据，read()已经重新注册了事件，不计入请求速率
+                }
+                else if( read_ret && !users[sockfd].in_body() && !limiter->request( users_timer[sockfd].address.sin_addr.s_addr ) )
+                {
+                    users[sockfd].reject( M_RATE_LIMITED );
+                    read_ret = false;
+                }
+                else if( read_ret && !( adm->admit( pool->queue_size() ) && dispatch( pool, sockfd ) ) )
+                {
+                    users[sockfd].reject( M_SHED_REQUESTS );
+                    read_ret = false;
+                }
+                if( read_ret )
+                {
+                    // 有数据传输，定时器延后，连接多时延后的时间缩短
                     if(timer){
                         time_t cur_time = time(NULL);
-                        timer->expire = cur_time + 3 * TIMESLOT;
+                        timer->expire = cur_time + adm->idle_timeout( http_conn::m_user_count );
                         lst_timer.adjust_timer(timer);
                     }
                 }
@@ -286,11 +638,17 @@ int main( int argc, char* argv[] )
                 //     users[sockfd].close_conn();
                 // }
                 util_timer* timer = users_timer[sockfd].timer;
-                if(users[sockfd].write()){
-                    // 有数据传输，定时器延后3个TIMESLOT
+                uint64_t start = metrics::now_us();
+                // 反向代理的消息体交回线程池继续转发，其他响应由主线程发送
+                bool write_ret = users[sockfd].relaying() ? dispatch( pool, sockfd ) : users[sockfd].write();
+                uint64_t write_us = metrics::now_us() - start;
+                stat->observe( H_WRITE, write_us );
+                PROBE3( write_done, sockfd, write_ret, write_us );
+                if(write_ret){
+                    // 有数据传输，定时器延后，连接多时延后的时间缩短
                     if(timer){
                         time_t cur_time = time(NULL);
-                        timer->expire = cur_time + 3 * TIMESLOT;
+                        timer->expire = cur_time + adm->idle_timeout( http_conn::m_user_count );
                         lst_timer.adjust_timer(timer);
                     }
                 }
@@ -308,15 +666,29 @@ int main( int argc, char* argv[] )
             timer_hander();
             timeout = false;
         }
+        // 和tick一样在本轮事件处理完之后关闭，不会关掉本轮还要处理的连接
+        if( evict ){
+            stat->inc( M_IDLE_EVICTED, lst_timer.evict( evict, http_conn::idle_cb, users ) );
+            evict = 0;
+        }
     }
 
     close(epollfd);
     close(listenfd);
+    if( tls_listenfd >= 0 )
+    {
+        close( tls_listenfd );
+    }
     close(pipefd[1]);
     close(pipefd[0]);
     delete[] users;
     delete[] users_timer;
     delete pool;
+    px->stop();
+    batcher->stop();
+    delete store;
+    traffic_capture::get_instance()->close();
+    access_log::get_instance()->stop();
     // cout << "close done!" << endl;
     return 0;
 }
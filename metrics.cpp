@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "metrics.h"
+
+__thread metrics::shard* metrics::t_shard = NULL;
+
+// 输出的最大桶边界，约67秒
+static const uint64_t MAX_LE = 1ULL << 26;
+
+struct metric_desc
+{
+    const char* name;
+    const char* help;
+};
+
+static const metric_desc counter_desc[ M_COUNTER_MAX ] =
+{
+    { "webserver_accepts_total", "Accepted connections" },
+    { "webserver_requests_total", "Fully parsed requests" },
+    { "webserver_sent_bytes_total", "Bytes written to clients" },
+    { "webserver_timer_expirations_total", "Connections closed by the idle timer" },
+    { "webserver_epoll_wakeups_total", "epoll_wait returns in the main loop" },
+    { "webserver_slow_requests_total", "Requests over the slow-request threshold" },
+    { "webserver_access_log_dropped_total", "Access log records dropped because the buffer was full" },
+    { "webserver_shed_requests_total", "Requests answered with 503 because the worker queue was overloaded" },
+    { "webserver_shed_connections_total", "Connections answered with 503 because the connection table was full" },
+    { "webserver_accept_throttled_total", "Times the listener was paused by the accept rate limit" },
+    { "webserver_rate_limited_total", "Requests answered with 429 because the client IP exceeded its request rate" },
+    { "webserver_conn_limited_total", "Connections answered with 429 because the client IP exceeded its connection limit" },
+    { "webserver_idle_evicted_total", "Idle keep-alive connections closed because open connections crossed the high-water mark" },
+    { "webserver_tls_handshakes_total", "Completed TLS handshakes" },
+    { "webserver_tls_resumed_total", "TLS handshakes that resumed a session from a ticket or the session cache" },
+    { "webserver_tls_failed_total", "TLS handshakes that failed" },
+    { "webserver_tls_ktls_tx_total", "TLS connections whose record encryption was offloaded to the kernel" },
+    { "webserver_tls_ktls_rx_total", "TLS connections whose record decryption was offloaded to the kernel" },
+    { "webserver_h2_connections_total", "Connections that switched to HTTP/2 after the connection preface" },
+    { "webserver_h2_streams_total", "Requests served as HTTP/2 streams" },
+    { "webserver_proxy_requests_total", "Requests forwarded to an upstream" },
+    { "webserver_proxy_failed_total", "Forwarded requests answered with 502" },
+    { "webserver_proxy_connects_total", "Connections opened to upstreams" },
+    { "webserver_proxy_spliced_bytes_total", "Upstream response bytes relayed to clients with splice" },
+    { "webserver_pack_hits_total", "Requests served from the site pack" },
+    { "webserver_pack_gzip_total", "Site pack responses that sent the precompressed gzip variant" },
+    { "webserver_not_modified_total", "Requests answered with 304 because If-None-Match matched the ETag" },
+    { "webserver_db_wait_timeouts_total", "Database pool acquisitions that timed out, primary and replicas" },
+};
+
+static const metric_desc hist_desc[ H_HIST_MAX ] =
+{
+    { "webserver_read_seconds", "Time spent in http_conn::read on the main thread" },
+    { "webserver_parse_seconds", "Time spent parsing a request, excluding do_request" },
+    { "webserver_process_seconds", "Time spent in do_request (filesystem and database)" },
+    { "webserver_write_seconds", "Time spent in http_conn::write on the main thread" },
+    { "webserver_queue_wait_seconds", "Time a request waited in the thread pool queue" },
+    { "webserver_db_wait_seconds", "Time waiting for a database pool connection" },
+    { "webserver_db_query_seconds", "Database query time" },
+    { "webserver_epoll_events", "Events returned per epoll_wait" },
+};
+
+metrics* metrics::get_instance()
+{
+    static metrics m;
+    return &m;
+}
+
+metrics::shard* metrics::create_shard()
+{
+    shard* s = new shard;
+    memset( s, 0, sizeof( shard ) );
+    m_lock.lock();
+    m_shards.push_back( s );
+    m_lock.unlock();
+    return s;
+}
+
+void metrics::add_gauge( const char* name, const char* help, gauge_fn fn, void* arg )
+{
+    gauge g = { name, help, fn, arg };
+    m_lock.lock();
+    m_gauges.push_back( g );
+    m_lock.unlock();
+}
+
+uint64_t metrics::bucket_upper( int b )
+{
+    if( b < SUB_BUCKETS )
+    {
+        return b;
+    }
+    int e = b / SUB_BUCKETS + SUB_BITS - 1;
+    int sub = b % SUB_BUCKETS;
+    uint64_t width = 1ULL << ( e - SUB_BITS );
+    return ( ( uint64_t )( SUB_BUCKETS + sub ) << ( e - SUB_BITS ) ) + width - 1;
+}
+
+static void append( string& out, const char* format, ... ) __attribute__(( format( printf, 2, 3 ) ));
+static void append( string& out, const char* format, ... )
+{
+    char buf[ 256 ];
+    va_list arg_list;
+    va_start( arg_list, format );
+    int len = vsnprintf( buf, sizeof( buf ), format, arg_list );
+    va_end( arg_list );
+    if( len > 0 )
+    {
+        out.append( buf, len < ( int )sizeof( buf ) ? len : sizeof( buf ) - 1 );
+    }
+}
+
+void metrics::scrape( string& out )
+{
+    uint64_t counters[ M_COUNTER_MAX ] = { 0 };
+    vector< uint64_t > buckets( H_HIST_MAX * BUCKETS, 0 );
+    uint64_t sums[ H_HIST_MAX ] = { 0 };
+
+    m_lock.lock();
+    for( size_t i = 0; i < m_shards.size(); ++i )
+    {
+        shard* s = m_shards[i];
+        for( int c = 0; c < M_COUNTER_MAX; ++c )
+        {
+            counters[c] += __atomic_load_n( &s->counters[c], __ATOMIC_RELAXED );
+        }
+        for( int h = 0; h < H_HIST_MAX; ++h )
+        {
+            for( int b = 0; b < BUCKETS; ++b )
+            {
+                buckets[ h * BUCKETS + b ] += __atomic_load_n( &s->buckets[h][b], __ATOMIC_RELAXED );
+            }
+            sums[h] += __atomic_load_n( &s->sums[h], __ATOMIC_RELAXED );
+        }
+    }
+    vector< gauge > gauges = m_gauges;
+    m_lock.unlock();
+
+    for( int c = 0; c < M_COUNTER_MAX; ++c )
+    {
+        append( out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_desc[c].name, counter_desc[c].help,
+                counter_desc[c].name, counter_desc[c].name, ( unsigned long long )counters[c] );
+    }
+
+    // 输出时把细分的桶合并到2的幂边界上
+    for( int h = 0; h < H_HIST_MAX; ++h )
+    {
+        const char* name = hist_desc[h].name;
+        // 事件数直方图没有单位，其余从微秒换算成秒
+        double scale = h == H_EPOLL_EVENTS ? 1.0 : 1e-6;
+        append( out, "# HELP %s %s\n# TYPE %s histogram\n", name, hist_desc[h].help, name );
+        uint64_t* hb = &buckets[ h * BUCKETS ];
+        uint64_t cumulative = 0;
+        uint64_t total = 0;
+        for( int b = 0; b < BUCKETS; ++b )
+        {
+            total += hb[b];
+        }
+        for( int b = 0; b < BUCKETS; ++b )
+        {
+            cumulative += hb[b];
+            uint64_t upper = bucket_upper( b );
+            if( upper >= MAX_LE )
+            {
+                break;
+            }
+            // 只在2的幂减一处输出，每次抓取的桶边界固定；记录的是整数，小于2^k即不大于2^k-1，le取2^k-1
+            if( ( upper & ( upper + 1 ) ) == 0 )
+            {
+                append( out, "%s_bucket{le=\"%g\"} %llu\n", name, upper * scale, ( unsigned long long )cumulative );
+            }
+        }
+        append( out, "%s_bucket{le=\"+Inf\"} %llu\n", name, ( unsigned long long )total );
+        append( out, "%s_sum %g\n%s_count %llu\n", name, sums[h] * scale, name, ( unsigned long long )total );
+
+        // 细分桶估算的分位数
+        static const double quantiles[] = { 0.5, 0.99, 0.999 };
+        append( out, "# TYPE %s_quantile gauge\n", name );
+        for( size_t q = 0; q < sizeof( quantiles ) / sizeof( quantiles[0] ); ++q )
+        {
+            uint64_t rank = ( uint64_t )( quantiles[q] * total );
+            uint64_t seen = 0;
+            uint64_t value = 0;
+            for( int b = 0; b < BUCKETS && total > 0; ++b )
+            {
+                seen += hb[b];
+                if( seen > rank )
+                {
+                    value = bucket_upper( b );
+                    break;
+                }
+            }
+            append( out, "%s_quantile{quantile=\"%g\"} %g\n", name, quantiles[q], value * scale );
+        }
+    }
+
+    for( size_t i = 0; i < gauges.size(); ++i )
+    {
+        append( out, "# HELP %s %s\n# TYPE %s gauge\n%s %g\n", gauges[i].name, gauges[i].help,
+                gauges[i].name, gauges[i].name, gauges[i].fn( gauges[i].arg ) );
+    }
+}
@@ -0,0 +1,148 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include "locker.h"
+
+using namespace std;
+
+// 计数器
+enum metric_counter
+{
+    M_ACCEPTS = 0,          // 接受的连接数
+    M_REQUESTS,             // 解析完成的请求数
+    M_BYTES_SENT,           // 发送的字节数
+    M_TIMER_EXPIRED,        // 超时关闭的连接数
+    M_EPOLL_WAKEUPS,        // epoll_wait返回次数
+    M_SLOW_REQUESTS,        // 超过慢请求阈值的请求数
+    M_ACCESS_DROPPED,       // 访问日志缓冲满丢弃的记录数
+    M_SHED_REQUESTS,        // 过载时直接回复503的请求数
+    M_SHED_CONNECTIONS,     // 连接数达到上限时回复503的连接数
+    M_ACCEPT_THROTTLED,     // accept令牌用完暂停监听的次数
+    M_RATE_LIMITED,         // 单个IP请求过快回复429的请求数
+    M_CONN_LIMITED,         // 单个IP连接数超过上限回复429的连接数
+    M_IDLE_EVICTED,         // 连接数超过高水位时关闭的空闲连接数
+    M_TLS_HANDSHAKES,       // 完成的TLS握手数
+    M_TLS_RESUMED,          // 其中复用会话的握手数
+    M_TLS_FAILED,           // 失败的TLS握手数
+    M_TLS_KTLS_TX,          // 内核接管发送方向加密的连接数
+    M_TLS_KTLS_RX,          // 内核接管接收方向解密的连接数
+    M_H2_CONNECTIONS,       // HTTP/2连接数
+    M_H2_STREAMS,           // HTTP/2连接上处理的请求(流)数
+    M_PROXY_REQUESTS,       // 转发给上游的请求数
+    M_PROXY_FAILED,         // 上游不可用或响应无效，回复502的请求数
+    M_PROXY_CONNECTS,       // 新建的上游连接数
+    M_PROXY_SPLICED,        // 经管道splice给客户的响应字节数
+    M_PACK_HITS,            // 从打包文件返回的请求数
+    M_PACK_GZIP,            // 其中返回gzip变体的请求数
+    M_NOT_MODIFIED,         // ETag匹配回复304的请求数
+    M_DB_WAIT_TIMEOUTS,     // 从连接池获取连接等待超时的次数，主库和从库都计入
+    M_COUNTER_MAX
+};
+
+// 直方图，除M_EPOLL_EVENTS外单位都是微秒
+enum metric_hist
+{
+    H_READ = 0,             // 主线程read()耗时
+    H_PARSE,                // 解析请求耗时(不含do_request)
+    H_PROCESS,              // do_request耗时，文件系统和数据库
+    H_WRITE,                // 主线程write()耗时
+    H_QUEUE_WAIT,           // 请求在线程池队列中等待的时间
+    H_DB_WAIT,              // 从连接池获取连接的等待时间
+    H_DB_QUERY,             // 数据库查询耗时
+    H_EPOLL_EVENTS,         // 每次epoll_wait返回的事件数
+    H_HIST_MAX
+};
+
+// 服务器运行指标
+// 每个线程写自己的分片，只有一个写者，不加锁也不需要原子读改写
+// 抓取时把所有分片加起来，输出Prometheus文本格式
+// 直方图按HDR的方式分桶：每个2的幂区间再等分成4个子桶，相对误差不超过25%
+class metrics
+{
+public:
+    typedef double ( *gauge_fn )( void* arg );
+
+    static metrics* get_instance();
+    // 单调时钟，微秒
+    static uint64_t now_us()
+    {
+        struct timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ( uint64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    void inc( metric_counter c, uint64_t n = 1 )
+    {
+        shard* s = local();
+        __atomic_store_n( &s->counters[c], s->counters[c] + n, __ATOMIC_RELAXED );
+    }
+    void observe( metric_hist h, uint64_t v )
+    {
+        shard* s = local();
+        int b = bucket_of( v );
+        __atomic_store_n( &s->buckets[h][b], s->buckets[h][b] + 1, __ATOMIC_RELAXED );
+        __atomic_store_n( &s->sums[h], s->sums[h] + v, __ATOMIC_RELAXED );
+    }
+    // 注册一个抓取时才计算的瞬时值，如队列长度、连接池状态
+    void add_gauge( const char* name, const char* help, gauge_fn fn, void* arg );
+    // 汇总所有线程的数据，追加到out
+    void scrape( string& out );
+
+private:
+    metrics() {}
+
+    static const int SUB_BITS = 2;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS = 64 * SUB_BUCKETS;
+
+    struct shard
+    {
+        uint64_t counters[ M_COUNTER_MAX ];
+        uint64_t buckets[ H_HIST_MAX ][ BUCKETS ];
+        uint64_t sums[ H_HIST_MAX ];
+    };
+    struct gauge
+    {
+        const char* name;
+        const char* help;
+        gauge_fn fn;
+        void* arg;
+    };
+
+    // 当前线程的分片，第一次使用时创建并登记
+    shard* local()
+    {
+        if( !t_shard )
+        {
+            t_shard = create_shard();
+        }
+        return t_shard;
+    }
+    shard* create_shard();
+
+    static int bucket_of( uint64_t v )
+    {
+        if( v < ( uint64_t )SUB_BUCKETS )
+        {
+            return v;
+        }
+        int e = 63 - __builtin_clzll( v );
+        int sub = ( v >> ( e - SUB_BITS ) ) & ( SUB_BUCKETS - 1 );
+        return ( e - SUB_BITS + 1 ) * SUB_BUCKETS + sub;
+    }
+    // 桶内的最大值
+    static uint64_t bucket_upper( int b );
+
+private:
+    static __thread shard* t_shard;
+
+    locker m_lock;              // 保护分片和瞬时值的登记
+    vector< shard* > m_shards;
+    vector< gauge > m_gauges;
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT静态探针，提供者名为webserver
+// 没有tracer附加时探针只是一条nop，参数已经在寄存器或栈上，不产生额外开销
+// 附加后可以直接用bpftrace/perf观察，例如：
+//   bpftrace -e 'usdt:./myServer:webserver:request { @[str(arg2)] = hist(arg3); }'
+//   perf probe -x ./myServer sdt_webserver:write
+//
+// 系统装了systemtap-sdt-dev时直接用<sys/sdt.h>，
+// 否则在x86_64/aarch64上自己生成同样格式的.note.stapsdt，其他平台探针为空
+
+#if defined( __has_include )
+#if __has_include( <sys/sdt.h> )
+#define PROBES_HAVE_SDT_H 1
+#endif
+#endif
+
+#if defined( PROBES_HAVE_SDT_H )
+
+#include <sys/sdt.h>
+
+#define PROBE0( name ) DTRACE_PROBE( webserver, name )
+#define PROBE1( name, a1 ) DTRACE_PROBE1( webserver, name, a1 )
+#define PROBE2( name, a1, a2 ) DTRACE_PROBE2( webserver, name, a1, a2 )
+#define PROBE3( name, a1, a2, a3 ) DTRACE_PROBE3( webserver, name, a1, a2, a3 )
+#define PROBE4( name, a1, a2, a3, a4 ) DTRACE_PROBE4( webserver, name, a1, a2, a3, a4 )
+
+#elif defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __aarch64__ ) )
+
+#include <type_traits>
+
+// 参数描述为"大小@位置"，有符号类型大小为负数，指针按无符号处理
+template< typename T >
+struct probe_arg
+{
+    static const int size = std::is_signed< T >::value ? -( int )sizeof( T ) : ( int )sizeof( T );
+};
+
+#define PROBE_ARG( n, x ) [_s##n] "n" ( probe_arg< __typeof__( x ) >::size ), [_a##n] "nor" ( x )
+#define PROBE_FMT( n ) "%c[_s" #n "]@%[_a" #n "]"
+
+// 和sys/sdt.h一样的note格式：探针地址、.stapsdt.base地址、信号量(0)、提供者、名字、参数
+#define PROBE_NOTE( name, fmt, ... )                                                \
+    __asm__ __volatile__(                                                          \
+        "990: nop\n"                                                               \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                              \
+        ".balign 4\n"                                                              \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                         \
+        "991: .asciz \"stapsdt\"\n"                                                \
+        "992: .balign 4\n"                                                         \
+        "993: .8byte 990b\n"                                                       \
+        ".8byte _.stapsdt.base\n"                                                  \
+        ".8byte 0\n"                                                               \
+        ".asciz \"webserver\"\n"                                                   \
+        ".asciz \"" #name "\"\n"                                                   \
+        ".asciz \"" fmt "\"\n"                                                     \
+        "994: .balign 4\n"                                                         \
+        ".popsection\n"                                                            \
+        ".ifndef _.stapsdt.base\n"                                                 \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"    \
+        ".weak _.stapsdt.base\n"                                                   \
+        ".hidden _.stapsdt.base\n"                                                 \
+        "_.stapsdt.base: .space 1\n"                                               \
+        ".size _.stapsdt.base, 1\n"                                                \
+        ".popsection\n"                                                            \
+        ".endif\n"                                                                 \
+        :: __VA_ARGS__ )
+
+#define PROBE0( name ) PROBE_NOTE( name, "", "i" ( 0 ) )
+#define PROBE1( name, a1 ) PROBE_NOTE( name, PROBE_FMT( 1 ), PROBE_ARG( 1, a1 ) )
+#define PROBE2( name, a1, a2 )                                                     \
+    PROBE_NOTE( name, PROBE_FMT( 1 ) " " PROBE_FMT( 2 ),                           \
+                PROBE_ARG( 1, a1 ), PROBE_ARG( 2, a2 ) )
+#define PROBE3( name, a1, a2, a3 )                                                 \
+    PROBE_NOTE( name, PROBE_FMT( 1 ) " " PROBE_FMT( 2 ) " " PROBE_FMT( 3 ),        \
+                PROBE_ARG( 1, a1 ), PROBE_ARG( 2, a2 ), PROBE_ARG( 3, a3 ) )
+#define PROBE4( name, a1, a2, a3, a4 )                                             \
+    PROBE_NOTE( name, PROBE_FMT( 1 ) " " PROBE_FMT( 2 ) " " PROBE_FMT( 3 ) " " PROBE_FMT( 4 ), \
+                PROBE_ARG( 1, a1 ), PROBE_ARG( 2, a2 ), PROBE_ARG( 3, a3 ), PROBE_ARG( 4, a4 ) )
+
+#else
+
+#define PROBE0( name ) do {} while( 0 )
+#define PROBE1( name, a1 ) do {} while( 0 )
+#define PROBE2( name, a1, a2 ) do {} while( 0 )
+#define PROBE3( name, a1, a2, a3 ) do {} while( 0 )
+#define PROBE4( name, a1, a2, a3, a4 ) do {} while( 0 )
+
+#endif
+
+#endif
@@ -0,0 +1,1090 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <algorithm>
+#include "proxy.h"
+#include "metrics.h"
+
+// 连接上游和健康检查的超时，毫秒
+static const int CONNECT_TIMEOUT_MS = 1000;
+static const int CHECK_TIMEOUT_MS = 2000;
+// 转发时等待上游读写的超时，毫秒；不等待上游数据的转发由客户连接的空闲定时器限制
+static const int IO_TIMEOUT_MS = 10000;
+// 响应头和分块大小行的长度上限
+static const size_t MAX_HEAD = 16384;
+static const size_t MAX_LINE = 1024;
+// 管道容量，超过系统上限时保持默认的64KB
+static const int PIPE_SIZE = 256 * 1024;
+// 消息体读进内存时每次recv的长度
+static const size_t READ_SIZE = 65536;
+
+static bool wait_fd( int fd, short events, int timeout_ms )
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = events;
+    pfd.revents = 0;
+    int ret;
+    do
+    {
+        ret = poll( &pfd, 1, timeout_ms );
+    } while( ret < 0 && errno == EINTR );
+    // POLLERR和POLLHUP由之后的读写报告
+    return ret > 0;
+}
+
+// 非阻塞连接，超时或失败返回-1
+static int connect_to( const sockaddr_in& addr )
+{
+    int fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+    if( fd < 0 )
+    {
+        return -1;
+    }
+    if( connect( fd, ( const struct sockaddr* )&addr, sizeof( addr ) ) < 0 )
+    {
+        int err = 0;
+        socklen_t len = sizeof( err );
+        if( errno != EINPROGRESS || !wait_fd( fd, POLLOUT, CONNECT_TIMEOUT_MS )
+            || getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len ) < 0 || err )
+        {
+            close( fd );
+            return -1;
+        }
+    }
+    // 长连接上的请求和响应都很短，不等Nagle合并
+    int nodelay = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof( nodelay ) );
+    return fd;
+}
+
+static bool header_is( const char* line, size_t name_len, const char* name )
+{
+    return strlen( name ) == name_len && strncasecmp( line, name, name_len ) == 0;
+}
+
+proxy* proxy::get_instance()
+{
+    static proxy p;
+    return &p;
+}
+
+proxy::proxy()
+{
+    m_rr = 0;
+    m_interval_s = 0;
+    m_running = false;
+}
+
+proxy::~proxy()
+{
+    stop();
+}
+
+upstream* proxy::find_upstream( const string& name )
+{
+    for( size_t i = 0; i < m_upstreams.size(); ++i )
+    {
+        if( m_upstreams[i]->name == name )
+        {
+            return m_upstreams[i];
+        }
+    }
+    size_t colon = name.rfind( ':' );
+    if( colon == string::npos || colon == 0 )
+    {
+        return NULL;
+    }
+    int port = atoi( name.c_str() + colon + 1 );
+    if( port <= 0 || port > 65535 )
+    {
+        return NULL;
+    }
+    // 启动时解析一次，之后只用地址
+    struct addrinfo hints;
+    struct addrinfo* res;
+    memset( &hints, 0, sizeof( hints ) );
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if( getaddrinfo( name.substr( 0, colon ).c_str(), NULL, &hints, &res ) != 0 )
+    {
+        return NULL;
+    }
+    upstream* u = new upstream;
+    u->name = name;
+    memcpy( &u->addr, res->ai_addr, sizeof( u->addr ) );
+    u->addr.sin_port = htons( port );
+    u->outstanding = 0;
+    u->healthy = true;
+    freeaddrinfo( res );
+    m_upstreams.push_back( u );
+    return u;
+}
+
+bool proxy::add_route( const char* spec )
+{
+    const char* eq = strchr( spec, '=' );
+    if( !eq || spec[0] != '/' )
+    {
+        return false;
+    }
+    route r;
+    r.prefix.assign( spec, eq - spec );
+    string list( eq + 1 );
+    size_t pos = 0;
+    while( pos <= list.size() )
+    {
+        size_t comma = list.find( ',', pos );
+        if( comma == string::npos )
+        {
+            comma = list.size();
+        }
+        upstream* u = find_upstream( list.substr( pos, comma - pos ) );
+        if( !u )
+        {
+            return false;
+        }
+        r.upstreams.push_back( u );
+        pos = comma + 1;
+    }
+    m_routes.push_back( r );
+    return true;
+}
+
+bool proxy::start( const char* check_path, int interval_s )
+{
+    m_check_path = check_path;
+    m_interval_s = interval_s;
+    if( interval_s == 0 )
+    {
+        return true;
+    }
+    m_running = true;
+    if( pthread_create( &m_thread, NULL, worker, this ) != 0 )
+    {
+        m_running = false;
+        return false;
+    }
+    return true;
+}
+
+void proxy::stop()
+{
+    if( m_running )
+    {
+        m_running = false;
+        pthread_join( m_thread, NULL );
+    }
+    for( size_t i = 0; i < m_upstreams.size(); ++i )
+    {
+        close_idle( m_upstreams[i] );
+    }
+    m_pipe_lock.lock();
+    for( size_t i = 0; i < m_pipes.size(); ++i )
+    {
+        close( m_pipes[i] );
+    }
+    m_pipes.clear();
+    m_pipe_lock.unlock();
+}
+
+int proxy::match( const char* url ) const
+{
+    int best = -1;
+    for( size_t i = 0; i < m_routes.size(); ++i )
+    {
+        const string& prefix = m_routes[i].prefix;
+        if( strncmp( url, prefix.c_str(), prefix.size() ) == 0
+            && ( best < 0 || prefix.size() > m_routes[ best ].prefix.size() ) )
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+upstream* proxy::pick( int route )
+{
+    const vector< upstream* >& ups = m_routes[ route ].upstreams;
+    // 从轮转位置开始找，未完成请求数相同时依次落到不同的上游
+    unsigned int start = __sync_fetch_and_add( &m_rr, 1 );
+    upstream* best = NULL;
+    int best_n = 0;
+    for( size_t i = 0; i < ups.size(); ++i )
+    {
+        upstream* u = ups[ ( start + i ) % ups.size() ];
+        if( !__atomic_load_n( &u->healthy, __ATOMIC_RELAXED ) )
+        {
+            continue;
+        }
+        int n = __atomic_load_n( &u->outstanding, __ATOMIC_RELAXED );
+        if( !best || n < best_n )
+        {
+            best = u;
+            best_n = n;
+        }
+    }
+    if( best )
+    {
+        __sync_fetch_and_add( &best->outstanding, 1 );
+    }
+    return best;
+}
+
+void proxy::done( upstream* u )
+{
+    __sync_fetch_and_sub( &u->outstanding, 1 );
+}
+
+void proxy::fail( upstream* u )
+{
+    // 不做健康检查时没有人能把它恢复，只丢弃空闲连接
+    if( m_interval_s > 0 )
+    {
+        __atomic_store_n( &u->healthy, false, __ATOMIC_RELAXED );
+    }
+    close_idle( u );
+}
+
+void proxy::close_idle( upstream* u )
+{
+    u->lock.lock();
+    for( size_t i = 0; i < u->idle.size(); ++i )
+    {
+        close( u->idle[i] );
+    }
+    u->idle.clear();
+    u->lock.unlock();
+}
+
+int proxy::acquire( upstream* u, bool& reused )
+{
+    u->lock.lock();
+    while( !u->idle.empty() )
+    {
+        int fd = u->idle.back();
+        u->idle.pop_back();
+        u->lock.unlock();
+        // 空闲期间被上游关闭的连接读到EOF或错误，正常的长连接此时没有数据可读
+        char c;
+        if( recv( fd, &c, 1, MSG_PEEK | MSG_DONTWAIT ) < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+        {
+            reused = true;
+            return fd;
+        }
+        close( fd );
+        u->lock.lock();
+    }
+    u->lock.unlock();
+    reused = false;
+    int fd = connect_to( u->addr );
+    if( fd >= 0 )
+    {
+        metrics::get_instance()->inc( M_PROXY_CONNECTS );
+    }
+    return fd;
+}
+
+void proxy::release( upstream* u, int fd )
+{
+    u->lock.lock();
+    if( u->idle.size() < MAX_IDLE )
+    {
+        u->idle.push_back( fd );
+        fd = -1;
+    }
+    u->lock.unlock();
+    if( fd >= 0 )
+    {
+        close( fd );
+    }
+}
+
+bool proxy::get_pipe( int fds[2] )
+{
+    m_pipe_lock.lock();
+    if( !m_pipes.empty() )
+    {
+        fds[1] = m_pipes.back();
+        m_pipes.pop_back();
+        fds[0] = m_pipes.back();
+        m_pipes.pop_back();
+        m_pipe_lock.unlock();
+        return true;
+    }
+    m_pipe_lock.unlock();
+    if( pipe2( fds, O_NONBLOCK | O_CLOEXEC ) < 0 )
+    {
+        return false;
+    }
+    fcntl( fds[1], F_SETPIPE_SZ, PIPE_SIZE );
+    return true;
+}
+
+void proxy::put_pipe( const int fds[2] )
+{
+    m_pipe_lock.lock();
+    m_pipes.push_back( fds[0] );
+    m_pipes.push_back( fds[1] );
+    m_pipe_lock.unlock();
+}
+
+int proxy::healthy_count()
+{
+    int n = 0;
+    for( size_t i = 0; i < m_upstreams.size(); ++i )
+    {
+        n += __atomic_load_n( &m_upstreams[i]->healthy, __ATOMIC_RELAXED ) ? 1 : 0;
+    }
+    return n;
+}
+
+void* proxy::worker( void* arg )
+{
+    proxy* p = ( proxy* )arg;
+    p->run();
+    return p;
+}
+
+void proxy::run()
+{
+    while( m_running )
+    {
+        for( size_t i = 0; i < m_upstreams.size(); ++i )
+        {
+            upstream* u = m_upstreams[i];
+            bool ok = check( u );
+            if( ok != __atomic_load_n( &u->healthy, __ATOMIC_RELAXED ) )
+            {
+                printf( "upstream %s is %s\n", u->name.c_str(), ok ? "up" : "down" );
+                fflush( stdout );
+                __atomic_store_n( &u->healthy, ok, __ATOMIC_RELAXED );
+            }
+            if( !ok )
+            {
+                close_idle( u );
+            }
+        }
+        // 每100ms看一次是否要停止
+        for( int i = 0; i < m_interval_s * 10 && m_running; ++i )
+        {
+            usleep( 100000 );
+        }
+    }
+}
+
+bool proxy::check( upstream* u )
+{
+    int fd = connect_to( u->addr );
+    if( fd < 0 )
+    {
+        return false;
+    }
+    char buf[ 512 ];
+    int len = snprintf( buf, sizeof( buf ), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                        m_check_path.c_str(), u->name.c_str() );
+    bool ok = false;
+    if( len < ( int )sizeof( buf ) && send( fd, buf, len, MSG_NOSIGNAL ) == len && wait_fd( fd, POLLIN, CHECK_TIMEOUT_MS ) )
+    {
+        ssize_t n = recv( fd, buf, sizeof( buf ) - 1, 0 );
+        int major, minor, status;
+        if( n > 0 )
+        {
+            buf[n] = '\0';
+            ok = sscanf( buf, "HTTP/%d.%d %d", &major, &minor, &status ) == 3 && status >= 200 && status < 500;
+        }
+    }
+    close( fd );
+    return ok;
+}
+
+proxy_exchange::proxy_exchange()
+{
+    m_upstream = NULL;
+    m_fd = -1;
+    m_keep_alive = false;
+    m_received = false;
+    m_uploading = false;
+    m_upload_chunked = false;
+    m_head_done = false;
+    m_reused = false;
+    m_attempt = 0;
+    m_wait = true;
+    m_blocked = false;
+    m_epollfd = -1;
+    m_status = 0;
+    m_length = -1;
+    m_chunked = false;
+    m_state = BODY_DONE;
+    m_remaining = 0;
+    m_pipe[0] = -1;
+    m_pipe[1] = -1;
+    m_in_pipe = 0;
+    m_pipe_size = 0;
+}
+
+bool proxy_exchange::start( int route, const char* method, const char* url, const char* host,
+                            const string& headers, const string& body )
+{
+    proxy* p = proxy::get_instance();
+    m_upstream = p->pick( route );
+    if( !m_upstream )
+    {
+        return false;
+    }
+    m_request.clear();
+    m_request.reserve( 128 + headers.size() + body.size() );
+    build_head( m_request, method, url, host, headers );
+    if( !body.empty() || strcmp( method, "POST" ) == 0 )
+    {
+        char len[ 48 ];
+        snprintf( len, sizeof( len ), "Content-Length: %zu\r\n", body.size() );
+        m_request += len;
+    }
+    m_request += "Connection: keep-alive\r\n\r\n";
+    m_request += body;
+    m_attempt = 0;
+    return send_request();
+}
+
+bool proxy_exchange::send_request()
+{
+    proxy* p = proxy::get_instance();
+    for( ; m_attempt < 2; ++m_attempt )
+    {
+        m_fd = p->acquire( m_upstream, m_reused );
+        if( m_fd < 0 )
+        {
+            break;
+        }
+        m_received = false;
+        m_head_done = false;
+        m_line.clear();
+        if( send_all( m_request.data(), m_request.size() ) && read_head() )
+        {
+            return true;
+        }
+        if( m_blocked )
+        {
+            return false;
+        }
+        close_upstream();
+        // 池中的长连接可能刚好被上游关闭，一个字节都没收到时换新连接重试一次
+        if( !m_reused || m_received )
+        {
+            break;
+        }
+    }
+    return upstream_failed();
+}
+
+bool proxy_exchange::resume_head()
+{
+    if( read_head() )
+    {
+        return true;
+    }
+    if( m_blocked )
+    {
+        return false;
+    }
+    close_upstream();
+    // 流式上传的请求没有保存，不能重试
+    if( m_reused && !m_received && !m_request.empty() && ++m_attempt < 2 )
+    {
+        return send_request();
+    }
+    return upstream_failed();
+}
+
+bool proxy_exchange::watch( int epollfd, int tag )
+{
+    epoll_event event;
+    event.data.fd = tag;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    int op = m_epollfd < 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    // 注册之后事件可能马上被别的工作线程处理，先记下
+    m_epollfd = epollfd;
+    if( epoll_ctl( epollfd, op, m_fd, &event ) < 0 )
+    {
+        if( op == EPOLL_CTL_ADD )
+        {
+            m_epollfd = -1;
+        }
+        return false;
+    }
+    return true;
+}
+
+void proxy_exchange::unwatch()
+{
+    if( m_epollfd >= 0 )
+    {
+        epoll_ctl( m_epollfd, EPOLL_CTL_DEL, m_fd, NULL );
+        m_epollfd = -1;
+    }
+}
+
+void proxy_exchange::close_upstream()
+{
+    if( m_fd >= 0 )
+    {
+        unwatch();
+        close( m_fd );
+        m_fd = -1;
+    }
+}
+
+bool proxy_exchange::begin( int route, const char* method, const char* url, const char* host,
+                            const string& headers, int64_t length )
+{
+    proxy* p = proxy::get_instance();
+    m_upstream = p->pick( route );
+    if( !m_upstream )
+    {
+        return false;
+    }
+    string req;
+    req.reserve( 128 + headers.size() );
+    build_head( req, method, url, host, headers );
+    if( length < 0 )
+    {
+        req += "Transfer-Encoding: chunked\r\n";
+    }
+    else
+    {
+        char len[ 48 ];
+        snprintf( len, sizeof( len ), "Content-Length: %lld\r\n", ( long long )length );
+        req += len;
+    }
+    req += "Connection: keep-alive\r\n\r\n";
+    m_request.clear();
+    m_head_done = false;
+    m_fd = p->acquire( m_upstream, m_reused );
+    if( m_fd < 0 || !send_all( req.data(), req.size() ) )
+    {
+        return upstream_failed();
+    }
+    m_uploading = true;
+    m_upload_chunked = length < 0;
+    return true;
+}
+
+bool proxy_exchange::send_body( const char* data, size_t len )
+{
+    if( len == 0 )
+    {
+        return true;
+    }
+    if( !m_upload_chunked )
+    {
+        return send_all( data, len ) || upstream_failed();
+    }
+    // 每段重新组成一个分块，客户端的分块扩展和分块大小不保留；一段不超过读缓冲，复制之后一次发出
+    char line[ 24 ];
+    int n = snprintf( line, sizeof( line ), "%zx\r\n", len );
+    string chunk;
+    chunk.reserve( n + len + 2 );
+    chunk.append( line, n );
+    chunk.append( data, len );
+    chunk += "\r\n";
+    return send_all( chunk.data(), chunk.size() ) || upstream_failed();
+}
+
+bool proxy_exchange::end_body()
+{
+    m_uploading = false;
+    m_received = false;
+    m_line.clear();
+    if( m_upload_chunked && !send_all( "0\r\n\r\n", 5 ) )
+    {
+        return upstream_failed();
+    }
+    return read_head() || ( !m_blocked && upstream_failed() );
+}
+
+void proxy_exchange::build_head( string& out, const char* method, const char* url, const char* host,
+                                 const string& headers ) const
+{
+    out += method;
+    out += ' ';
+    out += url;
+    out += " HTTP/1.1\r\nHost: ";
+    out += host ? host : m_upstream->name.c_str();
+    out += "\r\n";
+    out += headers;
+}
+
+bool proxy_exchange::upstream_failed()
+{
+    proxy* p = proxy::get_instance();
+    close_upstream();
+    m_blocked = false;
+    p->fail( m_upstream );
+    p->done( m_upstream );
+    m_upstream = NULL;
+    m_uploading = false;
+    return false;
+}
+
+bool proxy_exchange::send_all( const char* data, size_t len, int flags )
+{
+    while( len > 0 )
+    {
+        ssize_t n = send( m_fd, data, len, MSG_NOSIGNAL | flags );
+        if( n < 0 )
+        {
+            if( errno == EINTR || ( errno == EAGAIN && wait_fd( m_fd, POLLOUT, IO_TIMEOUT_MS ) ) )
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool proxy_exchange::wait_readable()
+{
+    if( !m_wait )
+    {
+        m_blocked = true;
+        return false;
+    }
+    return wait_fd( m_fd, POLLIN, IO_TIMEOUT_MS );
+}
+
+bool proxy_exchange::read_until( string& out, const char* delim, size_t max )
+{
+    size_t dlen = strlen( delim );
+    char buf[ 4096 ];
+    while( true )
+    {
+        size_t room = std::min( sizeof( buf ), max - out.size() );
+        if( room == 0 )
+        {
+            return false;
+        }
+        // 先窥视，只取走到分隔符为止的数据，消息体留在socket中给splice
+        ssize_t n = recv( m_fd, buf, room, MSG_PEEK );
+        if( n < 0 )
+        {
+            if( errno == EINTR || ( errno == EAGAIN && wait_readable() ) )
+            {
+                continue;
+            }
+            return false;
+        }
+        if( n == 0 )
+        {
+            return false;
+        }
+        // 分隔符可能跨过上一次读到的末尾
+        size_t old = out.size();
+        size_t from = old >= dlen - 1 ? old - ( dlen - 1 ) : 0;
+        out.append( buf, n );
+        size_t pos = out.find( delim, from );
+        size_t take = n;
+        if( pos != string::npos )
+        {
+            take = pos + dlen - old;
+            out.resize( pos + dlen );
+        }
+        if( recv( m_fd, buf, take, 0 ) != ( ssize_t )take )
+        {
+            return false;
+        }
+        m_received = true;
+        if( pos != string::npos )
+        {
+            return true;
+        }
+    }
+}
+
+bool proxy_exchange::read_head()
+{
+    m_blocked = false;
+    do
+    {
+        // 1xx是中间响应，跳过
+        if( !read_until( m_line, "\r\n\r\n", MAX_HEAD ) || !parse_head( m_line ) )
+        {
+            return false;
+        }
+        m_line.clear();
+    } while( m_status < 200 );
+    m_head_done = true;
+    // 请求不再需要重发
+    string().swap( m_request );
+
+    if( m_status == 204 || m_status == 304 )
+    {
+        m_chunked = false;
+        m_length = 0;
+    }
+    if( m_chunked )
+    {
+        m_state = BODY_CHUNK_SIZE;
+    }
+    else if( m_length >= 0 )
+    {
+        m_remaining = m_length;
+        m_state = m_length > 0 ? BODY_DATA : BODY_DONE;
+    }
+    else
+    {
+        // 没有长度，消息体到上游关闭连接为止
+        m_remaining = UINT64_MAX;
+        m_state = BODY_DATA;
+        m_keep_alive = false;
+    }
+    return true;
+}
+
+bool proxy_exchange::parse_head( const string& head )
+{
+    int major, minor, n = 0;
+    if( sscanf( head.c_str(), "HTTP/%d.%d %d%n", &major, &minor, &m_status, &n ) != 3 || m_status < 100 || m_status > 999 )
+    {
+        return false;
+    }
+    size_t eol = head.find( "\r\n" );
+    size_t reason = head.find_first_not_of( ' ', n );
+    m_reason = reason < eol ? head.substr( reason, eol - reason ) : "";
+    m_keep_alive = major > 1 || ( major == 1 && minor >= 1 );
+    m_headers.clear();
+    m_content_type.clear();
+    m_length = -1;
+    m_chunked = false;
+
+    // 最后的\r\n是空行
+    for( size_t pos = eol + 2; pos < head.size() - 2; )
+    {
+        size_t end = head.find( "\r\n", pos );
+        const char* line = head.c_str() + pos;
+        size_t len = end - pos;
+        const char* colon = ( const char* )memchr( line, ':', len );
+        if( !colon )
+        {
+            return false;
+        }
+        size_t name_len = colon - line;
+        const char* value = colon + 1;
+        value += strspn( value, " \t" );
+        string v( value, head.c_str() + end - value );
+        if( header_is( line, name_len, "Content-Length" ) )
+        {
+            m_length = strtoll( v.c_str(), NULL, 10 );
+        }
+        else if( header_is( line, name_len, "Transfer-Encoding" ) )
+        {
+            m_chunked = strcasestr( v.c_str(), "chunked" ) != NULL;
+        }
+        else if( header_is( line, name_len, "Connection" ) )
+        {
+            if( strcasestr( v.c_str(), "close" ) )
+            {
+                m_keep_alive = false;
+            }
+            else if( strcasestr( v.c_str(), "keep-alive" ) )
+            {
+                m_keep_alive = true;
+            }
+        }
+        else if( !header_is( line, name_len, "Keep-Alive" ) && !header_is( line, name_len, "Proxy-Connection" )
+                 && !header_is( line, name_len, "Upgrade" ) && !header_is( line, name_len, "TE" ) )
+        {
+            // 逐跳头部之外的原样转发
+            if( header_is( line, name_len, "Content-Type" ) )
+            {
+                m_content_type = v;
+            }
+            m_headers.append( line, len );
+            m_headers += "\r\n";
+        }
+        pos = end + 2;
+    }
+    return true;
+}
+
+void proxy_exchange::client_head( string& out, bool keep_alive, int64_t length, bool chunked ) const
+{
+    char line[ 64 ];
+    snprintf( line, sizeof( line ), "HTTP/1.1 %d ", m_status );
+    out += line;
+    out += m_reason;
+    out += "\r\n";
+    out += m_headers;
+    if( chunked )
+    {
+        out += "Transfer-Encoding: chunked\r\n";
+    }
+    else if( length >= 0 )
+    {
+        snprintf( line, sizeof( line ), "Content-Length: %lld\r\n", ( long long )length );
+        out += line;
+    }
+    // 其余情况消息体到连接关闭为止，调用者已经不再保持连接
+    out += keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+bool proxy_exchange::next_chunk( bool with_crlf )
+{
+    if( !read_until( m_line, "\r\n", MAX_LINE ) )
+    {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    unsigned long long size = strtoull( m_line.c_str(), &end, 16 );
+    // 分号之后是分块扩展，忽略
+    if( errno || end == m_line.c_str() || !strchr( ";\r \t", *end ) )
+    {
+        return false;
+    }
+    if( size == 0 )
+    {
+        m_state = BODY_TRAILER;
+        return true;
+    }
+    m_remaining = with_crlf ? size + 2 : size;
+    m_state = BODY_DATA;
+    return true;
+}
+
+bool proxy_exchange::read_body( string& out, size_t limit )
+{
+    while( m_state != BODY_DONE )
+    {
+        if( !read_piece( out, limit - out.size() ) )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool proxy_exchange::read_piece( string& out, size_t max )
+{
+    m_blocked = false;
+    while( m_state != BODY_DONE )
+    {
+        if( m_state == BODY_CHUNK_SIZE )
+        {
+            if( !next_chunk( false ) )
+            {
+                return false;
+            }
+            m_line.clear();
+            continue;
+        }
+        if( m_state == BODY_CHUNK_END || m_state == BODY_TRAILER )
+        {
+            // 分块数据之后的CRLF，或者尾部头部，直到空行
+            if( !read_until( m_line, "\r\n", MAX_LINE ) )
+            {
+                return false;
+            }
+            bool blank = m_line.size() == 2;
+            m_line.clear();
+            if( blank )
+            {
+                m_state = m_state == BODY_CHUNK_END ? BODY_CHUNK_SIZE : BODY_DONE;
+            }
+            else if( m_state == BODY_CHUNK_END )
+            {
+                return false;
+            }
+            continue;
+        }
+        size_t want = std::min( std::min( m_remaining, ( uint64_t )READ_SIZE ), ( uint64_t )max );
+        if( want == 0 )
+        {
+            return false;
+        }
+        size_t old = out.size();
+        out.resize( old + want );
+        ssize_t n = recv( m_fd, &out[ old ], want, 0 );
+        out.resize( old + ( n > 0 ? n : 0 ) );
+        if( n < 0 )
+        {
+            if( errno == EINTR || ( errno == EAGAIN && wait_readable() ) )
+            {
+                continue;
+            }
+            return false;
+        }
+        if( n == 0 )
+        {
+            if( !until_close() )
+            {
+                return false;
+            }
+            m_state = BODY_DONE;
+            break;
+        }
+        m_remaining -= n;
+        if( m_remaining == 0 )
+        {
+            m_state = m_chunked ? BODY_CHUNK_END : BODY_DONE;
+        }
+        return true;
+    }
+    return true;
+}
+
+int proxy_exchange::splice_body( int fd, uint64_t& sent )
+{
+    if( m_pipe[0] < 0 )
+    {
+        if( !proxy::get_instance()->get_pipe( m_pipe ) )
+        {
+            return -1;
+        }
+        int size = fcntl( m_pipe[1], F_GETPIPE_SZ );
+        m_pipe_size = size > 0 ? size : 65536;
+    }
+    while( true )
+    {
+        // 管道中的数据先发给客户；不带SPLICE_F_MORE，流式的分块响应不会被压在发送缓冲中等下一块
+        while( m_in_pipe > 0 )
+        {
+            ssize_t n = splice( m_pipe[0], NULL, fd, NULL, m_in_pipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+            if( n <= 0 )
+            {
+                if( n < 0 && errno == EINTR )
+                {
+                    continue;
+                }
+                return n < 0 && errno == EAGAIN ? 0 : -1;
+            }
+            m_in_pipe -= n;
+            sent += n;
+        }
+        if( m_state == BODY_DONE )
+        {
+            return 1;
+        }
+        if( !fill_pipe() )
+        {
+            return m_blocked ? 2 : -1;
+        }
+    }
+}
+
+bool proxy_exchange::fill_pipe()
+{
+    m_blocked = false;
+    if( m_state == BODY_CHUNK_SIZE || m_state == BODY_TRAILER )
+    {
+        // 分块大小行和尾部写进管道，和数据一起发给客户
+        if( m_state == BODY_CHUNK_SIZE )
+        {
+            if( !next_chunk( true ) )
+            {
+                return false;
+            }
+        }
+        else
+        {
+            if( !read_until( m_line, "\r\n", MAX_LINE ) )
+            {
+                return false;
+            }
+            if( m_line.size() == 2 )
+            {
+                m_state = BODY_DONE;
+            }
+        }
+        ssize_t len = m_line.size();
+        bool ok = write( m_pipe[1], m_line.data(), len ) == len;
+        m_line.clear();
+        if( !ok )
+        {
+            return false;
+        }
+        m_in_pipe += len;
+        return true;
+    }
+    while( true )
+    {
+        // 管道是空的，一次最多装满管道
+        size_t want = std::min( m_remaining, ( uint64_t )m_pipe_size );
+        ssize_t n = splice( m_fd, NULL, m_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if( n < 0 )
+        {
+            if( errno == EINTR || ( errno == EAGAIN && wait_readable() ) )
+            {
+                continue;
+            }
+            return false;
+        }
+        if( n == 0 )
+        {
+            if( !until_close() )
+            {
+                return false;
+            }
+            m_state = BODY_DONE;
+            return true;
+        }
+        metrics::get_instance()->inc( M_PROXY_SPLICED, n );
+        m_in_pipe += n;
+        m_remaining -= n;
+        if( m_remaining == 0 )
+        {
+            // 分块数据连同之后的CRLF已经装入
+            m_state = m_chunked ? BODY_CHUNK_SIZE : BODY_DONE;
+        }
+        return true;
+    }
+}
+
+void proxy_exchange::finish( bool ok )
+{
+    if( !m_upstream )
+    {
+        return;
+    }
+    proxy* p = proxy::get_instance();
+    if( ok && m_keep_alive && m_state == BODY_DONE && m_fd >= 0 )
+    {
+        unwatch();
+        p->release( m_upstream, m_fd );
+        m_fd = -1;
+    }
+    close_upstream();
+    m_head_done = false;
+    m_blocked = false;
+    m_line.clear();
+    string().swap( m_request );
+    if( m_pipe[0] >= 0 )
+    {
+        if( m_in_pipe == 0 )
+        {
+            p->put_pipe( m_pipe );
+        }
+        else
+        {
+            close( m_pipe[0] );
+            close( m_pipe[1] );
+        }
+        m_pipe[0] = -1;
+        m_pipe[1] = -1;
+        m_in_pipe = 0;
+    }
+    p->done( m_upstream );
+    m_upstream = NULL;
+    m_uploading = false;
+}
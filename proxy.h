@@ -0,0 +1,210 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include "locker.h"
+
+using namespace std;
+
+// 一个上游服务器，多条规则指向同一个地址时共用
+struct upstream
+{
+    string name;            // host:port，健康检查的Host头部
+    sockaddr_in addr;
+    int outstanding;        // 正在转发的请求数，原子操作
+    bool healthy;           // 由健康检查线程和转发失败修改
+    locker lock;            // 保护idle
+    vector< int > idle;     // 空闲的长连接，后进先出
+};
+
+// 反向代理
+// 请求路径匹配某条规则的前缀时转发给规则中的一个上游：只在健康的上游中选择未完成请求最少的，
+// 相同时轮转。每个上游维护一个长连接池，连接在响应读完之后放回，空闲期间被上游关闭的连接在取出时丢弃。
+// 健康检查线程定期向每个上游发送GET请求，状态码小于500为健康；转发失败的上游立即标记为不健康，
+// 等健康检查恢复。
+class proxy
+{
+public:
+    static proxy* get_instance();
+
+    // 添加一条规则，格式为prefix=host:port[,host:port...]
+    bool add_route( const char* spec );
+    bool enabled() const { return !m_routes.empty(); }
+    // 启动健康检查线程，interval_s为0时不检查，上游一直被认为是健康的
+    bool start( const char* check_path, int interval_s );
+    void stop();
+
+    // 最长前缀匹配，返回规则编号，没有匹配返回-1
+    int match( const char* url ) const;
+    // 选择上游并把它的未完成请求数加一，没有健康的上游时返回NULL
+    upstream* pick( int route );
+    // 转发结束，未完成请求数减一
+    void done( upstream* u );
+    // 转发失败，标记为不健康并关闭空闲连接
+    void fail( upstream* u );
+    // 取一个连接，连接池空时新建，reused表示是否是池中的长连接；失败返回-1
+    int acquire( upstream* u, bool& reused );
+    // 响应完整读完的连接放回连接池
+    void release( upstream* u, int fd );
+    // 取一个空的管道，用完归还；管道中有残留数据时调用者直接关闭，不归还
+    bool get_pipe( int fds[2] );
+    void put_pipe( const int fds[2] );
+    // 健康的上游数
+    int healthy_count();
+
+private:
+    proxy();
+    ~proxy();
+
+    struct route
+    {
+        string prefix;
+        vector< upstream* > upstreams;
+    };
+
+    upstream* find_upstream( const string& name );
+    static void* worker( void* arg );
+    void run();
+    bool check( upstream* u );
+    void close_idle( upstream* u );
+
+private:
+    // 每个上游最多保留的空闲连接数
+    static const size_t MAX_IDLE = 64;
+
+    vector< route > m_routes;
+    vector< upstream* > m_upstreams;
+    unsigned int m_rr;          // 轮转位置，原子操作
+
+    string m_check_path;
+    int m_interval_s;
+    bool m_running;
+    pthread_t m_thread;
+
+    locker m_pipe_lock;
+    vector< int > m_pipes;      // 空闲管道，读端和写端依次存放
+};
+
+// 一次转发，由http_conn持有
+// 请求整个发出之后读响应头；消息体由调用者选择splice_body经管道直接转发给客户socket，
+// 或者read_piece逐段读进内存(其他后端和用户态TLS)，HTTP/2用read_body一次读完。
+// 分块编码的响应直接转发时原样保留分块格式，只解析分块大小，数据部分仍然splice。
+// 客户端的消息体没有一次收完时流式上传：begin发出请求头，send_body随收随发，end_body之后读响应头。
+// 默认等待上游的数据(最多IO_TIMEOUT_MS)；set_wait(false)之后上游没有数据时读操作立即返回失败，blocked()为true，
+// 调用者用watch把上游fd注册到epoll，可读之后再调用同一个函数(响应头用resume_head)从断开的地方继续。
+// 发送请求时仍然等待，请求一般能整个放进上游socket的发送缓冲。
+class proxy_exchange
+{
+public:
+    proxy_exchange();
+    ~proxy_exchange() { finish( false ); }
+
+    // 选择上游，发送请求并读取响应头，失败返回false，上游被标记为不健康
+    // host为NULL时用上游的地址；headers是要转发的端到端头部，每行以\r\n结尾
+    bool start( int route, const char* method, const char* url, const char* host,
+                const string& headers, const string& body );
+    // 流式上传，参数和start相同，length为-1时消息体按分块编码发送
+    // 上传的消息体没有保存，失败之后不能重试；池中的连接取出时已经检查过是否被上游关闭
+    bool begin( int route, const char* method, const char* url, const char* host,
+                const string& headers, int64_t length );
+    bool send_body( const char* data, size_t len );
+    // 消息体发完，读响应头
+    bool end_body();
+    bool uploading() const { return m_uploading; }
+    // 响应头已经读到，还有消息体没有转发
+    bool active() const { return m_upstream != NULL && m_head_done; }
+    // 请求已经发出，响应头还没读完
+    bool pending() const { return m_upstream != NULL && !m_uploading && !m_head_done; }
+    // wait为false时上游没有数据不等待
+    void set_wait( bool wait ) { m_wait = wait; }
+    // 上一次失败是因为上游暂时没有数据，连接仍然有效
+    bool blocked() const { return m_blocked; }
+    // 继续读响应头，返回值和start相同
+    bool resume_head();
+    // 上游fd以EPOLLIN|EPOLLONESHOT注册到epollfd，事件的data.fd为tag；连接关闭或放回连接池之前注销
+    bool watch( int epollfd, int tag );
+    // 生成给客户端的状态行和头部，chunked为true时带Transfer-Encoding: chunked，
+    // 否则length不小于0时带Content-Length，都没有时消息体到连接关闭为止
+    void client_head( string& out, bool keep_alive, int64_t length, bool chunked ) const;
+    // 上游的Content-Length，没有时为-1；chunked()为上游按分块编码发送
+    int64_t length() const { return m_length; }
+    bool chunked() const { return m_chunked; }
+    // 上游按关闭连接结束消息体，客户端连接在这次响应之后也要关闭
+    bool until_close() const { return !m_chunked && m_length < 0; }
+    // 响应头之后还有消息体
+    bool has_body() const { return m_state != BODY_DONE; }
+    int status() const { return m_status; }
+    const string& content_type() const { return m_content_type; }
+
+    // 消息体读进out，分块编码被解开，超过limit返回false
+    bool read_body( string& out, size_t limit );
+    // 读一段消息体追加到out，最多max字节，分块编码被解开；读到末尾之后has_body()为false
+    bool read_piece( string& out, size_t max );
+    // 消息体经管道转发给非阻塞的fd，sent累加发送的字节数
+    // 返回1表示转发完，0表示fd发送缓冲满(应等待可写后再次调用)，2表示上游暂时没有数据(不等待时)，-1表示出错
+    int splice_body( int fd, uint64_t& sent );
+    // 结束这次转发，ok为true时连接放回连接池；可以重复调用
+    void finish( bool ok );
+
+private:
+    enum BODY_STATE { BODY_DATA = 0, BODY_CHUNK_SIZE, BODY_CHUNK_END, BODY_TRAILER, BODY_DONE };
+
+    bool send_all( const char* data, size_t len, int flags = 0 );
+    // 发送m_request并读响应头，池中的长连接刚好被上游关闭、一个字节都没收到时换新连接重试一次
+    bool send_request();
+    // 注销epoll之后关闭上游连接
+    void close_upstream();
+    void unwatch();
+    // 请求行、Host和转发的头部，消息体长度和Connection由调用者添加
+    void build_head( string& out, const char* method, const char* url, const char* host,
+                     const string& headers ) const;
+    // 发送或读响应头失败，关闭连接，上游标记为不健康
+    bool upstream_failed();
+    // 从上游读到delim为止(包含delim)追加到out，delim之后的数据留在socket中
+    // out中已有的内容是上一次因为没有数据而中断时读到的部分，调用者在开始读新的一行之前清空
+    bool read_until( string& out, const char* delim, size_t max );
+    // 读上游返回EAGAIN时是否继续等待，不等待时设置m_blocked
+    bool wait_readable();
+    // 读响应头，跳过1xx中间响应，确定消息体的长度
+    bool read_head();
+    bool parse_head( const string& head );
+    // 读分块大小行到m_line，设置m_remaining和下一个状态；with_crlf为true时数据之后的CRLF也算在m_remaining中
+    bool next_chunk( bool with_crlf );
+    // 直接转发时管道空了之后装入下一段数据
+    bool fill_pipe();
+
+private:
+    upstream* m_upstream;
+    int m_fd;
+    bool m_keep_alive;          // 上游连接可以复用
+    bool m_received;            // 这次请求已经从上游收到过数据，失败后不能重试
+    bool m_uploading;           // 正在流式上传请求的消息体
+    bool m_upload_chunked;
+    bool m_head_done;           // 已经读到响应头
+    bool m_reused;              // 当前连接来自连接池
+    int m_attempt;
+    string m_request;           // 没有读到响应头之前保留，重试时重新发送
+    string m_line;              // 没读完的响应头、分块大小行或者尾部头部
+    bool m_wait;
+    bool m_blocked;
+    int m_epollfd;              // 上游fd注册在这个epoll中，-1表示没有注册
+
+    int m_status;
+    string m_reason;
+    string m_headers;           // 转发给客户端的头部，每行以\r\n结尾，去掉了逐跳头部和消息体长度
+    string m_content_type;
+    int64_t m_length;           // Content-Length，没有时为-1
+    bool m_chunked;
+
+    BODY_STATE m_state;
+    uint64_t m_remaining;       // 当前一段还要读的字节数
+    int m_pipe[2];
+    size_t m_in_pipe;           // 管道中还没发给客户的字节数
+    size_t m_pipe_size;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include <string.h>
+#include <stdint.h>
+#include "router.h"
+
+// 路由表，添加路由只需加一行
+// 页面中的表单以POST提交到/0、/1、/5、/6、/7，所以这些别名两种方法都允许
+static constexpr route_entry ROUTES[] = {
+    { "/",              ROUTE_GET,              ROUTE_ALIAS,    "/judge.html",      NULL },
+    { "/0",             ROUTE_GET | ROUTE_POST, ROUTE_ALIAS,    "/register.html",   NULL },
+    { "/1",             ROUTE_GET | ROUTE_POST, ROUTE_ALIAS,    "/log.html",        NULL },
+    { "/2CGISQL.cgi",   ROUTE_POST,             ROUTE_LOGIN,    "/welcome.html",    "/logError.html" },
+    { "/3CGISQL.cgi",   ROUTE_POST,             ROUTE_REGISTER, "/log.html",        "/registerError.html" },
+    { "/5",             ROUTE_GET | ROUTE_POST, ROUTE_ALIAS,    "/picture.html",    NULL },
+    { "/6",             ROUTE_GET | ROUTE_POST, ROUTE_ALIAS,    "/video.html",      NULL },
+    { "/7",             ROUTE_GET | ROUTE_POST, ROUTE_ALIAS,    "/fans.html",       NULL },
+};
+static constexpr size_t ROUTE_COUNT = sizeof( ROUTES ) / sizeof( ROUTES[0] );
+// 槽数是2的幂且不少于路由数的两倍，种子很快就能找到
+static constexpr size_t SLOT_COUNT = 16;
+static_assert( ROUTE_COUNT * 2 <= SLOT_COUNT && ROUTE_COUNT < 256, "route table too large, enlarge SLOT_COUNT" );
+
+// 带种子的FNV-1a
+static constexpr uint32_t route_hash( uint32_t seed, const char* p )
+{
+    uint32_t h = 2166136261u ^ seed;
+    for( ; *p; ++p )
+    {
+        h ^= ( uint8_t )*p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+struct route_index
+{
+    uint32_t seed;
+    uint8_t slots[ SLOT_COUNT ];    // 路由下标加一，0为空槽
+    bool ok;
+};
+
+// 依次尝试种子，直到所有路由落在不同的槽
+static constexpr route_index build_index()
+{
+    for( uint32_t seed = 0; seed < 4096; ++seed )
+    {
+        route_index index = {};
+        index.seed = seed;
+        index.ok = true;
+        for( size_t i = 0; i < ROUTE_COUNT && index.ok; ++i )
+        {
+            uint8_t& slot = index.slots[ route_hash( seed, ROUTES[i].path ) & ( SLOT_COUNT - 1 ) ];
+            index.ok = slot == 0;
+            slot = i + 1;
+        }
+        if( index.ok )
+        {
+            return index;
+        }
+    }
+    return route_index{};
+}
+
+static constexpr route_index INDEX = build_index();
+static_assert( INDEX.ok, "no perfect hash for the route table, check for duplicate paths" );
+
+const route_entry* route_lookup( const char* path )
+{
+    uint8_t slot = INDEX.slots[ route_hash( INDEX.seed, path ) & ( SLOT_COUNT - 1 ) ];
+    if( slot == 0 )
+    {
+        return NULL;
+    }
+    const route_entry* r = &ROUTES[ slot - 1 ];
+    return strcmp( r->path, path ) == 0 ? r : NULL;
+}
+
+const char* route_allow( const route_entry* r )
+{
+    switch( r->methods )
+    {
+        case ROUTE_GET:
+            return "GET";
+        case ROUTE_POST:
+            return "POST";
+        default:
+            return "GET, POST";
+    }
+}
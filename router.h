@@ -0,0 +1,33 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+// 本地处理的请求路由
+// 路由表在router.cpp中声明，按完整路径精确匹配；编译期为表求出一个完美哈希：每条路由的路径落在不同的槽，
+// 匹配时对路径哈希一次，再和槽中唯一的路由比较一次，不分配内存。
+// 添加路由只需在表中加一行，路径重复或者找不到完美哈希时编译失败。
+// 没有匹配的路径按静态文件处理；反向代理规则和指标路径在运行时配置，先于路由表匹配。
+enum route_action
+{
+    ROUTE_ALIAS = 0,    // 返回target指定的静态文件
+    ROUTE_LOGIN,        // 登录，成功返回target，失败返回error
+    ROUTE_REGISTER,     // 注册，成功返回target，失败返回error
+};
+
+// 允许的方法，按位或
+enum route_method { ROUTE_GET = 1, ROUTE_POST = 2 };
+
+struct route_entry
+{
+    const char* path;
+    unsigned methods;
+    route_action action;
+    const char* target;     // 以/开头，相对于doc_root
+    const char* error;      // 登录注册失败时的页面，别名为NULL
+};
+
+// 没有匹配返回NULL
+const route_entry* route_lookup( const char* path );
+// 405响应的Allow头部
+const char* route_allow( const route_entry* r );
+
+#endif
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sitepack.h"
+
+// 大页的长度，MAP_HUGETLB的映射长度要按它取整
+static const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+site_pack* site_pack::get_instance()
+{
+    static site_pack pack;
+    return &pack;
+}
+
+site_pack::site_pack()
+{
+    m_base = NULL;
+    m_size = 0;
+    m_mapped = 0;
+    m_header = NULL;
+    m_disp = NULL;
+    m_slots = NULL;
+    m_entries = NULL;
+}
+
+site_pack::~site_pack()
+{
+    if( m_base )
+    {
+        munmap( m_base, m_mapped );
+    }
+}
+
+// 整个文件读进匿名内存，优先用预留的大页，没有时用普通页并建议内核合并成透明大页
+static char* load_huge( int fd, size_t size, size_t& mapped )
+{
+    mapped = ( size + HUGE_PAGE_SIZE - 1 ) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    void* p = mmap( NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+    if( p == MAP_FAILED )
+    {
+        p = mmap( NULL, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if( p == MAP_FAILED )
+        {
+            return NULL;
+        }
+        madvise( p, mapped, MADV_HUGEPAGE );
+        printf( "site pack: no reserved huge pages, using transparent huge pages\n" );
+    }
+    size_t done = 0;
+    while( done < size )
+    {
+        ssize_t n = pread( fd, ( char* )p + done, size - done, done );
+        if( n <= 0 )
+        {
+            if( n < 0 && errno == EINTR )
+            {
+                continue;
+            }
+            munmap( p, mapped );
+            return NULL;
+        }
+        done += n;
+    }
+    // 之后只读
+    mprotect( p, mapped, PROT_READ );
+    return ( char* )p;
+}
+
+bool site_pack::open( const char* path, LOAD_MODE mode, bool lock_hot )
+{
+    int fd = ::open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        printf( "site pack: cannot open %s: %s\n", path, strerror( errno ) );
+        return false;
+    }
+    struct stat st;
+    if( fstat( fd, &st ) < 0 || st.st_size < ( off_t )sizeof( pack_header ) )
+    {
+        printf( "site pack: %s is not a site pack\n", path );
+        close( fd );
+        return false;
+    }
+    m_size = st.st_size;
+    if( mode == LOAD_HUGEPAGE )
+    {
+        m_base = load_huge( fd, m_size, m_mapped );
+    }
+    else
+    {
+        m_mapped = m_size;
+        void* p = mmap( NULL, m_size, PROT_READ, MAP_SHARED | ( mode == LOAD_POPULATE ? MAP_POPULATE : 0 ), fd, 0 );
+        m_base = p == MAP_FAILED ? NULL : ( char* )p;
+    }
+    close( fd );
+    if( !m_base )
+    {
+        printf( "site pack: cannot load %s: %s\n", path, strerror( errno ) );
+        return false;
+    }
+
+    m_header = ( const pack_header* )m_base;
+    if( !validate() )
+    {
+        printf( "site pack: %s is damaged or was built by another version\n", path );
+        munmap( m_base, m_mapped );
+        m_base = NULL;
+        m_header = NULL;
+        return false;
+    }
+    m_disp = ( const uint32_t* )( m_base + m_header->disp_off );
+    m_slots = ( const uint32_t* )( m_base + m_header->slots_off );
+    m_entries = ( const pack_entry* )( m_base + m_header->entries_off );
+
+    // RLIMIT_MEMLOCK不够时热区照常使用，只是可能被换出
+    if( lock_hot && mlock( m_base, m_header->hot_size ) < 0 )
+    {
+        printf( "site pack: cannot lock %llu bytes: %s\n", ( unsigned long long )m_header->hot_size, strerror( errno ) );
+    }
+    return true;
+}
+
+bool site_pack::validate() const
+{
+    const pack_header* h = m_header;
+    if( memcmp( h->magic, PACK_MAGIC, sizeof( PACK_MAGIC ) ) != 0 || h->version != PACK_VERSION
+        || h->total_size != m_size || h->hot_size > m_size )
+    {
+        return false;
+    }
+    // 桶数和槽数是2的幂，槽数不少于文件数
+    if( h->bucket_count == 0 || ( h->bucket_count & ( h->bucket_count - 1 ) )
+        || h->slot_count < h->count || h->slot_count == 0 || ( h->slot_count & ( h->slot_count - 1 ) ) )
+    {
+        return false;
+    }
+    if( h->disp_off % sizeof( uint32_t ) || h->slots_off % sizeof( uint32_t ) || h->entries_off % sizeof( uint64_t )
+        || !in_range( h->disp_off, ( uint64_t )h->bucket_count * sizeof( uint32_t ) )
+        || !in_range( h->slots_off, ( uint64_t )h->slot_count * sizeof( uint32_t ) )
+        || !in_range( h->entries_off, ( uint64_t )h->count * sizeof( pack_entry ) ) )
+    {
+        return false;
+    }
+    const uint32_t* slots = ( const uint32_t* )( m_base + h->slots_off );
+    for( uint32_t i = 0; i < h->slot_count; ++i )
+    {
+        if( slots[i] > h->count )
+        {
+            return false;
+        }
+    }
+    const pack_entry* entries = ( const pack_entry* )( m_base + h->entries_off );
+    for( uint32_t i = 0; i < h->count; ++i )
+    {
+        const pack_entry& e = entries[i];
+        if( !valid_string( e.path_off, e.path_len )
+            || !in_range( e.type_off, 1 ) || memchr( m_base + e.type_off, '\0', m_size - e.type_off ) == NULL )
+        {
+            return false;
+        }
+        for( int v = 0; v < PACK_ENCODINGS; ++v )
+        {
+            const pack_variant& var = e.variants[v];
+            if( ( var.head_len && ( !in_range( var.head_off, var.head_len ) || !valid_string( var.etag_off, var.etag_len ) ) )
+                || !in_range( var.body_off, var.body_len ) )
+            {
+                return false;
+            }
+        }
+        if( e.variants[ PACK_IDENTITY ].head_len == 0 )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+const pack_entry* site_pack::find( const char* path ) const
+{
+    uint64_t h = pack_hash( path );
+    uint32_t disp = m_disp[ pack_bucket( h, m_header->bucket_count ) ];
+    uint32_t slot = m_slots[ pack_slot( h, disp, m_header->slot_count ) ];
+    if( slot == 0 )
+    {
+        return NULL;
+    }
+    const pack_entry* e = &m_entries[ slot - 1 ];
+    return strcmp( m_base + e->path_off, path ) == 0 ? e : NULL;
+}
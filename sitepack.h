@@ -0,0 +1,130 @@
+#ifndef SITEPACK_H
+#define SITEPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+using namespace std;
+
+// 站点打包文件
+// tools/mkpack把整个文档目录打包成一个文件，服务器启动时mmap一次，之后请求的文件都从映射中取，
+// 不再stat/open/mmap，查找不需要系统调用。部署时生成新文件再rename覆盖，替换是原子的；
+// 运行中的服务器仍然持有旧文件的映射，重启后才使用新文件。
+//
+// 布局(整数都是本机字节序，偏移从文件开头算起)：
+//   pack_header
+//   uint32_t disp[ bucket_count ]      每个桶的位移
+//   uint32_t slots[ slot_count ]       文件下标加一，0为空槽
+//   pack_entry entries[ count ]
+//   字符串区：路径、ETag、Content-Type和预先生成的响应头，都以\0结尾
+//   文件内容，每个变体从页边界开始
+// 文件内容按大小升序排列，不超过打包时热点阈值的小文件在前，和索引一起组成从偏移0开始的热区，可以整块mlock。
+//
+// 完美哈希用hash-and-displace：路径的64位哈希先选一个桶，再和桶的位移混合选槽，
+// 打包时为每个桶找到一个位移，使桶中的路径都落在空槽上；查找时对路径哈希一次，
+// 和槽中唯一的文件比较一次路径。
+static const char PACK_MAGIC[ 8 ] = { 'W', 'S', 'P', 'A', 'C', 'K', '\0', '\0' };
+static const uint32_t PACK_VERSION = 2;
+static const uint64_t PACK_ALIGN = 4096;
+
+// 变体：0为原文，1为gzip压缩
+enum pack_encoding { PACK_IDENTITY = 0, PACK_GZIP, PACK_ENCODINGS };
+
+struct pack_header
+{
+    char magic[ 8 ];
+    uint32_t version;
+    uint32_t count;             // 文件数
+    uint32_t bucket_count;      // 2的幂
+    uint32_t slot_count;        // 2的幂
+    uint64_t disp_off;
+    uint64_t slots_off;
+    uint64_t entries_off;
+    uint64_t hot_size;          // 热区长度
+    uint64_t total_size;        // 文件长度，用来检查文件是否完整
+};
+
+struct pack_variant
+{
+    uint64_t head_off;          // 状态行和头部，不含Connection和结尾的空行
+    uint32_t head_len;
+    uint32_t etag_len;
+    uint64_t etag_off;          // 带引号的强ETag，不同内容编码的变体不同，gzip变体带-gz后缀
+    uint64_t body_off;
+    uint64_t body_len;
+};
+
+struct pack_entry
+{
+    uint64_t path_off;          // 以/开头，相对于文档目录
+    uint64_t type_off;          // Content-Type
+    uint32_t path_len;
+    uint32_t reserved;
+    pack_variant variants[ PACK_ENCODINGS ];    // 没有的变体head_len为0
+};
+
+// 路径的64位FNV-1a
+inline uint64_t pack_hash( const char* p )
+{
+    uint64_t h = 14695981039346656037ull;
+    for( ; *p; ++p )
+    {
+        h ^= ( uint8_t )*p;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+inline uint32_t pack_bucket( uint64_t h, uint32_t bucket_count )
+{
+    return ( h >> 32 ) & ( bucket_count - 1 );
+}
+
+// 哈希和位移混合之后选槽，混合用splitmix64的终结函数
+inline uint32_t pack_slot( uint64_t h, uint32_t disp, uint32_t slot_count )
+{
+    uint64_t x = h + ( uint64_t )disp * 0x9e3779b97f4a7c15ull;
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x & ( slot_count - 1 );
+}
+
+// 服务器持有的打包文件，启动时打开，之后只读，多线程查找不加锁
+class site_pack
+{
+public:
+    // LOAD_MAP直接映射，按需缺页；LOAD_POPULATE映射时读入全部页面；
+    // LOAD_HUGEPAGE把文件读进大页内存(hugetlbfs没有预留时退回透明大页)，减少TLB缺失
+    enum LOAD_MODE { LOAD_MAP = 0, LOAD_POPULATE, LOAD_HUGEPAGE };
+
+    static site_pack* get_instance();
+
+    // 打开并检查打包文件，lock_hot为true时mlock热区，失败只打印警告
+    bool open( const char* path, LOAD_MODE mode, bool lock_hot );
+    bool enabled() const { return m_base != NULL; }
+    // 按完整路径查找，没有返回NULL
+    const pack_entry* find( const char* path ) const;
+    const char* at( uint64_t off ) const { return m_base + off; }
+    size_t count() const { return m_header ? m_header->count : 0; }
+
+private:
+    site_pack();
+    ~site_pack();
+
+    // 检查所有偏移都在文件范围内，损坏或截断的文件不会导致越界访问
+    bool validate() const;
+    bool in_range( uint64_t off, uint64_t len ) const { return off <= m_size && len <= m_size - off; }
+    bool valid_string( uint64_t off, uint64_t len ) const { return in_range( off, len + 1 ) && m_base[ off + len ] == '\0'; }
+
+private:
+    char* m_base;
+    size_t m_size;
+    size_t m_mapped;            // munmap的长度，大页内存按2MB取整
+    const pack_header* m_header;
+    const uint32_t* m_disp;
+    const uint32_t* m_slots;
+    const pack_entry* m_entries;
+};
+
+#endif
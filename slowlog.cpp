@@ -0,0 +1,65 @@
+#include "slowlog.h"
+#include "metrics.h"
+
+slow_log* slow_log::get_instance()
+{
+    static slow_log log;
+    return &log;
+}
+
+slow_log::slow_log()
+{
+    m_threshold_us = 0;
+    m_max_per_sec = 0;
+    m_sample = 1;
+    m_seen = 0;
+    m_out = stderr;
+    m_second = 0;
+    m_emitted = 0;
+    m_suppressed = 0;
+}
+
+void slow_log::init( int threshold_ms, int max_per_sec, int sample, FILE* out )
+{
+    m_threshold_us = ( uint64_t )threshold_ms * 1000;
+    m_max_per_sec = max_per_sec;
+    m_sample = sample > 0 ? sample : 1;
+    m_out = out;
+}
+
+void slow_log::record( const slow_request& req )
+{
+    if( !enabled() || req.total_us < m_threshold_us )
+    {
+        return;
+    }
+    metrics::get_instance()->inc( M_SLOW_REQUESTS );
+    // 先抽样再限流，没抽中的不算被限流丢弃
+    if( m_sample > 1 && __atomic_fetch_add( &m_seen, 1, __ATOMIC_RELAXED ) % m_sample != 0 )
+    {
+        return;
+    }
+
+    // 按秒限流，换秒时由一个线程清零计数
+    uint64_t second = metrics::now_us() / 1000000;
+    uint64_t last = __atomic_load_n( &m_second, __ATOMIC_RELAXED );
+    if( second != last && __atomic_compare_exchange_n( &m_second, &last, second, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    {
+        __atomic_store_n( &m_emitted, 0, __ATOMIC_RELAXED );
+    }
+    if( __atomic_fetch_add( &m_emitted, 1, __ATOMIC_RELAXED ) >= m_max_per_sec )
+    {
+        __atomic_fetch_add( &m_suppressed, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    uint64_t suppressed = __atomic_exchange_n( &m_suppressed, 0, __ATOMIC_RELAXED );
+
+    // 一次fprintf输出整行，多个线程的行不会交错
+    fprintf( m_out, "slow_request fd=%d method=%s url=%s code=%d aborted=%d total_us=%llu recv_us=%llu queue_us=%llu "
+             "parse_us=%llu process_us=%llu write_us=%llu bytes=%lld sample=%d suppressed=%llu\n",
+             req.fd, req.method, req.url ? req.url : "-", req.code, req.aborted ? 1 : 0,
+             ( unsigned long long )req.total_us, ( unsigned long long )req.recv_us,
+             ( unsigned long long )req.queue_us, ( unsigned long long )req.parse_us,
+             ( unsigned long long )req.process_us, ( unsigned long long )req.write_us,
+             req.bytes, m_sample, ( unsigned long long )suppressed );
+}
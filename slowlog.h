@@ -0,0 +1,56 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// 一次请求各阶段的耗时，单位微秒
+struct slow_request
+{
+    int fd;
+    const char* method;
+    const char* url;
+    int code;               // http_conn::HTTP_CODE
+    bool aborted;           // 写失败，连接被关闭
+    uint64_t total_us;      // 第一次读到数据到响应发完
+    uint64_t recv_us;       // 第一次读到请求交给线程池，客户端发得慢时变大
+    uint64_t queue_us;      // 线程池队列中等待
+    uint64_t parse_us;      // 解析，不含do_request
+    uint64_t process_us;    // do_request，文件系统和数据库
+    uint64_t write_us;      // 响应就绪到发完，包含等待EPOLLOUT的时间
+    long long bytes;        // 发送的字节数
+};
+
+// 慢请求日志
+// 超过阈值的请求每sample个抽样一个，输出一行key=value格式的日志，每秒最多输出max_per_sec行，
+// 超出的只计数，在下一行里以suppressed报告，满负载时也不会被日志拖慢
+class slow_log
+{
+public:
+    static slow_log* get_instance();
+
+    // threshold_ms为0表示关闭
+    void init( int threshold_ms, int max_per_sec, int sample = 1, FILE* out = stderr );
+    bool enabled() const { return m_threshold_us > 0; }
+    // 请求结束时调用，未超过阈值直接返回
+    void record( const slow_request& req );
+
+private:
+    slow_log();
+    ~slow_log(){}
+
+private:
+    uint64_t m_threshold_us;
+    int m_max_per_sec;
+    int m_sample;
+    // 超过阈值的请求数，用来抽样
+    uint64_t m_seen;
+    FILE* m_out;
+    // 当前秒和这一秒内已输出的行数，多个线程用原子操作更新
+    uint64_t m_second;
+    int m_emitted;
+    // 被限流丢弃的慢请求数
+    uint64_t m_suppressed;
+};
+
+#endif
@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <sys/time.h>
+#include "sqlbatch.h"
+#include "sqlconnRAII.h"
+#include "sqlrouter.h"
+#include "metrics.h"
+
+// 主键冲突，即用户名已存在
+#define ER_DUP_ENTRY 1062
+
+sqlbatcher::sqlbatcher()
+{
+    m_connpool = NULL;
+    m_batch_size = 64;
+    m_batch_window = 1000;
+    m_running = false;
+}
+
+sqlbatcher::~sqlbatcher()
+{
+    stop();
+}
+
+// 获取单例
+sqlbatcher* sqlbatcher::get_instance()
+{
+    static sqlbatcher batcher;
+    return &batcher;
+}
+
+void sqlbatcher::init( sqlconnpool* connpool, int batch_size, int batch_window )
+{
+    m_connpool = connpool;
+    m_batch_size = batch_size;
+    m_batch_window = batch_window;
+    m_running = true;
+    if( pthread_create( &m_thread, NULL, worker, this ) != 0 )
+    {
+        m_running = false;
+        throw std::exception();
+    }
+}
+
+void sqlbatcher::stop()
+{
+    m_lock.lock();
+    if( !m_running )
+    {
+        m_lock.unlock();
+        return;
+    }
+    m_running = false;
+    m_cond.broadcast();
+    m_lock.unlock();
+    pthread_join( m_thread, NULL );
+}
+
+bool sqlbatcher::login( const string& name, const string& password )
+{
+    sql_task task;
+    task.name = name;
+    task.password = password;
+    return submit( m_login_queue, &task );
+}
+
+bool sqlbatcher::regist( const string& name, const string& password )
+{
+    sql_task task;
+    task.name = name;
+    task.password = password;
+    return submit( m_regist_queue, &task );
+}
+
+bool sqlbatcher::submit( list< sql_task* >& queue, sql_task* task )
+{
+    task->result = false;
+    m_lock.lock();
+    if( !m_running )
+    {
+        m_lock.unlock();
+        return false;
+    }
+    queue.push_back( task );
+    // 队列由空变为非空时开启一个窗口，凑满一批时提前结束窗口
+    if( queue.size() == 1 || queue.size() >= (size_t)m_batch_size )
+    {
+        m_cond.signal();
+    }
+    m_lock.unlock();
+    task->done.wait();
+    return task->result;
+}
+
+void* sqlbatcher::worker( void* arg )
+{
+    sqlbatcher* batcher = ( sqlbatcher* )arg;
+    batcher->run();
+    return batcher;
+}
+
+void sqlbatcher::run()
+{
+    vector< sql_task* > logins;
+    vector< sql_task* > regists;
+
+    m_lock.lock();
+    while( m_running )
+    {
+        if( m_login_queue.empty() && m_regist_queue.empty() )
+        {
+            m_cond.wait( m_lock.get() );
+            continue;
+        }
+
+        // 第一个请求到达后等待一个窗口期，期间凑满一批则立即执行
+        struct timeval now;
+        gettimeofday( &now, NULL );
+        long usec = now.tv_usec + m_batch_window;
+        struct timespec deadline;
+        deadline.tv_sec = now.tv_sec + usec / 1000000;
+        deadline.tv_nsec = ( usec % 1000000 ) * 1000;
+        while( m_running && m_login_queue.size() < (size_t)m_batch_size
+                && m_regist_queue.size() < (size_t)m_batch_size )
+        {
+            if( !m_cond.timewait( m_lock.get(), deadline ) )
+            {
+                break;
+            }
+        }
+
+        // 每类最多取出一批，剩下的留给下一轮
+        while( !m_login_queue.empty() && logins.size() < (size_t)m_batch_size )
+        {
+            logins.push_back( m_login_queue.front() );
+            m_login_queue.pop_front();
+        }
+        while( !m_regist_queue.empty() && regists.size() < (size_t)m_batch_size )
+        {
+            regists.push_back( m_regist_queue.front() );
+            m_regist_queue.pop_front();
+        }
+        m_lock.unlock();
+
+        // 先提交注册，同一批中刚注册的用户也能登录成功
+        if( !regists.empty() )
+        {
+            flush( m_connpool, regists, true );
+        }
+        if( !logins.empty() )
+        {
+            // 读写分离：刚注册的用户查主库，其余的查同一个副本
+            sqlrouter* router = sqlrouter::get_instance();
+            sqlconnpool* rpool = router->reader( "" );
+            vector< sql_task* > primary;
+            vector< sql_task* > replica;
+            for( size_t i = 0; i < logins.size(); ++i )
+            {
+                if( rpool == m_connpool || router->sticky( logins[i]->name ) )
+                {
+                    primary.push_back( logins[i] );
+                }
+                else
+                {
+                    replica.push_back( logins[i] );
+                }
+            }
+            // 副本拿不到连接时退回主库
+            if( !replica.empty() && !flush( rpool, replica, false ) )
+            {
+                primary.insert( primary.end(), replica.begin(), replica.end() );
+            }
+            if( !primary.empty() )
+            {
+                flush( m_connpool, primary, false );
+            }
+        }
+        finish( regists );
+        finish( logins );
+
+        m_lock.lock();
+    }
+
+    // 退出前让所有等待者返回失败
+    list< sql_task* >::iterator it;
+    for( it = m_login_queue.begin(); it != m_login_queue.end(); ++it )
+    {
+        ( *it )->done.post();
+    }
+    for( it = m_regist_queue.begin(); it != m_regist_queue.end(); ++it )
+    {
+        ( *it )->done.post();
+    }
+    m_login_queue.clear();
+    m_regist_queue.clear();
+    m_lock.unlock();
+}
+
+bool sqlbatcher::flush( sqlconnpool* pool, vector< sql_task* >& tasks, bool regist )
+{
+    MYSQL* conn = NULL;
+    sqlconnRAII mysqlconn( &conn, pool );
+    if( !conn )
+    {
+        return false;
+    }
+    // 一批只记一次查询时间
+    uint64_t start = metrics::now_us();
+    if( regist )
+    {
+        flush_regist( conn, tasks );
+    }
+    else
+    {
+        flush_login( conn, tasks );
+    }
+    metrics::get_instance()->observe( H_DB_QUERY, metrics::now_us() - start );
+    return true;
+}
+
+string sqlbatcher::escape( MYSQL* conn, const string& str )
+{
+    string to( str.size() * 2 + 1, '\0' );
+    unsigned long len = mysql_real_escape_string( conn, &to[0], str.c_str(), str.size() );
+    to.resize( len );
+    return to;
+}
+
+// SELECT 0 FROM user WHERE username='a' AND password='x' UNION ALL SELECT 1 FROM user WHERE ...
+// 比较在数据库中完成，和不合并的查询结果一致；返回的每一行是一个登录成功的请求的下标
+void sqlbatcher::flush_login( MYSQL* conn, vector< sql_task* >& tasks )
+{
+    string sql_query;
+    for( size_t i = 0; i < tasks.size(); ++i )
+    {
+        if( i > 0 )
+        {
+            sql_query += " UNION ALL ";
+        }
+        sql_query += "SELECT " + to_string( i ) + " FROM user WHERE username='" + escape( conn, tasks[i]->name )
+                + "' AND password='" + escape( conn, tasks[i]->password ) + "'";
+    }
+    sql_query += ";";
+
+    if( mysql_real_query( conn, sql_query.c_str(), sql_query.size() ) )
+    {
+        return;
+    }
+    MYSQL_RES* result = mysql_store_result( conn );
+    if( !result )
+    {
+        return;
+    }
+    MYSQL_ROW row;
+    while( ( row = mysql_fetch_row( result ) ) != NULL )
+    {
+        size_t i = row[0] ? strtoul( row[0], NULL, 10 ) : tasks.size();
+        if( i < tasks.size() )
+        {
+            tasks[i]->result = true;
+        }
+    }
+    mysql_free_result( result );
+}
+
+// 一批INSERT放在同一个事务中，只提交一次
+void sqlbatcher::flush_regist( MYSQL* conn, vector< sql_task* >& tasks )
+{
+    mysql_autocommit( conn, 0 );
+    bool aborted = false;
+    for( size_t i = 0; i < tasks.size(); ++i )
+    {
+        string sql_insert = "INSERT INTO user(username, password) VALUES('"
+                + escape( conn, tasks[i]->name ) + "', '" + escape( conn, tasks[i]->password ) + "');";
+        if( !mysql_real_query( conn, sql_insert.c_str(), sql_insert.size() ) )
+        {
+            tasks[i]->result = true;
+            continue;
+        }
+        // 用户名重复只影响这一条语句，其他错误(如死锁)会回滚整个事务
+        if( mysql_errno( conn ) != ER_DUP_ENTRY )
+        {
+            aborted = true;
+            break;
+        }
+    }
+
+    if( aborted || mysql_commit( conn ) )
+    {
+        mysql_rollback( conn );
+        for( size_t i = 0; i < tasks.size(); ++i )
+        {
+            tasks[i]->result = false;
+        }
+    }
+    mysql_autocommit( conn, 1 );
+
+    // 提交后这些用户的登录暂时读主库
+    for( size_t i = 0; i < tasks.size(); ++i )
+    {
+        if( tasks[i]->result )
+        {
+            sqlrouter::get_instance()->mark_written( tasks[i]->name );
+        }
+    }
+}
+
+void sqlbatcher::finish( vector< sql_task* >& tasks )
+{
+    for( size_t i = 0; i < tasks.size(); ++i )
+    {
+        tasks[i]->done.post();
+    }
+    tasks.clear();
+}
@@ -0,0 +1,76 @@
+#ifndef _SQL_BATCH_
+#define _SQL_BATCH_
+
+#include <mysql/mysql.h>
+#include <list>
+#include <vector>
+#include <string>
+#include <pthread.h>
+#include "locker.h"
+#include "sqlconnpool.h"
+
+using namespace std;
+
+// 数据库请求合并层，位于sqlconnpool之前
+// 登录查询：窗口期内(或凑满batch_size个)的并发查询合并成一条UNION ALL查询，每个请求一个分支，
+// 分支的WHERE和不合并时相同，用户名和密码按列的排序规则比较(默认忽略大小写和末尾空格)
+// 注册插入：窗口期内的INSERT放到同一个事务中提交(group commit)
+// 工作线程提交请求后阻塞在各自的信号量上，由合并线程执行完后逐个唤醒
+class sqlbatcher
+{
+public:
+    // 单例模式
+    static sqlbatcher* get_instance();
+
+    // 启动合并线程
+    void init( sqlconnpool* connpool, int batch_size, int batch_window );
+    // 停止合并线程，未处理的请求全部返回失败
+    void stop();
+    bool enabled() const { return m_running; }
+
+    // 登录：用户名和密码匹配返回true
+    bool login( const string& name, const string& password );
+    // 注册：插入成功返回true
+    bool regist( const string& name, const string& password );
+
+private:
+    sqlbatcher();
+    ~sqlbatcher();
+
+    // 一个等待合并的请求，分配在调用者的栈上
+    struct sql_task
+    {
+        string name;
+        string password;
+        bool result;
+        sem done;       // 结果就绪后post
+    };
+
+    static void* worker( void* arg );
+    void run();
+    // 提交请求并等待结果
+    bool submit( list< sql_task* >& queue, sql_task* task );
+    // 从pool取一个连接执行一批请求，拿不到连接返回false
+    bool flush( sqlconnpool* pool, vector< sql_task* >& tasks, bool regist );
+    // 执行一批登录查询
+    void flush_login( MYSQL* conn, vector< sql_task* >& tasks );
+    // 执行一批注册插入
+    void flush_regist( MYSQL* conn, vector< sql_task* >& tasks );
+    // 唤醒一批请求
+    void finish( vector< sql_task* >& tasks );
+    string escape( MYSQL* conn, const string& str );
+
+private:
+    sqlconnpool* m_connpool;
+    int m_batch_size;           // 每批最多请求数
+    int m_batch_window;         // 合并窗口，微秒
+    bool m_running;
+    pthread_t m_thread;
+
+    locker m_lock;              // 保护两个队列
+    cond m_cond;                // 有新请求或者凑满一批
+    list< sql_task* > m_login_queue;
+    list< sql_task* > m_regist_queue;
+};
+
+#endif
@@ -1,11 +1,18 @@
 #include "sqlconnRAII.h"
 
+// connpool为NULL时不获取连接
+// 开启线程独占连接时优先使用本线程的连接，不需要归还
 sqlconnRAII::sqlconnRAII(MYSQL** sql, sqlconnpool* connpool){
+    connRAII = NULL;
+    connpoolRAII = connpool;
+    *sql = NULL;
+    if(!connpool) return;
+    if(connpool->is_affine() && (*sql = connpool->get_affine_connection()) != NULL) return;
+    // 池中没有余量给本线程独占，退回到每次借还
     *sql = connpool->get_connection();
     connRAII = *sql;
-    connpoolRAII = connpool;
 }
 
 sqlconnRAII::~sqlconnRAII(){
-    connpoolRAII->release_connection(connRAII);
+    if(connRAII) connpoolRAII->release_connection(connRAII);
 }
\ No newline at end of file
@@ -1,12 +1,52 @@
 #include <mysql/mysql.h>
+#include <sys/time.h>
+#include <vector>
+#include <algorithm>
 #include "sqlconnpool.h"
 #include "locker.h"
+#include "metrics.h"
+#include "probes.h"
 
 using namespace std;
 
+// 启动时并行建连的参数
+struct connect_arg
+{
+    sqlconnpool* pool;
+    MYSQL* conn;
+};
+
+// 当前线程在每个连接池中独占的连接及其最近一次使用时间，按连接池编号索引
+static __thread MYSQL* t_affine_conn[MAX_POOLS];
+static __thread time_t t_affine_used[MAX_POOLS];
+// 已创建的连接池数量，用于分配编号
+static int pool_count = 0;
+
+static unsigned long long elapsed_us(const struct timeval& start){
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start.tv_sec) * 1000000ULL + now.tv_usec - start.tv_usec;
+}
+
 sqlconnpool::sqlconnpool(){
     this->m_busy_conn = 0;
     this->m_free_conn = 0;
+    this->m_pending_conn = 0;
+    this->m_min_conn = 0;
+    this->m_max_conn = 0;
+    this->m_available = false;
+    this->m_running = false;
+    this->m_affine = false;
+    this->m_peak_busy = 0;
+    this->m_acquires = 0;
+    this->m_waits = 0;
+    this->m_wait_us = 0;
+    this->m_max_wait_us = 0;
+    this->m_timeouts = 0;
+    this->m_reconnects = 0;
+    this->m_affine_conn = 0;
+    this->m_waiting = 0;
+    this->m_id = __sync_fetch_and_add(&pool_count, 1);
 }
 
 // 获取单例
@@ -15,81 +55,380 @@ sqlconnpool* sqlconnpool::get_instance(){
     return &connpool;
 }
 
-void sqlconnpool::init(string url, string user, string password, string data_base_name, int port, unsigned int max_conn){
+// 建立一个新连接
+MYSQL* sqlconnpool::connect(){
+    MYSQL* conn = NULL;
+    conn = mysql_init(conn);
+    if(conn == NULL){
+        return NULL;
+    }
+    // 数据库宕机时不要让建连卡住太久
+    unsigned int timeout = WAIT_TIMEOUT;
+    mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &timeout);
+    if(mysql_real_connect(conn, m_url.c_str(), m_user.c_str(), m_password.c_str(), m_data_base_name.c_str(), m_port, NULL, 0) == NULL){
+        mysql_close(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+void* sqlconnpool::connect_worker(void* arg){
+    connect_arg* ca = (connect_arg*)arg;
+    ca->conn = ca->pool->connect();
+    mysql_thread_end();
+    return NULL;
+}
+
+void sqlconnpool::init(string url, string user, string password, string data_base_name, int port, unsigned int min_conn, unsigned int max_conn){
     this->m_url = url;
     this->m_user = user;
     this->m_password = password;
     this->m_data_base_name = data_base_name;
     this->m_port = port;
-    this->m_max_conn = max_conn;
+    this->m_min_conn = min_conn;
+    this->m_max_conn = max_conn < min_conn ? min_conn : max_conn;
+
+    // 多线程使用客户端库之前必须先初始化
+    mysql_library_init(0, NULL, NULL);
+
+    // 并行建立连接，启动耗时不再随连接数线性增长
+    vector<connect_arg> args(m_min_conn);
+    vector<pthread_t> threads(m_min_conn);
+    vector<bool> started(m_min_conn, false);
+    for(unsigned int i = 0; i < m_min_conn; ++i){
+        args[i].pool = this;
+        args[i].conn = NULL;
+        started[i] = pthread_create(&threads[i], NULL, connect_worker, &args[i]) == 0;
+        if(!started[i]){
+            args[i].conn = connect();
+        }
+    }
 
-    // 加锁
     lock.lock();
-    for(int i = 0; i < m_max_conn; ++i){
-        MYSQL* conn = NULL;
-        conn = mysql_init(conn);
-        if(conn == NULL){
-            exit(1);
+    time_t now = time(NULL);
+    for(unsigned int i = 0; i < m_min_conn; ++i){
+        if(started[i]){
+            pthread_join(threads[i], NULL);
         }
-        conn = mysql_real_connect(conn, m_url.c_str(), m_user.c_str(), m_password.c_str(), m_data_base_name.c_str(), port, NULL, 0);
-        // cout << "1234" << endl;
-        if(conn == NULL){
-            // cout << "123" << endl;
-            exit(1);
+        if(args[i].conn){
+            idle_conn item = { args[i].conn, now };
+            conn_list.push_back(item);
+            ++m_free_conn;
         }
-        // cout << "123" << endl;
-        conn_list.push_back(conn);
-        ++m_free_conn;
     }
-
-    reverse = sem(m_free_conn);
-    this->m_max_conn = m_free_conn;
+    // 一个都连不上时进入降级模式，只提供静态资源
+    m_available = m_free_conn > 0 || m_min_conn == 0;
+    m_running = true;
     lock.unlock();
+
+    if(!m_available){
+        printf("database unavailable, serving static content only\n");
+    }
+    if(pthread_create(&m_maintain_thread, NULL, maintain_worker, this) != 0){
+        m_running = false;
+    }
 }
 
 // 有请求时,获取一个连接
-MYSQL* sqlconnpool::get_connection(){
+MYSQL* sqlconnpool::get_connection(bool wait){
     MYSQL* conn = NULL;
-    if(conn_list.size() == 0){
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = start.tv_sec + WAIT_TIMEOUT;
+    deadline.tv_nsec = start.tv_usec * 1000;
+
+    lock.lock();
+    if(!m_running || !m_available){
+        lock.unlock();
         return NULL;
     }
-    reverse.wait();
-    lock.lock();
-    conn = conn_list.front();
-    conn_list.pop_front();
-    --m_free_conn;
-    ++m_busy_conn;
+    ++m_acquires;
+    bool waited = false;
+    bool timed_out = false;
+    while(true){
+        if(!conn_list.empty()){
+            conn = conn_list.front().conn;
+            conn_list.pop_front();
+            --m_free_conn;
+            break;
+        }
+        // 没有空闲连接且未达上限，按需扩容
+        if(m_free_conn + m_busy_conn + m_pending_conn < m_max_conn){
+            ++m_pending_conn;
+            lock.unlock();
+            conn = connect();
+            lock.lock();
+            --m_pending_conn;
+            if(conn == NULL){
+                // 连不上说明数据库出了问题，交给维护线程恢复
+                m_available = false;
+                m_cond.broadcast();
+                m_maintain_cond.signal();
+            }
+            break;
+        }
+        if(!wait){
+            break;
+        }
+        if(timed_out){
+            ++m_timeouts;
+            metrics::get_instance()->inc(M_DB_WAIT_TIMEOUTS);
+            break;
+        }
+        // 达到上限，等待其他线程归还
+        waited = true;
+        ++m_waiting;
+        if(!m_cond.timewait(lock.get(), deadline)){
+            timed_out = true;
+        }
+        --m_waiting;
+        if(!m_running || !m_available){
+            break;
+        }
+    }
+    if(conn){
+        ++m_busy_conn;
+        if(m_busy_conn > m_peak_busy){
+            m_peak_busy = m_busy_conn;
+        }
+    }
+    unsigned long long us = elapsed_us(start);
+    metrics::get_instance()->observe(H_DB_WAIT, us);
+    PROBE3(db_acquire, this, conn, us);
+    if(waited){
+        ++m_waits;
+        m_wait_us += us;
+        if(us > m_max_wait_us){
+            m_max_wait_us = us;
+        }
+    }
     lock.unlock();
     return conn;
 }
 
+void sqlconnpool::drop_affine(){
+    MYSQL* conn = t_affine_conn[m_id];
+    t_affine_conn[m_id] = NULL;
+    lock.lock();
+    // 不在列表中说明连接池已经销毁，连接已被关闭
+    list<MYSQL*>::iterator it = find(m_affine_list.begin(), m_affine_list.end(), conn);
+    bool owned = it != m_affine_list.end();
+    if(owned){
+        m_affine_list.erase(it);
+        --m_busy_conn;
+        --m_affine_conn;
+        ++m_reconnects;
+    }
+    lock.unlock();
+    if(owned){
+        mysql_close(conn);
+    }
+    m_cond.signal();
+}
+
+// 线程独占的连接不再归还，省掉每次请求的加锁和链表操作
+// 上一次调用出错(mysql_errno不为0)或者空闲超过CHECK_INTERVAL后先ping一下，坏了就关闭并重新从池中取
+MYSQL* sqlconnpool::get_affine_connection(){
+    if(!m_available || m_id >= MAX_POOLS){
+        return NULL;
+    }
+    time_t now = time(NULL);
+    MYSQL* conn = t_affine_conn[m_id];
+    if(conn && (mysql_errno(conn) != 0 || now - t_affine_used[m_id] >= CHECK_INTERVAL) && mysql_ping(conn) != 0){
+        drop_affine();
+    }
+    if(t_affine_conn[m_id] == NULL){
+        // 至少留一个连接在池中共享，否则没分到独占连接的线程会一直等不到
+        lock.lock();
+        bool room = m_affine_conn + 1 < m_max_conn;
+        if(room){
+            ++m_affine_conn;
+        }
+        lock.unlock();
+        if(!room){
+            return NULL;
+        }
+        t_affine_conn[m_id] = get_connection(false);
+        lock.lock();
+        if(t_affine_conn[m_id] == NULL){
+            --m_affine_conn;
+            lock.unlock();
+            return NULL;
+        }
+        m_affine_list.push_back(t_affine_conn[m_id]);
+        lock.unlock();
+    }
+    t_affine_used[m_id] = now;
+    return t_affine_conn[m_id];
+}
+
 // 释放当前连接
 bool sqlconnpool::release_connection(MYSQL* conn){
     // cout << "release" << endl;
     if(conn == NULL) return false;
     lock.lock();
-    conn_list.push_back(conn);
+    // 归还到头部，最近用过的连接优先复用，长时间空闲的留在尾部等待回收
+    idle_conn item = { conn, time(NULL) };
+    conn_list.push_front(item);
     ++m_free_conn;
     --m_busy_conn;
     lock.unlock();
-    reverse.post();
+    m_cond.signal();
     return true;
 }
 
+void* sqlconnpool::maintain_worker(void* arg){
+    sqlconnpool* pool = (sqlconnpool*)arg;
+    pool->maintain();
+    mysql_thread_end();
+    return NULL;
+}
+
+// 每CHECK_INTERVAL秒检查一次
+void sqlconnpool::maintain(){
+    while(true){
+        struct timespec deadline;
+        deadline.tv_sec = time(NULL) + CHECK_INTERVAL;
+        deadline.tv_nsec = 0;
+        lock.lock();
+        if(m_running){
+            m_maintain_cond.timewait(lock.get(), deadline);
+        }
+        if(!m_running){
+            lock.unlock();
+            break;
+        }
+        bool available = m_available;
+        lock.unlock();
+
+        // 降级状态下尝试重连，成功则恢复
+        if(!available){
+            MYSQL* conn = connect();
+            if(conn == NULL){
+                continue;
+            }
+            lock.lock();
+            idle_conn item = { conn, time(NULL) };
+            conn_list.push_front(item);
+            ++m_free_conn;
+            m_available = true;
+            lock.unlock();
+            m_cond.broadcast();
+            printf("database recovered\n");
+        }
+        check_idle();
+    }
+}
+
+// 检测空闲连接，坏连接重连，多余的空闲连接关闭，不足m_min_conn时补齐
+void sqlconnpool::check_idle(){
+    vector<idle_conn> checks;
+    time_t now = time(NULL);
+
+    // 只取出一段时间没用过的连接，在锁外ping
+    // 取出的连接计入m_pending_conn，防止这期间扩容超过上限
+    lock.lock();
+    unsigned int total = m_free_conn + m_busy_conn + m_pending_conn;
+    unsigned int surplus = total > m_min_conn ? total - m_min_conn : 0;
+    while(!conn_list.empty() && now - conn_list.back().last_used >= CHECK_INTERVAL){
+        checks.push_back(conn_list.back());
+        conn_list.pop_back();
+    }
+    m_free_conn -= checks.size();
+    m_pending_conn += checks.size();
+    lock.unlock();
+
+    vector<idle_conn> alive;
+    unsigned int closed = 0;
+    bool broken = false;
+    for(size_t i = 0; i < checks.size(); ++i){
+        // 空闲太久且超过最小连接数，关闭
+        if(now - checks[i].last_used >= IDLE_TIMEOUT && closed < surplus){
+            mysql_close(checks[i].conn);
+            ++closed;
+            continue;
+        }
+        if(mysql_ping(checks[i].conn) == 0){
+            alive.push_back(checks[i]);
+            continue;
+        }
+        // 坏连接，关闭后重连
+        mysql_close(checks[i].conn);
+        MYSQL* conn = broken ? NULL : connect();
+        if(conn == NULL){
+            broken = true;
+            continue;
+        }
+        idle_conn item = { conn, now };
+        alive.push_back(item);
+        lock.lock();
+        ++m_reconnects;
+        lock.unlock();
+    }
+
+    lock.lock();
+    for(size_t i = 0; i < alive.size(); ++i){
+        conn_list.push_back(alive[i]);
+    }
+    m_free_conn += alive.size();
+    m_pending_conn -= checks.size();
+    if(broken){
+        m_available = false;
+    }
+    unsigned int missing = 0;
+    total = m_free_conn + m_busy_conn + m_pending_conn;
+    if(m_available && total < m_min_conn){
+        missing = m_min_conn - total;
+        m_pending_conn += missing;
+    }
+    lock.unlock();
+    m_cond.broadcast();
+
+    // 补齐到最小连接数
+    for(unsigned int i = 0; i < missing; ++i){
+        MYSQL* conn = connect();
+        lock.lock();
+        --m_pending_conn;
+        if(conn){
+            idle_conn item = { conn, time(NULL) };
+            conn_list.push_front(item);
+            ++m_free_conn;
+        }
+        lock.unlock();
+        m_cond.signal();
+    }
+}
+
 // 销毁连接池
 void sqlconnpool::destroy_pool(){
+    lock.lock();
+    bool running = m_running;
+    m_running = false;
+    lock.unlock();
+    m_cond.broadcast();
+    m_maintain_cond.signal();
+    if(running){
+        pthread_join(m_maintain_thread, NULL);
+    }
+
     lock.lock();
     if(conn_list.size() > 0){
-        list<MYSQL*>::iterator it;
+        list<idle_conn>::iterator it;
         for(it = conn_list.begin(); it != conn_list.end(); ++it){
-            MYSQL* conn = *it;
-            mysql_close(conn);
+            mysql_close(it->conn);
         }
         m_busy_conn = 0;
         m_free_conn = 0;
         conn_list.clear();
-        lock.unlock();
     }
+    // 线程独占的连接一并关闭；m_available置为false，各线程之后不会再使用手里的旧指针
+    for(list<MYSQL*>::iterator it = m_affine_list.begin(); it != m_affine_list.end(); ++it){
+        mysql_close(*it);
+    }
+    m_affine_list.clear();
+    m_affine_conn = 0;
+    m_available = false;
     lock.unlock();
 }
 
@@ -98,6 +437,35 @@ int sqlconnpool::get_free_conn(){
     return this->m_free_conn;
 }
 
+// 不计入被线程独占的连接，作为选择副本时的负载参考，不加锁
+unsigned int sqlconnpool::outstanding(){
+    int n = (int)m_busy_conn - (int)m_affine_conn + (int)m_waiting;
+    return n > 0 ? n : 0;
+}
+
+bool sqlconnpool::available(){
+    return this->m_available;
+}
+
+sqlpool_stats sqlconnpool::get_stats(){
+    sqlpool_stats stats;
+    lock.lock();
+    stats.total_conn = m_free_conn + m_busy_conn;
+    stats.free_conn = m_free_conn;
+    stats.busy_conn = m_busy_conn;
+    stats.peak_busy = m_peak_busy;
+    stats.acquires = m_acquires;
+    stats.waits = m_waits;
+    stats.wait_us = m_wait_us;
+    stats.max_wait_us = m_max_wait_us;
+    stats.timeouts = m_timeouts;
+    stats.reconnects = m_reconnects;
+    stats.affine_conn = m_affine_conn;
+    stats.available = m_available;
+    lock.unlock();
+    return stats;
+}
+
 sqlconnpool::~sqlconnpool(){
     destroy_pool();
 }
@@ -10,32 +10,93 @@
 #include <string>
 #include <stdlib.h>
 #include <pthread.h>
+#include <time.h>
 #include "locker.h"
 
 using namespace std;
 
+// 线程独占连接最多支持的连接池个数(主库+副本)
+#define MAX_POOLS 16
+
+// 连接池运行统计
+struct sqlpool_stats
+{
+    unsigned int total_conn;        // 当前连接总数(空闲+忙碌)
+    unsigned int free_conn;         // 空闲连接数
+    unsigned int busy_conn;         // 忙碌连接数
+    unsigned int peak_busy;         // 忙碌连接数峰值
+    unsigned long long acquires;    // 获取连接次数
+    unsigned long long waits;       // 需要等待的获取次数
+    unsigned long long wait_us;     // 累计等待时间，微秒
+    unsigned long long max_wait_us; // 最长一次等待，微秒
+    unsigned long long timeouts;    // 等待超时次数
+    unsigned long long reconnects;  // 断线重连次数
+    unsigned int affine_conn;       // 被线程独占的连接数(计入busy_conn)
+    bool available;                 // 数据库是否可用
+};
+
 class sqlconnpool
 {
 public:
-    // 获取数据库连接
-    MYSQL* get_connection();
+    // 获取数据库连接，没有空闲连接时按需扩容，达到上限则等待
+    // 数据库不可用或等待超时返回NULL，wait为false时不等待
+    MYSQL* get_connection(bool wait = true);
+    // 获取当前线程独占的连接，第一次调用时从池中取出并一直持有，之后无锁返回
+    // 上次使用出错或者空闲较久时先ping，坏了换一个；池中没有余量时返回NULL，调用者退回到get_connection
+    MYSQL* get_affine_connection();
+    // 是否开启线程独占连接
+    bool is_affine() { return m_affine; }
+    void set_affine(bool affine) { m_affine = affine; }
     // 释放连接
     bool release_connection(MYSQL* conn);
     // 获取连接
     int get_free_conn();
     // 销毁所有连接
     void destroy_pool();
+    // 数据库是否可用，不可用时服务器降级为只提供静态资源
+    bool available();
+    // 正在执行和等待中的请求数
+    unsigned int outstanding();
+    // 读取统计信息
+    sqlpool_stats get_stats();
 
-    // 单例模式,本身是安全的
+    // 单例模式,本身是安全的，单例为主库连接池，副本的连接池由sqlrouter创建
     static sqlconnpool *get_instance();
     
-    // 初始化
-    void init(string url, string user, string password, string data_base_name, int port, unsigned int max_conn);
+    // 初始化，并行建立min_conn个连接，连接数可在[min_conn, max_conn]之间伸缩
+    // 数据库连不上时不退出，由后台线程继续重试
+    void init(string url, string user, string password, string data_base_name, int port, unsigned int min_conn, unsigned int max_conn);
     
     sqlconnpool();
     ~sqlconnpool(); 
 
 private:
+    // 空闲连接及其最近一次归还的时间
+    struct idle_conn
+    {
+        MYSQL* conn;
+        time_t last_used;
+    };
+
+    // 建立一个新连接，失败返回NULL
+    MYSQL* connect();
+    // 启动时并行建立连接的线程函数
+    static void* connect_worker(void* arg);
+    // 后台维护线程：检测坏连接并重连，回收长时间空闲的连接，数据库恢复后退出降级
+    static void* maintain_worker(void* arg);
+    void maintain();
+    void check_idle();
+    // 关闭当前线程独占的坏连接，腾出的名额还给池
+    void drop_affine();
+
+private:
+    // 等待空闲连接的最长时间，秒
+    static const int WAIT_TIMEOUT = 3;
+    // 维护线程的检查周期，秒
+    static const int CHECK_INTERVAL = 10;
+    // 空闲超过该时间且连接数大于m_min_conn时关闭，秒
+    static const int IDLE_TIMEOUT = 60;
+
     string m_url;
     string m_user;
     string m_password;
@@ -43,12 +104,34 @@ private:
     int m_port;
 
     locker lock;    // 对连接池进行处理 需要加锁
-    sem reverse;
-    list<MYSQL*> conn_list;
+    cond m_cond;    // 有连接归还或者数据库恢复，只有等待连接的工作线程在上面等待
+    cond m_maintain_cond;   // 唤醒维护线程：数据库出错或者连接池销毁；和m_cond分开，归还连接的signal不会被维护线程消耗
+    list<idle_conn> conn_list;
+    // 被线程独占的连接，线程局部变量在其他线程中访问不到，销毁连接池时从这里关闭
+    list<MYSQL*> m_affine_list;
 
+    unsigned int m_min_conn;
     unsigned int m_max_conn;
     unsigned int m_free_conn;
     unsigned int m_busy_conn;
+    // 正在建立中的连接，计入总数防止并发扩容超过上限
+    unsigned int m_pending_conn;
+    bool m_available;
+    bool m_running;
+    bool m_affine;
+    pthread_t m_maintain_thread;
+
+    // 统计
+    unsigned int m_peak_busy;
+    unsigned long long m_acquires;
+    unsigned long long m_waits;
+    unsigned long long m_wait_us;
+    unsigned long long m_max_wait_us;
+    unsigned long long m_timeouts;
+    unsigned long long m_reconnects;
+    unsigned int m_affine_conn;
+    unsigned int m_waiting;         // 正在等待空闲连接的线程数
+    int m_id;                       // 连接池编号，索引线程独占连接
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,116 @@
+#include "sqlrouter.h"
+
+sqlrouter::sqlrouter()
+{
+    m_writer = NULL;
+    m_next = 0;
+}
+
+sqlrouter::~sqlrouter()
+{
+    for( size_t i = 0; i < m_readers.size(); ++i )
+    {
+        m_readers[i]->destroy_pool();
+        delete m_readers[i];
+    }
+    m_readers.clear();
+}
+
+sqlrouter* sqlrouter::get_instance()
+{
+    static sqlrouter router;
+    return &router;
+}
+
+void sqlrouter::init( sqlconnpool* writer, const vector< string >& hosts, const vector< int >& ports,
+                      string user, string password, string data_base_name,
+                      unsigned int min_conn, unsigned int max_conn, bool affine )
+{
+    m_writer = writer;
+    for( size_t i = 0; i < hosts.size(); ++i )
+    {
+        sqlconnpool* pool = new sqlconnpool;
+        pool->init( hosts[i], user, password, data_base_name, ports[i], min_conn, max_conn );
+        pool->set_affine( affine );
+        m_readers.push_back( pool );
+    }
+}
+
+sqlconnpool* sqlrouter::reader( const string& name )
+{
+    if( m_readers.empty() || ( !name.empty() && sticky( name ) ) )
+    {
+        return m_writer;
+    }
+
+    // 从轮询起点开始找未完成请求最少的可用副本
+    size_t n = m_readers.size();
+    size_t start = __sync_fetch_and_add( &m_next, 1 ) % n;
+    sqlconnpool* best = NULL;
+    unsigned int best_load = 0;
+    for( size_t i = 0; i < n; ++i )
+    {
+        sqlconnpool* pool = m_readers[ ( start + i ) % n ];
+        if( !pool->available() )
+        {
+            continue;
+        }
+        unsigned int load = pool->outstanding();
+        if( !best || load < best_load )
+        {
+            best = pool;
+            best_load = load;
+        }
+    }
+    return best ? best : m_writer;
+}
+
+void sqlrouter::mark_written( const string& name )
+{
+    if( m_readers.empty() )
+    {
+        return;
+    }
+    time_t now = time( NULL );
+    m_lock.lock();
+    if( m_recent.size() >= STICKY_LIMIT )
+    {
+        map< string, time_t >::iterator it = m_recent.begin();
+        while( it != m_recent.end() )
+        {
+            if( it->second <= now )
+            {
+                m_recent.erase( it++ );
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    m_recent[ name ] = now + STICKY_TIME;
+    m_lock.unlock();
+}
+
+bool sqlrouter::sticky( const string& name )
+{
+    bool ret = false;
+    m_lock.lock();
+    if( !m_recent.empty() )
+    {
+        map< string, time_t >::iterator it = m_recent.find( name );
+        if( it != m_recent.end() )
+        {
+            if( it->second > time( NULL ) )
+            {
+                ret = true;
+            }
+            else
+            {
+                m_recent.erase( it );
+            }
+        }
+    }
+    m_lock.unlock();
+    return ret;
+}
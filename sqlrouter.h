@@ -0,0 +1,55 @@
+#ifndef _SQL_ROUTER_
+#define _SQL_ROUTER_
+
+#include <map>
+#include <vector>
+#include <string>
+#include <time.h>
+#include "locker.h"
+#include "sqlconnpool.h"
+
+using namespace std;
+
+// 读写分离
+// 写(注册INSERT)只走主库，读(登录SELECT)分散到各个副本
+// 副本按未完成请求数最少选择，相同时轮询
+// 刚注册的用户在STICKY_TIME秒内读主库，避免复制延迟导致注册后立即登录失败
+class sqlrouter
+{
+public:
+    static sqlrouter* get_instance();
+
+    // writer为主库连接池，每个副本创建一个连接池
+    void init( sqlconnpool* writer, const vector< string >& hosts, const vector< int >& ports,
+               string user, string password, string data_base_name,
+               unsigned int min_conn, unsigned int max_conn, bool affine );
+    // 写连接池
+    sqlconnpool* writer() { return m_writer; }
+    // 为name选择读连接池，没有可用副本时返回主库
+    sqlconnpool* reader( const string& name );
+    // 是否配置了副本
+    bool has_replicas() { return !m_readers.empty(); }
+    // 注册成功后调用
+    void mark_written( const string& name );
+    // name是否在刚写入的保护期内
+    bool sticky( const string& name );
+
+private:
+    sqlrouter();
+    ~sqlrouter();
+
+private:
+    // 注册后读主库的时间，秒
+    static const int STICKY_TIME = 5;
+    // 保护期表超过该大小时清理过期项
+    static const size_t STICKY_LIMIT = 4096;
+
+    sqlconnpool* m_writer;
+    vector< sqlconnpool* > m_readers;
+    unsigned int m_next;        // 轮询起点
+
+    locker m_lock;              // 保护m_recent
+    map< string, time_t > m_recent;     // 用户名 -> 保护期结束时间
+};
+
+#endif
@@ -5,10 +5,10 @@
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
-#include "sqlconnpool.h"
-#include "sqlconnRAII.h"
 // 线程同步机制的包装类
 #include "locker.h"
+#include "metrics.h"
+#include "probes.h"
 
 // 线程池类，定义为模板类
 // 半同步 半反应堆模式
@@ -20,10 +20,12 @@ public:
      * thread_number 线程池中线程的数量，
      * max_requests 请求队列中最多允许的，等待的请求的数量
      */
-    threadpool(sqlconnpool* connpool, int thread_number = 9, int max_requests = 10000 );
+    threadpool( int thread_number = 9, int max_requests = 10000 );
     ~threadpool();
     // 往请求队列中添加任务
     bool append( T* request );
+    // 当前排队的请求数
+    size_t queue_size();
 
 private:
     // 工作线程运行的函数，不断从工作队列中取出任务并执行
@@ -34,17 +36,16 @@ private:
     int m_thread_number;        // 线程数
     int m_max_requests;         // 最大请求数
     pthread_t* m_threads;       // 线程池数组，大小为m_thread_number
-    std::list< T* > m_workqueue;    // 请求队列
+    std::list< std::pair< T*, uint64_t > > m_workqueue;    // 请求队列，附带入队时间
     locker m_queuelocker;       // 保护请求队列的互斥锁
     sem m_queuestat;            // 是否有任务需要处理
     bool m_stop;                // 是否结束线程
-    sqlconnpool* m_connpool;      // 数据库连接池
 };
 
 // 构造函数
 template< typename T >
-threadpool< T >::threadpool( sqlconnpool* connpool, int thread_number, int max_requests ) : 
-        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL ), m_connpool(connpool)
+threadpool< T >::threadpool( int thread_number, int max_requests ) : 
+        m_thread_number( thread_number ), m_max_requests( max_requests ), m_stop( false ), m_threads( NULL )
 {
     if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
     {
@@ -96,12 +97,22 @@ bool threadpool< T >::append( T* request )
         m_queuelocker.unlock();
         return false;
     }
-    m_workqueue.push_back( request );
+    m_workqueue.push_back( std::make_pair( request, metrics::now_us() ) );
+    PROBE2( enqueue, request, m_workqueue.size() );
     m_queuelocker.unlock();
     m_queuestat.post();
     return true;
 }
 
+template< typename T >
+size_t threadpool< T >::queue_size()
+{
+    m_queuelocker.lock();
+    size_t size = m_workqueue.size();
+    m_queuelocker.unlock();
+    return size;
+}
+
 template< typename T >
 void* threadpool< T >::worker( void* arg )
 {
@@ -123,23 +134,19 @@ void threadpool< T >::run()
             m_queuelocker.unlock();
             continue;
         }
-        T* request = m_workqueue.front();
+        T* request = m_workqueue.front().first;
+        uint64_t enqueue_us = m_workqueue.front().second;
         m_workqueue.pop_front();
         m_queuelocker.unlock();
+        uint64_t wait_us = metrics::now_us() - enqueue_us;
+        metrics::get_instance()->observe( H_QUEUE_WAIT, wait_us );
+        PROBE2( dequeue, request, wait_us );
         if ( ! request )
         {
             continue;
         }
-        // 获取一条mysql连接，还需要释放，采用RAII机制
-        sqlconnRAII mysqlconn(&request->mysql, m_connpool);
-        request->process();
-        // 否则手动释放
-        /* 
-        request->mysql = m_connpool->get_connection();
+        // 数据库连接由凭据存储后端在需要时获取，静态资源请求不占用连接
         request->process();
-        m_connpool->release_connection(request->mysql);
-        // 悬空指针赋值为NULL
-        request->mysql = NULL; */
 
         // cout << "release current threadpool" << endl;
     }
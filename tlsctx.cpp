@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include "tlsctx.h"
+#include "metrics.h"
+
+// 服务端会话缓存的容量和会话有效期
+static const long SESSION_CACHE_SIZE = 20480;
+static const long SESSION_TIMEOUT_S = 300;
+// 一条TLS记录的最大明文长度
+static const size_t TLS_RECORD_SIZE = 16384;
+// ALPN按服务端的顺序选择，客户端支持h2时优先
+static const unsigned char ALPN_PROTOS[] = "\x02h2\x08http/1.1";
+
+static int select_alpn( SSL*, const unsigned char** out, unsigned char* outlen,
+                        const unsigned char* in, unsigned int inlen, void* )
+{
+    if( SSL_select_next_proto( ( unsigned char** )out, outlen, ALPN_PROTOS, sizeof( ALPN_PROTOS ) - 1, in, inlen )
+        != OPENSSL_NPN_NEGOTIATED )
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+tls_context* tls_context::get_instance()
+{
+    static tls_context ctx;
+    return &ctx;
+}
+
+tls_context::tls_context()
+{
+    m_ctx = NULL;
+}
+
+tls_context::~tls_context()
+{
+    if( m_ctx )
+    {
+        SSL_CTX_free( m_ctx );
+    }
+}
+
+bool tls_context::init( const char* cert_path, const char* key_path )
+{
+    m_ctx = SSL_CTX_new( TLS_server_method() );
+    if( !m_ctx )
+    {
+        return false;
+    }
+    SSL_CTX_set_min_proto_version( m_ctx, TLS1_2_VERSION );
+    // 握手完成后由OpenSSL设置TLS_TX/TLS_RX，内核不支持时静默退回用户态
+    SSL_CTX_set_options( m_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE );
+    // 非阻塞写允许只写一部分，重试时缓冲区地址可以变化(advance之后iovec的起点会移动)
+    SSL_CTX_set_mode( m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS );
+
+    // ticket默认开启，密钥由OpenSSL生成；不支持ticket的客户端用会话缓存
+    static const unsigned char sid_ctx[] = "myServer";
+    SSL_CTX_set_session_id_context( m_ctx, sid_ctx, sizeof( sid_ctx ) - 1 );
+    SSL_CTX_set_session_cache_mode( m_ctx, SSL_SESS_CACHE_SERVER );
+    SSL_CTX_sess_set_cache_size( m_ctx, SESSION_CACHE_SIZE );
+    SSL_CTX_set_timeout( m_ctx, SESSION_TIMEOUT_S );
+    SSL_CTX_set_alpn_select_cb( m_ctx, select_alpn, NULL );
+
+    if( SSL_CTX_use_certificate_chain_file( m_ctx, cert_path ) != 1
+        || SSL_CTX_use_PrivateKey_file( m_ctx, key_path, SSL_FILETYPE_PEM ) != 1
+        || SSL_CTX_check_private_key( m_ctx ) != 1 )
+    {
+        ERR_print_errors_fp( stdout );
+        SSL_CTX_free( m_ctx );
+        m_ctx = NULL;
+        return false;
+    }
+    return true;
+}
+
+SSL* tls_context::accept( int fd )
+{
+    SSL* ssl = SSL_new( m_ctx );
+    if( !ssl )
+    {
+        return NULL;
+    }
+    if( SSL_set_fd( ssl, fd ) != 1 )
+    {
+        SSL_free( ssl );
+        return NULL;
+    }
+    SSL_set_accept_state( ssl );
+    return ssl;
+}
+
+bool tls_context::established( SSL* ssl )
+{
+    metrics* stat = metrics::get_instance();
+    stat->inc( M_TLS_HANDSHAKES );
+    if( SSL_session_reused( ssl ) )
+    {
+        stat->inc( M_TLS_RESUMED );
+    }
+    bool ktls_tx = BIO_get_ktls_send( SSL_get_wbio( ssl ) );
+    if( ktls_tx )
+    {
+        stat->inc( M_TLS_KTLS_TX );
+    }
+    if( BIO_get_ktls_recv( SSL_get_rbio( ssl ) ) )
+    {
+        stat->inc( M_TLS_KTLS_RX );
+    }
+    return ktls_tx;
+}
+
+// SSL_get_error转换成errno，WANT_READ/WANT_WRITE都当作EAGAIN，由调用者按当前方向等待
+static int tls_errno( SSL* ssl, int ret )
+{
+    int err = SSL_get_error( ssl, ret );
+    ERR_clear_error();
+    if( err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE )
+    {
+        return EAGAIN;
+    }
+    return err == SSL_ERROR_SYSCALL && errno ? errno : EIO;
+}
+
+int tls_recv( SSL* ssl, char* buf, int len )
+{
+    int ret = SSL_read( ssl, buf, len );
+    if( ret > 0 )
+    {
+        return ret;
+    }
+    // 对端发送close_notify，和recv返回0一样
+    if( SSL_get_error( ssl, ret ) == SSL_ERROR_ZERO_RETURN )
+    {
+        return 0;
+    }
+    errno = tls_errno( ssl, ret );
+    return -1;
+}
+
+int tls_writev( SSL* ssl, const struct iovec* iov, int count )
+{
+    int i = 0;
+    while( i < count && iov[i].iov_len == 0 )
+    {
+        ++i;
+    }
+    if( i == count )
+    {
+        return 0;
+    }
+    const void* buf = iov[i].iov_base;
+    size_t len = iov[i].iov_len;
+    // 第一块不足一条记录时把后面的块复制进来凑满，HTTP/2的9字节帧头不会单独成为一条记录，
+    // 也不会因为Nagle算法等待对端的ACK；重试时iovec没有变化，复制出的内容和上次相同
+    char gather[ TLS_RECORD_SIZE ];
+    if( len < TLS_RECORD_SIZE && i + 1 < count )
+    {
+        len = 0;
+        for( ; i < count && len < TLS_RECORD_SIZE; ++i )
+        {
+            size_t n = std::min( iov[i].iov_len, TLS_RECORD_SIZE - len );
+            memcpy( gather + len, iov[i].iov_base, n );
+            len += n;
+        }
+        buf = gather;
+    }
+    // SSL_write的长度是int，大文件分多次发送
+    int ret = SSL_write( ssl, buf, len < ( 1u << 30 ) ? ( int )len : ( 1 << 30 ) );
+    if( ret > 0 )
+    {
+        return ret;
+    }
+    errno = tls_errno( ssl, ret );
+    return -1;
+}
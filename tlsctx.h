@@ -0,0 +1,40 @@
+#ifndef TLSCTX_H
+#define TLSCTX_H
+
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+// HTTPS
+// 握手在http_conn的read()/write()中非阻塞地进行，和请求解析一样由epoll事件驱动。
+// 握手完成后OpenSSL尝试打开内核TLS(kTLS)：成功时记录的加密解密由内核完成，响应照旧用writev发送mmap的文件，
+// 和明文连接一样不在用户态复制和加密；内核不支持时退回SSL_read/SSL_write。
+// 会话复用同时支持session ticket和服务端会话缓存。
+// ALPN优先选择h2，之后的连接前言由http_conn识别，和明文的h2c一样处理。
+class tls_context
+{
+public:
+    static tls_context* get_instance();
+
+    // 加载PEM格式的证书链和私钥
+    bool init( const char* cert_path, const char* key_path );
+    bool enabled() const { return m_ctx != NULL; }
+    // 为新接受的连接创建SSL对象，失败返回NULL
+    SSL* accept( int fd );
+    // 握手完成后调用，记录指标，返回内核是否接管了发送方向的加密
+    bool established( SSL* ssl );
+
+private:
+    tls_context();
+    ~tls_context();
+
+private:
+    SSL_CTX* m_ctx;
+};
+
+// 返回值和errno同recv，需要等待时返回-1且errno为EAGAIN
+int tls_recv( SSL* ssl, char* buf, int len );
+// 返回值和errno同writev，第一块非空的iovec不足一条记录时和后面的块合并成一条记录发送
+int tls_writev( SSL* ssl, const struct iovec* iov, int count );
+
+#endif
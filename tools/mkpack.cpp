@@ -0,0 +1,444 @@
+// 站点打包工具：把文档目录打包成服务器-D使用的打包文件，格式见sitepack.h
+// 每个文件预先生成状态行、Content-Length、Content-Type和ETag头部，可压缩的类型另外存一份gzip变体，
+// 压缩后没有小于原文的90%时不保存；文件内容页对齐，按大小升序排列，小文件和索引组成热区。
+// 先写到out.tmp，fsync之后rename成out，替换是原子的，服务器读到的总是完整的文件。
+//
+// 用法: ./mkpack [-z min_gzip_bytes] [-t hot_file_bytes] doc_root out.pack
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "../sitepack.h"
+
+using namespace std;
+
+struct pack_file
+{
+    string path;                // 以/开头
+    string body[ PACK_ENCODINGS ];
+    bool has_gzip;
+    string etag[ PACK_ENCODINGS ];
+    const char* type;
+};
+
+static vector< pack_file > g_files;
+static size_t g_root_len;
+static size_t g_min_gzip = 256;
+
+// 按扩展名决定Content-Type，compress表示值得预先压缩
+struct mime_type
+{
+    const char* ext;
+    const char* type;
+    bool compress;
+};
+
+static const mime_type MIME_TYPES[] = {
+    { ".html", "text/html; charset=utf-8", true },
+    { ".htm", "text/html; charset=utf-8", true },
+    { ".css", "text/css", true },
+    { ".js", "application/javascript", true },
+    { ".json", "application/json", true },
+    { ".txt", "text/plain; charset=utf-8", true },
+    { ".xml", "application/xml", true },
+    { ".svg", "image/svg+xml", true },
+    { ".ico", "image/x-icon", true },
+    { ".png", "image/png", false },
+    { ".jpg", "image/jpeg", false },
+    { ".jpeg", "image/jpeg", false },
+    { ".gif", "image/gif", false },
+    { ".webp", "image/webp", false },
+    { ".mp4", "video/mp4", false },
+    { ".woff2", "font/woff2", false },
+};
+
+static const mime_type* find_mime( const string& path )
+{
+    size_t dot = path.rfind( '.' );
+    if( dot == string::npos || path.find( '/', dot ) != string::npos )
+    {
+        return NULL;
+    }
+    for( size_t i = 0; i < sizeof( MIME_TYPES ) / sizeof( MIME_TYPES[0] ); ++i )
+    {
+        if( strcasecmp( path.c_str() + dot, MIME_TYPES[i].ext ) == 0 )
+        {
+            return &MIME_TYPES[i];
+        }
+    }
+    return NULL;
+}
+
+// 内容的64位FNV-1a，内容中可以有\0
+static uint64_t content_hash( const string& s )
+{
+    uint64_t h = 14695981039346656037ull;
+    for( size_t i = 0; i < s.size(); ++i )
+    {
+        h ^= ( uint8_t )s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static bool read_file( const char* path, string& out )
+{
+    int fd = open( path, O_RDONLY );
+    if( fd < 0 )
+    {
+        return false;
+    }
+    char buf[ 65536 ];
+    ssize_t n;
+    while( ( n = read( fd, buf, sizeof( buf ) ) ) > 0 )
+    {
+        out.append( buf, n );
+    }
+    close( fd );
+    return n == 0;
+}
+
+static bool gzip( const string& in, string& out )
+{
+    z_stream zs;
+    memset( &zs, 0, sizeof( zs ) );
+    // windowBits加16输出gzip格式
+    if( deflateInit2( &zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK )
+    {
+        return false;
+    }
+    out.resize( deflateBound( &zs, in.size() ) );
+    zs.next_in = ( Bytef* )in.data();
+    zs.avail_in = in.size();
+    zs.next_out = ( Bytef* )&out[0];
+    zs.avail_out = out.size();
+    int ret = deflate( &zs, Z_FINISH );
+    out.resize( zs.total_out );
+    deflateEnd( &zs );
+    return ret == Z_STREAM_END;
+}
+
+static int visit( const char* path, const struct stat* st, int type, struct FTW* )
+{
+    if( type != FTW_F || !S_ISREG( st->st_mode ) )
+    {
+        return 0;
+    }
+    // 服务器对其他用户不可读的文件回复403，不打包
+    if( !( st->st_mode & S_IROTH ) )
+    {
+        fprintf( stderr, "skip %s: not world-readable\n", path );
+        return 0;
+    }
+    pack_file f;
+    f.path = path + g_root_len;
+    if( !read_file( path, f.body[ PACK_IDENTITY ] ) )
+    {
+        fprintf( stderr, "cannot read %s: %s\n", path, strerror( errno ) );
+        return -1;
+    }
+    const string& body = f.body[ PACK_IDENTITY ];
+    const mime_type* mime = find_mime( f.path );
+    f.type = mime ? mime->type : "application/octet-stream";
+    f.has_gzip = false;
+    if( mime && mime->compress && body.size() >= g_min_gzip && gzip( body, f.body[ PACK_GZIP ] ) )
+    {
+        f.has_gzip = f.body[ PACK_GZIP ].size() < body.size() / 10 * 9;
+    }
+    if( !f.has_gzip )
+    {
+        f.body[ PACK_GZIP ].clear();
+    }
+    // 强ETag由原文的哈希和长度组成，内容不变时重新打包ETag也不变；
+    // 强ETag要区分内容编码，gzip变体加-gz后缀，缓存和范围请求不会把两种消息体混在一起
+    char etag[ 64 ];
+    snprintf( etag, sizeof( etag ), "\"%llx-%016llx", ( unsigned long long )body.size(),
+              ( unsigned long long )content_hash( body ) );
+    f.etag[ PACK_IDENTITY ] = string( etag ) + "\"";
+    f.etag[ PACK_GZIP ] = string( etag ) + "-gz\"";
+    g_files.push_back( f );
+    return 0;
+}
+
+static uint32_t next_pow2( uint32_t n )
+{
+    uint32_t p = 1;
+    while( p < n )
+    {
+        p <<= 1;
+    }
+    return p;
+}
+
+// 为每个桶找位移，桶按大小降序处理，大桶在槽还空的时候先放；失败返回false
+static bool build_index( const vector< pack_file >& files, uint32_t bucket_count, uint32_t slot_count,
+                         vector< uint32_t >& disp, vector< uint32_t >& slots )
+{
+    vector< uint64_t > hashes( files.size() );
+    vector< vector< uint32_t > > buckets( bucket_count );
+    for( size_t i = 0; i < files.size(); ++i )
+    {
+        hashes[i] = pack_hash( files[i].path.c_str() );
+        buckets[ pack_bucket( hashes[i], bucket_count ) ].push_back( i );
+    }
+    vector< uint32_t > order( bucket_count );
+    for( uint32_t b = 0; b < bucket_count; ++b )
+    {
+        order[b] = b;
+    }
+    stable_sort( order.begin(), order.end(), [&]( uint32_t a, uint32_t b ) { return buckets[a].size() > buckets[b].size(); } );
+
+    disp.assign( bucket_count, 0 );
+    slots.assign( slot_count, 0 );
+    vector< uint32_t > taken;
+    for( uint32_t b : order )
+    {
+        const vector< uint32_t >& keys = buckets[b];
+        if( keys.empty() )
+        {
+            break;
+        }
+        uint32_t d = 0;
+        for( ; d < ( 1u << 24 ); ++d )
+        {
+            taken.clear();
+            bool ok = true;
+            for( uint32_t k : keys )
+            {
+                uint32_t s = pack_slot( hashes[k], d, slot_count );
+                if( slots[s] || find( taken.begin(), taken.end(), s ) != taken.end() )
+                {
+                    ok = false;
+                    break;
+                }
+                taken.push_back( s );
+            }
+            if( ok )
+            {
+                break;
+            }
+        }
+        if( d == ( 1u << 24 ) )
+        {
+            return false;
+        }
+        disp[b] = d;
+        for( size_t i = 0; i < keys.size(); ++i )
+        {
+            slots[ taken[i] ] = keys[i] + 1;
+        }
+    }
+    return true;
+}
+
+static uint64_t align_up( uint64_t off, uint64_t align )
+{
+    return ( off + align - 1 ) / align * align;
+}
+
+// 字符串追加到字符串区，返回偏移
+static uint64_t add_string( string& strings, uint64_t base, const string& s )
+{
+    uint64_t off = base + strings.size();
+    strings += s;
+    strings += '\0';
+    return off;
+}
+
+static bool write_all( int fd, const char* data, size_t len )
+{
+    while( len > 0 )
+    {
+        ssize_t n = write( fd, data, len );
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+            {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool write_pad( int fd, uint64_t& off, uint64_t to )
+{
+    static const char zeros[ PACK_ALIGN ] = {};
+    size_t n = to - off;
+    off = to;
+    return write_all( fd, zeros, n );
+}
+
+static void usage( const char* prog )
+{
+    fprintf( stderr, "usage: %s [options] doc_root out.pack\n", prog );
+    fprintf( stderr, "  -z bytes        smallest file to precompress with gzip (default 256)\n" );
+    fprintf( stderr, "  -t bytes        files up to this size are in the hot region locked by the server's -k (default 65536)\n" );
+}
+
+int main( int argc, char* argv[] )
+{
+    uint64_t hot_file = 65536;
+    int opt;
+    while( ( opt = getopt( argc, argv, "z:t:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+        case 'z':
+            g_min_gzip = strtoull( optarg, NULL, 10 );
+            break;
+        case 't':
+            hot_file = strtoull( optarg, NULL, 10 );
+            break;
+        default:
+            usage( argv[0] );
+            return 1;
+        }
+    }
+    if( argc - optind != 2 )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+    string root = argv[ optind ];
+    while( root.size() > 1 && root[ root.size() - 1 ] == '/' )
+    {
+        root.erase( root.size() - 1 );
+    }
+    const char* out = argv[ optind + 1 ];
+    // 根目录是/时路径不去掉开头的/
+    g_root_len = root == "/" ? 0 : root.size();
+    if( nftw( root.c_str(), visit, 32, FTW_PHYS ) != 0 )
+    {
+        fprintf( stderr, "cannot walk %s\n", root.c_str() );
+        return 1;
+    }
+    // 小文件在前，热区连续
+    stable_sort( g_files.begin(), g_files.end(), []( const pack_file& a, const pack_file& b ) {
+        return a.body[ PACK_IDENTITY ].size() < b.body[ PACK_IDENTITY ].size();
+    } );
+
+    // 平均每桶4个文件，槽数至少是文件数的两倍
+    uint32_t count = g_files.size();
+    uint32_t bucket_count = next_pow2( count / 4 + 1 );
+    uint32_t slot_count = next_pow2( count * 2 + 1 );
+    vector< uint32_t > disp, slots;
+    if( !build_index( g_files, bucket_count, slot_count, disp, slots ) )
+    {
+        fprintf( stderr, "cannot build the path index\n" );
+        return 1;
+    }
+
+    pack_header header;
+    memset( &header, 0, sizeof( header ) );
+    memcpy( header.magic, PACK_MAGIC, sizeof( PACK_MAGIC ) );
+    header.version = PACK_VERSION;
+    header.count = count;
+    header.bucket_count = bucket_count;
+    header.slot_count = slot_count;
+    header.disp_off = sizeof( header );
+    header.slots_off = header.disp_off + bucket_count * sizeof( uint32_t );
+    header.entries_off = align_up( header.slots_off + slot_count * sizeof( uint32_t ), sizeof( uint64_t ) );
+    uint64_t strings_off = header.entries_off + ( uint64_t )count * sizeof( pack_entry );
+
+    // 先排好文件内容的位置，再生成头部和字符串区；字符串区的长度决定内容的起点，所以分两遍
+    vector< pack_entry > entries( count );
+    string strings;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        const pack_file& f = g_files[i];
+        pack_entry& e = entries[i];
+        memset( &e, 0, sizeof( e ) );
+        e.path_off = add_string( strings, strings_off, f.path );
+        e.path_len = f.path.size();
+        e.type_off = add_string( strings, strings_off, f.type );
+        for( int v = 0; v < PACK_ENCODINGS; ++v )
+        {
+            if( v == PACK_GZIP && !f.has_gzip )
+            {
+                continue;
+            }
+            e.variants[v].etag_off = add_string( strings, strings_off, f.etag[v] );
+            e.variants[v].etag_len = f.etag[v].size();
+            char head[ 512 ];
+            int len = snprintf( head, sizeof( head ),
+                                "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\nContent-Type: %s\r\nETag: %s\r\n%s%s",
+                                f.body[v].size(), f.type, f.etag[v].c_str(),
+                                f.has_gzip ? "Vary: Accept-Encoding\r\n" : "",
+                                v == PACK_GZIP ? "Content-Encoding: gzip\r\n" : "" );
+            e.variants[v].head_off = add_string( strings, strings_off, string( head, len ) );
+            e.variants[v].head_len = len;
+        }
+    }
+    uint64_t off = align_up( strings_off + strings.size(), PACK_ALIGN );
+    header.hot_size = strings_off + strings.size();
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        for( int v = 0; v < PACK_ENCODINGS; ++v )
+        {
+            const string& body = g_files[i].body[v];
+            entries[i].variants[v].body_off = off;
+            entries[i].variants[v].body_len = body.size();
+            off = align_up( off + body.size(), PACK_ALIGN );
+        }
+        if( g_files[i].body[ PACK_IDENTITY ].size() <= hot_file )
+        {
+            header.hot_size = off;
+        }
+    }
+    header.total_size = off;
+
+    string tmp = string( out ) + ".tmp";
+    int fd = open( tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+    if( fd < 0 )
+    {
+        fprintf( stderr, "cannot create %s: %s\n", tmp.c_str(), strerror( errno ) );
+        return 1;
+    }
+    uint64_t pos = 0;
+    bool ok = write_all( fd, ( const char* )&header, sizeof( header ) )
+              && write_all( fd, ( const char* )&disp[0], disp.size() * sizeof( uint32_t ) )
+              && write_all( fd, ( const char* )&slots[0], slots.size() * sizeof( uint32_t ) );
+    pos = header.slots_off + slot_count * sizeof( uint32_t );
+    ok = ok && write_pad( fd, pos, header.entries_off )
+         && ( count == 0 || write_all( fd, ( const char* )&entries[0], count * sizeof( pack_entry ) ) )
+         && write_all( fd, strings.data(), strings.size() );
+    pos = strings_off + strings.size();
+    for( uint32_t i = 0; ok && i < count; ++i )
+    {
+        for( int v = 0; ok && v < PACK_ENCODINGS; ++v )
+        {
+            const pack_variant& var = entries[i].variants[v];
+            ok = write_pad( fd, pos, var.body_off ) && write_all( fd, g_files[i].body[v].data(), var.body_len );
+            pos += var.body_len;
+        }
+    }
+    ok = ok && write_pad( fd, pos, header.total_size ) && fsync( fd ) == 0;
+    if( close( fd ) != 0 || !ok || rename( tmp.c_str(), out ) != 0 )
+    {
+        fprintf( stderr, "cannot write %s: %s\n", out, strerror( errno ) );
+        unlink( tmp.c_str() );
+        return 1;
+    }
+
+    size_t gzipped = 0;
+    for( uint32_t i = 0; i < count; ++i )
+    {
+        gzipped += g_files[i].has_gzip;
+    }
+    printf( "{\"files\": %u, \"gzip\": %zu, \"bytes\": %llu, \"hot_bytes\": %llu}\n", count, gzipped,
+            ( unsigned long long )header.total_size, ( unsigned long long )header.hot_size );
+    return 0;
+}
@@ -0,0 +1,765 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include "uringloop.h"
+#include "http_conn.h"
+#include "metrics.h"
+#include "admission.h"
+#include "iplimit.h"
+#include "probes.h"
+
+// provided buffer的个数和大小，每个连接一次最多收一个http_conn读缓冲的数据
+static const unsigned BUF_COUNT = 2048;
+static const unsigned BUF_SIZE = http_conn::READ_BUFFER_SIZE;
+static const unsigned short BUF_GROUP = 0;
+// 一个连接的pending超过这个大小时暂停接收，上传的消息体比工作线程处理得快时内存也不会一直增长
+static const size_t MAX_PENDING = 32 * BUF_SIZE;
+
+// user_data高32位为操作类型，低32位为fd
+enum uring_op
+{
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SEND,
+    OP_SIGNAL,
+    OP_WAKE,
+    OP_CANCEL,
+    OP_CLOSE
+};
+
+static inline uint64_t make_data( uring_op op, int fd )
+{
+    return ( ( uint64_t )op << 32 ) | ( uint32_t )fd;
+}
+
+static int sys_io_uring_setup( unsigned entries, struct io_uring_params* p )
+{
+    return syscall( __NR_io_uring_setup, entries, p );
+}
+
+static int sys_io_uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags )
+{
+    return syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0 );
+}
+
+static int sys_io_uring_register( int fd, unsigned opcode, void* arg, unsigned nr_args )
+{
+    return syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+}
+
+static void set_blocking( int fd )
+{
+    fcntl( fd, F_SETFL, fcntl( fd, F_GETFL ) & ~O_NONBLOCK );
+}
+
+uring_loop* uring_loop::get_instance()
+{
+    static uring_loop loop;
+    return &loop;
+}
+
+uring_loop::uring_loop()
+{
+    m_ring_fd = -1;
+    m_sqpoll = false;
+    m_ring_ptr = NULL;
+    m_sqes = NULL;
+    m_buf_ring = NULL;
+    m_bufs = NULL;
+    m_stop = false;
+    m_to_submit = 0;
+}
+
+uring_loop::~uring_loop()
+{
+    if( m_ring_fd >= 0 )
+    {
+        close( m_ring_fd );
+        munmap( m_ring_ptr, m_ring_size );
+        munmap( m_sqes, m_sqes_size );
+    }
+    free( m_buf_ring );
+    free( m_bufs );
+}
+
+bool uring_loop::init( unsigned entries, bool sqpoll )
+{
+    struct io_uring_params p;
+    memset( &p, 0, sizeof( p ) );
+    // 每个连接可能同时有recv和send在途，完成队列开大一些
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    if( sqpoll )
+    {
+        p.flags |= IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;
+    }
+    m_ring_fd = sys_io_uring_setup( entries, &p );
+    if( m_ring_fd < 0 )
+    {
+        printf( "io_uring_setup failed: %s\n", strerror( errno ) );
+        return false;
+    }
+    if( !( p.features & IORING_FEAT_SINGLE_MMAP ) )
+    {
+        printf( "io_uring: kernel too old\n" );
+        close( m_ring_fd );
+        m_ring_fd = -1;
+        return false;
+    }
+    m_sqpoll = sqpoll;
+
+    // 提交队列和完成队列映射到同一块内存
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof( struct io_uring_cqe );
+    m_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    m_ring_ptr = mmap( NULL, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING );
+    m_sqes_size = p.sq_entries * sizeof( struct io_uring_sqe );
+    m_sqes = ( struct io_uring_sqe* )mmap( NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            m_ring_fd, IORING_OFF_SQES );
+    if( m_ring_ptr == MAP_FAILED || m_sqes == MAP_FAILED )
+    {
+        printf( "io_uring: mmap failed\n" );
+        close( m_ring_fd );
+        m_ring_fd = -1;
+        return false;
+    }
+    char* ring = ( char* )m_ring_ptr;
+    m_sq_head = ( unsigned* )( ring + p.sq_off.head );
+    m_sq_tail = ( unsigned* )( ring + p.sq_off.tail );
+    m_sq_mask = ( unsigned* )( ring + p.sq_off.ring_mask );
+    m_sq_flags = ( unsigned* )( ring + p.sq_off.flags );
+    m_sq_entries = p.sq_entries;
+    m_sq_local_tail = *m_sq_tail;
+    // 提交队列的索引数组固定为一一对应
+    unsigned* array = ( unsigned* )( ring + p.sq_off.array );
+    for( unsigned i = 0; i < p.sq_entries; ++i )
+    {
+        array[i] = i;
+    }
+    m_cq_head = ( unsigned* )( ring + p.cq_off.head );
+    m_cq_tail = ( unsigned* )( ring + p.cq_off.tail );
+    m_cq_mask = ( unsigned* )( ring + p.cq_off.ring_mask );
+    m_cqes = ( struct io_uring_cqe* )( ring + p.cq_off.cqes );
+
+    // 注册provided buffer ring，收到的数据由内核挑选空闲缓冲写入
+    if( posix_memalign( ( void** )&m_buf_ring, 4096, BUF_COUNT * sizeof( struct io_uring_buf ) ) != 0
+        || posix_memalign( ( void** )&m_bufs, 4096, ( size_t )BUF_COUNT * BUF_SIZE ) != 0 )
+    {
+        printf( "io_uring: cannot allocate buffers\n" );
+        return false;
+    }
+    memset( m_buf_ring, 0, BUF_COUNT * sizeof( struct io_uring_buf ) );
+    struct io_uring_buf_reg reg;
+    memset( &reg, 0, sizeof( reg ) );
+    reg.ring_addr = ( uint64_t )m_buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP;
+    if( sys_io_uring_register( m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1 ) < 0 )
+    {
+        printf( "io_uring: provided buffer rings not supported: %s\n", strerror( errno ) );
+        close( m_ring_fd );
+        m_ring_fd = -1;
+        return false;
+    }
+    m_buf_mask = BUF_COUNT - 1;
+    for( unsigned i = 0; i < BUF_COUNT; ++i )
+    {
+        recycle( i );
+    }
+
+    // 唤醒用阻塞的eventfd，由IORING_OP_READ等待
+    return init_wake( EFD_CLOEXEC );
+}
+
+struct io_uring_sqe* uring_loop::get_sqe()
+{
+    unsigned head = __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE );
+    if( m_sq_local_tail - head >= m_sq_entries )
+    {
+        // 提交队列满，先提交再取
+        submit( 0 );
+        head = __atomic_load_n( m_sq_head, __ATOMIC_ACQUIRE );
+        if( m_sq_local_tail - head >= m_sq_entries )
+        {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe* sqe = &m_sqes[ m_sq_local_tail & *m_sq_mask ];
+    memset( sqe, 0, sizeof( *sqe ) );
+    ++m_sq_local_tail;
+    ++m_to_submit;
+    return sqe;
+}
+
+// 提交已填好的请求，wait_nr大于0时等待完成
+int uring_loop::submit( unsigned wait_nr )
+{
+    __atomic_store_n( m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE );
+    unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+    unsigned to_submit = m_to_submit;
+    if( m_sqpoll )
+    {
+        // 内核线程在轮询，只有它睡眠时才需要唤醒
+        __atomic_thread_fence( __ATOMIC_SEQ_CST );
+        if( __atomic_load_n( m_sq_flags, __ATOMIC_RELAXED ) & IORING_SQ_NEED_WAKEUP )
+        {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        else if( !wait_nr )
+        {
+            m_to_submit = 0;
+            return 0;
+        }
+    }
+    else if( !to_submit && !wait_nr )
+    {
+        return 0;
+    }
+    m_to_submit = 0;
+    int ret = sys_io_uring_enter( m_ring_fd, to_submit, wait_nr, flags );
+    return ret;
+}
+
+void uring_loop::recycle( int bid )
+{
+    unsigned short* tail = &m_buf_ring[0].resv;
+    unsigned short t = *tail;
+    struct io_uring_buf* buf = &m_buf_ring[ t & m_buf_mask ];
+    buf->addr = ( uint64_t )( m_bufs + ( size_t )bid * BUF_SIZE );
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    __atomic_store_n( tail, ( unsigned short )( t + 1 ), __ATOMIC_RELEASE );
+}
+
+void uring_loop::arm_accept()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe )
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = make_data( OP_ACCEPT, m_listenfd );
+}
+
+void uring_loop::arm_recv( int fd )
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe )
+    {
+        begin_close( fd );
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP;
+    sqe->user_data = make_data( OP_RECV, fd );
+    m_conns[ fd ].recv_armed = true;
+}
+
+// 取消multishot recv，它的最后一个完成事件随后到达
+void uring_loop::cancel_recv( int fd )
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if( sqe )
+    {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = make_data( OP_RECV, fd );
+        sqe->user_data = make_data( OP_CANCEL, fd );
+    }
+}
+
+void uring_loop::arm_signal()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe )
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = m_sigfd;
+    sqe->addr = ( uint64_t )m_sigbuf;
+    sqe->len = sizeof( m_sigbuf );
+    sqe->user_data = make_data( OP_SIGNAL, m_sigfd );
+}
+
+void uring_loop::arm_wake()
+{
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe )
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = m_wakefd;
+    sqe->addr = ( uint64_t )&m_wake_buf;
+    sqe->len = sizeof( m_wake_buf );
+    sqe->off = ( uint64_t )-1;
+    sqe->user_data = make_data( OP_WAKE, m_wakefd );
+}
+
+void uring_loop::run( int listenfd, int sigfd, http_conn* users, client_data* users_timer, int max_fd,
+                      sort_lst_timer* timers, threadpool< http_conn >* pool, void ( *on_alarm )() )
+{
+    m_listenfd = listenfd;
+    m_sigfd = sigfd;
+    m_users = users;
+    m_users_timer = users_timer;
+    m_timers = timers;
+    m_pool = pool;
+    m_on_alarm = on_alarm;
+    m_conns.resize( max_fd );
+    // 非阻塞的fd上io_uring直接返回EAGAIN而不是等待就绪，这两个fd是epoll后端设置的
+    set_blocking( listenfd );
+    set_blocking( sigfd );
+
+    arm_accept();
+    arm_signal();
+    arm_wake();
+
+    metrics* stat = metrics::get_instance();
+    while( !m_stop )
+    {
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n( m_cq_tail, __ATOMIC_ACQUIRE );
+        // 完成队列里已经有事件时只提交不等待
+        int ret = submit( head == tail ? 1 : 0 );
+        if( ret < 0 && errno != EINTR && errno != EBUSY )
+        {
+            printf( "io_uring_enter failure: %s\n", strerror( errno ) );
+            break;
+        }
+        head = *m_cq_head;
+        tail = __atomic_load_n( m_cq_tail, __ATOMIC_ACQUIRE );
+        if( head == tail )
+        {
+            continue;
+        }
+        stat->inc( M_EPOLL_WAKEUPS );
+        stat->observe( H_EPOLL_EVENTS, tail - head );
+        while( head != tail )
+        {
+            struct io_uring_cqe cqe = m_cqes[ head & *m_cq_mask ];
+            ++head;
+            // 先归还完成队列的位置，处理过程中可能要提交新请求
+            __atomic_store_n( m_cq_head, head, __ATOMIC_RELEASE );
+            handle( &cqe );
+        }
+    }
+}
+
+void uring_loop::handle( struct io_uring_cqe* cqe )
+{
+    uring_op op = ( uring_op )( cqe->user_data >> 32 );
+    int fd = ( int )( uint32_t )cqe->user_data;
+    switch( op )
+    {
+    case OP_ACCEPT:
+        on_accept( cqe->res, cqe->flags );
+        break;
+    case OP_RECV:
+        on_recv( fd, cqe->res, cqe->flags );
+        break;
+    case OP_SEND:
+        on_send( fd, cqe->res );
+        break;
+    case OP_SIGNAL:
+        on_signal( cqe->res );
+        break;
+    case OP_WAKE:
+        on_wake();
+        break;
+    default:
+        // 取消和关闭的结果不需要处理
+        break;
+    }
+}
+
+void uring_loop::on_accept( int res, unsigned flags )
+{
+    if( !( flags & IORING_CQE_F_MORE ) )
+    {
+        // multishot accept因为出错终止，重新挂上
+        arm_accept();
+    }
+    admission* adm = admission::get_instance();
+    if( res < 0 )
+    {
+        if( res == -EMFILE || res == -ENFILE )
+        {
+            evict( adm->evict_count( http_conn::m_user_count, true ) );
+        }
+        return;
+    }
+    int connfd = res;
+    metrics::get_instance()->inc( M_ACCEPTS );
+    // multishot accept不返回对端地址，用getpeername获取，访问日志、X-Forwarded-For和按IP限流都要用
+    struct sockaddr_in client_address;
+    memset( &client_address, 0, sizeof( client_address ) );
+    socklen_t client_addrlength = sizeof( client_address );
+    getpeername( connfd, ( struct sockaddr* )&client_address, &client_addrlength );
+    PROBE2( accept, connfd, client_address.sin_addr.s_addr );
+    // 超过高水位时关闭空闲连接，关闭是异步的，完成后连接数才减少
+    evict( adm->evict_count( http_conn::m_user_count + 1, false ) );
+    if( connfd >= ( int )m_conns.size() || http_conn::m_user_count >= ( int )m_conns.size() )
+    {
+        adm->reject( connfd, M_SHED_CONNECTIONS );
+        close( connfd );
+        return;
+    }
+    if( !ip_limiter::get_instance()->connect( client_address.sin_addr.s_addr ) )
+    {
+        adm->reject( connfd, M_CONN_LIMITED );
+        close( connfd );
+        return;
+    }
+    m_users[ connfd ].init( connfd, client_address );
+
+    conn_state& c = m_conns[ connfd ];
+    c.recv_armed = false;
+    c.busy = false;
+    c.sending = false;
+    c.closing = false;
+    c.paused = false;
+    c.pending.clear();
+
+    m_users_timer[ connfd ].address = client_address;
+    m_users_timer[ connfd ].sockfd = connfd;
+    util_timer* timer = new util_timer;
+    timer->user_data = &m_users_timer[ connfd ];
+    timer->cb_func = timer_cb;
+    timer->expire = time( NULL ) + admission::get_instance()->idle_timeout( http_conn::m_user_count );
+    m_users_timer[ connfd ].timer = timer;
+    m_timers->add_timer( timer );
+
+    arm_recv( connfd );
+}
+
+void uring_loop::on_recv( int fd, int res, unsigned flags )
+{
+    conn_state& c = m_conns[ fd ];
+    if( res > 0 && ( flags & IORING_CQE_F_BUFFER ) )
+    {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        const char* data = m_bufs + ( size_t )bid * BUF_SIZE;
+        if( !c.closing )
+        {
+            touch( fd );
+            if( c.busy || c.sending )
+            {
+                c.pending.append( data, res );
+                if( c.pending.size() >= MAX_PENDING && !c.paused )
+                {
+                    c.paused = true;
+                    cancel_recv( fd );
+                }
+            }
+            else
+            {
+                deliver( fd, data, res );
+            }
+        }
+        recycle( bid );
+    }
+    if( flags & IORING_CQE_F_MORE )
+    {
+        return;
+    }
+    c.recv_armed = false;
+    if( !c.closing && c.paused )
+    {
+        // 暂停期间的结束(包括对端关闭)由keep_alive重新挂上recv之后再处理
+        return;
+    }
+    if( !c.closing && ( res > 0 || res == -ENOBUFS || res == -ECANCELED ) )
+    {
+        // 缓冲用完或者内核主动结束了multishot，重新挂上
+        arm_recv( fd );
+        return;
+    }
+    if( res == 0 )
+    {
+        m_users[ fd ].feed( NULL, 0 );
+    }
+    begin_close( fd );
+}
+
+// 把数据交给http_conn，是否完整由工作线程判断
+// 读缓冲放不下的部分留在pending的开头，工作线程取走消息体之后由keep_alive继续交付
+void uring_loop::deliver( int fd, const char* data, int len )
+{
+    int room = m_users[ fd ].read_room();
+    if( len > room )
+    {
+        m_conns[ fd ].pending.insert( 0, data + room, len - room );
+        len = room;
+    }
+    if( len == 0 || !m_users[ fd ].feed( data, len ) )
+    {
+        begin_close( fd );
+        return;
+    }
+    admission* adm = admission::get_instance();
+    if( !m_users[ fd ].in_body() && !ip_limiter::get_instance()->request( m_users_timer[ fd ].address.sin_addr.s_addr ) )
+    {
+        // 客户端请求过快，回复429后关闭
+        adm->reject( fd, M_RATE_LIMITED );
+        begin_close( fd );
+        return;
+    }
+    m_conns[ fd ].busy = true;
+    if( !adm->admit( m_pool->queue_size() ) || !m_pool->append( m_users + fd ) )
+    {
+        // 过载，直接回复503后关闭，不进入线程池
+        m_conns[ fd ].busy = false;
+        adm->reject( fd, M_SHED_REQUESTS );
+        begin_close( fd );
+    }
+}
+
+void uring_loop::start_send( int fd )
+{
+    conn_state& c = m_conns[ fd ];
+    struct iovec* iov;
+    int count = m_users[ fd ].pending_iov( &iov );
+    if( count == 0 )
+    {
+        keep_alive( fd );
+        return;
+    }
+    struct io_uring_sqe* sqe = get_sqe();
+    if( !sqe )
+    {
+        m_users[ fd ].sent( -ENOMEM );
+        begin_close( fd );
+        return;
+    }
+    memset( &c.msg, 0, sizeof( c.msg ) );
+    c.msg.msg_iov = iov;
+    c.msg.msg_iovlen = count;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = ( uint64_t )&c.msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = make_data( OP_SEND, fd );
+    c.sending = true;
+}
+
+void uring_loop::on_send( int fd, int res )
+{
+    conn_state& c = m_conns[ fd ];
+    c.sending = false;
+    if( res == -EAGAIN || res == -EINTR )
+    {
+        start_send( fd );
+        return;
+    }
+    http_conn::SEND_STATUS status = m_users[ fd ].sent( res );
+    if( c.closing )
+    {
+        // 没发完的响应也要释放文件映射
+        if( status == http_conn::SEND_AGAIN || status == http_conn::SEND_MORE )
+        {
+            m_users[ fd ].sent( -ECANCELED );
+        }
+        finalize( fd );
+        return;
+    }
+    if( status == http_conn::SEND_AGAIN )
+    {
+        start_send( fd );
+    }
+    else if( status == http_conn::SEND_MORE )
+    {
+        // 流式响应的一段发完，交给工作线程生成下一段，完成后以LOOP_WRITE回来
+        c.busy = true;
+        if( !m_pool->append( m_users + fd ) )
+        {
+            c.busy = false;
+            m_users[ fd ].sent( -ECANCELED );
+            begin_close( fd );
+        }
+    }
+    else if( status == http_conn::SEND_KEEP )
+    {
+        touch( fd );
+        keep_alive( fd );
+    }
+    else
+    {
+        begin_close( fd );
+    }
+}
+
+// 响应发完，长连接继续处理期间收到的数据
+void uring_loop::keep_alive( int fd )
+{
+    conn_state& c = m_conns[ fd ];
+    c.busy = false;
+    if( !c.pending.empty() )
+    {
+        string data;
+        data.swap( c.pending );
+        deliver( fd, data.data(), data.size() );
+    }
+    if( c.paused && !c.closing && c.pending.size() < MAX_PENDING )
+    {
+        c.paused = false;
+        if( !c.recv_armed )
+        {
+            arm_recv( fd );
+        }
+    }
+}
+
+void uring_loop::on_signal( int res )
+{
+    for( int i = 0; i < res; ++i )
+    {
+        switch( m_sigbuf[i] )
+        {
+        case SIGALRM:
+            m_on_alarm();
+            break;
+        case SIGTERM:
+            m_stop = true;
+            break;
+        default:
+            break;
+        }
+    }
+    arm_signal();
+}
+
+void uring_loop::on_wake()
+{
+    arm_wake();
+    take_ready( m_ready_swap );
+    for( size_t i = 0; i < m_ready_swap.size(); ++i )
+    {
+        int fd = m_ready_swap[i].first;
+        conn_state& c = m_conns[ fd ];
+        switch( m_ready_swap[i].second )
+        {
+        case LOOP_READ:
+            if( c.closing )
+            {
+                c.busy = false;
+                finalize( fd );
+            }
+            else
+            {
+                keep_alive( fd );
+            }
+            break;
+        case LOOP_WRITE:
+            if( c.closing )
+            {
+                m_users[ fd ].sent( -ECANCELED );
+                c.busy = false;
+                finalize( fd );
+            }
+            else
+            {
+                // 请求离开工作线程，发送期间收到的数据由sending挡住
+                c.busy = false;
+                start_send( fd );
+            }
+            break;
+        case LOOP_CLOSE:
+            c.busy = false;
+            begin_close( fd );
+            break;
+        }
+    }
+}
+
+// 有数据传输，定时器延后
+void uring_loop::touch( int fd )
+{
+    util_timer* timer = m_users_timer[ fd ].timer;
+    if( timer )
+    {
+        timer->expire = time( NULL ) + admission::get_instance()->idle_timeout( http_conn::m_user_count );
+        m_timers->adjust_timer( timer );
+    }
+}
+
+void uring_loop::begin_close( int fd )
+{
+    conn_state& c = m_conns[ fd ];
+    if( c.closing )
+    {
+        finalize( fd );
+        return;
+    }
+    c.closing = true;
+    c.pending.clear();
+    if( c.recv_armed )
+    {
+        // multishot recv的最后一个完成事件到达后再关闭fd
+        cancel_recv( fd );
+    }
+    finalize( fd );
+}
+
+// recv、工作线程和send都结束后才真正关闭，避免fd被复用后收到旧连接的事件
+void uring_loop::finalize( int fd )
+{
+    conn_state& c = m_conns[ fd ];
+    if( !c.closing || c.recv_armed || c.busy || c.sending )
+    {
+        return;
+    }
+    util_timer* timer = m_users_timer[ fd ].timer;
+    if( timer )
+    {
+        m_timers->del_timer( timer );
+        m_users_timer[ fd ].timer = NULL;
+    }
+    c.closing = false;
+    m_users[ fd ].release();
+    struct io_uring_sqe* sqe = get_sqe();
+    if( sqe )
+    {
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = fd;
+        sqe->user_data = make_data( OP_CLOSE, fd );
+    }
+    else
+    {
+        close( fd );
+    }
+    __sync_fetch_and_sub( &http_conn::m_user_count, 1 );
+    ip_limiter::get_instance()->release( m_users_timer[ fd ].address.sin_addr.s_addr );
+}
+
+// 从最早到期的定时器开始关闭n个空闲连接，和超时一样走begin_close
+void uring_loop::evict( int n )
+{
+    if( n > 0 )
+    {
+        metrics::get_instance()->inc( M_IDLE_EVICTED, m_timers->evict( n, http_conn::idle_cb, m_users ) );
+    }
+}
+
+// 空闲超时，tick之后会删除定时器
+void uring_loop::timer_cb( client_data* user_data )
+{
+    user_data->timer = NULL;
+    get_instance()->begin_close( user_data->sockfd );
+}
@@ -0,0 +1,122 @@
+#ifndef URINGLOOP_H
+#define URINGLOOP_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include <string>
+#include <vector>
+#include "locker.h"
+#include "lst_timer.h"
+#include "threadpool.h"
+#include "connloop.h"
+
+using namespace std;
+
+class http_conn;
+
+// io_uring事件循环，启动时用-i选择，代替epoll + recv/writev
+// 监听socket上挂一个multishot accept，每个连接挂一个multishot recv，数据收进内核管理的provided buffer ring，
+// 复制到http_conn后立即归还；响应头和mmap的文件用一次sendmsg发出。
+// 高负载时一次io_uring_enter提交和收割一批操作，开启SQPOLL后连提交也不需要系统调用。
+// 工作线程通过eventfd通知事件循环，线程池和http_conn的解析处理与epoll后端完全相同。
+// 直接使用系统调用，不依赖liburing
+class uring_loop : public conn_loop
+{
+public:
+    static uring_loop* get_instance();
+
+    // entries为提交队列大小，sqpoll为true时由内核线程轮询提交队列
+    // 内核缺少需要的特性(multishot accept/recv、provided buffer ring，6.0以上)时返回false，调用者退回epoll
+    bool init( unsigned entries, bool sqpoll );
+    // 运行事件循环直到收到SIGTERM，sigfd为信号管道的读端
+    // 空闲超时和空闲连接回收由admission决定
+    // SIGALRM时调用on_alarm处理定时器
+    void run( int listenfd, int sigfd, http_conn* users, client_data* users_timer, int max_fd,
+              sort_lst_timer* timers, threadpool< http_conn >* pool, void ( *on_alarm )() );
+
+private:
+    uring_loop();
+    ~uring_loop();
+
+    // 每个连接在事件循环中的状态
+    struct conn_state
+    {
+        bool recv_armed;        // multishot recv还在进行
+        bool busy;              // 请求在工作线程中
+        bool sending;           // sendmsg还没完成
+        bool closing;           // 正在关闭，等上面三个都结束后关闭fd
+        bool paused;            // pending太多，取消了multishot recv，pending消化之后重新挂上
+        string pending;         // busy期间收到的数据，以及读缓冲放不下的消息体
+        struct msghdr msg;
+    };
+
+    struct io_uring_sqe* get_sqe();
+    int submit( unsigned wait_nr );
+    void arm_accept();
+    void arm_recv( int fd );
+    void cancel_recv( int fd );
+    void arm_signal();
+    void arm_wake();
+    void recycle( int bid );
+
+    void handle( struct io_uring_cqe* cqe );
+    void on_accept( int res, unsigned flags );
+    void on_recv( int fd, int res, unsigned flags );
+    void on_send( int fd, int res );
+    void on_signal( int res );
+    void on_wake();
+
+    void deliver( int fd, const char* data, int len );
+    void start_send( int fd );
+    void keep_alive( int fd );
+    void touch( int fd );
+    void begin_close( int fd );
+    void finalize( int fd );
+    void evict( int n );
+    static void timer_cb( client_data* user_data );
+
+private:
+    int m_ring_fd;
+    bool m_sqpoll;
+    // 提交队列
+    unsigned* m_sq_head;
+    unsigned* m_sq_tail;
+    unsigned* m_sq_mask;
+    unsigned* m_sq_flags;
+    unsigned m_sq_entries;
+    unsigned m_sq_local_tail;
+    unsigned m_to_submit;
+    struct io_uring_sqe* m_sqes;
+    // 完成队列
+    unsigned* m_cq_head;
+    unsigned* m_cq_tail;
+    unsigned* m_cq_mask;
+    struct io_uring_cqe* m_cqes;
+    void* m_ring_ptr;
+    size_t m_ring_size;
+    size_t m_sqes_size;
+
+    // provided buffer ring
+    struct io_uring_buf* m_buf_ring;
+    char* m_bufs;
+    unsigned m_buf_mask;
+
+    int m_listenfd;
+    int m_sigfd;
+    char m_sigbuf[ 64 ];
+    uint64_t m_wake_buf;
+    bool m_stop;
+
+    http_conn* m_users;
+    client_data* m_users_timer;
+    sort_lst_timer* m_timers;
+    threadpool< http_conn >* m_pool;
+    void ( *m_on_alarm )();
+    vector< conn_state > m_conns;
+
+    // 取出的工作线程通知
+    vector< pair< int, loop_notify > > m_ready_swap;
+};
+
+#endif
@@ -0,0 +1,145 @@
+#include <mysql/mysql.h>
+#include "userstore.h"
+#include "sqlconnpool.h"
+#include "sqlconnRAII.h"
+#include "sqlbatch.h"
+#include "sqlrouter.h"
+#include "metrics.h"
+
+static string escape( MYSQL* conn, const string& str )
+{
+    string to( str.size() * 2 + 1, '\0' );
+    unsigned long len = mysql_real_escape_string( conn, &to[0], str.c_str(), str.size() );
+    to.resize( len );
+    return to;
+}
+
+user_store::RESULT mysql_store::login( const string& name, const string& password )
+{
+    // 按用户选择读主库还是副本
+    sqlconnpool* rpool = sqlrouter::get_instance()->reader( name );
+    if( !rpool->available() )
+    {
+        return STORE_UNAVAILABLE;
+    }
+    if( m_batch )
+    {
+        // 与其他并发登录合并成一条查询
+        return sqlbatcher::get_instance()->login( name, password ) ? STORE_OK : STORE_FAIL;
+    }
+
+    MYSQL* conn = NULL;
+    sqlconnRAII mysqlconn( &conn, rpool );
+    if( !conn )
+    {
+        return STORE_UNAVAILABLE;
+    }
+    // 判断数据是否存在
+    string sql_query = "SELECT * FROM user WHERE username='" + escape( conn, name )
+            + "' and password='" + escape( conn, password ) + "';";
+    uint64_t start = metrics::now_us();
+    if( mysql_real_query( conn, sql_query.c_str(), sql_query.size() ) )
+    {
+        return STORE_UNAVAILABLE;
+    }
+    // 获取完整的结果集
+    MYSQL_RES* result = mysql_store_result( conn );
+    metrics::get_instance()->observe( H_DB_QUERY, metrics::now_us() - start );
+    if( !result )
+    {
+        return STORE_UNAVAILABLE;
+    }
+    // 返回结果集中的行数
+    int num_rows = mysql_num_rows( result );
+    mysql_free_result( result );
+    return num_rows == 0 ? STORE_FAIL : STORE_OK;
+}
+
+bool mysql_store::key( const string& name, string& out ) const
+{
+    size_t len = name.find_last_not_of( ' ' ) + 1;
+    out.resize( len );
+    for( size_t i = 0; i < len; ++i )
+    {
+        unsigned char c = name[i];
+        if( c >= 0x80 )
+        {
+            return false;
+        }
+        out[i] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    return true;
+}
+
+// 用mysql_use_result逐行读取，不把整张表读进内存
+// 扫描主库：副本有复制延迟，漏掉的新用户会被布隆过滤器判为不存在，之后无法登录
+bool mysql_store::scan( scan_cb cb, void* arg )
+{
+    sqlconnpool* pool = sqlrouter::get_instance()->writer();
+    // 不用sqlconnRAII，扫描线程结束后独占连接会被一直占用
+    MYSQL* conn = pool->get_connection();
+    if( !conn )
+    {
+        return false;
+    }
+    bool ok = false;
+    string sql_query = "SELECT username FROM user;";
+    if( !mysql_real_query( conn, sql_query.c_str(), sql_query.size() ) )
+    {
+        MYSQL_RES* result = mysql_use_result( conn );
+        if( result )
+        {
+            MYSQL_ROW row;
+            while( ( row = mysql_fetch_row( result ) ) != NULL )
+            {
+                unsigned long* lengths = mysql_fetch_lengths( result );
+                if( row[0] && lengths )
+                {
+                    cb( string( row[0], lengths[0] ), arg );
+                }
+            }
+            // 读完所有行后errno为0，中途断开则非0
+            ok = mysql_errno( conn ) == 0;
+            mysql_free_result( result );
+        }
+    }
+    pool->release_connection( conn );
+    return ok;
+}
+
+user_store::RESULT mysql_store::regist( const string& name, const string& password )
+{
+    sqlrouter* router = sqlrouter::get_instance();
+    if( !router->writer()->available() )
+    {
+        return STORE_UNAVAILABLE;
+    }
+    if( m_batch )
+    {
+        // 合并到同一个事务中提交
+        return sqlbatcher::get_instance()->regist( name, password ) ? STORE_OK : STORE_FAIL;
+    }
+
+    MYSQL* conn = NULL;
+    sqlconnRAII mysqlconn( &conn, router->writer() );
+    if( !conn )
+    {
+        return STORE_UNAVAILABLE;
+    }
+    // 插入数据
+    // 表必须设置了主键
+    string sql_insert = "INSERT INTO user(username, password) VALUES('"
+            + escape( conn, name ) + "', '" + escape( conn, password ) + "');";
+    uint64_t start = metrics::now_us();
+    m_lock.lock();
+    int res = mysql_real_query( conn, sql_insert.c_str(), sql_insert.size() );
+    m_lock.unlock();
+    metrics::get_instance()->observe( H_DB_QUERY, metrics::now_us() - start );
+    if( res )
+    {
+        return STORE_FAIL;
+    }
+    // 副本可能还没同步，接下来一段时间该用户的登录读主库
+    router->mark_written( name );
+    return STORE_OK;
+}
@@ -0,0 +1,48 @@
+#ifndef _USER_STORE_
+#define _USER_STORE_
+
+#include <string>
+#include "locker.h"
+
+using namespace std;
+
+// 用户凭据存储接口，do_request的登录和注册只通过它访问后端
+class user_store
+{
+public:
+    // STORE_UNAVAILABLE表示后端暂时不可用，调用者返回503
+    enum RESULT { STORE_OK = 0, STORE_FAIL, STORE_UNAVAILABLE };
+    // 遍历用户名的回调
+    typedef void ( *scan_cb )( const string& name, void* arg );
+
+    virtual ~user_store() {}
+    // 用户名和密码匹配返回STORE_OK
+    virtual RESULT login( const string& name, const string& password ) = 0;
+    // 插入成功返回STORE_OK，用户名已存在返回STORE_FAIL
+    virtual RESULT regist( const string& name, const string& password ) = 0;
+    // 流式遍历所有用户名，后端不支持或中途出错返回false
+    virtual bool scan( scan_cb cb, void* arg ) { return false; }
+    // 过滤器使用的用户名键，后端认为相同的用户名必须得到相同的键；默认逐字节比较，键就是用户名
+    // 无法归一化时返回false，过滤器不能据此拒绝
+    virtual bool key( const string& name, string& out ) const { out = name; return true; }
+};
+
+// MySQL后端：经过sqlrouter读写分离，batch为true时经过sqlbatcher合并
+class mysql_store : public user_store
+{
+public:
+    mysql_store( bool batch ) : m_batch( batch ) {}
+
+    RESULT login( const string& name, const string& password );
+    RESULT regist( const string& name, const string& password );
+    bool scan( scan_cb cb, void* arg );
+    // 排序规则不区分大小写并忽略末尾空格：转成小写、去掉末尾空格；
+    // 含非ASCII字符时排序规则还可能忽略重音，返回false
+    bool key( const string& name, string& out ) const;
+
+private:
+    bool m_batch;
+    locker m_lock;      // INSERT 操作时加锁
+};
+
+#endif